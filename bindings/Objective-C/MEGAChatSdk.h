@@ -74,6 +74,7 @@ typedef NS_ENUM (NSInteger, MEGAChatConnection) {
 
 - (instancetype)init:(MEGASdk *)megaSDK;
 
+- (void)setDatabaseOptionsWithWalMode:(BOOL)walMode syncNormal:(BOOL)syncNormal cacheSizeKb:(NSInteger)cacheSizeKb mmapSize:(int64_t)mmapSize asyncWrites:(BOOL)asyncWrites compressHistory:(BOOL)compressHistory;
 - (MEGAChatInit)initKarereWithSid:(NSString *)sid;
 
 - (MEGAChatInit)initState;
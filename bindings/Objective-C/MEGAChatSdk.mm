@@ -65,6 +65,10 @@ static DelegateMEGAChatLoggerListener *externalLogger = NULL;
     return self;
 }
 
+- (void)setDatabaseOptionsWithWalMode:(BOOL)walMode syncNormal:(BOOL)syncNormal cacheSizeKb:(NSInteger)cacheSizeKb mmapSize:(int64_t)mmapSize asyncWrites:(BOOL)asyncWrites compressHistory:(BOOL)compressHistory {
+    self.megaChatApi->setDatabaseOptions(walMode, syncNormal, (int)cacheSizeKb, mmapSize, asyncWrites, compressHistory);
+}
+
 - (MEGAChatInit)initKarereWithSid:(NSString *)sid {
     return (MEGAChatInit) self.megaChatApi->init((sid != nil) ? [sid UTF8String] : NULL);
 }
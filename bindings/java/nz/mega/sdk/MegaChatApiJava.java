@@ -207,6 +207,38 @@ public class MegaChatApiJava {
         return megaChatApi.getInitState();
     }
 
+    /**
+     * Limits the memory used by the messages of the chatrooms that are kept in RAM
+     *
+     * When a limit is exceeded, the oldest messages are removed from RAM, starting from
+     * the chatrooms that are closed and have not been used for longest. They are loaded
+     * again from the local cache when needed.
+     *
+     * @param chatBytes Maximum number of bytes used by the history of a single chatroom, or zero for no limit
+     * @param totalBytes Maximum number of bytes used by the history of all chatrooms, or zero for no limit
+     */
+    public void setHistoryMemoryLimits(long chatBytes, long totalBytes){
+        megaChatApi.setHistoryMemoryLimits(chatBytes, totalBytes);
+    }
+
+    /**
+     * Removes from RAM all the messages that can be loaded again from the local cache
+     *
+     * Call this function when the system signals that memory is low, i.e. from
+     * Application.onTrimMemory().
+     *
+     * The associated request type with this request is MegaChatRequest::TYPE_TRIM_HISTORY_MEMORY
+     *
+     * Valid data in the MegaChatRequest object received in onRequestFinish when the error code
+     * is MegaError::ERROR_OK:
+     * - MegaChatRequest::getNumber - Returns the number of bytes freed
+     *
+     * @param listener MegaChatRequestListener to track this request
+     */
+    public void trimHistoryMemory(MegaChatRequestListenerInterface listener){
+        megaChatApi.trimHistoryMemory(createDelegateRequestListener(listener));
+    }
+
     /**
      * Establish the connection with chat-related servers (chatd, presenced and Gelb).
      *
@@ -1214,6 +1246,33 @@ public class MegaChatApiJava {
         return megaChatApi.getManualSendingMessage(chatid, rowid);
     }
 
+    /**
+     * Searches the text of the messages in the local history of one or all chatrooms
+     *
+     * Results are returned from the newest to the oldest message, a page at a time. To get
+     * the next page, call this function again with the cursor returned by the previous one.
+     *
+     * The associated request type with this request is MegaChatRequest::TYPE_SEARCH_MESSAGES
+     * Valid data in the MegaChatRequest object received on callbacks:
+     * - MegaChatRequest::getChatHandle - Returns the chat identifier
+     * - MegaChatRequest::getText - Returns the query
+     * - MegaChatRequest::getParamType - Returns the maximum number of results
+     *
+     * Valid data in the MegaChatRequest object received in onRequestFinish when the error code
+     * is MegaError::ERROR_OK:
+     * - MegaChatRequest::getMegaChatMessageList - Returns the messages that match the query
+     * - MegaChatRequest::getNumber - Returns the cursor of the next page, or 0 if there are no more results
+     *
+     * @param chatid MegaChatHandle that identifies the chat room, or MEGACHAT_INVALID_HANDLE to search all chats
+     * @param query Words to search for
+     * @param limit Maximum number of messages to return
+     * @param cursor 0 for the first page, or the value of MegaChatRequest::getNumber of the previous page
+     * @param listener MegaChatRequestListener to track this request
+     */
+    public void searchMessages(long chatid, String query, int limit, long cursor, MegaChatRequestListenerInterface listener){
+        megaChatApi.searchMessages(chatid, query, limit, cursor, createDelegateRequestListener(listener));
+    }
+
     /**
      * Sends a new message to the specified chatroom
      *
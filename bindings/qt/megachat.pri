@@ -9,10 +9,13 @@ VPATH += $$MEGACHAT_BASE_PATH/src
 SOURCES += megachatapi.cpp \
             megachatapi_impl.cpp \
             strongvelope/strongvelope.cpp \
+            strongvelope/keyCache.cpp \
             presenced.cpp \
             base64url.cpp \
             chatClient.cpp \
             chatd.cpp \
+            historyCompression.cpp \
+            messageSearch.cpp \
             url.cpp \
             karereCommon.cpp \
             userAttrCache.cpp \
@@ -46,6 +49,8 @@ HEADERS  += asyncTest-framework.h \
             url.h \
             base64url.h \
             chatdDb.h \
+            historyCompression.h \
+            messageSearch.h \
             IGui.h \
             megachatapi_impl.h \
             sdkApi.h \
@@ -88,6 +93,7 @@ HEADERS  += asyncTest-framework.h \
             strongvelope/tlvstore.h \
             strongvelope/strongvelope.h \
             strongvelope/cryptofunctions.h \
+            strongvelope/keyCache.h \
             waiter/libuvWaiter.h \
             waiter/libeventWaiter.h
 
@@ -365,6 +365,13 @@ public:
 
     virtual void onChatNotification(karere::Id chatid, const chatd::Message &msg, chatd::Message::Status status, chatd::Idx idx) {}
 
+    /** @brief Called when the name or email of a member of a group chat has been
+     * fetched or has changed. Called before the chat's IChatHandler, if any, is
+     * notified, so that state the app derives from the members is already stale
+     * when the handler queries it.
+     */
+    virtual void onChatMemberInfoChanged(karere::Id chatid) {}
+
     virtual ~IApp() {}
 };
 }
@@ -0,0 +1,187 @@
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <asyncTest-framework.h>
+#include <flatHashMap.h>
+
+TESTS_INIT();
+using namespace karere;
+
+/** Exposes the internals that the tests need to construct collisions */
+struct TestMap: public FlatHashMap<uint64_t, int>
+{
+    using FlatHashMap::idealPos;
+    size_t capacity() const { return mSlots.size(); }
+    /** Returns \c count keys, starting from \c from, whose ideal position is \c pos */
+    std::vector<uint64_t> keysAt(size_t pos, size_t count, uint64_t from=1) const
+    {
+        std::vector<uint64_t> keys;
+        for (uint64_t key = from; keys.size() < count; key++)
+        {
+            if (idealPos(key) == pos)
+                keys.push_back(key);
+        }
+        return keys;
+    }
+};
+
+/** Checks that the map has exactly the contents of \c ref */
+static bool sameAs(const TestMap& map, const std::map<uint64_t, int>& ref)
+{
+    if (map.size() != ref.size())
+        return false;
+    size_t iterated = 0;
+    for (auto& item: map)
+    {
+        auto it = ref.find(item.first);
+        if (it == ref.end() || it->second != item.second)
+            return false;
+        iterated++;
+    }
+    if (iterated != ref.size())
+        return false;
+    for (auto& item: ref)
+    {
+        auto it = map.find(item.first);
+        if (it == map.end() || it->second != item.second)
+            return false;
+    }
+    return true;
+}
+
+int main()
+{
+
+TestGroup("FlatHashMap")
+{
+    syncTest("emplace, operator[] and find")
+    {
+        TestMap map;
+        check(map.empty());
+        check(map.find(1) == map.end());
+        check(map.emplace(1, 10).second);
+        check(!map.emplace(1, 20).second); //doesn't overwrite
+        check(map.find(1)->second == 10);
+        map[2] = 30;
+        check(map[2] == 30);
+        check(map[3] == 0); //inserts a default value
+        check(map.size() == 3);
+        check(map.count(3) == 1);
+        check(map.count(4) == 0);
+    });
+    syncTest("erase backward-shifts a collision chain")
+    {
+        TestMap map;
+        map.emplace(0, 0); //allocates the minimum capacity
+        map.erase(0);
+        std::map<uint64_t, int> ref;
+        // keys 5a,5b,5c want slot 5 and 6a,6b slot 6, so they are laid out as
+        // 5a 5b 5c 6a 6b in slots 5..9
+        auto at5 = map.keysAt(5, 3);
+        auto at6 = map.keysAt(6, 2);
+        for (auto key: {at5[0], at5[1], at5[2], at6[0], at6[1]})
+        {
+            map[key] = (int)key;
+            ref[key] = (int)key;
+        }
+        check(map.capacity() == 16);
+        // erasing from the head of the chain must shift all of it back
+        map.erase(at5[0]);
+        ref.erase(at5[0]);
+        check(sameAs(map, ref));
+        // 6a is now in slot 8, erasing 5c before it must move it to its own slot
+        map.erase(at5[2]);
+        ref.erase(at5[2]);
+        check(sameAs(map, ref));
+        check(map.erase(at5[2]) == 0);
+        for (auto& item: ref)
+        {
+            check(map.erase(item.first) == 1);
+        }
+        check(map.empty());
+        check(map.begin() == map.end());
+    });
+    syncTest("erase backward-shifts a chain that wraps around")
+    {
+        TestMap map;
+        map.emplace(0, 0);
+        map.erase(0);
+        std::map<uint64_t, int> ref;
+        // 15a 15b 15c 0a occupy slots 15, 0, 1, 2
+        auto at15 = map.keysAt(15, 3);
+        auto at0 = map.keysAt(0, 1);
+        for (auto key: {at15[0], at15[1], at15[2], at0[0]})
+        {
+            map[key] = (int)key;
+            ref[key] = (int)key;
+        }
+        map.erase(at15[1]); //slot 0, 15c and 0a shift back across the end
+        ref.erase(at15[1]);
+        check(sameAs(map, ref));
+        map.erase(at15[0]);
+        ref.erase(at15[0]);
+        check(sameAs(map, ref));
+        // an entry in its ideal slot must not be moved before it
+        map.emplace(at15[0], 1);
+        ref.emplace(at15[0], 1);
+        map.erase(at0[0]);
+        ref.erase(at0[0]);
+        check(sameAs(map, ref));
+    });
+    syncTest("rehash keeps all entries, load factor stays at most 3/4")
+    {
+        TestMap map;
+        std::map<uint64_t, int> ref;
+        std::mt19937_64 rng(1);
+        size_t capacity = 0;
+        for (int i = 0; i < 10000; i++)
+        {
+            uint64_t key = rng();
+            map[key] = i;
+            ref[key] = i;
+            if (map.capacity() != capacity)
+            {
+                check((map.capacity() & (map.capacity()-1)) == 0); //power of 2
+                check(capacity == 0 || map.capacity() == capacity*2);
+                capacity = map.capacity();
+                check(sameAs(map, ref)); //just rehashed
+            }
+            check(map.size()*4 <= map.capacity()*3);
+        }
+        check(sameAs(map, ref));
+        map.clear();
+        check(map.empty());
+        check(map.capacity() == 0);
+        check(map.find(ref.begin()->first) == map.end());
+        map[5] = 5;
+        check(map.find(5)->second == 5);
+    });
+    syncTest("random operations match std::map")
+    {
+        TestMap map;
+        std::map<uint64_t, int> ref;
+        std::mt19937_64 rng(2);
+        for (int i = 0; i < 200000; i++)
+        {
+            uint64_t key = rng() % 4096; //small key space, so that erases hit
+            switch (rng() % 3)
+            {
+            case 0:
+                map[key] = i;
+                ref[key] = i;
+                break;
+            case 1:
+                check(map.erase(key) == ref.erase(key));
+                break;
+            default:
+                check((map.find(key) == map.end()) == (ref.find(key) == ref.end()));
+                break;
+            }
+        }
+        check(sameAs(map, ref));
+    });
+});
+
+return test::gNumFailed;
+}
@@ -0,0 +1,168 @@
+#ifndef KARERE_FLAT_HASH_MAP_H
+#define KARERE_FLAT_HASH_MAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <utility>
+#include <vector>
+
+namespace karere
+{
+/** @brief Open-addressing (linear probing) hash map for 64-bit integer-like keys,
+ * such as karere::Id or chatd::BackRefId. All entries are stored in one flat
+ * array, so a lookup normally touches a single cache line, unlike the node
+ * chasing of std::map. Erase uses backward-shift deletion, so there are no
+ * tombstones and lookups don't degrade over time.
+ * The interface is the subset of std::map that is used for message indexes:
+ * find(), operator[], emplace(), erase(), clear() and iteration (in no
+ * particular order). Any insertion or erase invalidates iterators.
+ */
+template <class K, class V>
+class FlatHashMap
+{
+public:
+    typedef std::pair<K, V> value_type;
+protected:
+    struct Slot
+    {
+        value_type kv;
+        bool used = false;
+    };
+    std::vector<Slot> mSlots;
+    size_t mSize = 0;
+    size_t mMask = 0;
+    enum { kMinCapacity = 16 };
+    size_t idealPos(const K& key) const
+    {
+        // Fibonacci hashing - takes the high bits, so that keys with non-random
+        // low bits (i.e. backrefids which start with a timestamp) are spread too
+        return (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> 32) & mMask;
+    }
+    size_t findPos(const K& key) const
+    {
+        if (!mSize)
+            return mSlots.size();
+        for (size_t i = idealPos(key);; i = (i+1) & mMask)
+        {
+            auto& slot = mSlots[i];
+            if (!slot.used)
+                return mSlots.size();
+            if (slot.kv.first == key)
+                return i;
+        }
+    }
+    void rehash(size_t capacity)
+    {
+        std::vector<Slot> old;
+        old.swap(mSlots);
+        mSlots.resize(capacity);
+        mMask = capacity-1;
+        for (auto& slot: old)
+        {
+            if (slot.used)
+                placeNew(std::move(slot.kv));
+        }
+    }
+    size_t placeNew(value_type&& kv)
+    {
+        size_t i = idealPos(kv.first);
+        while (mSlots[i].used)
+            i = (i+1) & mMask;
+        mSlots[i].kv = std::move(kv);
+        mSlots[i].used = true;
+        return i;
+    }
+public:
+    template <class S, class VT>
+    class Iter
+    {
+    protected:
+        S* mSlot;
+        S* mEnd;
+        void skipUnused() { while (mSlot != mEnd && !mSlot->used) mSlot++; }
+    public:
+        Iter(S* slot, S* end): mSlot(slot), mEnd(end) { skipUnused(); }
+        VT& operator*() const { return mSlot->kv; }
+        VT* operator->() const { return &mSlot->kv; }
+        Iter& operator++() { mSlot++; skipUnused(); return *this; }
+        bool operator==(const Iter& other) const { return mSlot == other.mSlot; }
+        bool operator!=(const Iter& other) const { return mSlot != other.mSlot; }
+    };
+    typedef Iter<Slot, value_type> iterator;
+    typedef Iter<const Slot, const value_type> const_iterator;
+
+    iterator begin() { return iterator(mSlots.data(), mSlots.data()+mSlots.size()); }
+    iterator end() { auto e = mSlots.data()+mSlots.size(); return iterator(e, e); }
+    const_iterator begin() const { return const_iterator(mSlots.data(), mSlots.data()+mSlots.size()); }
+    const_iterator end() const { auto e = mSlots.data()+mSlots.size(); return const_iterator(e, e); }
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+    iterator find(const K& key)
+    {
+        auto e = mSlots.data()+mSlots.size();
+        return iterator(mSlots.data()+findPos(key), e);
+    }
+    const_iterator find(const K& key) const
+    {
+        auto e = mSlots.data()+mSlots.size();
+        return const_iterator(mSlots.data()+findPos(key), e);
+    }
+    size_t count(const K& key) const { return findPos(key) != mSlots.size(); }
+    std::pair<iterator, bool> emplace(const K& key, const V& val)
+    {
+        auto pos = findPos(key);
+        auto e = mSlots.data()+mSlots.size();
+        if (pos != mSlots.size())
+            return std::make_pair(iterator(mSlots.data()+pos, e), false);
+
+        // keep the load factor at most 3/4
+        if ((mSize+1)*4 > mSlots.size()*3)
+        {
+            rehash(mSlots.empty() ? (size_t)kMinCapacity : mSlots.size()*2);
+        }
+        pos = placeNew(value_type(key, val));
+        mSize++;
+        return std::make_pair(iterator(mSlots.data()+pos, mSlots.data()+mSlots.size()), true);
+    }
+    V& operator[](const K& key)
+    {
+        auto pos = findPos(key);
+        if (pos != mSlots.size())
+            return mSlots[pos].kv.second;
+        return emplace(key, V()).first->second;
+    }
+    size_t erase(const K& key)
+    {
+        auto i = findPos(key);
+        if (i == mSlots.size())
+            return 0;
+        // backward-shift the entries following the erased one, that would
+        // otherwise become unreachable
+        for (size_t j = (i+1) & mMask; mSlots[j].used; j = (j+1) & mMask)
+        {
+            size_t ideal = idealPos(mSlots[j].kv.first);
+            // move j to i only if i is cyclically within [ideal, j)
+            bool movable = (i <= j) ? ((ideal <= i) || (ideal > j))
+                                    : ((ideal <= i) && (ideal > j));
+            if (movable)
+            {
+                mSlots[i].kv = std::move(mSlots[j].kv);
+                i = j;
+            }
+        }
+        mSlots[i].used = false;
+        mSlots[i].kv = value_type();
+        mSize--;
+        return 1;
+    }
+    void clear()
+    {
+        std::vector<Slot>().swap(mSlots);
+        mSize = 0;
+        mMask = 0;
+    }
+};
+}
+
+#endif
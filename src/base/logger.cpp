@@ -4,6 +4,7 @@
 
 #include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
 #define KRLOGGER_BUILDING //sets DLLIMPEXPs in logger.h to 'export' mode
 #include "logger.h"
 #include "loggerFile.h"
@@ -44,6 +45,99 @@ namespace karere
 */
 static size_t myStrncpy(char* dest, const char* src, size_t maxCount);
 
+/** A log record in a LogRing. The zero-terminated prefix (if any) and message
+ * follow the header. Records are aligned to 8 bytes */
+struct LogRecord
+{
+    enum: uint16_t { kWrapMarker = 0xffff };
+    uint64_t seq;
+    time_t ts;
+    unsigned flags;
+    krLogLevel level;
+    uint16_t prefixLen; //including the terminating zero, 0 if no prefix
+    uint32_t msgLen;    //excluding the terminating zero
+    const char* prefix() const { return prefixLen ? (const char*)(this+1) : nullptr; }
+    const char* msg() const { return (const char*)(this+1)+prefixLen; }
+    static size_t recordSize(size_t prefixLen, size_t msgLen)
+    {
+        return (sizeof(LogRecord)+prefixLen+msgLen+1+7) & ~(size_t)7;
+    }
+};
+
+/** Single-producer/single-consumer byte ring. The producer is the thread that
+ * owns it, the consumer is the writer thread */
+struct Logger::LogRing
+{
+    enum { kSize = 64*1024 };
+    alignas(8) char mBuf[kSize];
+    std::atomic<size_t> mHead; //advanced by the producer
+    std::atomic<size_t> mTail; //advanced by the consumer
+    std::atomic<size_t> mWritten; //mTail as of the last flush of the backends
+    std::atomic<bool> mOrphaned; //the owning thread has exited
+    LogRing(): mHead(0), mTail(0), mWritten(0), mOrphaned(false) {}
+    /** Returns a pointer to a contiguous space of \c size bytes, or NULL if
+     * the ring is full. The record becomes visible to the consumer on commit() */
+    LogRecord* reserve(size_t size, size_t& newHead)
+    {
+        size_t head = mHead.load(std::memory_order_relaxed);
+        size_t tail = mTail.load(std::memory_order_acquire);
+        size_t offset = head % kSize;
+        size_t toEnd = kSize-offset;
+        size_t pad = (toEnd < size) ? toEnd : 0;
+        if (head+pad+size-tail > kSize)
+            return nullptr;
+        if (pad && toEnd >= sizeof(LogRecord))
+            reinterpret_cast<LogRecord*>(mBuf+offset)->level = LogRecord::kWrapMarker;
+        newHead = head+pad+size;
+        return reinterpret_cast<LogRecord*>(mBuf+(head+pad) % kSize);
+    }
+    void commit(size_t newHead) { mHead.store(newHead, std::memory_order_release); }
+    /** Returns the oldest record, or NULL if the ring is empty */
+    const LogRecord* peek()
+    {
+        size_t head = mHead.load(std::memory_order_acquire);
+        for (;;)
+        {
+            size_t tail = mTail.load(std::memory_order_relaxed);
+            if (tail == head)
+                return nullptr;
+            size_t offset = tail % kSize;
+            size_t toEnd = kSize-offset;
+            auto rec = reinterpret_cast<const LogRecord*>(mBuf+offset);
+            if (toEnd < sizeof(LogRecord) || rec->level == LogRecord::kWrapMarker)
+            {
+                mTail.store(tail+toEnd, std::memory_order_release);
+                continue;
+            }
+            return rec;
+        }
+    }
+    void pop(const LogRecord* rec)
+    {
+        mTail.store(mTail.load(std::memory_order_relaxed)
+            + LogRecord::recordSize(rec->prefixLen, rec->msgLen), std::memory_order_release);
+    }
+    bool empty() const
+    {
+        return mHead.load(std::memory_order_acquire) == mTail.load(std::memory_order_relaxed);
+    }
+};
+
+/** Per-thread handle of a LogRing. When the thread exits, the writer still
+ * drains whatever is left in the ring, and then drops it */
+struct Logger::ThreadRing
+{
+    Logger* logger = nullptr;
+    std::shared_ptr<LogRing> ring;
+    ~ThreadRing()
+    {
+        if (ring)
+            ring->mOrphaned = true;
+    }
+};
+
+static thread_local Logger::ThreadRing tThreadRing;
+
 void Logger::logToConsole(bool enable)
 {
     LockGuard lock(mMutex);
@@ -92,7 +186,8 @@ void Logger::setAutoFlush(bool enable)
 }
 
 Logger::Logger(unsigned aFlags, const char* timeFmt)
-    :mTimeFmt(timeFmt), mFlags(aFlags)
+    :mTimeFmt(timeFmt), mFlags(aFlags), mWriterStarted(false), mWriterStopped(false),
+    mWriterSleeping(false), mLogSeq(0)
 {
     setup();
     setupFromEnvVar();
@@ -100,16 +195,15 @@ Logger::Logger(unsigned aFlags, const char* timeFmt)
         log("LOGGER", 0, 0, "========== Application startup ===========\n");
 }
 
-inline size_t Logger::prependInfo(char* buf, size_t bufSize, const char* prefix, const char* severity,
-                                  unsigned flags)
+inline size_t Logger::prependInfo(char* buf, size_t bufSize, time_t ts, const char* prefix,
+                                  const char* severity, unsigned flags)
 {
     size_t bytesLogged = 0;
     if ((mFlags & krLogNoTimestamps) == 0)
     {
         buf[bytesLogged++] = '[';
-        time_t now = time(NULL);
         struct tm tmbuf;
-        struct tm* tmval = gmtime_r(&now, &tmbuf);
+        struct tm* tmval = gmtime_r(&ts, &tmbuf);
         bytesLogged += strftime(buf+bytesLogged, bufSize-bytesLogged, mTimeFmt.c_str(), tmval);
         buf[bytesLogged++] = ']';
     }
@@ -135,8 +229,28 @@ void Logger::logv(const char* prefix, krLogLevel level, unsigned flags, const ch
 {
     flags |= (mFlags & krGlobalFlagMask);
     char statBuf[LOGGER_SPRINTF_BUF_SIZE];
+    if (((mFlags & krLogSynchronous) == 0) && !mWriterStopped && !isWriterThread())
+    {
+        // Errors are written synchronously, as they are often the last thing
+        // logged before an abort, and would be lost in the ring
+        if (level > krLogLevelError)
+        {
+            // Only the message itself is formatted here, the rest is done by the writer
+            va_list vaList;
+            va_copy(vaList, aVaList);
+            int len = vsnprintf(statBuf, LOGGER_SPRINTF_BUF_SIZE, fmtString, vaList);
+            va_end(vaList);
+            if (len < 0)
+                return;
+            if (len < LOGGER_SPRINTF_BUF_SIZE && logAsync(prefix, level, flags, statBuf, len))
+                return;
+        }
+        // An error, or a message too big for the ring: log it synchronously,
+        // but only after everything queued before it
+        flush();
+    }
     char* buf = statBuf;
-    size_t bytesLogged = prependInfo(buf, LOGGER_SPRINTF_BUF_SIZE, prefix,
+    size_t bytesLogged = prependInfo(buf, LOGGER_SPRINTF_BUF_SIZE, time(NULL), prefix,
         ((flags & krLogNoLevel) && (level > krLogLevelWarn))
             ? NULL
             :krLogLevelNames[level][0], flags);
@@ -223,12 +337,253 @@ std::shared_ptr<Logger::LogBuffer> Logger::loadLog()
 {
     if (!mFileLogger)
         return NULL;
+    flush();
     LockGuard lock(mMutex);
     return mFileLogger->loadLog();
 }
 
+Logger::LogRing* Logger::threadRing()
+{
+    auto& tr = tThreadRing;
+    if (tr.logger == this)
+        return tr.ring.get();
+    if (tr.logger) //thread already logs to another Logger instance
+        return nullptr;
+
+    tr.logger = this;
+    tr.ring = std::make_shared<LogRing>();
+    std::lock_guard<std::mutex> lock(mRingsMutex);
+    mRings.push_back(tr.ring);
+    if (!mWriterStarted)
+    {
+        mWriterThread = std::thread([this]() { writerLoop(); });
+        mWriterStarted = true;
+    }
+    return tr.ring.get();
+}
+
+bool Logger::logAsync(const char* prefix, krLogLevel level, unsigned flags, const char* msg, size_t len)
+{
+    LogRing* ring = threadRing();
+    if (!ring)
+        return false;
+    size_t prefixLen = prefix ? strlen(prefix)+1 : 0;
+    size_t recSize = LogRecord::recordSize(prefixLen, len);
+    if (recSize > LogRing::kSize / 4 || prefixLen > 0xffff)
+        return false;
+
+    size_t newHead;
+    LogRecord* rec;
+    while (!(rec = ring->reserve(recSize, newHead)))
+    {
+        // ring is full, wait for the writer to make some space
+        wakeupWriter();
+        std::this_thread::yield();
+    }
+    rec->ts = time(NULL);
+    rec->flags = flags;
+    rec->level = level;
+    rec->prefixLen = (uint16_t)prefixLen;
+    rec->msgLen = (uint32_t)len;
+    if (prefixLen)
+        memcpy((char*)(rec+1), prefix, prefixLen);
+    memcpy((char*)(rec+1)+prefixLen, msg, len+1);
+    rec->seq = mLogSeq.fetch_add(1, std::memory_order_relaxed);
+    ring->commit(newHead);
+
+    // Pairs with the fence in writerLoop(), so that either the writer sees the
+    // record before going to sleep, or we see it sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (level <= krLogLevelWarn || mWriterSleeping.load(std::memory_order_relaxed))
+        wakeupWriter();
+    return true;
+}
+
+void Logger::wakeupWriter()
+{
+    std::lock_guard<std::mutex> lock(mWriterMutex);
+    mWriterWakeup = true;
+    mWriterCv.notify_one();
+}
+
+/** Writes all queued records, merging the rings by sequence number.
+ * @returns Whether anything was written */
+bool Logger::writeQueued()
+{
+    std::vector<std::shared_ptr<LogRing>> rings;
+    {
+        std::lock_guard<std::mutex> lock(mRingsMutex);
+        rings = mRings;
+    }
+    bool wrote = false;
+    size_t bufSize = LOGGER_SPRINTF_BUF_SIZE+256;
+    std::unique_ptr<char[]> buf(new char[bufSize]);
+    {
+        LockGuard lock(mMutex);
+        for (;;)
+        {
+            LogRing* minRing = nullptr;
+            const LogRecord* minRec = nullptr;
+            for (auto& ring: rings)
+            {
+                const LogRecord* rec = ring->peek();
+                if (rec && (!minRec || rec->seq < minRec->seq))
+                {
+                    minRec = rec;
+                    minRing = ring.get();
+                }
+            }
+            if (!minRec)
+                break;
+
+            unsigned flags = minRec->flags;
+            size_t len = prependInfo(buf.get(), bufSize, minRec->ts, minRec->prefix(),
+                ((flags & krLogNoLevel) && (minRec->level > krLogLevelWarn))
+                    ? NULL
+                    : krLogLevelNames[minRec->level][0], flags);
+            if (len+minRec->msgLen+1 > bufSize)
+            {
+                bufSize = len+minRec->msgLen+1;
+                std::unique_ptr<char[]> newBuf(new char[bufSize]);
+                memcpy(newBuf.get(), buf.get(), len);
+                buf.swap(newBuf);
+            }
+            memcpy(buf.get()+len, minRec->msg(), minRec->msgLen+1);
+            // flushing is done once for the whole batch
+            logString(minRec->level, buf.get(), flags | krLogNoAutoFlush, len+minRec->msgLen);
+            minRing->pop(minRec);
+            wrote = true;
+        }
+        if (wrote && ((mFlags & krLogNoAutoFlush) == 0))
+        {
+            if (mFileLogger)
+                mFileLogger->flush();
+            if (mConsoleLogger)
+            {
+                fflush(stdout);
+                fflush(stderr);
+            }
+        }
+    }
+    // publish what has actually been written, for flush()
+    for (auto& ring: rings)
+    {
+        ring->mWritten.store(ring->mTail.load(std::memory_order_relaxed), std::memory_order_release);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mRingsMutex);
+        for (auto it = mRings.begin(); it != mRings.end();)
+        {
+            if ((*it)->mOrphaned && (*it)->empty())
+                it = mRings.erase(it);
+            else
+                it++;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mWriterMutex);
+        mFlushedCv.notify_all();
+    }
+    return wrote;
+}
+
+void Logger::writerLoop()
+{
+    //how long to keep collecting records after a write, before writing again
+    static const std::chrono::milliseconds kBatchInterval(10);
+    mWriterThreadId = std::this_thread::get_id();
+    for (;;)
+    {
+        bool wrote = writeQueued();
+        std::unique_lock<std::mutex> lock(mWriterMutex);
+        if (mStopWriter && !wrote)
+            break;
+        if (wrote)
+        {
+            // more is likely to follow, don't require notifications meanwhile
+            mWriterCv.wait_for(lock, kBatchInterval, [this]() { return mWriterWakeup || mStopWriter; });
+        }
+        else
+        {
+            mWriterSleeping = true;
+            lock.unlock();
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool hasQueued = false;
+            {
+                std::lock_guard<std::mutex> ringsLock(mRingsMutex);
+                for (auto& ring: mRings)
+                {
+                    if (!ring->empty())
+                    {
+                        hasQueued = true;
+                        break;
+                    }
+                }
+            }
+            lock.lock();
+            if (!hasQueued)
+                mWriterCv.wait(lock, [this]() { return mWriterWakeup || mStopWriter; });
+            mWriterSleeping = false;
+        }
+        mWriterWakeup = false;
+    }
+}
+
+void Logger::flush()
+{
+    if (!mWriterStarted || mWriterStopped || isWriterThread())
+        return;
+    // Everything committed so far, including the caller's own records, is
+    // before the current head of its ring. Sequence numbers can't be used for
+    // this, as a record gets its number before it's committed
+    std::vector<std::pair<std::shared_ptr<LogRing>, size_t>> targets;
+    {
+        std::lock_guard<std::mutex> lock(mRingsMutex);
+        for (auto& ring: mRings)
+        {
+            size_t head = ring->mHead.load(std::memory_order_acquire);
+            if (ring->mWritten.load(std::memory_order_acquire) != head)
+                targets.emplace_back(ring, head);
+        }
+    }
+    if (targets.empty())
+        return;
+    std::unique_lock<std::mutex> lock(mWriterMutex);
+    mWriterWakeup = true;
+    mWriterCv.notify_one();
+    mFlushedCv.wait(lock, [this, &targets]()
+    {
+        if (mWriterStopped)
+            return true;
+        for (auto& target: targets)
+        {
+            if (target.first->mWritten.load(std::memory_order_acquire) < target.second)
+                return false;
+        }
+        return true;
+    });
+}
+
+void Logger::stopWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mRingsMutex);
+        if (!mWriterStarted)
+            return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mWriterMutex);
+        mStopWriter = true;
+        mWriterCv.notify_one();
+    }
+    mWriterThread.join(); //drains everything before exiting
+    mWriterStopped = true;
+    mFlushedCv.notify_all();
+}
+
 Logger::~Logger()
 {
+    stopWriter(); //must not be done with mMutex locked, as the writer needs it
     LockGuard lock(mMutex);
     if (!mUserLoggers.empty())
     {
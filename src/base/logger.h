@@ -47,6 +47,7 @@ enum
     krLogDontShowEnvConfig = 1 << 10,
     krLogNoStartMessage = 1 << 11,
     krLogNoTerminateMessage = 1 << 12,
+    krLogSynchronous = 1 << 13, ///write to the backends on the logging thread, instead of on the writer thread
     krGlobalFlagMask = krLogNoAutoFlush|krLogNoLevel|krLogNoTimestamps ///flags that override channel flags when they are globally set
 };
 typedef unsigned char krLogChannelNo;
@@ -62,10 +63,15 @@ enum { krLogChannelCount = 32 };
 
 #ifdef __cplusplus
 
+#include <time.h>
 #include <string>
 #include <memory>
 #include <mutex>
 #include <map>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
 
 namespace karere
 {
@@ -77,6 +83,8 @@ class KRLOGGER_DLLIMPEXP Logger
 public:
     class ILoggerBackend;
     struct LogBuffer;
+    struct LogRing;     //internal, used by the asynchronous logging
+    struct ThreadRing;  //internal, used by the asynchronous logging
 protected:
     std::string mTimeFmt;
     inline void setup();
@@ -84,12 +92,38 @@ protected:
     std::unique_ptr<FileLogger> mFileLogger;
     std::unique_ptr<ConsoleLogger> mConsoleLogger;
     volatile unsigned mFlags;
-    size_t prependInfo(char *buf, size_t bufSize, const char* prefix, const char* severity, unsigned flags);
+    size_t prependInfo(char *buf, size_t bufSize, time_t ts, const char* prefix, const char* severity, unsigned flags);
 
     /** This is the low-level log function that does the actual logging
      *  of an assembled single string */
     void logString(krLogLevel level, const char* msg, unsigned flags, size_t len=(size_t)-1);
     std::map<std::string, ILoggerBackend*> mUserLoggers;
+
+    /** Asynchronous logging: each logging thread formats the message and
+     * puts it, together with the prefix, level and timestamp, in its own
+     * lock-free ring buffer. A single writer thread collects the records of all
+     * threads in order, assembles the log lines and passes them to the console,
+     * file and user loggers, flushing once per batch. */
+    std::vector<std::shared_ptr<LogRing>> mRings;
+    std::mutex mRingsMutex;
+    std::thread mWriterThread;
+    std::atomic<std::thread::id> mWriterThreadId;
+    std::atomic<bool> mWriterStarted;
+    std::atomic<bool> mWriterStopped;
+    std::mutex mWriterMutex;
+    std::condition_variable mWriterCv; //wakes up the writer
+    std::condition_variable mFlushedCv; //signalled by the writer when it has drained the rings
+    std::atomic<bool> mWriterSleeping;
+    bool mWriterWakeup = false;
+    bool mStopWriter = false;
+    std::atomic<uint64_t> mLogSeq;
+    bool isWriterThread() const { return std::this_thread::get_id() == mWriterThreadId.load(); }
+    LogRing* threadRing();
+    bool logAsync(const char* prefix, krLogLevel level, unsigned flags, const char* msg, size_t len);
+    void wakeupWriter();
+    void writerLoop();
+    bool writeQueued();
+    void stopWriter();
 public:
     std::recursive_mutex mMutex;
     typedef std::lock_guard<std::recursive_mutex> LockGuard;
@@ -110,11 +144,17 @@ public:
     void log(const char* prefix, krLogLevel level, unsigned flags,
                 const char* fmtString, ...);
     std::shared_ptr<LogBuffer> loadLog();
+    /** @brief Waits until everything logged so far has been passed to the backends */
+    void flush();
 
     /** @brief Registers a user logger with the specified tag.
      * If a logger with that tag does not already exist, the function returns
      * \c nullptr. If one already exists, the new one replaces it, and the old one
      * is returned.
+     * \note Unless the krLogSynchronous flag is set, the logger's log() method is
+     * called on the logger's writer thread, not on the thread that logged the
+     * message. Error messages, and messages too big for the queue, are the
+     * exception: they are passed to the backends on the logging thread.
      */
     ILoggerBackend *addUserLogger(const char* tag, ILoggerBackend* logger);
 
@@ -46,7 +46,7 @@ void logString(const char* buf, size_t len, unsigned flags)
 {
 //    std::lock_guard<std::mutex> lock(mMutex);
     //do not increment mLogSize until we have actually written the data
-    if (mLogSize >= mRotateSize)
+    if (mLogSize >= mRotateSize / 2)
         rotateLog();
     mLogSize += len;
     size_t ret = fwrite(buf, 1, len, mFile);
@@ -57,65 +57,77 @@ void logString(const char* buf, size_t len, unsigned flags)
 }
 
 
-std::shared_ptr<Logger::LogBuffer> loadLog() //Logger must be locked!!!
+std::string rotatedFileName() const { return mFileName + ".1"; }
+
+static bool readFile(FILE* file, long size, char* output)
 {
-    std::shared_ptr<Logger::LogBuffer> buf(new Logger::LogBuffer(new char[mLogSize+1], mLogSize+1));
-    if (!buf->data)
-        throw std::runtime_error("FileLogger::loadLog: Out of memory when allocating buffer");
-    fseek(mFile, 0, SEEK_SET);
-    long bytesRead = fread(buf->data, 1, mLogSize, mFile);
-    if (bytesRead != mLogSize)
+    fseek(file, 0, SEEK_SET);
+    long bytesRead = fread(output, 1, size, file);
+    if (bytesRead != size)
     {
-        if (ferror(mFile))
+        if (ferror(file))
             perror("ERROR: FileLogger::loadLog: Error reading log file: ");
-        else if (feof(mFile))
-            fprintf(stderr, "ERROR: FileLogger::loadLog: EOF while reading log file. Required: %ld, read: %ld", mLogSize, bytesRead);
+        else if (feof(file))
+            fprintf(stderr, "ERROR: FileLogger::loadLog: EOF while reading log file. Required: %ld, read: %ld", size, bytesRead);
         else
             fprintf(stderr, "ERROR: FileLogger::loadLog: Unknown error has occurred while reading file. ferror() and feof() were not set");
 
-        return NULL;
+        return false;
+    }
+    return true;
+}
+
+/** Returns the contents of the rotated log (if any), followed by the current one */
+std::shared_ptr<Logger::LogBuffer> loadLog() //Logger must be locked!!!
+{
+    FILE* oldFile = fopen(rotatedFileName().c_str(), "rb");
+    long oldSize = 0;
+    if (oldFile)
+    {
+        fseek(oldFile, 0, SEEK_END);
+        oldSize = ftell(oldFile);
     }
-    buf->data[mLogSize] = 0; //zero terminate the string in the buffer
+    std::shared_ptr<Logger::LogBuffer> buf(new Logger::LogBuffer(new char[oldSize+mLogSize+1], oldSize+mLogSize+1));
+    if (!buf->data)
+        throw std::runtime_error("FileLogger::loadLog: Out of memory when allocating buffer");
+    if (oldFile)
+    {
+        bool ok = readFile(oldFile, oldSize, buf->data);
+        fclose(oldFile);
+        if (!ok)
+            return NULL;
+    }
+    fflush(mFile);
+    if (!readFile(mFile, mLogSize, buf->data+oldSize))
+        return NULL;
+    buf->data[oldSize+mLogSize] = 0; //zero terminate the string in the buffer
     fseek(mFile, 0, SEEK_END);
     return buf;
 }
 
-void rotateLog()
+void flush()
 {
-    auto buf = loadLog();
-    long slicePos = mLogSize - (mRotateSize / 2);
-    if (slicePos <= 1)
-        throw std::runtime_error("FileLogger::rotate: The slice offset is less than 1");
-    if (slicePos >= mLogSize - 1)
-        throw std::runtime_error("FileLogger::rotate: The slice offset is at the end of the log. Rotate size is too small");
-
-    long i;
-    for (i = slicePos; i >= 0; i--)
-        if (buf->data[i] == '\n')
-            break;
-//i shoud point to a \n or be -1
-//It is guaranteed that the highest value of i (=half) is
-//at least 1 less that the end of the buf (see checks above)
-    if (i > 0)
-        slicePos = i+1;
-//else no new line found in the half->beginning backward scan, so just truncate and dont care about newlines
+    fflush(mFile);
+}
 
-    fclose(mFile); //writing appends to the end of the file, and now we want to rewrite it
+/** The current log is renamed to <name>.1, replacing the previous one, and a
+ * new one is started. As rotation happens at half the rotate size, the two
+ * files together take at most about the rotate size, and there is always at
+ * least half of it of recent log, as with the previous in-place rotation
+ */
+void rotateLog()
+{
+    fclose(mFile);
     mFile = NULL;
-    FILE* writeFile = fopen(mFileName.c_str(), "wb");
-    if (!writeFile)
-        throw std::runtime_error("FileLogger::rotate: Cannot open log file for rewriting");
-    int writeLen = mLogSize-slicePos;
-    int ret = fwrite(buf->data+slicePos, 1, writeLen, writeFile);
-    if (ret != writeLen)
+    std::string oldName = rotatedFileName();
+    remove(oldName.c_str()); //rename() doesn't replace existing files on Windows
+    if (rename(mFileName.c_str(), oldName.c_str()) != 0)
     {
-        if (ret < 0)
-            perror("ERROR: FileLogger::rotate: Error writing file:");
-        else
-            fprintf(stderr, "ERROR: FileLogger::rotate: Not all data could be written to file: requested %d, written: %d\n",
-                writeLen, ret);
+        perror("ERROR: FileLogger::rotate: Error renaming log file, truncating it: ");
+        FILE* truncFile = fopen(mFileName.c_str(), "wb");
+        if (truncFile)
+            fclose(truncFile);
     }
-    fclose(writeFile);
     openLogFile();
 }
 
@@ -0,0 +1,128 @@
+#include <functional>
+#include <memory>
+#include <thread>
+#include <asyncTest-framework.h>
+#include <mpscQueue.h>
+
+TESTS_INIT();
+using namespace karere;
+
+int main()
+{
+
+TestGroup("MpscQueue")
+{
+    syncTest("FIFO order, also across ring overflow")
+    {
+        MpscQueue<uint64_t, 16> queue;
+        uint64_t item;
+        check(queue.empty());
+        check(!queue.pop(item));
+        // 16 fit in the ring, the rest overflow
+        for (uint64_t i = 0; i < 40; i++)
+        {
+            queue.push(i);
+        }
+        check(queue.size() == 40);
+        // after popping a few, there is room in the ring again, but new items
+        // must still go after the overflowed ones
+        for (uint64_t i = 0; i < 5; i++)
+        {
+            check(queue.pop(item) && item == i);
+        }
+        for (uint64_t i = 40; i < 50; i++)
+        {
+            queue.push(i);
+        }
+        for (uint64_t i = 5; i < 50; i++)
+        {
+            check(queue.pop(item));
+            check(item == i);
+        }
+        check(!queue.pop(item));
+        check(queue.empty());
+    });
+    syncTest("popBatch and forEach")
+    {
+        MpscQueue<uint64_t, 16> queue;
+        for (uint64_t i = 0; i < 20; i++)
+        {
+            queue.push(i);
+        }
+        uint64_t expected = 0;
+        queue.forEach([&](uint64_t item)
+        {
+            check(item == expected++);
+        });
+        check(expected == 20);
+        check(queue.size() == 20); //forEach doesn't remove anything
+
+        uint64_t batch[8];
+        check(queue.popBatch(batch, 8) == 8);
+        for (uint64_t i = 0; i < 8; i++)
+        {
+            check(batch[i] == i);
+        }
+        check(queue.popBatch(batch, 8) == 8);
+        check(batch[0] == 8 && batch[7] == 15);
+        check(queue.popBatch(batch, 8) == 4);
+        check(batch[3] == 19);
+        check(queue.popBatch(batch, 8) == 0);
+    });
+    syncTest("Multiple producers: no loss, each producer's items in order")
+    {
+        // A small ring, so that producers overflow all the time, while the
+        // consumer pops concurrently
+        enum { kProducers = 8, kItemsPerProducer = 200000 };
+        MpscQueue<uint64_t, 64> queue;
+        std::vector<std::thread> producers;
+        for (uint64_t p = 0; p < kProducers; p++)
+        {
+            producers.emplace_back([&queue, p]()
+            {
+                for (uint64_t i = 0; i < kItemsPerProducer; i++)
+                {
+                    queue.push((p << 32) | i);
+                }
+            });
+        }
+
+        std::vector<uint64_t> nextSeq(kProducers, 0);
+        size_t received = 0;
+        bool orderOk = true;
+        uint64_t batch[64];
+        while (received < kProducers * kItemsPerProducer)
+        {
+            size_t count = queue.popBatch(batch, 64);
+            if (!count)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            for (size_t i = 0; i < count; i++)
+            {
+                uint64_t p = batch[i] >> 32;
+                uint64_t seq = batch[i] & 0xffffffff;
+                if (p >= kProducers || seq != nextSeq[p])
+                    orderOk = false;
+                else
+                    nextSeq[p]++;
+            }
+            received += count;
+        }
+        for (auto& thread: producers)
+        {
+            thread.join();
+        }
+        check(orderOk);
+        for (auto seq: nextSeq)
+        {
+            check(seq == kItemsPerProducer);
+        }
+        uint64_t item;
+        check(!queue.pop(item)); //nothing duplicated
+    });
+});
+
+return test::gNumFailed;
+}
@@ -0,0 +1,158 @@
+#ifndef KARERE_MPSC_QUEUE_H
+#define KARERE_MPSC_QUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace karere
+{
+/** @brief Bounded lock-free multi-producer/single-consumer FIFO queue of
+ * trivially copyable items (normally pointers).
+ * Producers claim a slot in the ring with a single CAS and publish it via the
+ * slot's sequence number, so they never block each other or the consumer.
+ * If the ring is full, items go to a mutex-protected overflow list, so push()
+ * never fails. Once something has overflowed, further pushes also go to the
+ * overflow list until the consumer has drained it, which keeps the items of
+ * each producer in FIFO order.
+ * All the pop-side methods (pop(), popBatch(), forEach(), size(), empty())
+ * must be called from one thread at a time - the consumer.
+ */
+template <class T, size_t Capacity=4096>
+class MpscQueue
+{
+protected:
+    static_assert((Capacity & (Capacity-1)) == 0, "Capacity must be a power of 2");
+    enum { kCacheLine = 64 };
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        T data;
+    };
+    std::vector<Cell> mCells;
+    alignas(kCacheLine) std::atomic<size_t> mEnqueuePos;
+    alignas(kCacheLine) size_t mDequeuePos = 0;
+    // items that the consumer has already taken out of the ring/overflow, but
+    // not yet returned. They are always older than whatever is in the ring
+    std::deque<T> mReady;
+    std::atomic<bool> mOverflowed;
+    std::mutex mOverflowMutex;
+    std::deque<T> mOverflow;
+    bool tryPush(const T& item)
+    {
+        size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell& cell = mCells[pos & (Capacity-1)];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (mEnqueuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+                {
+                    cell.data = item;
+                    cell.seq.store(pos+1, std::memory_order_release);
+                    return true;
+                }
+                // pos was updated by compare_exchange_weak
+            }
+            else if (diff < 0)
+            {
+                return false; //full
+            }
+            else
+            {
+                pos = mEnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    bool tryPop(T& item)
+    {
+        Cell& cell = mCells[mDequeuePos & (Capacity-1)];
+        if (cell.seq.load(std::memory_order_acquire) != mDequeuePos+1)
+            return false; //empty, or the next producer has not published yet
+        item = cell.data;
+        cell.seq.store(mDequeuePos+Capacity, std::memory_order_release);
+        mDequeuePos++;
+        return true;
+    }
+    /** Moves everything that was pushed so far to mReady, preserving the order */
+    void drainToReady()
+    {
+        T item;
+        std::lock_guard<std::mutex> lock(mOverflowMutex);
+        // Anything a producer pushed to the ring before its overflowed items
+        // has already been published, as overflowing requires this lock
+        while (tryPop(item))
+            mReady.push_back(item);
+        for (auto& ovf: mOverflow)
+            mReady.push_back(ovf);
+        mOverflow.clear();
+        mOverflowed.store(false, std::memory_order_release);
+    }
+public:
+    MpscQueue(): mCells(Capacity), mEnqueuePos(0), mOverflowed(false)
+    {
+        for (size_t i = 0; i < Capacity; i++)
+            mCells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+    /** @brief Can be called from any thread */
+    void push(const T& item)
+    {
+        if (!mOverflowed.load(std::memory_order_acquire) && tryPush(item))
+            return;
+        std::lock_guard<std::mutex> lock(mOverflowMutex);
+        mOverflow.push_back(item);
+        mOverflowed.store(true, std::memory_order_release);
+    }
+    bool pop(T& item)
+    {
+        if (!mReady.empty())
+        {
+            item = mReady.front();
+            mReady.pop_front();
+            return true;
+        }
+        if (tryPop(item))
+            return true;
+        if (!mOverflowed.load(std::memory_order_acquire))
+            return false;
+        drainToReady();
+        return pop(item);
+    }
+    /** @brief Pops up to \c maxCount items into \c out, in order.
+     * @returns The number of items popped */
+    size_t popBatch(T* out, size_t maxCount)
+    {
+        size_t count = 0;
+        while (count < maxCount && pop(out[count]))
+            count++;
+        return count;
+    }
+    /** @brief Calls \c func for every queued item, in order, without removing it */
+    template <class F>
+    void forEach(F&& func)
+    {
+        drainToReady();
+        for (auto& item: mReady)
+            func(item);
+    }
+    /** @brief The number of queued items. Items that are being pushed
+     * concurrently may or may not be counted */
+    size_t size()
+    {
+        size_t ringSize = mEnqueuePos.load(std::memory_order_acquire) - mDequeuePos;
+        std::lock_guard<std::mutex> lock(mOverflowMutex);
+        return mReady.size() + ringSize + mOverflow.size();
+    }
+    bool empty() { return size() == 0; }
+};
+}
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef KARERE_SLAB_ALLOCATOR_H
+#define KARERE_SLAB_ALLOCATOR_H
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+#ifdef _WIN32
+    #include <malloc.h>
+#endif
+
+namespace karere
+{
+/** @brief Arena of small objects, carved out of big slabs. Blocks are of
+ * size classes of kSizeClassStep bytes, each slab holds blocks of one class.
+ * Freed blocks go to the free list of their class and are reused, slabs are
+ * returned to the system only when the arena is destroyed.
+ * It is meant for objects that are allocated in very large numbers, like
+ * chatd::Message, where the per-allocation overhead of malloc and heap
+ * fragmentation become significant.
+ * Slabs are aligned to their size and start with a header that points to the
+ * arena, so a block can be freed without knowing where it was allocated from.
+ * Each chatd::Client has its own arena, which is used mostly by the event loop
+ * thread, so its lock is virtually never contended. Objects that don't belong
+ * to a client are allocated from the shared() arena.
+ */
+class SlabArena
+{
+public:
+    enum: size_t
+    {
+        kSlabSize = 64 * 1024,
+        kHeaderSize = 64, //keeps the blocks aligned to kSizeClassStep
+        kSizeClassStep = 16,
+        kMaxBlockSize = 512,
+        kSizeClassCount = kMaxBlockSize / kSizeClassStep
+    };
+protected:
+    struct Block
+    {
+        Block* next;
+    };
+    struct SlabHeader
+    {
+        SlabArena* arena;
+        size_t sizeClass;
+    };
+    std::mutex mMutex;
+    Block* mFreeLists[kSizeClassCount] = {};
+    std::vector<void*> mSlabs;
+    std::atomic<size_t> mLiveCount;
+    std::atomic<size_t> mLiveBytes;
+    std::atomic<size_t> mReservedBytes;
+    bool mReleased = false;
+    static size_t blockSize(size_t sizeClass) { return (sizeClass + 1) * kSizeClassStep; }
+    static void* allocSlab()
+    {
+#ifdef _WIN32
+        return _aligned_malloc(kSlabSize, kSlabSize);
+#else
+        void* slab;
+        return posix_memalign(&slab, kSlabSize, kSlabSize) ? nullptr : slab;
+#endif
+    }
+    static void freeSlab(void* slab)
+    {
+#ifdef _WIN32
+        _aligned_free(slab);
+#else
+        ::free(slab);
+#endif
+    }
+    void addSlab(size_t sizeClass)
+    {
+        void* slab = allocSlab();
+        if (!slab)
+            throw std::bad_alloc();
+        mSlabs.push_back(slab);
+        mReservedBytes += kSlabSize;
+        auto header = static_cast<SlabHeader*>(slab);
+        header->arena = this;
+        header->sizeClass = sizeClass;
+        size_t size = blockSize(sizeClass);
+        char* blocks = static_cast<char*>(slab) + kHeaderSize;
+        Block*& freeList = mFreeLists[sizeClass];
+        for (size_t i = (kSlabSize - kHeaderSize) / size; i-- > 0;)
+        {
+            auto block = reinterpret_cast<Block*>(blocks + i * size);
+            block->next = freeList;
+            freeList = block;
+        }
+    }
+    void freeBlock(void* ptr, size_t sizeClass)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            auto block = static_cast<Block*>(ptr);
+            block->next = mFreeLists[sizeClass];
+            mFreeLists[sizeClass] = block;
+            mLiveBytes -= blockSize(sizeClass);
+            if ((--mLiveCount != 0) || !mReleased)
+                return;
+        }
+        delete this; //the owner is gone and this was the last block
+    }
+    ~SlabArena()
+    {
+        for (auto slab: mSlabs)
+        {
+            freeSlab(slab);
+        }
+    }
+public:
+    SlabArena(): mLiveCount(0), mLiveBytes(0), mReservedBytes(0) {}
+    SlabArena(const SlabArena&) = delete;
+    SlabArena& operator=(const SlabArena&) = delete;
+    static bool fits(size_t size) { return size && (size <= kMaxBlockSize); }
+    void* alloc(size_t size)
+    {
+        assert(fits(size));
+        size_t sizeClass = (size - 1) / kSizeClassStep;
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mFreeLists[sizeClass])
+            addSlab(sizeClass);
+        Block* block = mFreeLists[sizeClass];
+        mFreeLists[sizeClass] = block->next;
+        mLiveCount++;
+        mLiveBytes += blockSize(sizeClass);
+        return block;
+    }
+    /** @brief Frees a block allocated from any arena */
+    static void free(void* ptr)
+    {
+        if (!ptr)
+            return;
+        auto header = reinterpret_cast<SlabHeader*>(reinterpret_cast<uintptr_t>(ptr) & ~(uintptr_t)(kSlabSize - 1));
+        header->arena->freeBlock(ptr, header->sizeClass);
+    }
+    /** @brief Called by the owner instead of deleting the arena. Blocks may
+     * outlive their owner, i.e. messages still referenced by pending operations,
+     * so the arena is destroyed when its last block is freed */
+    void release()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            assert(!mReleased);
+            mReleased = true;
+            if (mLiveCount)
+                return;
+        }
+        delete this;
+    }
+    /** @brief The number of blocks currently allocated */
+    size_t liveCount() const { return mLiveCount; }
+    /** @brief The size in bytes of the blocks currently allocated */
+    size_t liveBytes() const { return mLiveBytes; }
+    /** @brief The memory reserved from the system, in bytes */
+    size_t reservedBytes() const { return mReservedBytes; }
+    /** @brief The arena for objects that don't belong to a chatd::Client. It is
+     * intentionally never destroyed, as objects allocated from it may be freed
+     * by static destructors at exit */
+    static SlabArena& shared()
+    {
+        static SlabArena* arena = new SlabArena;
+        return *arena;
+    }
+};
+
+/** @brief STL allocator that takes single-object allocations (i.e. the nodes
+ * of a std::list) from a SlabArena, the shared one by default
+ */
+template <class T>
+struct SlabStlAllocator
+{
+    typedef T value_type;
+    SlabArena* arena;
+    SlabStlAllocator(): arena(&SlabArena::shared()) {}
+    explicit SlabStlAllocator(SlabArena& aArena): arena(&aArena) {}
+    template <class U>
+    SlabStlAllocator(const SlabStlAllocator<U>& other): arena(other.arena) {}
+    T* allocate(size_t n)
+    {
+        if ((n == 1) && SlabArena::fits(sizeof(T)))
+            return static_cast<T*>(arena->alloc(sizeof(T)));
+        return static_cast<T*>(::operator new(n*sizeof(T)));
+    }
+    void deallocate(T* ptr, size_t n)
+    {
+        if ((n == 1) && SlabArena::fits(sizeof(T)))
+            SlabArena::free(ptr);
+        else
+            ::operator delete(ptr);
+    }
+    template <class U>
+    bool operator==(const SlabStlAllocator<U>& other) const { return arena == other.arena; }
+    template <class U>
+    bool operator!=(const SlabStlAllocator<U>& other) const { return arena != other.arena; }
+};
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef KARERE_WORKER_POOL_H
+#define KARERE_WORKER_POOL_H
+
+#include <assert.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace karere
+{
+/** @brief A process-wide pool of threads for CPU-bound work, like crypto,
+ * that would otherwise run on the event loop thread.
+ * Jobs are run in FIFO order, but in parallel, so they must not depend on each
+ * other. They must not touch anything that belongs to the event loop thread
+ * (promises, DeleteTrackable handles, slab-allocated objects) - they should
+ * work on data that is owned by the job until it is done, and pass the
+ * results back to the loop via marshallCall().
+ * The threads are started on the first post(), so there is no cost if the pool
+ * is never used.
+ */
+class WorkerPool
+{
+public:
+    typedef std::function<void()> Job;
+    static WorkerPool& instance()
+    {
+        static WorkerPool pool;
+        return pool;
+    }
+    /** @brief Sets the number of worker threads. 0 means the number of CPU
+     * cores minus one (for the event loop thread), but at least one.
+     * Running threads finish all queued jobs and exit, and the new number of
+     * threads is started on the next post() */
+    void setThreadCount(unsigned count)
+    {
+        stop();
+        std::lock_guard<std::mutex> lock(mMutex);
+        mThreadCount = count ? count : defaultThreadCount();
+    }
+    unsigned threadCount() const { return mThreadCount; }
+    static unsigned defaultThreadCount()
+    {
+        unsigned cores = std::thread::hardware_concurrency();
+        return (cores > 2) ? cores - 1 : 1;
+    }
+    void post(Job&& job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mThreads.empty())
+            {
+                mExit = false;
+                for (unsigned i = 0; i < mThreadCount; i++)
+                {
+                    mThreads.emplace_back(&WorkerPool::workerLoop, this);
+                }
+            }
+            mJobs.push_back(std::move(job));
+        }
+        mCv.notify_one();
+    }
+    ~WorkerPool() { stop(); }
+protected:
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    std::deque<Job> mJobs;
+    std::vector<std::thread> mThreads;
+    unsigned mThreadCount = defaultThreadCount();
+    bool mExit = false;
+    WorkerPool() {}
+    void stop()
+    {
+        std::vector<std::thread> threads;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mExit = true;
+            threads.swap(mThreads);
+        }
+        mCv.notify_all();
+        for (auto& thread: threads)
+        {
+            thread.join();
+        }
+    }
+    void workerLoop()
+    {
+        for (;;)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCv.wait(lock, [this]() { return mExit || !mJobs.empty(); });
+                if (mJobs.empty())
+                    return; //exit only after the queue is drained
+                job = std::move(mJobs.front());
+                mJobs.pop_front();
+            }
+            job();
+        }
+    }
+};
+}
+#endif // KARERE_WORKER_POOL_H
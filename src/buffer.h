@@ -226,7 +226,8 @@ public:
         {
             if (datalen <= mBufSize)
             {
-                memcpy(mBuf, data, datalen);
+                // data may be a part of our own buffer
+                memmove(mBuf, data, datalen);
                 mDataSize = datalen;
                 return;
             }
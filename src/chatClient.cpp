@@ -33,6 +33,7 @@
 #include <codecvt> //for nonWhitespaceStr()
 #include <locale>
 #include "strongvelope/strongvelope.h"
+#include "strongvelope/keyCache.h"
 #include "base64url.h"
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -147,28 +148,106 @@ bool Client::openDb(const std::string& sid)
         return false;
     }
 
-    bool ok = db.open(path.c_str(), false);
+    bool ok = db.open(path.c_str(), false, mDbOptions);
     if (!ok)
     {
         KR_LOG_WARNING("Error opening database");
         return false;
     }
-    SqliteStmt stmt(db, "select value from vars where name = 'schema_version'");
-    if (!stmt.step())
+    std::string dbVer;
     {
-        db.close();
-        KR_LOG_WARNING("Can't get local database version");
-        return false;
+        SqliteStmt stmt(db, "select value from vars where name = 'schema_version'");
+        if (!stmt.step())
+        {
+            db.close();
+            KR_LOG_WARNING("Can't get local database version");
+            return false;
+        }
+        dbVer = stmt.stringCol(0);
     }
     std::string ver(gDbSchemaHash);
     ver.append("_").append(gDbSchemaVersionSuffix);
-    if (stmt.stringCol(0) != ver)
+    if (dbVer != ver && !migrateDb(dbVer))
     {
         db.close();
         KR_LOG_WARNING("Database schema version is not compatible with app version, will rebuild it");
         return false;
     }
     mSid = sid;
+    startDbWriter();
+    initMessageSearch();
+    return true;
+}
+
+/** An in-place upgrade of the db schema from a previous version. The version
+ * strings are in the format stored in vars.schema_version, i.e.
+ * <sha1 of whitespace-stripped dbSchema.sql>_<gDbSchemaVersionSuffix>.
+ * A null \c to means the current version. When changing dbSchema.sql, the
+ * previous last entry must get a non-null \c to, and a new one must be added.
+ */
+struct DbMigration
+{
+    const char* from;
+    const char* to;
+    const char* sql;
+};
+
+static const DbMigration gDbMigrations[] =
+{
+    // Add is_deleted, covering index for unread count and index for the send queue
+    { "aeb77a3336575a31d5cf42a065fe1db5ebe0fd1d_2", "8bd295022d3f42031abd274ace4b94f76cf16ae8_3",
+        "ALTER TABLE history ADD COLUMN is_deleted tinyint not null default 0;"
+        "UPDATE history SET is_deleted = 1 where ifnull(updated, 0) != 0 and ifnull(length(data), 0) = 0;"
+        "CREATE INDEX history_unread ON history(chatid, idx, userid, type, is_deleted);"
+        "CREATE INDEX sending_chatid ON sending(chatid);"
+    },
+    // Add the format flag of the (optionally compressed) history payload
+    { "8bd295022d3f42031abd274ace4b94f76cf16ae8_3", nullptr,
+        "ALTER TABLE history ADD COLUMN data_fmt tinyint not null default 0;"
+    }
+};
+
+bool Client::migrateDb(std::string& ver)
+{
+    std::string current(gDbSchemaHash);
+    current.append("_").append(gDbSchemaVersionSuffix);
+    auto start = timestampMs();
+    try
+    {
+        while (ver != current)
+        {
+            const DbMigration* migration = nullptr;
+            for (auto& item: gDbMigrations)
+            {
+                if (ver == item.from)
+                {
+                    migration = &item;
+                    break;
+                }
+            }
+            if (!migration)
+            {
+                KR_LOG_WARNING("No db migration path from schema version %s", ver.c_str());
+                db.rollback();
+                return false;
+            }
+            const char* to = migration->to ? migration->to : current.c_str();
+            KR_LOG_INFO("Migrating db schema from version %s to %s...", ver.c_str(), to);
+            auto stepStart = timestampMs();
+            db.simpleQuery(migration->sql);
+            ver = to;
+            KR_LOG_INFO("Db schema migration step done in %lld ms", (long long)(timestampMs() - stepStart));
+        }
+        db.query("update vars set value = ? where name = 'schema_version'", ver);
+        db.commit();
+    }
+    catch(std::exception& e)
+    {
+        KR_LOG_ERROR("Error migrating db schema: %s", e.what());
+        db.rollback();
+        return false;
+    }
+    KR_LOG_INFO("Db schema migrated in place in %lld ms", (long long)(timestampMs() - start));
     return true;
 }
 
@@ -316,7 +395,7 @@ void Client::saveDb()
     {
         if (db.isOpen())
         {
-            db.commit();
+            db.flush();
         }
     }
     catch(std::runtime_error& e)
@@ -371,6 +450,7 @@ promise::Promise<void> Client::initWithNewSession(const char* sid, const std::st
             return;
         loadContactListFromApi(*contactList);
         chatd.reset(new chatd::Client(this, mMyHandle));
+        chatd->setHistoryMemoryLimits(mChatHistoryMemLimit, mTotalHistoryMemLimit);
         assert(chats->empty());
         chats->onChatsUpdate(*chatList);
         commit(scsn);
@@ -382,6 +462,16 @@ void Client::setCommitMode(bool commitEach)
     db.setCommitMode(commitEach);
 }
 
+void Client::setHistoryMemoryLimits(size_t chatLimit, size_t totalLimit)
+{
+    mChatHistoryMemLimit = chatLimit;
+    mTotalHistoryMemLimit = totalLimit;
+    if (chatd)
+    {
+        chatd->setHistoryMemoryLimits(chatLimit, totalLimit);
+    }
+}
+
 void Client::commit(const std::string& scsn)
 {
     if (scsn.empty())
@@ -500,6 +590,7 @@ void Client::initWithDbSession(const char* sid)
         contactList->loadFromDb();
         mContactsLoaded = true;
         chatd.reset(new chatd::Client(this, mMyHandle));
+        chatd->setHistoryMemoryLimits(mChatHistoryMemLimit, mTotalHistoryMemLimit);
         chats->loadFromDb();
     }
     catch(std::runtime_error& e)
@@ -693,9 +784,15 @@ void Client::onRequestFinish(::mega::MegaApi* apiObj, ::mega::MegaRequest *reque
 void Client::wipeDb(const std::string& sid)
 {
     assert(!sid.empty());
+    mMessageSearch.reset();
+    // don't keep the keys of a logged out account in memory
+    strongvelope::KeyCache::instance().clear();
     db.close();
     std::string path = dbPath(sid);
     remove(path.c_str());
+    // in WAL mode, these may hold the latest changes
+    remove((path+"-wal").c_str());
+    remove((path+"-shm").c_str());
     struct stat info;
     if (stat(path.c_str(), &info) == 0)
         throw std::runtime_error("wipeDb: Could not delete old database file in "+mAppDir);
@@ -705,9 +802,69 @@ void Client::createDb()
 {
     wipeDb(mSid);
     std::string path = dbPath(mSid);
-    if (!db.open(path.c_str(), false))
+    if (!db.open(path.c_str(), false, mDbOptions))
         throw std::runtime_error("Can't access application database at "+mAppDir);
     createDbSchema(); //calls commit() at the end
+    startDbWriter();
+    initMessageSearch();
+}
+
+void Client::startDbWriter()
+{
+    mDbWriteFailed = false;
+    auto wptr = weakHandle();
+    db.setWriteErrorHandler([this, wptr](const std::string& sql, int errCode, const std::string& errMsg)
+    {
+        marshallCall([this, wptr, sql, errCode, errMsg]()
+        {
+            if (wptr.deleted())
+                return;
+            onDbWriteError(sql, errCode, errMsg);
+        }, appCtx);
+    });
+    db.setAsyncWrites(mAsyncDbWrites);
+}
+
+// The code that queued the write assumes that it is persisted. If it was lost
+// because the db is failing, the cache may now miss history or keys that are
+// not fetched again, so invalidate the schema version, and the cache is rebuilt
+// from the server on the next start. Other errors, i.e. a constraint violated
+// by a duplicate row, affect only that write, and are just logged, as they
+// were before write-behind
+void Client::onDbWriteError(const std::string& sql, int errCode, const std::string& errMsg)
+{
+    KR_LOG_ERROR("Queued db write failed with error %d: %s\n%s", errCode, errMsg.c_str(), sql.c_str());
+    int primaryCode = errCode & 0xff; //strip the extended code, if any
+    if ((primaryCode != SQLITE_IOERR) && (primaryCode != SQLITE_FULL) && (primaryCode != SQLITE_CORRUPT))
+        return;
+    if (mDbWriteFailed || !db.isOpen())
+        return;
+
+    mDbWriteFailed = true;
+    try
+    {
+        db.query("update vars set value = 'invalid' where name = 'schema_version'");
+        db.flush();
+        KR_LOG_WARNING("The local cache will be rebuilt on next start");
+    }
+    catch(std::exception& e)
+    {
+        KR_LOG_ERROR("Error invalidating the local cache: %s", e.what());
+    }
+}
+
+void Client::initMessageSearch()
+{
+    mMessageSearch.reset();
+    if (!MessageSearch::createIndex(db))
+    {
+        // The index is not updated in this session, so it must be rebuilt
+        // once FTS5 is available again
+        db.query("delete from vars where name = 'fts_backfill'");
+        return;
+    }
+    mMessageSearch.reset(new MessageSearch(db, dbPath(mSid), appCtx, mSearchTextFunc));
+    mMessageSearch->startBackfill();
 }
 
 bool Client::checkSyncWithSdkDb(const std::string& scsn,
@@ -1182,6 +1339,8 @@ void Client::terminate(bool deleteDb)
 
     disconnect();
     mUserAttrCache.reset();
+    mMessageSearch.reset();
+    KR_LOG_DEBUG("Key cache: %s", strongvelope::KeyCache::instance().stats().toString().c_str());
 
     try
     {
@@ -1192,7 +1351,12 @@ void Client::terminate(bool deleteDb)
         else if (db.isOpen())
         {
             KR_LOG_INFO("Doing final COMMIT to database");
-            db.commit();
+            KR_LOG_DEBUG("Db statement cache: %llu hits, %llu misses",
+                (unsigned long long)db.stmtCacheHits(), (unsigned long long)db.stmtCacheMisses());
+            KR_LOG_DEBUG("Db writer: %llu writes queued, %llu of them executed inline, %llu WAL checkpoints",
+                (unsigned long long)db.queuedWriteCount(), (unsigned long long)db.inlineWriteCount(),
+                (unsigned long long)db.checkpointCount());
+            db.flush();
             db.close();
         }
     }
@@ -1322,6 +1486,63 @@ void ChatRoom::createChatdChat(const karere::SetOfIds& initialUsers)
         parent.client.newStrongvelope(chatid()), mCreationTs, mIsGroup);
 }
 
+void ChatRoom::initDormantOrWithChatd(const chatd::ChatSummary* summary)
+{
+    if (!summary || !summary->canBeDormant())
+    {
+        initWithChatd();
+        return;
+    }
+    mDormantSummary.reset(new chatd::ChatSummary(*summary));
+    // the room is removed from chatd in its destructor, so the callback can't outlive it
+    parent.client.chatd->addDormantChat(mChatid, mShardNo, mUrl, summary->dbInfo,
+        [this]() { materialize(); },
+        [this](chatd::ChatState state) { onOnlineStateChange(state); });
+}
+
+void ChatRoom::materialize()
+{
+    assert(!mChat);
+    mDormantSummary.reset();
+    initWithChatd();
+    mChat->resumeDormantJoin();
+}
+
+int ChatRoom::unreadMsgCount() const
+{
+    return mChat ? mChat->unreadMsgCount() : mDormantSummary->unreadCount;
+}
+
+uint32_t ChatRoom::lastMessageTs() const
+{
+    return mChat ? mChat->lastMessageTs() : mDormantSummary->lastMsgTs;
+}
+
+uint8_t ChatRoom::lastTextMessage(chatd::LastTextMsg*& msg)
+{
+    if (mChat)
+        return mChat->lastTextMessage(msg);
+
+    auto& lastTextMsg = mDormantSummary->lastTextMsg;
+    if (lastTextMsg.isValid())
+    {
+        msg = &lastTextMsg;
+        return chatd::LastTextMsgState::kHave;
+    }
+    if (mDormantSummary->haveAllHistory)
+    {
+        msg = nullptr;
+        return chatd::LastTextMsgState::kNone;
+    }
+    // not in local history, has to be fetched from server
+    return chat().lastTextMessage(msg);
+}
+
+chatd::ChatState ChatRoom::chatdOnlineState() const
+{
+    return mChat ? mChat->onlineState() : parent.client.chatd->dormantChatState(mChatid);
+}
+
 template <class T, typename F>
 void callAfterInit(T* self, F&& func, void *ctx)
 {
@@ -1347,7 +1568,10 @@ void PeerChatRoom::initWithChatd()
 
 void PeerChatRoom::connect()
 {
-    mChat->connect();
+    if (mChat)
+        mChat->connect();
+    else
+        parent.client.chatd->connectDormantChat(mChatid);
 }
 
 #ifndef KARERE_DISABLE_WEBRTC
@@ -1433,16 +1657,15 @@ IApp::IGroupChatListItem* GroupChatRoom::addAppItem()
 }
 
 GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const uint64_t& chatid,
-    unsigned char aShard, chatd::Priv aOwnPriv, uint32_t ts, const std::string& title)
+    unsigned char aShard, chatd::Priv aOwnPriv, uint32_t ts, const std::string& title,
+    const UserPrivMap& peers, const chatd::ChatSummary* summary)
 :ChatRoom(parent, chatid, true, aShard, aOwnPriv, ts, title),
 mHasTitle(!title.empty()), mRoomGui(nullptr)
 {
-    SqliteStmt stmt(parent.client.db, "select userid, priv from chat_peers where chatid=?");
-    stmt << mChatid;
     std::vector<promise::Promise<void> > promises;
-    while(stmt.step())
+    for (auto& peer: peers)
     {
-        promises.push_back(addMember(stmt.uint64Col(0), (chatd::Priv)stmt.intCol(1), false));
+        promises.push_back(addMember(peer.first, peer.second, false));
     }
 
     auto wptr = weakHandle();
@@ -1457,7 +1680,7 @@ mHasTitle(!title.empty()), mRoomGui(nullptr)
     });
 
     notifyTitleChanged();
-    initWithChatd();
+    initDormantOrWithChatd(summary);
     mRoomGui = addAppItem();
     mIsInitializing = false;
 }
@@ -1475,10 +1698,14 @@ void GroupChatRoom::initWithChatd()
 
 void GroupChatRoom::connect()
 {
-    if (chat().onlineState() != chatd::kChatStateOffline)
+    if (chatdOnlineState() != chatd::kChatStateOffline)
         return;
 
-    mChat->connect();
+    if (mChat)
+        mChat->connect();
+    else
+        parent.client.chatd->connectDormantChat(mChatid);
+
     if (mHasTitle)
     {
         decryptTitle()
@@ -1501,13 +1728,14 @@ IApp::IPeerChatListItem* PeerChatRoom::addAppItem()
 }
 
 PeerChatRoom::PeerChatRoom(ChatRoomList& parent, const uint64_t& chatid,
-    unsigned char aShard, chatd::Priv aOwnPriv, const uint64_t& peer, chatd::Priv peerPriv, uint32_t ts)
+    unsigned char aShard, chatd::Priv aOwnPriv, const uint64_t& peer, chatd::Priv peerPriv, uint32_t ts,
+    const chatd::ChatSummary* summary)
 :ChatRoom(parent, chatid, false, aShard, aOwnPriv, ts), mPeer(peer),
   mPeerPriv(peerPriv),
   mRoomGui(nullptr)
 {
     initContact(peer);
-    initWithChatd();
+    initDormantOrWithChatd(summary);
     mRoomGui = addAppItem();
     mIsInitializing = false;
 }
@@ -1717,7 +1945,7 @@ void GroupChatRoom::deleteSelf()
             return;
         }
 
-        auto db = parent.client.db;
+        auto& db = parent.client.db;
         db.query("delete from chat_peers where chatid=?", mChatid);
         db.query("delete from chats where chatid=?", mChatid);
         delete this;
@@ -1730,6 +1958,17 @@ ChatRoomList::ChatRoomList(Client& aClient)
 
 void ChatRoomList::loadFromDb()
 {
+    // Load the state of all chats in bulk, so that rooms can be left dormant,
+    // without creating their chatd::Chat and crypto objects, until they are needed
+    std::map<karere::Id, chatd::ChatSummary> summaries;
+    ChatdSqliteDb::loadChatSummaries(client.db, summaries);
+    std::map<uint64_t, UserPrivMap> peers;
+    SqliteStmt peerStmt(client.db, "select chatid, userid, priv from chat_peers");
+    while (peerStmt.step())
+    {
+        peers[peerStmt.uint64Col(0)][peerStmt.uint64Col(1)] = (chatd::Priv)peerStmt.intCol(2);
+    }
+
     SqliteStmt stmt(client.db, "select chatid, ts_created ,shard, own_priv, peer, peer_priv, title from chats");
     while(stmt.step())
     {
@@ -1739,14 +1978,17 @@ void ChatRoomList::loadFromDb()
             KR_LOG_WARNING("ChatRoomList: Attempted to load from db cache a chatid that is already in memory");
             continue;
         }
+        auto it = summaries.find(chatid);
+        const chatd::ChatSummary* summary = (it != summaries.end()) ? &it->second : nullptr;
         auto peer = stmt.uint64Col(4);
         ChatRoom* room;
         if (peer != uint64_t(-1))
-            room = new PeerChatRoom(*this, chatid, stmt.intCol(2), (chatd::Priv)stmt.intCol(3), peer, (chatd::Priv)stmt.intCol(5), stmt.intCol(1));
+            room = new PeerChatRoom(*this, chatid, stmt.intCol(2), (chatd::Priv)stmt.intCol(3), peer, (chatd::Priv)stmt.intCol(5), stmt.intCol(1), summary);
         else
-            room = new GroupChatRoom(*this, chatid, stmt.intCol(2), (chatd::Priv)stmt.intCol(3), stmt.intCol(1), stmt.stringCol(6));
+            room = new GroupChatRoom(*this, chatid, stmt.intCol(2), (chatd::Priv)stmt.intCol(3), stmt.intCol(1), stmt.stringCol(6), peers[chatid], summary);
         emplace(chatid, room);
     }
+    KR_LOG_DEBUG("Loaded %zu chats from db, %zu of them are dormant", size(), client.chatd->dormantChatCount());
 }
 void ChatRoomList::addMissingRoomsFromApi(const mega::MegaTextChatList& rooms, SetOfIds& chatids)
 {
@@ -1955,7 +2197,7 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const mega::MegaTextChat& aCh
     }
 
     //save to db
-    auto db = parent.client.db;
+    auto& db = parent.client.db;
     db.query("delete from chat_peers where chatid=?", mChatid);
     db.query(
         "insert or replace into chats(chatid, shard, peer, peer_priv, "
@@ -2189,7 +2431,10 @@ bool ChatRoom::syncRoomPropertiesWithApi(const mega::MegaTextChat &chat)
 void ChatRoom::init(chatd::Chat& chat, chatd::DbInterface*& dbIntf)
 {
     mChat = &chat;
-    dbIntf = new ChatdSqliteDb(*mChat, parent.client.db);
+    auto db = new ChatdSqliteDb(*mChat, parent.client.db);
+    db->setCompression(parent.client.compressHistory());
+    db->setSearch(parent.client.messageSearch());
+    dbIntf = db;
     if (mAppChatHandler)
     {
         setAppChatHandler(mAppChatHandler);
@@ -2201,13 +2446,15 @@ void ChatRoom::setAppChatHandler(IApp::IChatHandler* handler)
     if (mAppChatHandler)
         throw std::runtime_error("App chat handler is already set, remove it first");
 
+    auto& chat = this->chat(); //creates the chatd::Chat if the room is dormant
     mAppChatHandler = handler;
     chatd::DbInterface* dummyIntf = nullptr;
 // mAppChatHandler->init() may rely on some events, so we need to set mChatWindow as listener before
 // calling init(). This is safe, as and we will not get any async events before we
 //return to the event loop
-    mChat->setListener(mAppChatHandler);
-    mAppChatHandler->init(*mChat, dummyIntf);
+    chat.setListener(mAppChatHandler);
+    chat.setOpen(true);
+    mAppChatHandler->init(chat, dummyIntf);
 }
 
 void ChatRoom::removeAppChatHandler()
@@ -2216,6 +2463,7 @@ void ChatRoom::removeAppChatHandler()
         return;
     mAppChatHandler = nullptr;
     mChat->setListener(this);
+    mChat->setOpen(false);
 }
 
 bool ChatRoom::hasChatHandler() const
@@ -2387,7 +2635,7 @@ void GroupChatRoom::onUnreadChanged()
 bool GroupChatRoom::syncMembers(const UserPrivMap& users)
 {
     bool changed = false;
-    auto db = parent.client.db;
+    auto& db = parent.client.db;
     for (auto ourIt = mPeers.begin(); ourIt != mPeers.end();)
     {
         auto userid = ourIt->first;
@@ -2543,6 +2791,7 @@ GroupChatRoom::Member::Member(GroupChatRoom& aRoom, const uint64_t& user, chatd:
         {
             self->mName.assign("\0", 1);
         }
+        self->mRoom.parent.client.app.onChatMemberInfoChanged(self->mRoom.chatid());
         if (self->mRoom.mAppChatHandler)
         {
             self->mRoom.mAppChatHandler->onMemberNameChanged(self->mHandle, self->mName);
@@ -2566,6 +2815,7 @@ GroupChatRoom::Member::Member(GroupChatRoom& aRoom, const uint64_t& user, chatd:
         if (buf && !buf->empty())
         {
             self->mEmail.assign(buf->buf(), buf->dataSize());
+            self->mRoom.parent.client.app.onChatMemberInfoChanged(self->mRoom.chatid());
             if (self->mName.size() <= 1 && self->mRoom.memberNamesResolved().done() && !self->mRoom.mHasTitle)
             {
                 self->mRoom.makeTitleFromMemberNames();
@@ -2592,7 +2842,7 @@ void Client::connectToChatd(bool isInBackground)
     for (auto& item: *chats)
     {
         auto& chat = *item.second;
-        if (!chat.chat().isDisabled())
+        if (chat.isDormant() || !chat.chat().isDisabled())
         {
             chat.connect();
         }
@@ -8,6 +8,7 @@
 #include <type_traits>
 #include <retryHandler.h>
 #include "userAttrCache.h"
+#include "messageSearch.h"
 #include <db.h>
 #include "chatd.h"
 #include "presenced.h"
@@ -62,6 +63,8 @@ protected:
     bool mIsGroup;
     chatd::Priv mOwnPriv;
     chatd::Chat* mChat = nullptr;
+    /** While the room is dormant (mChat is null), holds what is needed to show it in the chat list */
+    std::unique_ptr<chatd::ChatSummary> mDormantSummary;
     bool mIsInitializing = true;
     std::string mTitleString;
     uint32_t mCreationTs;
@@ -69,6 +72,9 @@ protected:
     bool syncRoomPropertiesWithApi(const ::mega::MegaTextChat& chat);
     void switchListenerToApp();
     void createChatdChat(const karere::SetOfIds& initialUsers); //We can't do the join in the ctor, as chatd may fire callbcks synchronously from join(), and the derived class will not be constructed at that point.
+    virtual void initWithChatd() = 0;
+    void initDormantOrWithChatd(const chatd::ChatSummary* summary);
+    void materialize();
     void notifyExcludedFromChat();
     void notifyRejoinedChat();
     bool syncOwnPriv(chatd::Priv priv);
@@ -93,11 +99,32 @@ public:
 
     virtual ~ChatRoom(){}
 
-    /** @brief returns the chatd::Chat chat object associated with the room */
-    chatd::Chat& chat() { return *mChat; }
+    /** @brief returns the chatd::Chat chat object associated with the room.
+     * If the room is dormant, the chat object is created first */
+    chatd::Chat& chat()
+    {
+        if (!mChat)
+            materialize();
+        return *mChat;
+    }
+
+    /** @brief Whether the chatd::Chat object of the room has not been created
+     * yet. Rooms loaded from the db at startup are dormant until opened by
+     * the app, or until chatd sends something for them */
+    bool isDormant() const { return !mChat; }
+
+    /** @brief The number of unread messages. Does not create the chatd::Chat
+     * object of a dormant room */
+    int unreadMsgCount() const;
 
-    /** @brief returns the chatd::Chat chat object associated with the room */
-    const chatd::Chat& chat() const { return *mChat; }
+    /** @brief The timestamp of the newest message. Does not create the
+     * chatd::Chat object of a dormant room */
+    uint32_t lastMessageTs() const;
+
+    /** @brief The last text message, see chatd::Chat::lastTextMessage(). Does
+     * not create the chatd::Chat object of a dormant room, unless the message
+     * has to be fetched from the server */
+    uint8_t lastTextMessage(chatd::LastTextMsg*& msg);
 
     /** @brief The chatid of the chatroom */
     const uint64_t& chatid() const { return mChatid; }
@@ -120,13 +147,13 @@ public:
     bool isActive() const { return mIsGroup ? (mOwnPriv != chatd::PRIV_NOTPRESENT) : true; }
 
     /** @brief The online state reported by chatd for that chatroom */
-    chatd::ChatState chatdOnlineState() const { return mChat->onlineState(); }
+    chatd::ChatState chatdOnlineState() const;
 
     /** @brief send a notification to the chatroom that the user is typing. */
-    virtual void sendTypingNotification() { mChat->sendTypingNotification(); }
+    virtual void sendTypingNotification() { chat().sendTypingNotification(); }
 
     /** @brief send a notification to the chatroom that the user has stopped typing. */
-    virtual void sendStopTypingNotification() { mChat->sendStopTypingNotification(); }
+    virtual void sendStopTypingNotification() { chat().sendStopTypingNotification(); }
 
     /** @brief The application-side event handler that receives events from
      * the chatd chatroom and events about title, online status and unread
@@ -200,7 +227,7 @@ protected:
     bool syncPeerPriv(chatd::Priv priv);
     static uint64_t getSdkRoomPeer(const ::mega::MegaTextChat& chat);
     static chatd::Priv getSdkRoomPeerPriv(const ::mega::MegaTextChat& chat);
-    void initWithChatd();
+    virtual void initWithChatd();
     virtual void connect();
     UserAttrCache::Handle mUsernameAttrCbId;
     void updateTitle(const std::string& title);
@@ -208,7 +235,7 @@ protected:
     friend class ChatRoomList;
     PeerChatRoom(ChatRoomList& parent, const uint64_t& chatid,
             unsigned char shard, chatd::Priv ownPriv, const uint64_t& peer,
-            chatd::Priv peerPriv, uint32_t ts);
+            chatd::Priv peerPriv, uint32_t ts, const chatd::ChatSummary* summary=nullptr);
     PeerChatRoom(ChatRoomList& parent, const mega::MegaTextChat& room);
     ~PeerChatRoom();
 
@@ -314,7 +341,7 @@ public:
     virtual IApp::IChatListItem* roomGui() { return mRoomGui; }
     void deleteSelf(); //<Deletes the room from db and then immediately destroys itself (i.e. delete this)
     void makeTitleFromMemberNames();
-    void initWithChatd();
+    virtual void initWithChatd();
     void setRemoved();
     virtual void connect();
     promise::Promise<void> memberNamesResolved() const;
@@ -325,7 +352,8 @@ public:
     GroupChatRoom(ChatRoomList& parent, const mega::MegaTextChat& chat);
     GroupChatRoom(ChatRoomList& parent, const uint64_t& chatid,
                   unsigned char aShard, chatd::Priv aOwnPriv, uint32_t ts,
-                  const std::string& title);
+                  const std::string& title, const UserPrivMap& peers,
+                  const chatd::ChatSummary* summary=nullptr);
     ~GroupChatRoom();
 public:
 //chatd::Listener
@@ -352,7 +380,7 @@ public:
      */
     virtual Presence presence() const
     {
-        return (mChat->onlineState() == chatd::kChatStateOnline)
+        return (chatdOnlineState() == chatd::kChatStateOnline)
                 ? Presence::kOnline
                 : Presence::kOffline;
     }
@@ -567,6 +595,15 @@ protected:
     uint64_t mMyIdentity = 0; // seed for CLIENTID
     ConnState mConnState = kDisconnected;
     promise::Promise<void> mConnectPromise;
+    SqliteDb::Options mDbOptions;
+    bool mAsyncDbWrites = true;
+    bool mCompressHistory = false;
+    bool mDbWriteFailed = false;
+    MessageSearch::TextFunc mSearchTextFunc;
+    size_t mChatHistoryMemLimit = 0;
+    size_t mTotalHistoryMemLimit = 0;
+    // declared before the chat list, which references it, so that it is destroyed after it
+    std::unique_ptr<MessageSearch> mMessageSearch;
 public:
     enum { kInitErrorType = 0x9e9a1417 }; //should resemble 'megainit'
     enum InitState: uint8_t
@@ -814,6 +851,27 @@ public:
     createGroupChat(std::vector<std::pair<uint64_t, chatd::Priv>> peers);
     void setCommitMode(bool commitEach);
     void saveDb();  // forces a commit
+    /** @brief Sets the options of the local database, whether it is used
+     * in write-behind mode (see SqliteDb::setAsyncWrites()) and whether the
+     * message history is stored compressed (see ChatdSqliteDb::setCompression()).
+     * Takes effect when the db is opened, so must be called before init() */
+    void setDbOptions(const SqliteDb::Options& options, bool asyncWrites, bool compressHistory=false)
+    {
+        mDbOptions = options;
+        mAsyncDbWrites = asyncWrites;
+        mCompressHistory = compressHistory;
+    }
+    bool compressHistory() const { return mCompressHistory; }
+    /** @brief Sets the function that extracts the searchable text of messages
+     * (see MessageSearch::TextFunc). Must be called before init() */
+    void setSearchTextFunc(MessageSearch::TextFunc func) { mSearchTextFunc = func; }
+    /** @brief The message search index, or NULL if the db is not open or the
+     * SQLite library does not support FTS5 */
+    MessageSearch* messageSearch() const { return mMessageSearch.get(); }
+    /** @brief Sets the limits of the memory used by the RAM history buffers
+     * of the chats (see chatd::Client::setHistoryMemoryLimits()). Can be called
+     * at any time, before init() the limits are applied when chatd is created */
+    void setHistoryMemoryLimits(size_t chatLimit, size_t totalLimit);
     bool isCallInProgress() const;
 #ifndef KARERE_DISABLE_WEBRTC
     std::unique_ptr<rtcModule::IRtcModule> rtc;
@@ -846,7 +904,11 @@ protected:
     bool openDb(const std::string& sid);
     void createDb();
     void wipeDb(const std::string& sid);
+    void initMessageSearch();
+    void startDbWriter();
+    void onDbWriteError(const std::string& sql, int errCode, const std::string& errMsg);
     void createDbSchema();
+    bool migrateDb(std::string& ver);
     void connectToChatd(bool isInBackground);
     karere::Id getMyHandleFromDb();
     karere::Id getMyHandleFromSdk();
@@ -2,6 +2,7 @@
 #include "chatClient.h"
 #include "chatdICrypto.h"
 #include "base64url.h"
+#include "net/frameRecorder.h"
 #include <algorithm>
 #include <random>
 
@@ -58,6 +59,7 @@ using namespace karere;
 
 #define CALL_DB(methodName,...)                                                           \
     do {                                                                                        \
+      flushHistBatch();                                                                         \
       try {                                                                                     \
           CHATD_LOG_DB_CALL("Calling DbInterface::" #methodName "()");                               \
           mDbInterface->methodName(__VA_ARGS__);                                                   \
@@ -80,7 +82,7 @@ namespace chatd
 const unsigned Client::chatdVersion = 2;
 
 Client::Client(karere::Client *client, Id userId)
-:mUserId(userId), mApi(&client->api), karereClient(client)
+:mUserId(userId), mMsgArena(new karere::SlabArena), mApi(&client->api), karereClient(client)
 {
 }
 
@@ -94,6 +96,44 @@ Chat& Client::createChat(Id chatid, int shardNo, const std::string& url,
         return *chatit->second;
     }
 
+    // if the chat was dormant, JOINRANGEHIST may have been sent on its behalf,
+    // and chatd may have replied to it already
+    bool joinSent = false;
+    std::unique_ptr<DormantJoin> dormantJoin;
+    auto dormantIt = mDormantChats.find(chatid);
+    if (dormantIt != mDormantChats.end())
+    {
+        joinSent = (dormantIt->second.state != kChatStateOffline);
+        if (joinSent)
+        {
+            dormantJoin.reset(new DormantJoin(std::move(dormantIt->second.join)));
+        }
+        mDormantChats.erase(dormantIt);
+    }
+
+    Connection* conn = connectionForShard(shardNo, url);
+    // map chatid to this shard
+    mConnectionForChatId[chatid] = conn;
+
+    auto& recorder = FrameRecorder::instance();
+    if (recorder.isRecording())
+        recorder.recordChat(chatid, shardNo, mUserId, chatCreationTs, isGroup, users);
+
+    // always update the URL to give the API an opportunity to migrate chat shards between hosts
+    Chat* chat = new Chat(*conn, chatid, listener, users, chatCreationTs, crypto, isGroup);
+    // add chatid to the connection's chatids
+    conn->mChatIds.insert(chatid);
+    mChatForChatId.emplace(chatid, std::shared_ptr<Chat>(chat));
+    if (joinSent)
+    {
+        chat->setJoiningRangeHist();
+        chat->mDormantJoin = std::move(dormantJoin);
+    }
+    return *chat;
+}
+
+Connection* Client::connectionForShard(int shardNo, const std::string& url)
+{
     // instantiate a Connection object for this shard if needed
     Connection* conn;
     auto it = mConnections.find(shardNo);
@@ -112,15 +152,98 @@ Chat& Client::createChat(Id chatid, int shardNo, const std::string& url,
     {
         conn->mUrl.parse(url);
     }
-    // map chatid to this shard
-    mConnectionForChatId[chatid] = conn;
+    return conn;
+}
 
-    // always update the URL to give the API an opportunity to migrate chat shards between hosts
-    Chat* chat = new Chat(*conn, chatid, listener, users, chatCreationTs, crypto, isGroup);
-    // add chatid to the connection's chatids
+void Client::addDormantChat(Id chatid, int shardNo, const std::string& url,
+    const ChatDbInfo& dbInfo, std::function<void()>&& materialize,
+    std::function<void(ChatState)>&& onStateChange)
+{
+    assert(dbInfo.oldestDbId && dbInfo.newestDbId);
+    if (mChatForChatId.find(chatid) != mChatForChatId.end() || isDormant(chatid))
+    {
+        CHATD_LOG_WARNING("Client::addDormantChat: Chat with chatid %s already exists", ID_CSTR(chatid));
+        return;
+    }
+    Connection* conn = connectionForShard(shardNo, url);
+    mConnectionForChatId[chatid] = conn;
     conn->mChatIds.insert(chatid);
-    mChatForChatId.emplace(chatid, std::shared_ptr<Chat>(chat));
-    return *chat;
+    auto& dormant = mDormantChats[chatid];
+    dormant.dbInfo = dbInfo;
+    dormant.materialize = std::move(materialize);
+    dormant.onStateChange = std::move(onStateChange);
+}
+
+Chat& Client::materializeChat(Id chatid)
+{
+    auto it = mDormantChats.find(chatid);
+    if (it == mDormantChats.end())
+        throw std::runtime_error("chatidChat: Unknown chatid "+chatid.toString());
+
+    CHATD_LOG_DEBUG("%s: Creating the Chat object of dormant chat", ID_CSTR(chatid));
+    // createChat() removes the entry, so keep the callback alive until it returns
+    auto materialize = std::move(it->second.materialize);
+    materialize();
+    auto chatit = mChatForChatId.find(chatid);
+    if (chatit == mChatForChatId.end())
+        throw std::runtime_error("materializeChat: Chat object was not created for dormant chat "+chatid.toString());
+    chatit->second->resumeDormantJoin(); //in case the callback didn't
+    return *chatit->second;
+}
+
+ChatState Client::dormantChatState(Id chatid) const
+{
+    auto it = mDormantChats.find(chatid);
+    return (it != mDormantChats.end()) ? it->second.state : kChatStateOffline;
+}
+
+void Client::onChatOnline()
+{
+    bool allConnected = true;
+    std::map<uint64_t, ChatRoom*> *chats = karereClient->chats.get();
+    std::map<uint64_t, ChatRoom*>::iterator itChatRooms;
+    for (itChatRooms = chats->begin(); itChatRooms != chats->end(); itChatRooms++)
+    {
+        if (itChatRooms->second->chatdOnlineState() != kChatStateOnline)
+        {
+            allConnected = false;
+            break;
+        }
+    }
+    if (allConnected)
+    {
+        karereClient->setCommitMode(true);
+    }
+}
+
+Client::DormantChat* Client::dormantJoiningChat(Id chatid)
+{
+    auto it = mDormantChats.find(chatid);
+    return (it != mDormantChats.end() && it->second.state == kChatStateJoining) ? &it->second : nullptr;
+}
+
+void Client::connectDormantChat(Id chatid)
+{
+    auto it = mDormantChats.find(chatid);
+    if (it == mDormantChats.end())
+    {
+        CHATD_LOG_ERROR("Client::connectDormantChat: Chat %s is not dormant", ID_CSTR(chatid));
+        return;
+    }
+    auto& conn = chatidConn(chatid);
+    if (conn.isConnected() || conn.isLoggedIn())
+    {
+        if (it->second.state == kChatStateOffline)
+        {
+            it->second.setState(kChatStateJoining);
+            conn.joinDormantChat(chatid, it->second.dbInfo);
+        }
+    }
+    else
+    {
+        // the chat will be joined by rejoinExistingChats() once connected
+        conn.connect(chatid);
+    }
 }
 void Client::sendKeepalive()
 {
@@ -177,13 +300,35 @@ bool Client::isMessageReceivedConfirmationActive() const
 }
 
 void Chat::connect()
+{
+    if (mConnection.isConnected() || mConnection.isLoggedIn())
+    {
+        login();
+    }
+    else
+    {
+        mConnection.connect(mChatId);
+    }
+}
+
+void Connection::connect(Id chatid)
 {
     // attempt a connection ONLY if this is a new shard.
-    if (mConnection.state() == Connection::kStateNew)
+    if (mState == kStateNew)
     {
-        mConnection.mState = Connection::kStateFetchingUrl;
+        if (mClient.urlProvider)
+        {
+            mUrl.parse(mClient.urlProvider(chatid, mShardNo));
+            reconnect()
+            .fail([this](const promise::Error& err)
+            {
+                CHATD_LOG_ERROR("shard %d: Error connecting to server: %s", mShardNo, err.what());
+            });
+            return;
+        }
+        mState = kStateFetchingUrl;
         auto wptr = getDelTracker();
-        mClient.mApi->call(&::mega::MegaApi::getUrlChat, mChatId)
+        mClient.mApi->call(&::mega::MegaApi::getUrlChat, chatid)
         .then([wptr, this](ReqResult result)
         {
             if (wptr.deleted())
@@ -195,34 +340,30 @@ void Chat::connect()
             const char* url = result->getLink();
             if (!url || !url[0])
             {
-                CHATID_LOG_ERROR("No chatd URL received from API");
+                CHATD_LOG_ERROR("shard %d: No chatd URL received from API", mShardNo);
                 return;
             }
 
             std::string sUrl = url;
-            mConnection.mUrl.parse(sUrl);
+            mUrl.parse(sUrl);
 
-            mConnection.reconnect()
+            reconnect()
             .fail([this](const promise::Error& err)
             {
-                CHATID_LOG_ERROR("Error connecting to server: %s", err.what());
+                CHATD_LOG_ERROR("shard %d: Error connecting to server: %s", mShardNo, err.what());
             });
         });
 
     }
-    else if (mConnection.state() == Connection::kStateDisconnected)
+    else if (mState == kStateDisconnected)
     {
-        mConnection.reconnect()
+        reconnect()
         .fail([this](const promise::Error& err)
         {
-            CHATID_LOG_ERROR("Error connecting to server: %s", err.what());
+            CHATD_LOG_ERROR("shard %d: Error connecting to server: %s", mShardNo, err.what());
         });
 
     }
-    else if (mConnection.isConnected() || mConnection.isLoggedIn())
-    {
-        login();
-    }
 }
 
 void Chat::disconnect()
@@ -233,6 +374,7 @@ void Chat::disconnect()
 void Chat::login()
 {
     ChatDbInfo info;
+    flushHistBatch();
     mDbInterface->getHistoryInfo(info);
     mOldestKnownMsgId = info.oldestDbId;
     if (mOldestKnownMsgId) //if we have local history
@@ -266,6 +408,8 @@ void Connection::onSocketClose(int errcode, int errtype, const std::string& reas
 {
     CHATD_LOG_WARNING("Socket close on connection to shard %d. Reason: %s", mShardNo, reason.c_str());
     mHeartbeatEnabled = false;
+    mRejoinQueue.clear();
+    mOutputBuffer.clear();
     auto oldState = mState;
     mState = kStateDisconnected;
 
@@ -277,6 +421,13 @@ void Connection::onSocketClose(int errcode, int errtype, const std::string& reas
 
     for (auto& chatid: mChatIds)
     {
+        auto dormantIt = mClient.mDormantChats.find(chatid);
+        if (dormantIt != mClient.mDormantChats.end())
+        {
+            dormantIt->second.join = DormantJoin();
+            dormantIt->second.setState(kChatStateOffline);
+            continue;
+        }
         auto& chat = mClient.chats(chatid);
         chat.onDisconnect();
     }
@@ -384,6 +535,8 @@ Promise<void> Connection::reconnect()
 
             for (auto& chatid: mChatIds)
             {
+                if (mClient.isDormant(chatid))
+                    continue;
                 auto& chat = mClient.chats(chatid);
                 if (!chat.isDisabled())
                     chat.setOnlineState(kChatStateConnecting);                
@@ -573,14 +726,192 @@ void Client::heartbeat()
     }
 }
 
+// Commands are not sent immediately, but appended to the output buffer, which
+// is sent as a single frame when the current event loop iteration completes.
+// This saves frames, syscalls and TLS records when many commands are generated
+// at once, i.e. SEENs and RECEIVEDs while processing history, or JOINs after
+// reconnect. Latency-critical commands flush the buffer immediately.
+// Returns false if offline or if an immediate flush fails. If a deferred flush
+// fails, the connection is reset, see reconnectAfterSendError()
 bool Connection::sendBuf(Buffer&& buf)
 {
     if (!isLoggedIn() && !isConnected())
         return false;
-    
-    bool rc = wsSendMessage(buf.buf(), buf.dataSize());
+
+    mOutputStats.commands++;
+    // the buffer may contain several commands, all of the same kind
+    uint8_t opcode = buf.dataSize() ? (uint8_t)buf.buf()[0] : 0;
+    mOutputBuffer.append(buf.buf(), buf.dataSize());
     buf.free();
-    return rc;
+
+    if (isLatencyCritical(opcode) || mOutputBuffer.dataSize() >= kMaxOutputFrameSize)
+    {
+        mOutputStats.earlyFlushes++;
+        return flushOutput();
+    }
+    if (!mOutputFlushScheduled)
+    {
+        mOutputFlushScheduled = true;
+        auto wptr = weakHandle();
+        marshallCall([wptr, this]()
+        {
+            if (wptr.deleted())
+                return;
+            mOutputFlushScheduled = false;
+            flushOutput();
+        }, mClient.karereClient->appCtx);
+    }
+    return true;
+}
+
+bool Connection::flushOutput()
+{
+    if (mOutputBuffer.empty())
+        return true;
+    if (!isLoggedIn() && !isConnected())
+    {
+        mOutputBuffer.clear();
+        return false;
+    }
+    auto& recorder = FrameRecorder::instance();
+    if (recorder.isRecording())
+        recorder.record(FrameRecorder::kChatdOut, mShardNo, mOutputBuffer.buf(), mOutputBuffer.dataSize());
+
+    mOutputStats.frames++;
+    mOutputStats.bytes += mOutputBuffer.dataSize();
+    bool sent = wsSendMessage(mOutputBuffer.buf(), mOutputBuffer.dataSize());
+    if (!sent)
+    {
+        CHATD_LOG_ERROR("shard %d: Error sending %zu bytes of commands, reconnecting", mShardNo, mOutputBuffer.dataSize());
+        reconnectAfterSendError();
+    }
+    mOutputBuffer.clear();
+    return sent;
+}
+
+// The commands of a frame that failed to be sent are lost, but the callers of
+// sendBuf() have already been told that they were sent. Reconnect, so that the
+// chats rejoin and resend their send queues, as after any other disconnect.
+// Done asynchronously, as the flush may happen in the middle of a Chat method
+void Connection::reconnectAfterSendError()
+{
+    auto wptr = weakHandle();
+    marshallCall([wptr, this]()
+    {
+        if (wptr.deleted())
+            return;
+        if (mState < kStateConnected) //already disconnected meanwhile
+            return;
+        mState = kStateDisconnected;
+        mHeartbeatEnabled = false;
+        if (mEchoTimer)
+        {
+            cancelTimeout(mEchoTimer, mClient.karereClient->appCtx);
+            mEchoTimer = 0;
+        }
+        reconnect();
+    }, mClient.karereClient->appCtx);
+}
+
+// Commands whose delay would be noticed: heartbeats, whose response time is
+// used to detect dead connections, and call signalling
+bool Connection::isLatencyCritical(uint8_t opcode)
+{
+    switch (opcode)
+    {
+        case OP_KEEPALIVE:
+        case OP_KEEPALIVEAWAY:
+        case OP_ECHO:
+        case OP_RTMSG_BROADCAST:
+        case OP_RTMSG_USER:
+        case OP_RTMSG_ENDPOINT:
+        case OP_INCALL:
+        case OP_ENDCALL:
+        case OP_CALLDATA:
+            return true;
+        default:
+            return false;
+    }
+}
+
+Connection::OutputStats Client::outputStats() const
+{
+    Connection::OutputStats stats;
+    for (auto& conn: mConnections)
+    {
+        stats += conn.second->outputStats();
+    }
+    return stats;
+}
+
+void Client::setHistoryMemoryLimits(size_t chatLimit, size_t totalLimit)
+{
+    mChatMemoryLimit = chatLimit;
+    mTotalMemoryLimit = totalLimit;
+    CHATD_LOG_DEBUG("History memory limits set to %zu bytes per chat, %zu in total", chatLimit, totalLimit);
+    for (auto& chat: mChatForChatId)
+    {
+        chat.second->checkHistoryMemory();
+    }
+}
+
+void Client::scheduleHistoryMemoryCheck()
+{
+    // Enforcing the limit walks all chats, so it's done once per event loop
+    // turn at most
+    if (mHistMemCheckTimer)
+        return;
+    mHistMemCheckTimer = karere::setTimeout([this]()
+    {
+        mHistMemCheckTimer = 0;
+        enforceHistoryMemoryLimit();
+    }, 0, karereClient->appCtx);
+}
+
+size_t Client::enforceHistoryMemoryLimit()
+{
+    if (!mTotalMemoryLimit || (mHistoryBytes <= mTotalMemoryLimit))
+        return 0;
+
+    struct ChatBytes
+    {
+        Chat* chat;
+        size_t bytes;
+    };
+    std::vector<ChatBytes> chats;
+    chats.reserve(mChatForChatId.size());
+    for (auto& item: mChatForChatId)
+    {
+        chats.push_back({item.second.get(), item.second->historyBytes()});
+    }
+    size_t total = mHistoryBytes;
+    std::sort(chats.begin(), chats.end(), [](const ChatBytes& a, const ChatBytes& b)
+    {
+        if (a.chat->isOpen() != b.chat->isOpen())
+            return !a.chat->isOpen(); //closed chats first
+        return a.chat->lastUseSeq() < b.chat->lastUseSeq();
+    });
+    size_t freed = 0;
+    for (auto& item: chats)
+    {
+        size_t excess = total - freed - mTotalMemoryLimit;
+        freed += item.chat->trimHistory((item.bytes > excess) ? (item.bytes - excess) : 0);
+        if (total - freed <= mTotalMemoryLimit)
+            break;
+    }
+    CHATD_LOG_DEBUG("History uses %zu bytes, over the limit of %zu, freed %zu bytes", total, mTotalMemoryLimit, freed);
+    return freed;
+}
+
+size_t Client::trimHistoryMemory()
+{
+    size_t freed = 0;
+    for (auto& chat: mChatForChatId)
+    {
+        freed += chat.second->trimHistory(0);
+    }
+    CHATD_LOG_DEBUG("trimHistoryMemory: Freed %zu bytes", freed);
+    return freed;
 }
 
 bool Connection::sendCommand(Command&& cmd)
@@ -740,14 +1071,92 @@ string KeyCommand::toString() const
     return string("NEWKEY: keyid = ")+to_string(keyId());
 }
 // rejoin all open chats after reconnection (this is mandatory)
+// Chats that are open in the app or have messages to send are joined first, and
+// the rest in batches of kRejoinBatchSize, one batch per event loop iteration,
+// so that a shard with thousands of chats does not block the app. The JOINs of
+// each batch are sent in a single frame
 promise::Promise<void> Connection::rejoinExistingChats()
 {
+    std::vector<Id> priority;
+    mRejoinQueue.clear();
     for (auto& chatid: mChatIds)
     {
+        if (mClient.isDormant(chatid)) //dormant chats are never open and have nothing to send
+        {
+            mRejoinQueue.push_back(chatid);
+            continue;
+        }
+        Chat& chat = mClient.chats(chatid);
+        if (chat.isDisabled())
+            continue;
+        if (chat.isOpen() || chat.hasPendingSends())
+            priority.push_back(chatid);
+        else
+            mRejoinQueue.push_back(chatid);
+    }
+    CHATD_LOG_DEBUG("shard %d: Rejoining %zu chats, %zu of them with priority",
+        mShardNo, priority.size() + mRejoinQueue.size(), priority.size());
+
+    for (size_t i = 0; i < priority.size(); i += kRejoinBatchSize)
+    {
+        auto end = std::min(priority.size(), i + kRejoinBatchSize);
+        joinChats(std::vector<Id>(priority.begin() + i, priority.begin() + end));
+    }
+    rejoinNextBatch();
+    return mLoginPromise;
+}
+
+void Connection::rejoinNextBatch()
+{
+    if (!isConnected() && !isLoggedIn())
+    {
+        mRejoinQueue.clear();
+        return;
+    }
+    std::vector<Id> batch;
+    while (!mRejoinQueue.empty() && batch.size() < kRejoinBatchSize)
+    {
+        batch.push_back(mRejoinQueue.front());
+        mRejoinQueue.pop_front();
+    }
+    joinChats(batch);
+    if (mRejoinQueue.empty() || mRejoinScheduled)
+        return;
+
+    mRejoinScheduled = true;
+    auto wptr = weakHandle();
+    marshallCall([wptr, this]()
+    {
+        if (wptr.deleted())
+            return;
+        mRejoinScheduled = false;
+        rejoinNextBatch();
+    }, mClient.karereClient->appCtx);
+}
+
+// sends the JOIN/JOINRANGEHIST commands of the specified chats. They are
+// coalesced into a single frame by sendBuf()
+void Connection::joinChats(const std::vector<Id>& chatids)
+{
+    for (auto chatid: chatids)
+    {
+        if (mChatIds.find(chatid) == mChatIds.end())
+            continue; //removed while waiting in the rejoin queue
         try
         {
+            auto dormantIt = mClient.mDormantChats.find(chatid);
+            if (dormantIt != mClient.mDormantChats.end())
+            {
+                if (dormantIt->second.state == kChatStateOffline)
+                {
+                    dormantIt->second.setState(kChatStateJoining);
+                    joinDormantChat(chatid, dormantIt->second.dbInfo);
+                }
+                continue;
+            }
             Chat& chat = mClient.chats(chatid);
-            if (!chat.isDisabled())
+            // may have been joined meanwhile, i.e. via Chat::connect()
+            if (!chat.isDisabled() && chat.onlineState() < kChatStateJoining)
                 chat.login();
         }
         catch(std::exception& e)
@@ -755,7 +1164,17 @@ promise::Promise<void> Connection::rejoinExistingChats()
             mLoginPromise.reject(std::string("rejoinExistingChats: Exception: ")+e.what());
         }
     }
-    return mLoginPromise;
+}
+
+// join a chat that has no Chat object yet. The replies that only update the
+// participants, SEEN/RECEIVED and HISTDONE are kept by the dormant entry. The
+// Chat object is created upon the first message or other command that needs
+// it, and continues the join from there
+void Connection::joinDormantChat(Id chatid, const ChatDbInfo& dbInfo)
+{
+    CHATD_LOG_DEBUG("%s: Sending JOINRANGEHIST for dormant chat: %s - %s", ID_CSTR(chatid),
+        dbInfo.oldestDbId.toString().c_str(), dbInfo.newestDbId.toString().c_str());
+    sendBuf(Command(OP_JOINRANGEHIST) + chatid + dbInfo.oldestDbId + dbInfo.newestDbId);
 }
 
 // send JOIN
@@ -784,6 +1203,9 @@ void Chat::onJoinRejected()
 
 void Chat::onDisconnect()
 {
+    flushDecryptBatch();
+    flushHistBatch();
+    persistUnreadCount();
     if (mServerOldHistCbEnabled && (mServerFetchState & kHistFetchingOldFromServer))
     {
         //app has been receiving old history from server, but we are now
@@ -797,6 +1219,7 @@ void Chat::onDisconnect()
 
 HistSource Chat::getHistory(unsigned count)
 {
+    touch();
     if (isNotifyingOldHistFromServer())
     {
         return kHistSourceServer;
@@ -806,6 +1229,12 @@ HistSource Chat::getHistory(unsigned count)
         //start from newest message and go backwards
         mNextHistFetchIdx = highnum();
     }
+    else if ((mNextHistFetchIdx != CHATD_IDX_INVALID) && (mEvictedLownum != CHATD_IDX_INVALID)
+        && (mNextHistFetchIdx < lownum()-1))
+    {
+        //the chat was trimmed after this history fetch was started
+        loadEvicted(mNextHistFetchIdx+1);
+    }
 
     Idx countSoFar = 0;
     if (mNextHistFetchIdx != CHATD_IDX_INVALID)
@@ -906,6 +1335,7 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
     const karere::SetOfIds& initialUsers, uint32_t chatCreationTs,
     ICrypto* crypto, bool isGroup)
     : mClient(conn.mClient), mConnection(conn), mChatId(chatid),
+      mSending(OutputQueue::allocator_type(conn.mClient.msgArena())),
       mListener(listener), mUsers(initialUsers), mCrypto(crypto),
       mLastMsgTs(chatCreationTs), mIsGroup(isGroup)
 {
@@ -926,6 +1356,7 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
     mLastReceivedId = info.lastRecvId;
     mLastSeenIdx = mDbInterface->getIdxOfMsgid(mLastSeenId);
     mLastReceivedIdx = mDbInterface->getIdxOfMsgid(mLastReceivedId);
+    mUnreadCountValid = mDbInterface->getUnreadCount(mUnreadCount, mLastSeenId);
 
     if ((mHaveAllHistory = mDbInterface->haveAllHistory()))
     {
@@ -953,6 +1384,8 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
 }
 Chat::~Chat()
 {
+    flushHistBatch();
+    persistUnreadCount();
     CALL_LISTENER(onDestroy); //we don't delete because it may have its own idea of its lifetime (i.e. it could be a GUI class)
     try { delete mCrypto; }
     catch(std::exception& e)
@@ -982,7 +1415,13 @@ Idx Chat::getHistoryFromDb(unsigned count)
     {
         mNextHistFetchIdx -= messages.size();
     }
+    if ((mEvictedLownum != CHATD_IDX_INVALID) && (lownum() <= mEvictedLownum))
+    {
+        //all evicted messages have been loaded back
+        mEvictedLownum = CHATD_IDX_INVALID;
+    }
     CALL_LISTENER(onHistoryDone, kHistSourceDb);
+    checkHistoryMemory();
 
     // If we haven't yet seen the message with the last-seen msgid, then all messages
     // in the buffer (and in the loaded range) are unseen - so we just loaded
@@ -1007,6 +1446,9 @@ Idx Chat::getHistoryFromDb(unsigned count)
 void Connection::wsHandleMsgCb(char *data, size_t len)
 {
     mTsLastRecv = time(NULL);
+    auto& recorder = FrameRecorder::instance();
+    if (recorder.isRecording())
+        recorder.record(FrameRecorder::kChatdIn, mShardNo, data, len);
     execCommand(StaticBuffer(data, len));
 }
     
@@ -1054,6 +1496,12 @@ void Connection::execCommand(const StaticBuffer& buf)
                 pos++;
                 CHATD_LOG_DEBUG("%s: recv JOIN - user '%s' with privilege level %d",
                                 ID_CSTR(chatid), ID_CSTR(userid), priv);
+                auto dormant = mClient.dormantJoiningChat(chatid);
+                if (dormant)
+                {
+                    dormant->join.users.emplace_back(userid, priv);
+                    break;
+                }
                 auto& chat =  mClient.chats(chatid);
                 if (priv == PRIV_NOTPRESENT)
                     chat.onUserLeave(userid);
@@ -1079,7 +1527,7 @@ void Connection::execCommand(const StaticBuffer& buf)
                     ID_CSTR(chatid), Command::opcodeToStr(opcode), ID_CSTR(msgid),
                     ID_CSTR(userid), keyid, ts, updated);
 
-                std::unique_ptr<Message> msg(new Message(msgid, userid, ts, updated, msgdata, msglen, false, keyid));
+                std::unique_ptr<Message> msg(new (mClient.msgArena()) Message(msgid, userid, ts, updated, msgdata, msglen, false, keyid));
                 msg->setEncrypted(1);
                 Chat& chat = mClient.chats(chatid);
                 if (opcode == OP_MSGUPD)
@@ -1097,6 +1545,13 @@ void Connection::execCommand(const StaticBuffer& buf)
                 READ_CHATID(0);
                 READ_ID(msgid, 8);
                 CHATD_LOG_DEBUG("%s: recv SEEN - msgid: '%s'", ID_CSTR(chatid), ID_CSTR(msgid));
+                auto dormant = mClient.dormantJoiningChat(chatid);
+                if (dormant && (msgid == dormant->dbInfo.lastSeenId))
+                {
+                    // the persisted unread count is still valid
+                    dormant->join.lastSeenId = msgid;
+                    break;
+                }
                 mClient.chats(chatid).onLastSeen(msgid);
                 break;
             }
@@ -1105,6 +1560,12 @@ void Connection::execCommand(const StaticBuffer& buf)
                 READ_CHATID(0);
                 READ_ID(msgid, 8);
                 CHATD_LOG_DEBUG("%s: recv RECEIVED - msgid: '%s'", ID_CSTR(chatid), ID_CSTR(msgid));
+                auto dormant = mClient.dormantJoiningChat(chatid);
+                if (dormant)
+                {
+                    dormant->join.lastRecvId = msgid;
+                    break;
+                }
                 mClient.chats(chatid).onLastReceived(msgid);
                 break;
             }
@@ -1186,6 +1647,17 @@ void Connection::execCommand(const StaticBuffer& buf)
             {
                 READ_CHATID(0);
                 CHATD_LOG_DEBUG("%s: recv HISTDONE - history retrieval finished", ID_CSTR(chatid));
+                auto dormant = mClient.dormantJoiningChat(chatid);
+                if (dormant)
+                {
+                    // no message was received, so there is no new history
+                    // and the chat can stay dormant
+                    dormant->join.histDone = true;
+                    notifyLoggedIn();
+                    dormant->setState(kChatStateOnline); //may create the Chat object
+                    mClient.onChatOnline();
+                    break;
+                }
                 Chat &chat = mClient.chats(chatid);
                 chat.onHistDone();
                 break;
@@ -1361,6 +1833,10 @@ void Chat::onNewKeys(StaticBuffer&& keybuf)
 
 void Chat::onHistDone()
 {
+    flushDecryptBatch();
+    flushHistBatch();
+    persistUnreadCount();
+
     // We may be fetching from memory and db because of a resetHistFetch()
     // while fetching from server. In that case, we don't notify about
     // fetched messages and onHistDone()
@@ -1433,6 +1909,10 @@ void Chat::onFetchHistDone()
         CHATID_LOG_DEBUG("No text message seen yet, fetching more history from server");
         getHistory(16);
     }
+    else if (mServerFetchState == kHistNotFetching)
+    {
+        checkHistoryMemory();
+    }
 }
 
 void Chat::loadAndProcessUnsent()
@@ -1441,6 +1921,10 @@ void Chat::loadAndProcessUnsent()
     CALL_DB(loadSendQueue, mSending);
     if (mSending.empty())
         return;
+    for (auto& item: mSending)
+    {
+        accountMsg(*item.msg, false);
+    }
     mNextUnsent = mSending.begin();
     replayUnsentNotifications();
 
@@ -1513,19 +1997,161 @@ Message* Chat::getManualSending(uint64_t rowid, ManualSendReason& reason)
     return item.msg;
 }
 
-Idx Chat::lastIdxReceivedFromServer() const
+Idx Chat::lastIdxReceivedFromServer() const
+{
+    return mLastIdxReceivedFromServer;
+}
+
+Id Chat::lastIdReceivedFromServer() const
+{
+    return mLastIdReceivedFromServer;
+}
+
+bool Chat::isGroup() const
+{
+    return mIsGroup;
+}
+
+size_t Chat::trimHistory(size_t maxBytes)
+{
+    if (mHistoryBytes <= maxBytes)
+        return 0;
+
+    // While history is fetched or decrypted, the oldest messages may not be in
+    // the db yet, and the RAM buffer is the only place where they exist
+    if (isFetchingFromServer() || (mDecryptOldHaltedAt != CHATD_IDX_INVALID)
+        || (mDecryptNewHaltedAt != CHATD_IDX_INVALID) || !mDecryptBatch.empty())
+    {
+        return 0;
+    }
+
+    // The app gets status changes and edits only for messages that are in RAM,
+    // so in an open chat, the messages that it has loaded must stay there
+    Idx maxEnd = highnum() - kMinRamWindow + 1;
+    if (mIsOpen && (mNextHistFetchIdx != CHATD_IDX_INVALID) && (mNextHistFetchIdx < maxEnd))
+    {
+        maxEnd = mNextHistFetchIdx + 1;
+    }
+    Idx low = lownum();
+    if (maxEnd <= low)
+        return 0;
+
+    // walks only the messages that are evicted
+    size_t freed = 0;
+    Idx end = low;
+    while ((end < maxEnd) && (mHistoryBytes - freed > maxBytes))
+    {
+        auto& msg = at(end);
+        if ((msg.isEncrypted() == 1) || msg.isSending())
+            break; //not in the db
+        freed += msg.accountedBytes;
+        end++;
+    }
+    if (end == low)
+        return 0;
+
+    evictBefore(end);
+    return freed;
+}
+
+void Chat::evictBefore(Idx idx)
+{
+    Idx low = lownum();
+    assert((idx > low) && (idx <= highnum()));
+    flushHistBatch();
+    if (!mHasMoreHistoryInDb)
+    {
+        // the oldest message is in RAM, it will not be after the eviction
+        mOldestKnownMsgId = at(low).id();
+        mHasMoreHistoryInDb = true;
+    }
+    for (Idx i = low; i < idx; i++)
+    {
+        mIdToIndexMap.erase(at(i).id());
+    }
+    if (mEvictedLownum == CHATD_IDX_INVALID)
+    {
+        mEvictedLownum = low;
+    }
+    deleteMessagesBefore(idx);
+    CHATID_LOG_DEBUG("Evicted %d messages from RAM, %d evicted in total", idx - low, evictedCount());
+}
+
+void Chat::loadEvicted(Idx downTo)
+{
+    assert(mEvictedLownum != CHATD_IDX_INVALID);
+    Idx low = lownum();
+    if (downTo >= low)
+        return;
+    if (downTo < mEvictedLownum)
+        downTo = mEvictedLownum;
+
+    // load a few more, as history is usually accessed sequentially
+    Idx count = std::max<Idx>(low - downTo, kEvictedLoadChunk);
+    count = std::min<Idx>(count, low - mEvictedLownum);
+    std::vector<Message*> messages;
+    CALL_DB(fetchDbHistory, low-1, count, messages);
+
+    // Evicted messages are still logically part of the history buffer, so
+    // they are loaded back silently, without notifying the app
+    for (auto msg: messages)
+    {
+        push_back(msg);
+        mIdToIndexMap[msg->id()] = lownum();
+        if (msg->id() == mOldestKnownMsgId)
+            mHasMoreHistoryInDb = false;
+    }
+    if (((Idx)messages.size() < count) || (lownum() <= mEvictedLownum))
+    {
+        if ((Idx)messages.size() < count)
+            CHATID_LOG_ERROR("loadEvicted: Only %zu of %d evicted messages found in db", messages.size(), count);
+        mEvictedLownum = CHATD_IDX_INVALID;
+    }
+}
+
+Idx Chat::evictedMsgIndexFromId(Id msgid) const
+{
+    // The batched messages are in RAM, so they are never looked up here
+    assert(mEvictedLownum != CHATD_IDX_INVALID);
+    Idx idx = CHATD_IDX_INVALID;
+    try
+    {
+        idx = mDbInterface->getIdxOfMsgid(msgid);
+    }
+    catch(std::exception& e)
+    {
+        CHATID_LOG_ERROR("Exception thrown from DbInterface::getIdxOfMsgid():\n%s", e.what());
+    }
+    return ((idx != CHATD_IDX_INVALID) && (idx >= mEvictedLownum) && (idx < lownum()))
+        ? idx : CHATD_IDX_INVALID;
+}
+
+void Chat::setOpen(bool open)
 {
-    return mLastIdxReceivedFromServer;
+    mIsOpen = open;
+    touch();
+    if (!open)
+    {
+        // the messages that the app had loaded can be evicted now
+        checkHistoryMemory();
+    }
 }
 
-Id Chat::lastIdReceivedFromServer() const
+void Chat::touch()
 {
-    return mLastIdReceivedFromServer;
+    mLastUseSeq = ++mClient.mUseSeq;
 }
 
-bool Chat::isGroup() const
+void Chat::checkHistoryMemory()
 {
-    return mIsGroup;
+    if (mClient.mChatMemoryLimit && (mHistoryBytes > mClient.mChatMemoryLimit))
+    {
+        trimHistory(mClient.mChatMemoryLimit);
+    }
+    if (mClient.mTotalMemoryLimit && (mClient.mHistoryBytes > mClient.mTotalMemoryLimit))
+    {
+        mClient.scheduleHistoryMemoryCheck();
+    }
 }
 
 void Chat::clearHistory()
@@ -1581,8 +2207,8 @@ void Chat::onEndCall(karere::Id userid, uint32_t clientid)
 
 void Chat::initChat()
 {
-    mBackwardList.clear();
-    mForwardList.clear();
+    mHistBatch.clear(); //points to the messages that are about to be deleted
+    clear();
     mIdToIndexMap.clear();
 
     mForwardStart = CHATD_IDX_RANGE_MIDDLE;
@@ -1591,6 +2217,8 @@ void Chat::initChat()
     mLastSeenIdx = CHATD_IDX_INVALID;
     mLastReceivedIdx = CHATD_IDX_INVALID;
     mNextHistFetchIdx = CHATD_IDX_INVALID;
+    mUnreadCountValid = false;
+    mUnreadCountDirty = false;
     mLastIdReceivedFromServer = 0;
     mLastIdxReceivedFromServer = CHATD_IDX_INVALID;
     mLastServerHistFetchCount = 0;
@@ -1600,10 +2228,12 @@ void Chat::initChat()
     mEncryptionHalted = false;
     mDecryptNewHaltedAt = CHATD_IDX_INVALID;
     mDecryptOldHaltedAt = CHATD_IDX_INVALID;
+    mDecryptBatch.clear();
     mRefidToIdxMap.clear();
 
     mHasMoreHistoryInDb = false;
     mHaveAllHistory = false;
+    mEvictedLownum = CHATD_IDX_INVALID;
 }
 
 Message* Chat::msgSubmit(const char* msg, size_t msglen, unsigned char type, void* userp)
@@ -1614,7 +2244,7 @@ Message* Chat::msgSubmit(const char* msg, size_t msglen, unsigned char type, voi
     }
 
     // write the new message to the message buffer and mark as in sending state
-    auto message = new Message(makeRandomId(), client().userId(), time(NULL),
+    auto message = new (client().msgArena()) Message(makeRandomId(), client().userId(), time(NULL),
         0, msg, msglen, true, CHATD_KEYID_INVALID, type, userp);
     message->backRefId = generateRefId(mCrypto);
 
@@ -1725,6 +2355,7 @@ void Chat::createMsgBackRefs(Chat::OutputQueue::iterator msgit)
 Chat::SendingItem* Chat::postMsgToSending(uint8_t opcode, Message* msg)
 {
     mSending.emplace_back(opcode, msg, mUsers);
+    accountMsg(*msg, false);
     CALL_DB(saveMsgToSending, mSending.back());
     if (mNextUnsent == mSending.end())
     {
@@ -1821,9 +2452,10 @@ Message* Chat::msgModify(Message& msg, const char* newdata, size_t newlen, void*
             item->msg->updated = age + 1;
         }
         msg.assign((void*)newdata, newlen);
+        accountMsg(*item->msg, false);
         CALL_DB(updateMsgPlaintextInSending, item->rowid, msg);
     } //end msg.isSending()
-    auto upd = new Message(msg.id(), msg.userid, msg.ts, age+1, newdata, newlen,
+    auto upd = new (client().msgArena()) Message(msg.id(), msg.userid, msg.ts, age+1, newdata, newlen,
         msg.isSending(), msg.keyid, msg.type, userp);
 
     auto wptr = weakHandle();
@@ -1846,6 +2478,7 @@ void Chat::onLastReceived(Id msgid)
     auto it = mIdToIndexMap.find(msgid);
     if (it == mIdToIndexMap.end())
     { // we don't have that message in the buffer yet, so we don't know its index
+        flushHistBatch();
         Idx idx = mDbInterface->getIdxOfMsgid(msgid);
         if (idx != CHATD_IDX_INVALID)
         {
@@ -1911,6 +2544,7 @@ void Chat::onLastSeen(Id msgid)
     auto it = mIdToIndexMap.find(msgid);
     if (it == mIdToIndexMap.end())  // msgid not loaded in RAM
     {
+        flushHistBatch();
         idx = mDbInterface->getIdxOfMsgid(msgid);   // return CHATD_IDX_INVALID if not found in DB
     }
     else    // msgid is in RAM
@@ -1958,6 +2592,7 @@ void Chat::onLastSeen(Id msgid)
     {
         Idx oldLastSeenIdx = mLastSeenIdx;
         mLastSeenIdx = idx;
+        onLastSeenIdxChanged(oldLastSeenIdx);
 
         //notify about messages that have become 'seen'
         Idx  notifyOldest = oldLastSeenIdx + 1;
@@ -2018,7 +2653,10 @@ bool Chat::setMessageSeen(Idx idx)
             Idx lowest = lownum()-1;
             notifyStart = (mLastSeenIdx < lowest) ? lowest : mLastSeenIdx;
         }
+        Idx oldLastSeenIdx = mLastSeenIdx;
         mLastSeenIdx = idx;
+        mLastSeenId = id;
+        onLastSeenIdxChanged(oldLastSeenIdx);
         Idx highest = highnum();
         Idx notifyEnd = (mLastSeenIdx > highest) ? highest : mLastSeenIdx;
 
@@ -2030,7 +2668,6 @@ bool Chat::setMessageSeen(Idx idx)
                 CALL_LISTENER(onMessageStatusChange, i, Message::kSeen, m);
             }
         }
-        mLastSeenId = id;
         CALL_DB(setLastSeen, mLastSeenId);
         CALL_LISTENER(onUnreadChanged);
     }, kSeenTimeout, mClient.karereClient->appCtx);
@@ -2052,6 +2689,145 @@ bool Chat::setMessageSeen(Id msgid)
 }
 
 int Chat::unreadMsgCount() const
+{
+    if (!mUnreadCountValid)
+    {
+        // persisted at the next checkpoint, see mUnreadCountDirty
+        setUnreadCount(calcUnreadMsgCount());
+        mUnreadCountValid = true;
+    }
+    return mUnreadCount;
+}
+
+void Chat::verifyUnreadCount() const
+{
+#ifndef NDEBUG
+    // Messages that are being decrypted have not been counted yet
+    if (!mUnreadCountValid || (mDecryptNewHaltedAt != CHATD_IDX_INVALID)
+        || (mDecryptOldHaltedAt != CHATD_IDX_INVALID) || !mDecryptBatch.empty())
+    {
+        return;
+    }
+    int count = calcUnreadMsgCount();
+    if (count != mUnreadCount)
+    {
+        CHATID_LOG_ERROR("unreadMsgCount: incrementally maintained count %d differs from actual count %d",
+            mUnreadCount, count);
+        mUnreadCount = count;
+        mUnreadCountDirty = true;
+    }
+#endif
+}
+
+bool Chat::isUnreadCountable(const Message& msg) const
+{
+    // conditions to consider unread messages should match the
+    // ones in ChatdSqliteDb::getPeerMsgCountAfterIdx()
+    return (msg.userid != mClient.userId()               // skip own messages
+            && !(msg.updated && !msg.size())             // skip deleted messages
+            && (msg.type != Message::kMsgRevokeAttachment));  // skip revoke messages
+}
+
+void Chat::setUnreadCount(int count) const
+{
+    mUnreadCount = count;
+    mUnreadCountDirty = true;
+}
+
+void Chat::persistUnreadCount()
+{
+    if (!mUnreadCountDirty || !mUnreadCountValid)
+        return;
+    verifyUnreadCount();
+    mUnreadCountDirty = false;
+    CALL_DB(setUnreadCount, mUnreadCount, mLastSeenId);
+}
+
+void Chat::invalidateUnreadCount()
+{
+    if (!mUnreadCountValid)
+        return;
+    mUnreadCountValid = false;
+    mUnreadCountDirty = false;
+    CALL_DB(clearUnreadCount);
+}
+
+void Chat::onUnreadMsgAdded(const Message& msg, Idx idx)
+{
+    if (!mUnreadCountValid || !isUnreadCountable(msg))
+        return;
+
+    if (mLastSeenIdx == CHATD_IDX_INVALID)
+    {
+        // the count is negative, meaning 'at least N' unread messages. A positive
+        // value is possible only if the history consists of a single truncate
+        if (mUnreadCount > 0)
+        {
+            invalidateUnreadCount();
+            return;
+        }
+        setUnreadCount(mUnreadCount - 1);
+    }
+    else if (idx > mLastSeenIdx)
+    {
+        setUnreadCount(mUnreadCount + 1);
+    }
+}
+
+void Chat::onUnreadMsgRemoved(Idx idx)
+{
+    if (!mUnreadCountValid)
+        return;
+
+    if (mLastSeenIdx == CHATD_IDX_INVALID)
+    {
+        if (mUnreadCount >= 0)
+        {
+            invalidateUnreadCount();
+            return;
+        }
+        setUnreadCount(mUnreadCount + 1);
+    }
+    else if (idx > mLastSeenIdx)
+    {
+        if (mUnreadCount <= 0)
+        {
+            invalidateUnreadCount();
+            return;
+        }
+        setUnreadCount(mUnreadCount - 1);
+    }
+    // A deleted message doesn't change the history range that the persisted
+    // count is checked against, so it's persisted right away. Deletes are rare
+    persistUnreadCount();
+}
+
+void Chat::onLastSeenIdxChanged(Idx oldIdx)
+{
+    if (!mUnreadCountValid)
+        return;
+
+    // we can only subtract the newly seen messages if they are all in RAM
+    if ((oldIdx == CHATD_IDX_INVALID) || (mLastSeenIdx == CHATD_IDX_INVALID)
+        || (mLastSeenIdx < oldIdx) || (oldIdx < lownum()-1) || (mLastSeenIdx > highnum()))
+    {
+        invalidateUnreadCount();
+        return;
+    }
+
+    int count = mUnreadCount;
+    for (Idx i = oldIdx+1; i <= mLastSeenIdx; i++)
+    {
+        if (isUnreadCountable(at(i)))
+        {
+            count--;
+        }
+    }
+    setUnreadCount(count);
+    persistUnreadCount(); //the last seen pointer has just been written, keep them in sync
+}
+
+int Chat::calcUnreadMsgCount() const
 {
     if (mLastSeenIdx == CHATD_IDX_INVALID)
     {
@@ -2063,12 +2839,12 @@ int Chat::unreadMsgCount() const
         }
         else
         {
-            return -mDbInterface->getPeerMsgCountAfterIdx(CHATD_IDX_INVALID);
+            return -(mDbInterface->getPeerMsgCountAfterIdx(CHATD_IDX_INVALID) + histBatchUnreadCount());
         }
     }
     else if (mLastSeenIdx < lownum())
     {
-        return mDbInterface->getPeerMsgCountAfterIdx(mLastSeenIdx);
+        return mDbInterface->getPeerMsgCountAfterIdx(mLastSeenIdx) + histBatchUnreadCount();
     }
 
     Idx first = mLastSeenIdx+1;
@@ -2076,12 +2852,22 @@ int Chat::unreadMsgCount() const
     auto last = highnum();
     for (Idx i=first; i<=last; i++)
     {
-        // conditions to consider unread messages should match the
-        // ones in ChatdSqliteDb::getPeerMsgCountAfterIdx()
-        auto& msg = at(i);
-        if (msg.userid != mClient.userId()               // skip own messages
-                && !(msg.updated && !msg.size())         // skip deleted messages
-                && (msg.type != Message::kMsgRevokeAttachment))  // skip revoke messages
+        if (isUnreadCountable(*findInRam(i))) //all in RAM, as mLastSeenIdx >= lownum()
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+int Chat::histBatchUnreadCount() const
+{
+    // The batched messages are not in the db yet
+    int count = 0;
+    for (auto& item: mHistBatch)
+    {
+        if (((mLastSeenIdx == CHATD_IDX_INVALID) || (item.second > mLastSeenIdx))
+            && isUnreadCountable(*item.first))
         {
             count++;
         }
@@ -2119,6 +2905,7 @@ void Chat::moveItemToManualSending(OutputQueue::iterator it, ManualSendReason re
     CALL_DB(deleteItemFromSending, it->rowid);
     CALL_DB(saveItemToManualSending, *it, reason);
     CALL_LISTENER(onManualSendRequired, it->msg, it->rowid, reason); //GUI should put this message at end of that list of messages requiring 'manual' resend
+    unaccountMsg(*it->msg, false);
     it->msg = nullptr; //don't delete the Message object, it will be owned by the app
     mSending.erase(it);
 }
@@ -2151,19 +2938,59 @@ void Chat::joinRangeHist(const ChatDbInfo& dbInfo)
 {
     assert(mConnection.isConnected() || mConnection.isLoggedIn());
     assert(dbInfo.oldestDbId && dbInfo.newestDbId);
+    setJoiningRangeHist();
+    CHATID_LOG_DEBUG("Sending JOINRANGEHIST based on app db: %s - %s",
+            dbInfo.oldestDbId.toString().c_str(), dbInfo.newestDbId.toString().c_str());
+
+    sendCommand(Command(OP_JOINRANGEHIST) + mChatId + dbInfo.oldestDbId + dbInfo.newestDbId);
+}
+
+// also called when the chat was dormant and JOINRANGEHIST was sent on its behalf
+void Chat::setJoiningRangeHist()
+{
     mUserDump.clear();
     setOnlineState(kChatStateJoining);
     mServerOldHistCbEnabled = false;
     mServerFetchState = kHistFetchingNewFromServer;
-    CHATID_LOG_DEBUG("Sending JOINRANGEHIST based on app db: %s - %s",
-            dbInfo.oldestDbId.toString().c_str(), dbInfo.newestDbId.toString().c_str());
+}
 
-    sendCommand(Command(OP_JOINRANGEHIST) + mChatId + dbInfo.oldestDbId + dbInfo.newestDbId);
+void Chat::resumeDormantJoin()
+{
+    if (!mDormantJoin)
+        return;
+
+    std::unique_ptr<DormantJoin> join(std::move(mDormantJoin));
+    CHATID_LOG_DEBUG("Resuming the join of the dormant chat, %zu participants received%s",
+        join->users.size(), join->histDone ? ", join complete" : "");
+    for (auto& user: join->users)
+    {
+        if (user.second == PRIV_NOTPRESENT)
+            onUserLeave(user.first);
+        else
+            onUserJoin(user.first, user.second);
+    }
+    if (join->lastSeenId.isValid())
+    {
+        onLastSeen(join->lastSeenId);
+    }
+    if (join->lastRecvId.isValid())
+    {
+        onLastReceived(join->lastRecvId);
+    }
+    if (join->histDone)
+    {
+        onHistDone();
+    }
 }
 
 Client::~Client()
 {
     cancelTimers();
+    if (mHistMemCheckTimer)
+    {
+        cancelTimeout(mHistMemCheckTimer, karereClient->appCtx);
+    }
+    mMsgArena->release(); //destroyed when the messages still held by the app are freed
 }
 
 void Client::msgConfirm(Id msgxid, Id msgid)
@@ -2231,9 +3058,10 @@ Message* Chat::msgRemoveFromSending(Id msgxid, Id msgid)
         return nullptr;
     }
     auto msg = item.msg;
-    item.msg = nullptr;
     assert(msg);
     assert(msg->isSending());
+    unaccountMsg(*msg, false);
+    item.msg = nullptr;
 
     CALL_DB(deleteItemFromSending, item.rowid);
     mSending.pop_front(); //deletes item
@@ -2357,7 +3185,7 @@ void Chat::rejectMsgupd(Id id, uint8_t serverReason)
     {
         CALL_LISTENER(onEditRejected, msg, kManualSendEditNoChange);
         CALL_DB(deleteItemFromSending, mSending.front().rowid);
-        mSending.pop_front();
+        eraseFromSending(mSending.begin());
     }
     else
     {
@@ -2392,7 +3220,7 @@ void Chat::onMsgUpdated(Message* cipherMsg)
             auto erased = it;
             it++;
             mPendingEdits.erase(cipherMsg->id());
-            mSending.erase(erased);
+            eraseFromSending(erased);
         }
     }
     mCrypto->msgDecrypt(cipherMsg)
@@ -2432,14 +3260,24 @@ void Chat::onMsgUpdated(Message* cipherMsg)
             CALL_DB(updateMsgInHistory, msg->id(), *msg);
 
             // update in RAM
+            bool wasUnreadCountable = isUnreadCountable(histmsg);
             histmsg.assign(*msg);     // content
             histmsg.updated = msg->updated;
             histmsg.type = msg->type;
             histmsg.userid = msg->userid;
+            accountMsg(histmsg, true);
             if (msg->type == Message::kMsgTruncate)
             {
                 histmsg.ts = msg->ts;   // truncates update the `ts` instead of `update`
             }
+            if (wasUnreadCountable && !isUnreadCountable(histmsg))
+            {
+                onUnreadMsgRemoved(idx);
+            }
+            else if (!wasUnreadCountable && isUnreadCountable(histmsg))
+            {
+                onUnreadMsgAdded(histmsg, idx);
+            }
 
             if (idx > mNextHistFetchIdx)
             {
@@ -2486,6 +3324,10 @@ void Chat::onMsgUpdated(Message* cipherMsg)
             {
                 //update in db
                 CALL_DB(updateMsgInHistory, msg->id(), *msg);
+                if (msg->userid != client().userId() && msg->updated && !msg->size())
+                {
+                    invalidateUnreadCount(); //may have been unread
+                }
             }
         }
 
@@ -2521,12 +3363,15 @@ void Chat::handleTruncate(const Message& msg, Idx idx)
     CHATID_LOG_DEBUG("Truncating chat history before msgid %s, idx %d, fwdStart %d", ID_CSTR(msg.id()), idx, mForwardStart);
     CALL_CRYPTO(resetSendKey);
     CALL_DB(truncateHistory, msg);
+    invalidateUnreadCount();
     if (idx != CHATD_IDX_INVALID)
     {
         //GUI must detach and free any resources associated with
         //messages older than the one specified
         CALL_LISTENER(onHistoryTruncated, msg, idx);
         deleteMessagesBefore(idx);
+        //evicted messages are all older than idx, and have been deleted from db
+        mEvictedLownum = CHATD_IDX_INVALID;
         if (mLastSeenIdx != CHATD_IDX_INVALID)
         {
             if (mLastSeenIdx <= idx)
@@ -2557,6 +3402,7 @@ void Chat::handleTruncate(const Message& msg, Idx idx)
     }
 
     ChatDbInfo info;
+    flushHistBatch();
     mDbInterface->getHistoryInfo(info);
     mOldestKnownMsgId = info.oldestDbId;
     if (mOldestKnownMsgId)
@@ -2578,9 +3424,60 @@ Id Chat::makeRandomId()
     return distrib(rd);
 }
 
+void Chat::clear()
+{
+    mClient.mHistoryBytes -= mHistoryBytes;
+    mHistoryBytes = 0;
+    mBackwardList.clear();
+    mForwardList.clear();
+}
+
+void Chat::accountMsg(Message& msg, bool inHistory)
+{
+    // unsigned arithmetic, so this works for shrinking messages as well
+    size_t delta = msg.liveBytes() - msg.accountedBytes;
+    msg.accountedBytes += delta;
+    if (inHistory)
+    {
+        mHistoryBytes += delta;
+        mClient.mHistoryBytes += delta;
+    }
+    else
+    {
+        mSendingBytes += delta;
+    }
+}
+
+void Chat::unaccountMsg(Message& msg, bool inHistory)
+{
+    if (inHistory)
+    {
+        mHistoryBytes -= msg.accountedBytes;
+        mClient.mHistoryBytes -= msg.accountedBytes;
+    }
+    else
+    {
+        mSendingBytes -= msg.accountedBytes;
+    }
+    msg.accountedBytes = 0;
+}
+
+void Chat::eraseFromSending(OutputQueue::iterator it)
+{
+    if (it->msg)
+    {
+        unaccountMsg(*it->msg, false);
+    }
+    mSending.erase(it);
+}
+
 void Chat::deleteMessagesBefore(Idx idx)
 {
     //delete everything before idx, but not including idx
+    for (Idx i = lownum(); i < idx; i++)
+    {
+        unaccountMsg(at(i), true);
+    }
     if (idx > mForwardStart)
     {
         mBackwardList.clear();
@@ -2660,6 +3557,7 @@ Idx Chat::msgIncoming(bool isNew, Message* message, bool isLocal)
             if (mHasMoreHistoryInDb)
             { //we have db history that is not loaded, so we determine the index
               //by the db, and don't add the message to RAM
+                flushHistBatch();
                 idx = mDbInterface->getOldestIdx()-1;
             }
             else
@@ -2731,6 +3629,15 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
             CHATID_LOG_DEBUG("Decryption of old messages is halted, message queued for decryption");
             return false;
         }
+        // Old history comes in bursts, which are decrypted in batches, that
+        // the crypto module can process in parallel. The batch is passed on
+        // in index order by deliverDecryptBatch()
+        mDecryptBatch.push_back(idx);
+        if (mDecryptBatch.size() >= kDecryptBatchMaxSize)
+        {
+            flushDecryptBatch();
+        }
+        return true;
     }
     CHATD_LOG_CRYPTO_CALL("Calling ICrypto::decrypt()");
     auto pms = mCrypto->msgDecrypt(&msg);
@@ -2755,21 +3662,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
             return promise::Error("History was reloaded, ignore message", EINVAL, SVCRYPTO_ENOMSG);
         }
 
-        assert(message->isEncrypted() == 1);
-        message->setEncrypted(2);
-        if ((err.type() != SVCRYPTO_ERRTYPE) ||
-            (err.code() != SVCRYPTO_ENOKEY))
-        {
-            CHATID_LOG_ERROR(
-                "Unrecoverable decrypt error at message %s(idx %d):'%s'\n"
-                "Message will not be decrypted", ID_CSTR(message->id()), idx, err.toString().c_str());
-        }
-        else
-        {
-            //we have a normal situation where a message was sent just before a user joined, so it will be undecryptable
-            //TODO: assert chatroom is not 1on1
-            CHATID_LOG_WARNING("No key to decrypt message %s, possibly message was sent just before user joined", ID_CSTR(message->id()));
-        }
+        onMsgDecryptError(*message, idx, err);
         return message;
     })
     .then([this, isNew, isLocal, idx](Message* message)
@@ -2799,6 +3692,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
             if ((mServerFetchState == kHistDecryptingNew) &&
                 (mDecryptNewHaltedAt == CHATD_IDX_INVALID)) //all messages decrypted
             {
+                flushHistBatch();
                 mServerFetchState = kHistNotFetching;
             }
         }
@@ -2813,21 +3707,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
             assert(!isLocal);
             auto first = mDecryptOldHaltedAt - 1;
             mDecryptOldHaltedAt = CHATD_IDX_INVALID;
-            auto last = lownum();
-            for (Idx i = first; i >= last; i--)
-            {
-                if (!msgIncomingAfterAdd(isNew, false, at(i), i))
-                    break;
-            }
-            if ((mServerFetchState == kHistDecryptingOld) &&
-                (mDecryptOldHaltedAt == CHATD_IDX_INVALID))
-            {
-                mServerFetchState = kHistNotFetching;
-                if (mServerOldHistCbEnabled)
-                {
-                    CALL_LISTENER(onHistoryDone, kHistSourceServer);
-                }
-            }
+            resumeOldHistDecrypt(first);
         }
     })
     .fail([this](const promise::Error& err)
@@ -2840,10 +3720,158 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
     return false; //decrypt was not done immediately
 }
 
+void Chat::onMsgDecryptError(Message& msg, Idx idx, const promise::Error& err)
+{
+    assert(msg.isEncrypted() == 1);
+    msg.setEncrypted(2);
+    if ((err.type() != SVCRYPTO_ERRTYPE) ||
+        (err.code() != SVCRYPTO_ENOKEY))
+    {
+        CHATID_LOG_ERROR(
+            "Unrecoverable decrypt error at message %s(idx %d):'%s'\n"
+            "Message will not be decrypted", ID_CSTR(msg.id()), idx, err.toString().c_str());
+    }
+    else
+    {
+        //we have a normal situation where a message was sent just before a user joined, so it will be undecryptable
+        //TODO: assert chatroom is not 1on1
+        CHATID_LOG_WARNING("No key to decrypt message %s, possibly message was sent just before user joined", ID_CSTR(msg.id()));
+    }
+}
+
+struct Chat::DecryptBatch
+{
+    std::vector<Idx> idxs;
+    std::vector<promise::Promise<Message*>> results;
+    size_t next = 0; //the first message not yet passed to msgIncomingAfterDecrypt()
+    bool halted = false; //whether decryption of old messages is halted at this batch
+};
+
+void Chat::flushDecryptBatch()
+{
+    if (mDecryptBatch.empty())
+        return;
+
+    auto batch = std::make_shared<DecryptBatch>();
+    batch->idxs.swap(mDecryptBatch);
+    std::vector<Message*> msgs;
+    msgs.reserve(batch->idxs.size());
+    for (auto idx: batch->idxs)
+    {
+        msgs.push_back(&at(idx));
+    }
+    CHATD_LOG_CRYPTO_CALL("Calling ICrypto::msgDecryptBatch() with %zu messages", msgs.size());
+    batch->results = mCrypto->msgDecryptBatch(msgs);
+    assert(batch->results.size() == msgs.size());
+    deliverDecryptBatch(batch);
+}
+
+void Chat::deliverDecryptBatch(const std::shared_ptr<DecryptBatch>& batch)
+{
+    // The messages may be decrypted in any order, but they are passed on in
+    // the order of their indexes, as if they were decrypted one by one
+    while (batch->next < batch->idxs.size())
+    {
+        Idx idx = batch->idxs[batch->next];
+        auto& pms = batch->results[batch->next];
+        if (!pms.done())
+        {
+            CHATID_LOG_DEBUG("Decryption could not be done immediately, halting for next messages");
+            mDecryptOldHaltedAt = idx;
+            batch->halted = true;
+            auto wptr = weakHandle();
+            pms.fail([](const promise::Error&) -> Message* { return nullptr; }) //the error is handled when the batch is resumed
+            .then([this, wptr, batch](Message*)
+            {
+                if (wptr.deleted())
+                    return;
+                deliverDecryptBatch(batch);
+            });
+            return;
+        }
+
+        batch->next++;
+        if (pms.failed())
+        {
+            auto err = pms.error();
+            pms.fail([](const promise::Error&) -> Message* { return nullptr; }); //mark as handled
+            if (err.type() == SVCRYPTO_ENOMSG)
+            {
+                CHATID_LOG_DEBUG("History was reloaded, dropping batch of messages being decrypted");
+                for (auto i = batch->next; i < batch->results.size(); i++)
+                {
+                    batch->results[i].fail([](const promise::Error&) -> Message* { return nullptr; });
+                }
+                return;
+            }
+            onMsgDecryptError(at(idx), idx, err);
+        }
+        else
+        {
+            assert(!at(idx).isEncrypted());
+        }
+        if (batch->halted)
+        {
+            mDecryptOldHaltedAt = CHATD_IDX_INVALID;
+        }
+        msgIncomingAfterDecrypt(false, false, at(idx), idx);
+    }
+
+    if (batch->halted)
+    {
+        // messages received meanwhile were queued
+        resumeOldHistDecrypt(batch->idxs.back() - 1);
+    }
+}
+
+void Chat::resumeOldHistDecrypt(Idx first)
+{
+    // Decrypt the rest synchronously, or in batches, bail out on the
+    // first that can't be decrypted synchronously
+    assert(mDecryptOldHaltedAt == CHATD_IDX_INVALID);
+    auto last = lownum();
+    for (Idx i = first; i >= last; i--)
+    {
+        if (!msgIncomingAfterAdd(false, false, at(i), i))
+            break;
+    }
+    flushDecryptBatch();
+    if ((mServerFetchState == kHistDecryptingOld) &&
+        (mDecryptOldHaltedAt == CHATD_IDX_INVALID))
+    {
+        // the messages decrypted after HISTDONE were batched, write them now
+        flushHistBatch();
+        mServerFetchState = kHistNotFetching;
+        if (mServerOldHistCbEnabled)
+        {
+            CALL_LISTENER(onHistoryDone, kHistSourceServer);
+        }
+    }
+}
+
+void Chat::flushHistBatch()
+{
+    if (mHistBatch.empty())
+        return;
+
+    CHATD_LOG_DB_CALL("Calling DbInterface::addMsgsToHistory() with %zu messages", mHistBatch.size());
+    try
+    {
+        mDbInterface->addMsgsToHistory(mHistBatch);
+    }
+    catch(std::exception& e)
+    {
+        CHATID_LOG_ERROR("Exception thrown from DbInterface::addMsgsToHistory():\n%s", e.what());
+    }
+    mHistBatch.clear();
+    persistUnreadCount();
+}
+
 // Save to history db, handle received and seen pointers, call new/old message user callbacks
 void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx idx)
 {
     assert(idx != CHATD_IDX_INVALID);
+    accountMsg(msg, true); //decryption changes the size
     if (!isNew)
     {
         mLastHistDecryptCount++;
@@ -2861,7 +3889,20 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
         }
 
         verifyMsgOrder(msg, idx);
-        CALL_DB(addMsgToHistory, msg, idx);
+        if (isFetchingFromServer())
+        {
+            // history burst - written to db in one go upon HISTDONE
+            mHistBatch.emplace_back(&msg, idx);
+            if (mHistBatch.size() >= kHistBatchMaxSize)
+            {
+                flushHistBatch();
+            }
+        }
+        else
+        {
+            CALL_DB(addMsgToHistory, msg, idx);
+        }
+        onUnreadMsgAdded(msg, idx);
 
 
         if (mClient.isMessageReceivedConfirmationActive() && !isGroup() &&
@@ -2876,9 +3917,14 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
             sendCommand(Command(OP_RECEIVED) + mChatId + msgid);
         }
     }
-    if (msg.backRefId && !mRefidToIdxMap.emplace(msg.backRefId, idx).second)
+    if (msg.backRefId)
     {
-        CALL_LISTENER(onMsgOrderVerificationFail, msg, idx, "A message with that backrefId "+std::to_string(msg.backRefId)+" already exists");
+        //messages that are loaded back after being evicted from RAM still have their entry
+        auto res = mRefidToIdxMap.emplace(msg.backRefId, idx);
+        if (!res.second && (res.first->second != idx))
+        {
+            CALL_LISTENER(onMsgOrderVerificationFail, msg, idx, "A message with that backrefId "+std::to_string(msg.backRefId)+" already exists");
+        }
     }
 
     auto status = getMsgStatus(msg, idx);
@@ -2997,8 +4043,13 @@ void Chat::onUserJoin(Id userid, Priv priv)
 
     if (mOnlineState == kChatStateOnline || !mIsFirstJoin)
     {
-        mUsers.insert(userid);
-        CALL_CRYPTO(onUserJoin, userid);
+        // A privilege change of a participant, or the JOIN of an existing
+        // participant on rejoin, doesn't change who can read the chat, so
+        // the current send key can be kept
+        if (mUsers.insert(userid).second)
+        {
+            CALL_CRYPTO(onUserJoin, userid);
+        }
         CALL_LISTENER(onUserJoin, userid, priv);
     }
 }
@@ -3039,6 +4090,7 @@ void Chat::onJoinComplete()
         CALL_CRYPTO(setUsers, &mUsers);
     }
     mUserDump.clear();
+    CALL_CRYPTO(prefetchUserKeys);
     mEncryptionHalted = false;
     auto unconfirmedKeyCmd = mCrypto->unconfirmedKeyCmd();
     if (unconfirmedKeyCmd)
@@ -3072,23 +4124,9 @@ void Chat::setOnlineState(ChatState state)
     if (state == mOnlineState)
         return;
 
-    bool allConnected = true;
     if (state == kChatStateOnline)
     {
-       std::map<uint64_t, ChatRoom*> *chats = mClient.karereClient->chats.get();
-       std::map<uint64_t, ChatRoom*>::iterator itChatRooms;
-       for (itChatRooms = chats->begin(); itChatRooms != chats->end(); itChatRooms++)
-       {
-           if (itChatRooms->second->chatdOnlineState() != kChatStateOnline)
-           {
-               allConnected = false;
-               break;
-           }
-       }
-       if (allConnected)
-       {
-           mClient.karereClient->setCommitMode(true);
-       }
+        mClient.onChatOnline();
     }
 
     mOnlineState = state;
@@ -3264,6 +4302,7 @@ void Client::leave(Id chatid)
     }
     conn->second->mChatIds.erase(chatid);
     mConnectionForChatId.erase(conn);
+    mDormantChats.erase(chatid);
     mChatForChatId.erase(chatid);
 }
 
@@ -8,9 +8,11 @@
 #include <set>
 #include <list>
 #include <deque>
+#include <functional>
 #include <base/promise.h>
 #include <base/timers.hpp>
 #include <base/trackDelete.h>
+#include <base/flatHashMap.h>
 #include "chatdMsg.h"
 #include "url.h"
 #include "net/websocketsIO.h"
@@ -332,6 +334,7 @@ struct EndpointId
 };
 
 class Client;
+struct ChatDbInfo;
 
 // need DeleteTrackable for graceful disconnect timeout
 class Connection: public karere::DeleteTrackable, public WebsocketsClient
@@ -340,14 +343,42 @@ public:
     enum State { kStateNew, kStateFetchingUrl, kStateDisconnected, kStateResolving, kStateConnecting, kStateConnected, kStateLoggedIn };
     enum {
         kIdleTimeout = 64,  // chatd closes connection after 48-64s of not receiving a response
-        kEchoTimeout = 1    // echo to check connection is alive when back to foreground
+        kEchoTimeout = 1,   // echo to check connection is alive when back to foreground
+        kRejoinBatchSize = 128, // max chats joined per event loop iteration, after (re)connect
+        kMaxOutputFrameSize = 64*1024 // the output buffer is flushed earlier if it grows above this
          };
+    /** @brief Counters of the outbound traffic of a connection */
+    struct OutputStats
+    {
+        uint64_t commands = 0;
+        uint64_t frames = 0;
+        uint64_t bytes = 0;
+        /** Frames that were flushed before the end of the event loop iteration,
+         * because of a latency-critical command or the size limit */
+        uint64_t earlyFlushes = 0;
+        OutputStats& operator+=(const OutputStats& other)
+        {
+            commands += other.commands;
+            frames += other.frames;
+            bytes += other.bytes;
+            earlyFlushes += other.earlyFlushes;
+            return *this;
+        }
+    };
 
 protected:
     bool usingipv6;
     Client& mClient;
     int mShardNo;
     std::set<karere::Id> mChatIds;
+    /** Chats that still have to be rejoined after (re)connect, see rejoinExistingChats() */
+    std::deque<karere::Id> mRejoinQueue;
+    bool mRejoinScheduled = false;
+    /** Commands are collected here during an event loop iteration, and sent
+     * as a single websocket frame at its end, see sendBuf() */
+    Buffer mOutputBuffer;
+    bool mOutputFlushScheduled = false;
+    OutputStats mOutputStats;
     State mState = kStateNew;
     karere::Url mUrl;
     bool mHeartbeatEnabled = false;
@@ -377,10 +408,17 @@ protected:
     void notifyLoggedIn();
 // Destroys the buffer content
     bool sendBuf(Buffer&& buf);
+    bool flushOutput();
+    void reconnectAfterSendError();
+    static bool isLatencyCritical(uint8_t opcode);
     promise::Promise<void> rejoinExistingChats();
+    void rejoinNextBatch();
+    void joinChats(const std::vector<karere::Id>& chatids);
     void resendPending();
     void join(karere::Id chatid);
+    void joinDormantChat(karere::Id chatid, const ChatDbInfo& dbInfo);
     void hist(karere::Id chatid, long count);
+    void connect(karere::Id chatid);
     bool sendCommand(Command&& cmd); // used internally only for OP_HELLO
     void execCommand(const StaticBuffer& buf);
     bool sendKeepalive(uint8_t opcode);
@@ -395,6 +433,7 @@ public:
     }
     const std::set<karere::Id>& chatIds() const { return mChatIds; }
     uint32_t clientId() const { return mClientId; }
+    const OutputStats& outputStats() const { return mOutputStats; }
     promise::Promise<void> retryPendingConnection();
     virtual ~Connection()
     {
@@ -505,12 +544,59 @@ protected:
     uint8_t mState = kNone;
 };
 
-struct ChatDbInfo;
+struct ChatDbInfo
+{
+    karere::Id oldestDbId;
+    karere::Id newestDbId;
+    Idx newestDbIdx;
+    karere::Id lastSeenId;
+    karere::Id lastRecvId;
+};
+
+/** @brief The locally stored state of a chat that is needed to display it in
+ * the chat list and to join it, without creating its \c Chat object. It is
+ * loaded for all chats at once at startup, see \c Client::addDormantChat()
+ */
+struct ChatSummary
+{
+    ChatDbInfo dbInfo;
+    /** The persisted unread count, or -1 if it is not valid for the current last-seen message */
+    int unreadCount = -1;
+    /** Timestamp of the newest message, or the chat creation time if there are no messages */
+    uint32_t lastMsgTs = 0;
+    /** The newest text message in the local history, if any */
+    LastTextMsgState lastTextMsg;
+    bool haveAllHistory = false;
+    /** Whether there are messages in the send queue of the chat */
+    bool hasPendingSends = false;
+    /** @brief Whether the chat can be left dormant. A chat without local history
+     * needs a full JOIN with a history fetch, and one with a stale unread count
+     * or queued messages needs its Chat object anyway */
+    bool canBeDormant() const
+    {
+        return dbInfo.oldestDbId && dbInfo.newestDbId && (unreadCount >= 0) && !hasPendingSends;
+    }
+};
+
+/** @brief The replies of chatd to the JOINRANGEHIST of a dormant chat that
+ * don't need its \c Chat object: the JOINs of the participants, SEEN, RECEIVED
+ * and HISTDONE. They are kept until the Chat object is created, if ever, and
+ * then passed to it, see \c Chat::resumeDormantJoin()
+ */
+struct DormantJoin
+{
+    std::vector<std::pair<karere::Id, Priv>> users;
+    karere::Id lastSeenId = karere::Id::inval();
+    karere::Id lastRecvId = karere::Id::inval();
+    bool histDone = false;
+};
 
 /** @brief Represents a single chatroom together with the message history.
  * Message sending is done by calling methods on this class.
  * The history buffer can grow in two directions and is always contiguous, i.e.
- * there are no "holes".
+ * there are no "holes". To limit memory usage, its oldest part may be evicted,
+ * as it is also in the db, see \c trimHistory(). Evicted messages are loaded
+ * back when accessed via \c findOrNull() or \c at().
  */
 class Chat: public karere::DeleteTrackable
 {
@@ -540,7 +626,10 @@ public:
             msg->keyid = keyid;
         }
     };
-    typedef std::list<SendingItem> OutputQueue;
+    typedef std::list<SendingItem, karere::SlabStlAllocator<SendingItem>> OutputQueue;
+    /** A batch of received history messages pending to be written to db, with
+     * their indexes. The messages are the ones in the RAM history buffer */
+    typedef std::vector<std::pair<const Message*, Idx>> HistBatch;
     struct ManualSendItem
     {
         Message* msg;
@@ -564,7 +653,9 @@ protected:
     OutputQueue mSending;
     OutputQueue::iterator mNextUnsent;
     bool mIsFirstJoin = true;
-    std::map<karere::Id, Idx> mIdToIndexMap;
+    /// the replies to the JOINRANGEHIST sent while the chat was dormant, until resumeDormantJoin()
+    std::unique_ptr<DormantJoin> mDormantJoin;
+    karere::FlatHashMap<karere::Id, Idx> mIdToIndexMap;
     karere::Id mLastReceivedId;
     Idx mLastReceivedIdx = CHATD_IDX_INVALID;
     karere::Id mLastSeenId;
@@ -594,8 +685,35 @@ protected:
     /** @brief Have reached the beggining of the history (not necessarily the end of it) */
     bool mHaveAllHistory = false;
     bool mIsDisabled = false;
+    bool mIsOpen = false;
     Idx mNextHistFetchIdx = CHATD_IDX_INVALID;
     DbInterface* mDbInterface = nullptr;
+    /** History messages received from server while a history fetch is in progress
+     * are not written to db one by one, but collected here and written in one go
+     * via DbInterface::addMsgsToHistory() upon HISTDONE (or when the batch grows
+     * to kHistBatchMaxSize). Any other db write by the chat flushes the batch
+     * first, so the db is always consistent with what has been processed. Reads
+     * don't flush it, they take the batched messages into account instead.
+     * The batch points to the messages in the history buffer, so it is also
+     * flushed before they are evicted, and dropped when the history is cleared */
+    HistBatch mHistBatch;
+    enum { kHistBatchMaxSize = 512 };
+    /** Indexes of old messages received from server, waiting to be passed to
+     * ICrypto::msgDecryptBatch() by flushDecryptBatch(), in descending order.
+     * The batch is flushed when it's full, at HISTDONE and on disconnect */
+    std::vector<Idx> mDecryptBatch;
+    enum { kDecryptBatchMaxSize = 128 };
+    struct DecryptBatch;
+    /** The lowest index of the messages that have been evicted from the RAM
+     * history buffer, or CHATD_IDX_INVALID if none. The messages from there to
+     * lownum()-1 are in the db, and are loaded back on access by loadEvicted() */
+    Idx mEvictedLownum = CHATD_IDX_INVALID;
+    /** When the app last used this chat, in Client::mUseSeq units. Chats
+     * that have not been used recently are trimmed first */
+    uint32_t mLastUseSeq = 0;
+    /// running totals of Message::accountedBytes, see accountMsg()
+    size_t mHistoryBytes = 0;
+    size_t mSendingBytes = 0;
     // last text message stuff
     LastTextMsgState mLastTextMsg;
     // crypto stuff
@@ -633,20 +751,22 @@ protected:
     uint32_t mLastMsgTs;
     bool mIsGroup;
     // ====
-    std::map<karere::Id, Message*> mPendingEdits;
-    std::map<BackRefId, Idx> mRefidToIdxMap;
+    karere::FlatHashMap<karere::Id, Message*> mPendingEdits;
+    karere::FlatHashMap<BackRefId, Idx> mRefidToIdxMap;
     std::set<EndpointId> mCallParticipants;
     Chat(Connection& conn, karere::Id chatid, Listener* listener,
     const karere::SetOfIds& users, uint32_t chatCreationTs, ICrypto* crypto, bool isGroup);
-    void push_forward(Message* msg) { mForwardList.emplace_back(msg); }
-    void push_back(Message* msg) { mBackwardList.emplace_back(msg); }
+    void push_forward(Message* msg) { accountMsg(*msg, true); mForwardList.emplace_back(msg); }
+    void push_back(Message* msg) { accountMsg(*msg, true); mBackwardList.emplace_back(msg); }
     Message* oldest() const { return (!mBackwardList.empty()) ? mBackwardList.back().get() : mForwardList.front().get(); }
     Message* newest() const { return (!mForwardList.empty())? mForwardList.back().get() : mBackwardList.front().get(); }
-    void clear()
-    {
-        mBackwardList.clear();
-        mForwardList.clear();
-    }
+    void clear();
+    /** Updates the memory counters after \c msg was added to the history buffer
+     * (\c inHistory is true) or to the send queue, or after its size changed */
+    void accountMsg(Message& msg, bool inHistory);
+    /** Updates the memory counters before \c msg leaves the history buffer or the send queue */
+    void unaccountMsg(Message& msg, bool inHistory);
+    void eraseFromSending(OutputQueue::iterator it);
     // msgid can be 0 in case of rejections
     Idx msgConfirm(karere::Id msgxid, karere::Id msgid);
     bool msgAlreadySent(karere::Id msgxid, karere::Id msgid);
@@ -654,6 +774,39 @@ protected:
     Idx msgIncoming(bool isNew, Message* msg, bool isLocal=false);
     bool msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx);
     void msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx idx);
+    void onMsgDecryptError(Message& msg, Idx idx, const promise::Error& err);
+    void flushDecryptBatch();
+    void deliverDecryptBatch(const std::shared_ptr<DecryptBatch>& batch);
+    void resumeOldHistDecrypt(Idx first);
+    void flushHistBatch();
+    void loadEvicted(Idx downTo);
+    Idx evictedMsgIndexFromId(karere::Id msgid) const;
+    void evictBefore(Idx idx);
+    void touch();
+    void checkHistoryMemory();
+    /** Cached value of unreadMsgCount(). It is maintained incrementally as messages
+     * are received, deleted and seen, and is persisted in the db, so that it is
+     * recalculated from history only when it can't be updated incrementally
+     * (i.e. after a truncate). The \c mUnreadCountDirty flag is set when the
+     * value has changed but has not yet been written to db. Received messages
+     * don't write it - it's persisted at checkpoints: when the history batch is
+     * flushed, at HISTDONE, on disconnect and on destruction. If the app exits
+     * before a checkpoint, the db range check of DbInterface::getUnreadCount()
+     * discards the stale value. In debug builds, the count is verified against
+     * a full recount at the checkpoints */
+    mutable int mUnreadCount = 0;
+    mutable bool mUnreadCountValid = false;
+    mutable bool mUnreadCountDirty = false;
+    int calcUnreadMsgCount() const;
+    int histBatchUnreadCount() const;
+    bool isUnreadCountable(const Message& msg) const;
+    void setUnreadCount(int count) const;
+    void invalidateUnreadCount();
+    void persistUnreadCount();
+    void verifyUnreadCount() const;
+    void onUnreadMsgAdded(const Message& msg, Idx idx);
+    void onUnreadMsgRemoved(Idx idx);
+    void onLastSeenIdxChanged(Idx oldIdx);
     void onUserJoin(karere::Id userid, Priv priv);
     void onUserLeave(karere::Id userid);
     void onJoinComplete();
@@ -674,6 +827,7 @@ protected:
     void login();
     void join();
     void joinRangeHist(const ChatDbInfo& dbInfo);
+    void setJoiningRangeHist();
     void onDisconnect();
     void onHistDone(); //called upont receipt of HISTDONE from server
     void onFetchHistDone(); //called by onHistDone() if we are receiving old history (not new, and not via JOINRANGEHIST)
@@ -692,11 +846,32 @@ protected:
 /// @endcond PRIVATE
 public:
     unsigned initialHistoryFetchCount = 32; //< This is the amount of messages that will be requested from server _only_ in case local db is empty
+    enum
+    {
+        kMinRamWindow = 32, //< The number of newest messages that are never evicted from RAM
+        kEvictedLoadChunk = 32 //< Evicted messages are loaded back at least this many at a time
+    };
     /** @brief users The current set of users in the chatroom */
     const karere::SetOfIds& users() const { return mUsers; }
     ~Chat();
     /** @brief The chatid of this chat */
     karere::Id chatId() const { return mChatId; }
+    /** @brief The memory in bytes used by the messages of this chat that are loaded
+     * in RAM, including the send queue */
+    size_t liveBytes() const { return mHistoryBytes + mSendingBytes + mSending.size() * sizeof(SendingItem); }
+    /** @brief The memory in bytes used by the messages in the RAM history buffer */
+    size_t historyBytes() const { return mHistoryBytes; }
+    /** @brief Evicts the oldest messages from the RAM history buffer, until it
+     * uses at most \c maxBytes. The newest kMinRamWindow messages, and in an
+     * open chat the messages that have been passed to the app by getHistory(),
+     * are never evicted. Nothing is evicted while history is being fetched from
+     * server or decrypted, as these messages may not be in the db yet.
+     * @returns The number of bytes freed */
+    size_t trimHistory(size_t maxBytes);
+    /** @brief The number of messages that have been evicted from the RAM history
+     * buffer and not loaded back */
+    Idx evictedCount() const { return (mEvictedLownum == CHATD_IDX_INVALID) ? 0 : lownum() - mEvictedLownum; }
+    uint32_t lastUseSeq() const { return mLastUseSeq; }
     /** @brief The chatd client */
     Client& client() const { return mClient; }
     Connection& connection() const { return mConnection; }
@@ -715,6 +890,12 @@ public:
     bool isDisabled() const { return mIsDisabled; }
     bool isFirstJoin() const { return mIsFirstJoin; }
     void disable(bool state) { mIsDisabled = state; }
+    /** @brief Whether the app is currently displaying this chat. Open chats
+     * are rejoined first after a reconnect */
+    bool isOpen() const { return mIsOpen; }
+    void setOpen(bool open);
+    /** @brief Whether there are messages in the send queue */
+    bool hasPendingSends() const { return !mSending.empty(); }
     /** The index of the oldest decrypted message in the RAM history buffer.
      * This will be greater than lownum() if there are not-yet-decrypted messages
      * at the start of the buffer, i.e. when more history has been fetched, but
@@ -741,6 +922,12 @@ public:
     void connect();
 
     void disconnect();
+    /** @brief If the chat was dormant and chatd has already replied to its
+     * JOINRANGEHIST, processes those replies, as if they had been received
+     * now. Must be called once the Chat object is fully set up, i.e. by the
+     * \c materialize callback of \c Client::addDormantChat(), after \c createChat()
+     * has returned. Does nothing otherwise */
+    void resumeDormantJoin();
     /** @brief The online state of the chatroom */
     ChatState onlineState() const { return mOnlineState; }
 
@@ -752,7 +939,7 @@ public:
       *  This can be used by the app to replace the text of messages who have
       * been edited before they have been sent/confirmed. Normally the app needs
       * to display the edited text in the unsent message.*/
-    const std::map<karere::Id, Message*>& pendingEdits() const { return mPendingEdits; }
+    const karere::FlatHashMap<karere::Id, Message*>& pendingEdits() const { return mPendingEdits; }
 
     /** @brief Whether the listener will be notified upon receiving
      * old history messages from the server.
@@ -797,9 +984,20 @@ public:
 
     /** @brief
      * Get the message with the specified index, or \c NULL if that
-     * index is out of range
+     * index is out of range. Evicted messages are loaded back from the db
      */
-    inline Message* findOrNull(Idx num) const
+    inline Message* findOrNull(Idx num)
+    {
+        Message* msg = findInRam(num);
+        if (msg || (mEvictedLownum == CHATD_IDX_INVALID) || (num < mEvictedLownum) || (num >= mForwardStart))
+            return msg;
+        loadEvicted(num);
+        return findInRam(num);
+    }
+
+    /** @brief Like \c findOrNull(), but returns \c NULL for evicted messages
+     * instead of loading them */
+    inline Message* findInRam(Idx num) const
     {
         if (num < mForwardStart) //look in mBackwardList
         {
@@ -821,7 +1019,7 @@ public:
      * @brief Returns the message at the specified index in the RAM history buffer.
      * Throws if index is out of range
      */
-    Message& at(Idx num) const
+    Message& at(Idx num)
     {
         Message* msg = findOrNull(num);
         if (!msg)
@@ -837,13 +1035,15 @@ public:
      * @brief Returns the message at the specified index in the RAM history buffer.
      * Throws if index is out of range
      */
-    Message& operator[](Idx num) const { return at(num); }
+    Message& operator[](Idx num) { return at(num); }
 
     /** @brief Returns whether the specified RAM history buffer index is valid or out
-     * of range
+     * of range. Evicted messages are considered to be in range
      */
     bool hasNum(Idx num) const
     {
+        if ((mEvictedLownum != CHATD_IDX_INVALID) && (num >= mEvictedLownum) && (num < mForwardStart))
+            return true;
         if (num < mForwardStart)
             return (static_cast<size_t>(mForwardStart - num) <= mBackwardList.size());
         else
@@ -855,12 +1055,14 @@ public:
      * @param msgid The message id whose index to find
      * @returns The index of the message inside the RAM history buffer.
      *  If no such message exists in the RAM history buffer, CHATD_IDX_INVALID
-     * is returned
+     * is returned. Evicted messages are looked up in the db
      */
     Idx msgIndexFromId(karere::Id msgid) const
     {
         auto it = mIdToIndexMap.find(msgid);
-        return (it == mIdToIndexMap.end()) ? CHATD_IDX_INVALID : it->second;
+        if (it != mIdToIndexMap.end())
+            return it->second;
+        return (mEvictedLownum == CHATD_IDX_INVALID) ? CHATD_IDX_INVALID : evictedMsgIndexFromId(msgid);
     }
 
     /**
@@ -1092,10 +1294,48 @@ protected:
     std::map<karere::Id, Connection*> mConnectionForChatId;
 /// maps chatids to the Message object
     std::map<karere::Id, std::shared_ptr<Chat>> mChatForChatId;
+    struct DormantChat
+    {
+        ChatDbInfo dbInfo;
+        std::function<void()> materialize;
+        std::function<void(ChatState)> onStateChange;
+        /// offline, joining once JOINRANGEHIST is sent, online after HISTDONE
+        ChatState state = kChatStateOffline;
+        DormantJoin join;
+        void setState(ChatState newState)
+        {
+            if (newState == state)
+                return;
+            state = newState;
+            if (onStateChange)
+            {
+                // the callback may create the Chat object, which removes this entry
+                auto callback = onStateChange;
+                callback(newState);
+            }
+        }
+    };
+/// chats whose Chat object has not been created yet, see addDormantChat()
+    std::map<karere::Id, DormantChat> mDormantChats;
+    /** Returns the entry of \c chatid if it is dormant and chatd has not
+     * completed its JOINRANGEHIST yet, so that the replies can be handled
+     * without creating its Chat object, otherwise null */
+    DormantChat* dormantJoiningChat(karere::Id chatid);
+    /** Switches the db to commit mode when all chats are online, including dormant ones */
+    void onChatOnline();
  // set of seen timers
     std::set<megaHandle> mSeenTimers;
     karere::Id mUserId;
     bool mMessageReceivedConfirmation = false;
+    size_t mChatMemoryLimit = 0;
+    /// the sum of Chat::historyBytes() of all chats
+    size_t mHistoryBytes = 0;
+    /// Message objects and send queue items of all chats are allocated from here
+    karere::SlabArena* mMsgArena;
+    size_t mTotalMemoryLimit = 0;
+    uint32_t mUseSeq = 0;
+    megaHandle mHistMemCheckTimer = 0;
+    void scheduleHistoryMemoryCheck();
     Connection& chatidConn(karere::Id chatid)
     {
         auto it = mConnectionForChatId.find(chatid);
@@ -1103,6 +1343,8 @@ protected:
             throw std::runtime_error("chatidConn: Unknown chatid "+chatid.toString());
         return *it->second;
     }
+    Connection* connectionForShard(int shardNo, const std::string& url);
+    Chat& materializeChat(karere::Id chatid);
     bool onMsgAlreadySent(karere::Id msgxid, karere::Id msgid);
     void msgConfirm(karere::Id msgxid, karere::Id msgid);
     void sendKeepalive();
@@ -1115,21 +1357,30 @@ public:
     karere::Client *karereClient;
     uint8_t mKeepaliveType = OP_KEEPALIVE;
     IRtcHandler* mRtcHandler = nullptr;
+    /** @brief If set, it is called instead of querying the API for the chatd URL
+     * of a chat. Allows to connect to a local chatd, i.e. the emulator used by
+     * the chatd benchmark */
+    std::function<std::string(karere::Id chatid, int shardNo)> urlProvider;
     karere::Id userId() const { return mUserId; }
     void setKeepaliveType(bool isInBackground);
     Client(karere::Client *client, karere::Id userId);
     ~Client();
+    /** @brief Returns the Chat object of the specified chat, or nullptr if
+     * the chat is unknown or dormant. Unlike \c chats(), it never creates the
+     * Chat object of a dormant chat */
     std::shared_ptr<Chat> chatFromId(karere::Id chatid) const
     {
         auto it = mChatForChatId.find(chatid);
         return (it == mChatForChatId.end()) ? nullptr : it->second;
     }
-    Chat& chats(karere::Id chatid) const
+    /** @brief Returns the Chat object of the specified chat. If the chat is
+     * dormant, its Chat object is created first */
+    Chat& chats(karere::Id chatid)
     {
         auto it = mChatForChatId.find(chatid);
-        if (it == mChatForChatId.end())
-            throw std::runtime_error("chatidChat: Unknown chatid "+chatid.toString());
-        return *it->second;
+        if (it != mChatForChatId.end())
+            return *it->second;
+        return materializeChat(chatid);
     }
     /** @brief Joins the specifed chatroom on the specified shard, using the specified
      * url, and assocuates the specified Listener and ICRypto instances
@@ -1137,6 +1388,32 @@ public:
      */
     Chat& createChat(karere::Id chatid, int shardNo, const std::string& url,
     Listener* listener, const karere::SetOfIds& initialUsers, ICrypto* crypto, uint32_t chatCreationTs, bool isGroup);
+    /** @brief Registers a chat without creating its Chat object, which is
+     * expensive - it loads the crypto keys and part of the history.
+     * A dormant chat is joined via JOINRANGEHIST, based on \c dbInfo. Its Chat
+     * object is created on first access via \c chats(), i.e. when the app
+     * opens the chat, or when chatd sends anything for it.
+     * @param dbInfo The local history range, as returned by DbInterface::getHistoryInfo().
+     * The chat must have local history and no queued messages,
+     * see \c ChatSummary::canBeDormant()
+     * @param materialize Called to create the Chat object. It must call
+     * \c createChat() for this chatid, with the same shard, and then
+     * \c Chat::resumeDormantJoin() on it
+     * @param onStateChange Called when the online state of the chat changes
+     * while it is dormant. The chat is joined without creating its Chat object,
+     * as long as chatd only sends the participants, SEEN, RECEIVED and HISTDONE
+     * for it, see \c dormantChatState()
+     */
+    void addDormantChat(karere::Id chatid, int shardNo, const std::string& url,
+        const ChatDbInfo& dbInfo, std::function<void()>&& materialize,
+        std::function<void(ChatState)>&& onStateChange=nullptr);
+    bool isDormant(karere::Id chatid) const { return mDormantChats.find(chatid) != mDormantChats.end(); }
+    size_t dormantChatCount() const { return mDormantChats.size(); }
+    /** @brief The online state of a dormant chat - offline, joining, or online
+     * once chatd has confirmed that there is no new history */
+    ChatState dormantChatState(karere::Id chatid) const;
+    /** @brief The equivalent of Chat::connect() for a dormant chat */
+    void connectDormantChat(karere::Id chatid);
     /** @brief Leaves the specified chatroom */
     void leave(karere::Id chatid);
     void disconnect();
@@ -1150,6 +1427,27 @@ public:
     /** Clean the timers set */
     void cancelTimers();
     bool isMessageReceivedConfirmationActive() const;
+    /** @brief The outbound traffic counters, summed over all shard connections */
+    Connection::OutputStats outputStats() const;
+    /** @brief Sets the limits of the memory used by the RAM history buffers of
+     * the chats, per chat and for all chats together. Zero means no limit.
+     * When a limit is exceeded, the oldest messages of the least recently used
+     * chats are evicted, see Chat::trimHistory() */
+    void setHistoryMemoryLimits(size_t chatLimit, size_t totalLimit);
+    /** @brief Checks the memory used by the RAM history buffers against the
+     * total limit, evicting messages from closed chats first, and then from the
+     * least recently used ones
+     * @returns The number of bytes freed */
+    size_t enforceHistoryMemoryLimit();
+    /** @brief Evicts from RAM all history that can be evicted, i.e. in reaction
+     * to a memory pressure signal from the OS. See Chat::trimHistory() for what
+     * is kept.
+     * @returns The number of bytes freed */
+    size_t trimHistoryMemory();
+    /** @brief The memory used by the RAM history buffers of all chats */
+    size_t historyBytes() const { return mHistoryBytes; }
+    /** @brief The arena of the Message objects of this client, see Message::operator new */
+    karere::SlabArena& msgArena() { return *mMsgArena; }
     friend class Connection;
     friend class Chat;
 
@@ -1174,15 +1472,6 @@ static inline const char* connStateToStr(Connection::State state)
     }
 }
 
-struct ChatDbInfo
-{
-    karere::Id oldestDbId;
-    karere::Id newestDbId;
-    Idx newestDbIdx;
-    karere::Id lastSeenId;
-    karere::Id lastRecvId;
-};
-
 class DbInterface
 {
 public:
@@ -1206,6 +1495,15 @@ public:
     virtual void updateMsgKeyIdInSending(uint64_t rowid, KeyId keyid) = 0;
     virtual void loadSendQueue(Chat::OutputQueue& queue) = 0;
     virtual void addMsgToHistory(const Message& msg, Idx idx) = 0;
+    /** @brief Adds a batch of messages, received in one history fetch, to the history db.
+     * The messages are in order of arrival, i.e. each one is adjacent to the
+     * range formed by the db history and the preceding messages of the batch.
+     * The default implementation just calls \c addMsgToHistory() for each message */
+    virtual void addMsgsToHistory(const Chat::HistBatch& msgs)
+    {
+        for (auto& item: msgs)
+            addMsgToHistory(*item.first, item.second);
+    }
     virtual void confirmKeyOfSendingItem(uint64_t rowid, KeyId keyid) = 0;
     virtual void updateMsgInHistory(karere::Id msgid, const Message& msg) = 0;
     virtual void getMessageDelta(karere::Id msgid, uint16_t *updated) = 0;
@@ -1224,6 +1522,13 @@ public:
     virtual bool haveAllHistory() = 0;
     virtual void getLastTextMessage(Idx from, chatd::LastTextMsgState& msg) = 0;
     virtual void clearHistory() = 0;
+    /// Persists the unread message count of the chat, as calculated with \c lastSeenId
+    /// as the last seen message, over the history that is in the db at that point
+    virtual void setUnreadCount(int count, karere::Id lastSeenId) = 0;
+    virtual void clearUnreadCount() = 0;
+    /// Returns false if there is no persisted count, or it was calculated for a
+    /// different last seen message or a different range of db history
+    virtual bool getUnreadCount(int& count, karere::Id lastSeenId) = 0;
     virtual ~DbInterface(){}
 };
 
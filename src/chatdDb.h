@@ -3,6 +3,8 @@
 
 #include "db.h"
 #include "chatd.h"
+#include "historyCompression.h"
+#include "messageSearch.h"
 //extern sqlite3* db;
 
 class ChatdSqliteDb: public chatd::DbInterface
@@ -12,9 +14,44 @@ protected:
     chatd::Chat& mChat;
     std::string mSendingTblName;
     std::string mHistTblName;
+    bool mCompress = false;
+    karere::MessageSearch* mSearch = nullptr;
 public:
+    static int isDeleted(const chatd::Message& msg) { return (msg.updated && msg.empty()) ? 1 : 0; }
     ChatdSqliteDb(chatd::Chat& chat, SqliteDb& db, const std::string& sendingTblName="sending", const std::string& histTblName="history")
         :mDb(db), mChat(chat), mSendingTblName(sendingTblName), mHistTblName(histTblName){}
+    /** @brief Enables compression of the payloads of the messages written to
+     * the history table. Rows are readable regardless of this setting, as
+     * each one records its format in the \c data_fmt column */
+    void setCompression(bool enabled) { mCompress = enabled; }
+    /** @brief Sets the search index that is updated together with the
+     * history table, or NULL if there is none */
+    void setSearch(karere::MessageSearch* search) { mSearch = search; }
+    /** Returns the payload of \c msg as to be stored in the \c data column,
+     * which is either \c msg itself or \c packed, and its format in \c fmt */
+    StaticBuffer packMsgData(const chatd::Message& msg, Buffer& packed, int& fmt) const
+    {
+        if (mCompress && chatd::compressMsgData(msg, packed))
+        {
+            fmt = chatd::kMsgDataDeflateDict1;
+            return StaticBuffer(packed.buf(), packed.dataSize());
+        }
+        fmt = chatd::kMsgDataRaw;
+        return StaticBuffer(msg.buf(), msg.dataSize());
+    }
+    /** Reads the message payload of a history row, stored in column
+     * \c dataCol with the format in column \c fmtCol */
+    static void msgDataCol(SqliteStmt& stmt, int dataCol, int fmtCol, Buffer& buf)
+    {
+        int fmt = stmt.intCol(fmtCol);
+        if (fmt == chatd::kMsgDataRaw)
+        {
+            stmt.blobCol(dataCol, buf);
+            return;
+        }
+        chatd::decompressMsgData(fmt, sqlite3_column_blob(stmt, dataCol),
+            sqlite3_column_bytes(stmt, dataCol), buf);
+    }
     virtual void getHistoryInfo(chatd::ChatDbInfo& info)
     {
         SqliteStmt stmt(mDb, "select min(idx), max(idx) from history where chatid=?1");
@@ -46,7 +83,7 @@ public:
     }
     void assertAffectedRowCount(int count, const char* opname=nullptr)
     {
-        auto actual = sqlite3_changes(mDb);
+        auto actual = mDb.changes();
         if (actual == count)
             return;
         std::string msg;
@@ -68,7 +105,7 @@ public:
                          "recipients, backrefid, backrefs) values(?,?,?,?,?,?,?,?,?,?)",
             (uint64_t)mChat.chatId(), item.opcode(), msg->ts, msg->id(),
             *msg, msg->type, msg->updated, rcpts, msg->backRefId, msg->backrefBuf());
-        item.rowid = sqlite3_last_insert_rowid(mDb);
+        item.rowid = mDb.lastInsertRowid();
     }
     virtual void updateMsgInSending(const chatd::Chat::SendingItem& item)
     {
@@ -118,43 +155,171 @@ public:
         mDb.query("update sending set keyid = ? where rowid = ?", keyid, rowid);
         assertAffectedRowCount(1, "updateMsgKeyIdInSending");
     }
-    virtual void addMsgToHistory(const chatd::Message& msg, chatd::Idx idx)
+    /** The history discontinuity checks read the db, which in write-behind
+     * mode would execute the queued writes synchronously, so in that mode they
+     * are done by the writer thread instead, see checkHistoryAdjacent() */
+    bool historyChecksEnabled() const
     {
-#if 1
-        SqliteStmt stmt(mDb, "select min(idx), max(idx), count(*) from history where chatid = ?");
-        stmt << mChat.chatId();
+        return !mDb.asyncWrites();
+    }
+    /** The discontinuity check of addMsgToHistory(), for a queued history insert,
+     * done by the writer thread. The values are in the column order of
+     * insertHistoryRow(). Uses only the (chatid, idx) index, unlike count(*) */
+    static void checkHistoryAdjacent(SqliteDb& db, const std::vector<SqliteDb::QueuedValue>& values)
+    {
+        enum { kIdxCol = 0, kChatidCol = 1 };
+        int64_t idx = values[kIdxCol].intVal;
+        SqliteStmt stmt(db, "select min(idx), max(idx) from history where chatid = ?");
+        stmt << values[kChatidCol].intVal;
         stmt.step();
-        int low = stmt.intCol(0);
-        int high = stmt.intCol(1);
-        int count = stmt.intCol(2);
-        if ((count > 0) && (idx != low-1) && (idx != high+1))
+        if (sqlite3_column_type(stmt, 0) == SQLITE_NULL)
+            return; //no history yet
+        int64_t low = stmt.int64Col(0);
+        int64_t high = stmt.int64Col(1);
+        if ((idx == low-1) || (idx == high+1))
+            return;
+        throw std::runtime_error("chatid "+karere::Id(values[kChatidCol].intVal).toString()
+            +": history discontinuity detected: index of added msg is not adjacent to neither "
+            "end of db history: add idx="+std::to_string(idx)+", histlow="+std::to_string(low)
+            +", histhigh="+std::to_string(high));
+    }
+    /** Compresses the payload of a queued history insert, on the thread that
+     * executes it. The values are in the column order of insertHistoryRow() */
+    static void compressQueuedRow(std::vector<SqliteDb::QueuedValue>& values)
+    {
+        enum { kDataCol = 8, kFmtCol = 11 };
+        auto& data = values[kDataCol];
+        if (data.type != SqliteDb::QueuedValue::kBlob)
+            return;
+        Buffer packed;
+        if (!chatd::compressMsgData(StaticBuffer(data.data.data(), data.data.size()), packed))
+            return;
+        data.data.assign(packed.buf(), packed.dataSize());
+        values[kFmtCol].intVal = chatd::kMsgDataDeflateDict1;
+    }
+    void insertHistoryRow(const chatd::Message& msg, chatd::Idx idx)
+    {
+        // In write-behind mode, the payload is compressed and the row checked
+        // by the writer thread. A duplicate row is not inserted, and is
+        // reported as an unexpected number of changed rows
+        SqliteDb::QueryHooks hooks;
+        hooks.prepare = mCompress ? compressQueuedRow : nullptr;
+        hooks.verify = historyChecksEnabled() ? nullptr : checkHistoryAdjacent;
+        hooks.expectedChanges = 1;
+        mDb.queryAsyncEx(hooks, "insert or ignore into history"
+            "(idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_deleted, data_fmt) "
+            "values(?,?,?,?,?,?,?,?,?,?,?,?)", idx, mChat.chatId(), msg.id(), msg.keyid,
+            msg.type, msg.userid, msg.ts, msg.updated, StaticBuffer(msg.buf(), msg.dataSize()),
+            msg.backRefId, isDeleted(msg), (int)chatd::kMsgDataRaw);
+        if (mSearch)
+            mSearch->indexMsg(mChat.chatId(), msg, true);
+    }
+    virtual void addMsgToHistory(const chatd::Message& msg, chatd::Idx idx)
+    {
+        if (historyChecksEnabled())
         {
-            CHATD_LOG_ERROR("chatid %s: addMsgToHistory: history discontinuity detected: "
-                "index of added msg %s is not adjacent to neither end of db history: "
-                "add idx=%d, histlow=%d, histhigh=%d, histcount= %d, fwdStart=%d, lownum=%d, highnum=%d",
-                mChat.chatId().toString().c_str(), msg.id().toString().c_str(),
-                idx, low, high, count, mChat.forwardStart(), mChat.lownum(), mChat.highnum());
-            assert(false);
+            SqliteStmt stmt(mDb, "select min(idx), max(idx), count(*) from history where chatid = ?");
+            stmt << mChat.chatId();
+            stmt.step();
+            int low = stmt.intCol(0);
+            int high = stmt.intCol(1);
+            int count = stmt.intCol(2);
+            if ((count > 0) && (idx != low-1) && (idx != high+1))
+            {
+                CHATD_LOG_ERROR("chatid %s: addMsgToHistory: history discontinuity detected: "
+                    "index of added msg %s is not adjacent to neither end of db history: "
+                    "add idx=%d, histlow=%d, histhigh=%d, histcount= %d, fwdStart=%d, lownum=%d, highnum=%d",
+                    mChat.chatId().toString().c_str(), msg.id().toString().c_str(),
+                    idx, low, high, count, mChat.forwardStart(), mChat.lownum(), mChat.highnum());
+                assert(false);
+            }
         }
-#endif
-        mDb.query("insert into history"
-            "(idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid) "
-            "values(?,?,?,?,?,?,?,?,?,?)", idx, mChat.chatId(), msg.id(), msg.keyid,
-            msg.type, msg.userid, msg.ts, msg.updated, msg, msg.backRefId);
+        insertHistoryRow(msg, idx);
+    }
+    virtual void addMsgsToHistory(const chatd::Chat::HistBatch& msgs)
+    {
+        if (msgs.empty())
+            return;
+        // Check the whole batch for discontinuities with a single query
+        if (historyChecksEnabled())
+        {
+            SqliteStmt stmt(mDb, "select min(idx), max(idx), count(*) from history where chatid = ?");
+            stmt << mChat.chatId();
+            stmt.step();
+            int low = stmt.intCol(0);
+            int high = stmt.intCol(1);
+            int count = stmt.intCol(2);
+            for (auto& item: msgs)
+            {
+                chatd::Idx idx = item.second;
+                if (count == 0)
+                {
+                    low = high = idx;
+                }
+                else if (idx == low-1)
+                {
+                    low = idx;
+                }
+                else if (idx == high+1)
+                {
+                    high = idx;
+                }
+                else
+                {
+                    CHATD_LOG_ERROR("chatid %s: addMsgsToHistory: history discontinuity detected: "
+                        "index of added msg %s is not adjacent to neither end of db history: "
+                        "add idx=%d, histlow=%d, histhigh=%d, histcount= %d, fwdStart=%d, lownum=%d, highnum=%d",
+                        mChat.chatId().toString().c_str(), item.first->id().toString().c_str(),
+                        idx, low, high, count, mChat.forwardStart(), mChat.lownum(), mChat.highnum());
+                    assert(false);
+                }
+                count++;
+            }
+        }
+        // In write-behind mode, the rows are queued, and executed by the writer
+        // thread in a group transaction. Otherwise, if we are not inside the
+        // timed-commit transaction, make the batch one transaction
+        bool ownTransaction = !mDb.asyncWrites() && (sqlite3_get_autocommit(mDb) != 0);
+        if (ownTransaction)
+            mDb.simpleQuery("BEGIN TRANSACTION");
+        for (auto& item: msgs)
+        {
+            try
+            {
+                insertHistoryRow(*item.first, item.second);
+            }
+            catch(std::exception& e)
+            {
+                // i.e. a message that is already in the db. Only that row is lost
+                CHATD_LOG_ERROR("chatid %s: addMsgsToHistory: error inserting msg %s with idx %d:\n%s",
+                    mChat.chatId().toString().c_str(), item.first->id().toString().c_str(),
+                    item.second, e.what());
+            }
+        }
+        if (ownTransaction)
+            mDb.simpleQuery("COMMIT TRANSACTION");
     }
     virtual void updateMsgInHistory(karere::Id msgid, const chatd::Message& msg)
     {
+        Buffer packed;
+        int fmt;
+        StaticBuffer data = packMsgData(msg, packed, fmt);
+        // the edited message may not be searchable anymore, i.e. if deleted
+        if (mSearch)
+            mSearch->unindexMsg(mChat.chatId(), msgid);
         if (msg.type == chatd::Message::kMsgTruncate)
         {
-            mDb.query("update history set type = ?, data = ?, ts = ?, userid = ? where chatid = ? and msgid = ?",
-                msg.type, msg, msg.ts, msg.userid, mChat.chatId(), msgid);
+            mDb.query("update history set type = ?, data = ?, data_fmt = ?, ts = ?, userid = ?, is_deleted = ? where chatid = ? and msgid = ?",
+                msg.type, data, fmt, msg.ts, msg.userid, isDeleted(msg), mChat.chatId(), msgid);
         }
         else    // "updated" instead of "ts"
         {
-            mDb.query("update history set type = ?, data = ?, updated = ?, userid = ? where chatid = ? and msgid = ?",
-                msg.type, msg, msg.updated, msg.userid, mChat.chatId(), msgid);
+            mDb.query("update history set type = ?, data = ?, data_fmt = ?, updated = ?, userid = ?, is_deleted = ? where chatid = ? and msgid = ?",
+                msg.type, data, fmt, msg.updated, msg.userid, isDeleted(msg), mChat.chatId(), msgid);
         }
         assertAffectedRowCount(1, "updateMsgInHistory");
+        if (mSearch)
+            mSearch->indexMsg(mChat.chatId(), msg);
     }
 
     virtual void getMessageDelta(karere::Id msgid, uint16_t *updated)
@@ -178,7 +343,7 @@ public:
             assert((opcode == chatd::OP_NEWMSG) || (opcode == chatd::OP_MSGUPD)
                    || (opcode == chatd::OP_MSGUPDX));
 
-            auto msg = new chatd::Message(stmt.int64Col(2), mChat.client().userId(),
+            auto msg = new (mChat.client().msgArena()) chatd::Message(stmt.int64Col(2), mChat.client().userId(),
                     stmt.intCol(6), stmt.intCol(7), nullptr, 0, true, (chatd::KeyId)stmt.intCol(3),
                     (unsigned char)stmt.intCol(5));
             stmt.blobCol(4, *msg);
@@ -196,7 +361,7 @@ public:
     }
     virtual void fetchDbHistory(chatd::Idx idx, unsigned count, std::vector<chatd::Message*>& messages)
     {
-        SqliteStmt stmt(mDb, "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated from history "
+        SqliteStmt stmt(mDb, "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, data_fmt from history "
             "where chatid = ?1 and idx <= ?2 order by idx desc limit ?3");
         stmt << mChat.chatId() << idx << count;
         int i = 0;
@@ -208,7 +373,7 @@ public:
             unsigned ts = stmt.uintCol(2);
             chatd::KeyId keyid = stmt.uintCol(6);
             Buffer buf;
-            stmt.blobCol(4, buf);
+            msgDataCol(stmt, 4, 9, buf);
 #ifndef NDEBUG
             auto idx = stmt.intCol(5);
             if(idx != mChat.lownum()-1-(int)messages.size()) //we go backward in history, hence the -messages.size()
@@ -219,7 +384,7 @@ public:
                 assert(false);
             }
 #endif
-            auto msg = new chatd::Message(msgid, userid, ts, stmt.intCol(8), std::move(buf),
+            auto msg = new (mChat.client().msgArena()) chatd::Message(msgid, userid, ts, stmt.intCol(8), std::move(buf),
                 false, keyid, (unsigned char)stmt.intCol(3));
             msg->backRefId = stmt.uint64Col(7);
             messages.push_back(msg);
@@ -234,8 +399,10 @@ public:
     virtual chatd::Idx getPeerMsgCountAfterIdx(chatd::Idx idx)
     {
         // get the unread messages count --> conditions should match the ones in Chat::unreadMsgCount()
+        // is_deleted is (updated != 0 and length(data) = 0), precomputed so that
+        // the count is served entirely from the history_unread index
         std::string sql = "select count(*) from history where (chatid = ?)"
-                "and (userid != ?) and (type != ?) and not (updated != 0 and length(data) = 0 )";
+                "and (userid != ?) and (type != ?) and (is_deleted = 0)";
         if (idx != CHATD_IDX_INVALID)
             sql+=" and (idx > ?)";
 
@@ -263,7 +430,7 @@ public:
         {
             Buffer buf;
             stmt.blobCol(5, buf);
-            auto msg = new chatd::Message(stmt.uint64Col(1), mChat.client().userId(),
+            auto msg = new (mChat.client().msgArena()) chatd::Message(stmt.uint64Col(1), mChat.client().userId(),
                 stmt.int64Col(3), stmt.intCol(4), std::move(buf), true,
                 CHATD_KEYID_INVALID, (unsigned char)stmt.intCol(2));
             items.emplace_back(msg, stmt.uint64Col(0), stmt.intCol(6), (chatd::ManualSendReason)stmt.intCol(7));
@@ -272,7 +439,7 @@ public:
     virtual bool deleteManualSendItem(uint64_t rowid)
     {
         mDb.query("delete from manual_sending where rowid = ?", rowid);
-        return sqlite3_changes(mDb) != 0;
+        return mDb.changes() != 0;
     }
     virtual void loadManualSendItem(uint64_t rowid, chatd::Chat::ManualSendItem& item)
     {
@@ -283,7 +450,7 @@ public:
 
         Buffer buf;
         stmt.blobCol(4, buf);
-        auto msg = new chatd::Message(stmt.uint64Col(0), mChat.client().userId(),
+        auto msg = new (mChat.client().msgArena()) chatd::Message(stmt.uint64Col(0), mChat.client().userId(),
                                       stmt.int64Col(2), stmt.intCol(3), std::move(buf), true,
                                       CHATD_KEYID_INVALID, (unsigned char)stmt.intCol(1));
         item.msg = msg;
@@ -296,6 +463,8 @@ public:
         auto idx = getIdxOfMsgid(msg.id());
         if (idx == CHATD_IDX_INVALID)
             throw std::runtime_error("dbInterface::truncateHistory: msgid "+msg.id().toString()+" does not exist in db");
+        if (mSearch)
+            mSearch->unindexChat(mChat.chatId(), idx);
         mDb.query("delete from history where chatid = ? and idx < ?", mChat.chatId(), idx);
 #if 1
         SqliteStmt stmt(mDb, "select type from history where chatid=? and msgid=?");
@@ -316,20 +485,67 @@ public:
     }
     virtual void setLastSeen(karere::Id msgid)
     {
-        mDb.query("update chats set last_seen=? where chatid=?", msgid, mChat.chatId());
-        assertAffectedRowCount(1);
+        SqliteDb::QueryHooks hooks;
+        hooks.expectedChanges = 1;
+        mDb.queryAsyncEx(hooks, "update chats set last_seen=? where chatid=?", msgid, mChat.chatId());
     }
     virtual void setLastReceived(karere::Id msgid)
     {
-        mDb.query("update chats set last_recv=? where chatid=?", msgid, mChat.chatId());
-        assertAffectedRowCount(1);
+        SqliteDb::QueryHooks hooks;
+        hooks.expectedChanges = 1;
+        mDb.queryAsyncEx(hooks, "update chats set last_recv=? where chatid=?", msgid, mChat.chatId());
     }
     virtual void setHaveAllHistory()
     {
-        mDb.query(
+        mDb.queryAsync(
             "insert or replace into chat_vars(chatid, name, value) "
             "values(?, 'have_all_history', '1')", mChat.chatId());
     }
+    /** The count is stored as "count:lastSeenId:lowIdx:highIdx", where lowIdx and
+     * highIdx are the range of db history when it's written. The count is not
+     * written for every received message, so if the history range has changed
+     * since, the count is stale. The range is taken by the query itself, so in
+     * write-behind mode it includes the history writes queued before it */
+    virtual void setUnreadCount(int count, karere::Id lastSeenId)
+    {
+        std::string val = std::to_string(count);
+        val.append(":").append(std::to_string(lastSeenId.val)).append(":");
+        mDb.queryAsync(
+            "insert or replace into chat_vars(chatid, name, value) "
+            "select ?1, 'unread_count', ?2 || ifnull(min(idx), '') || ':' || ifnull(max(idx), '') "
+            "from history where chatid = ?1", mChat.chatId(), val);
+    }
+    /** Parses a value written by setUnreadCount(), returns false if it's not valid
+     * for the last seen message \c lastSeenId and the history range \c low - \c high */
+    static bool parseUnreadCount(const std::string& val, karere::Id lastSeenId,
+        bool haveHistory, int low, int high, int& count)
+    {
+        int readCount;
+        unsigned long long readSeenId;
+        int readLow, readHigh;
+        int fields = sscanf(val.c_str(), "%d:%llu:%d:%d", &readCount, &readSeenId, &readLow, &readHigh);
+        if (fields < 2 || readSeenId != lastSeenId.val)
+            return false;
+        if (haveHistory ? ((fields != 4) || (readLow != low) || (readHigh != high)) : (fields != 2))
+            return false;
+        count = readCount;
+        return true;
+    }
+    virtual void clearUnreadCount()
+    {
+        mDb.queryAsync("delete from chat_vars where chatid = ? and name='unread_count'", mChat.chatId());
+    }
+    virtual bool getUnreadCount(int& count, karere::Id lastSeenId)
+    {
+        SqliteStmt stmt(mDb, "select value, (select min(idx) from history where chatid=?1), "
+            "(select max(idx) from history where chatid=?1) "
+            "from chat_vars where chatid=?1 and name='unread_count'");
+        stmt << mChat.chatId();
+        if (!stmt.step())
+            return false;
+        return parseUnreadCount(stmt.stringCol(0), lastSeenId,
+            sqlite3_column_type(stmt, 1) != SQLITE_NULL, stmt.intCol(1), stmt.intCol(2), count);
+    }
     virtual bool haveAllHistory()
     {
         SqliteStmt stmt(mDb,
@@ -340,7 +556,7 @@ public:
     virtual void getLastTextMessage(chatd::Idx from, chatd::LastTextMsgState& msg)
     {
         SqliteStmt stmt(mDb,
-            "select type, idx, data, msgid, userid from history where chatid=? and "
+            "select type, idx, data, msgid, userid, data_fmt from history where chatid=? and "
             "(type=1 or type >= 16) and (idx <= ?) and length(data) > 0 "
             "order by idx desc limit 1");
         stmt << mChat.chatId() << from;
@@ -350,14 +566,76 @@ public:
             return;
         }
         Buffer buf(128);
-        stmt.blobCol(2, buf);
+        msgDataCol(stmt, 2, 5, buf);
         msg.assign(buf, stmt.intCol(0), stmt.uint64Col(3), stmt.intCol(1), stmt.uint64Col(4));
     }
 
+    /** @brief Loads the \c ChatSummary of all chats with a single query, instead
+     * of the several per-chat queries done when a chatd::Chat is created */
+    static void loadChatSummaries(SqliteDb& db, std::map<karere::Id, chatd::ChatSummary>& summaries)
+    {
+        SqliteStmt stmt(db,
+            "select c.chatid, c.ts_created, c.last_seen, c.last_recv, "
+            "lo.msgid, hi.idx, hi.msgid, hi.ts, "
+            "unread.value, allhist.value is not null, "
+            "exists(select 1 from sending where chatid = c.chatid), "
+            "txt.type, txt.idx, txt.data, txt.msgid, txt.userid, txt.data_fmt, lo.idx "
+            "from chats c "
+            "left join history lo on lo.chatid = c.chatid and "
+            "  lo.idx = (select min(idx) from history where chatid = c.chatid) "
+            "left join history hi on hi.chatid = c.chatid and "
+            "  hi.idx = (select max(idx) from history where chatid = c.chatid) "
+            "left join history txt on txt.chatid = c.chatid and "
+            "  txt.idx = (select idx from history where chatid = c.chatid and "
+            "    (type=1 or type >= 16) and length(data) > 0 order by idx desc limit 1) "
+            "left join chat_vars unread on unread.chatid = c.chatid and unread.name = 'unread_count' "
+            "left join chat_vars allhist on allhist.chatid = c.chatid and "
+            "  allhist.name = 'have_all_history' and allhist.value = '1'");
+        while (stmt.step())
+        {
+            auto& summary = summaries[stmt.uint64Col(0)];
+            auto& info = summary.dbInfo;
+            info.lastSeenId = stmt.uint64Col(2);
+            info.lastRecvId = stmt.uint64Col(3);
+            summary.lastMsgTs = stmt.uintCol(1);
+            if (sqlite3_column_type(stmt, 5) != SQLITE_NULL) //have local history
+            {
+                info.oldestDbId = stmt.uint64Col(4);
+                info.newestDbIdx = stmt.intCol(5);
+                info.newestDbId = stmt.uint64Col(6);
+                if (stmt.uintCol(7) > summary.lastMsgTs)
+                    summary.lastMsgTs = stmt.uintCol(7);
+            }
+            else
+            {
+                info.newestDbIdx = CHATD_IDX_INVALID;
+            }
+            if (sqlite3_column_type(stmt, 8) != SQLITE_NULL)
+            {
+                // same validity check as in getUnreadCount()
+                int count;
+                if (parseUnreadCount(stmt.stringCol(8), info.lastSeenId,
+                    sqlite3_column_type(stmt, 5) != SQLITE_NULL, stmt.intCol(17), stmt.intCol(5), count))
+                {
+                    summary.unreadCount = count;
+                }
+            }
+            summary.haveAllHistory = stmt.intCol(9) != 0;
+            summary.hasPendingSends = stmt.intCol(10) != 0;
+            if (sqlite3_column_type(stmt, 11) != SQLITE_NULL)
+            {
+                Buffer buf(128);
+                msgDataCol(stmt, 13, 16, buf);
+                summary.lastTextMsg.assign(buf, stmt.intCol(11), stmt.uint64Col(14), stmt.intCol(12), stmt.uint64Col(15));
+            }
+        }
+    }
     virtual void clearHistory()
     {
+        if (mSearch)
+            mSearch->unindexChat(mChat.chatId());
         mDb.query("delete from history where chatid = ?", mChat.chatId());
-        mDb.query("delete from chat_vars where chatid = ? and name='have_all_history'", mChat.chatId());
+        mDb.query("delete from chat_vars where chatid = ? and (name='have_all_history' or name='unread_count')", mChat.chatId());
     }
 };
 
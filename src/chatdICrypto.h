@@ -20,6 +20,7 @@ class ICrypto
     
 public:
     ICrypto(void *ctx) : appCtx(ctx) {}
+    void* getAppCtx() const { return appCtx; }
     
     virtual void setUsers(karere::SetOfIds* users) = 0;
 
@@ -73,21 +74,46 @@ public:
      */
     virtual promise::Promise<Message*> msgDecrypt(Message* src) = 0;
 
+    /**
+     * @brief Called by the client to decrypt a batch of received old history
+     * messages. Returns one promise per message, in the same order as \c msgs.
+     * The crypto module may decrypt the messages in any order, and in parallel,
+     * the client passes them on in index order. The default implementation
+     * calls \c msgDecrypt() for each message.
+     */
+    virtual std::vector<promise::Promise<Message*>>
+    msgDecryptBatch(const std::vector<Message*>& msgs)
+    {
+        std::vector<promise::Promise<Message*>> result;
+        result.reserve(msgs.size());
+        for (auto msg: msgs)
+        {
+            result.push_back(msgDecrypt(msg));
+        }
+        return result;
+    }
+
     /**
      * @brief The chatroom connection (to the chatd server shard) state state has changed.
      */
     virtual void onOnlineStateChange(ChatState state){}
 
     /**
-     * @brief A user has joined, or their privilege has changed
-     * @param privilege - the new privilege, if it is PRIV_NOTPRESENT, then the user
-     * left the chat
+     * @brief A user has joined the chat. Not called for privilege changes of
+     * existing participants, as they don't require a new send key
      */
     virtual void onUserJoin(karere::Id userid){}
 
     /**  @brief A user has left the room */
     virtual void onUserLeave(karere::Id userid){}
 
+    /**
+     * @brief The member list of the chat is known, after joining it. The crypto
+     * module should start fetching whatever it needs from the participants, so
+     * that decrypting the history received next does not wait for it
+     */
+    virtual void prefetchUserKeys(){}
+
     /**
     * @brief A key was received from the server, and added to Chat.keys
     */
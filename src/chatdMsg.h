@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <string>
 #include <buffer.h>
+#include <base/slabAllocator.h>
 #include "karereId.h"
 
 enum { CHATD_KEYID_INVALID = 0, CHATD_KEYID_UNCONFIRMED = 0xffffffff };
@@ -402,6 +403,9 @@ protected:
     uint8_t mIsEncrypted = 0; //0 = not encrypted, 1 = encrypted, 2 = encrypted, there was a decrypt error
     uint8_t mFlags = 0;
 public:
+    /** The bytes of this message that are included in the memory counters of
+     * its chat, see Chat::liveBytes() */
+    uint32_t accountedBytes = 0;
     karere::Id userid;
     uint32_t ts;
     uint16_t updated;
@@ -416,6 +420,33 @@ public:
     uint8_t isEncrypted() const { return mIsEncrypted; }
     void setEncrypted(uint8_t encrypted) { mIsEncrypted = encrypted; }
     void setId(karere::Id aId, bool isXid) { mId = aId; mIdIsXid = isXid; }
+    /** Message objects are allocated from slabs, as a client may hold hundreds of
+     * thousands of them. The messages of a chatd::Client are allocated from its
+     * arena via the placement form, others from the shared arena.
+     * The content buffer is malloc()-ed as usual */
+    static void* operator new(size_t size)
+    {
+        return operator new(size, karere::SlabArena::shared());
+    }
+    static void* operator new(size_t size, karere::SlabArena& arena)
+    {
+        if (!karere::SlabArena::fits(size))
+            return ::operator new(size);
+        return arena.alloc(size);
+    }
+    static void operator delete(void* ptr, size_t size)
+    {
+        if (!karere::SlabArena::fits(size))
+            ::operator delete(ptr);
+        else
+            karere::SlabArena::free(ptr);
+    }
+    static void operator delete(void* ptr, karere::SlabArena&)
+    {
+        operator delete(ptr, sizeof(Message));
+    }
+    /** @brief The memory in bytes used by this message, including its content buffer */
+    size_t liveBytes() const { return sizeof(Message) + mBufSize + backRefs.capacity()*sizeof(BackRefId); }
     explicit Message(karere::Id aMsgid, karere::Id aUserid, uint32_t aTs, uint16_t aUpdated,
           Buffer&& buf, bool aIsSending=false, KeyId aKeyid=CHATD_KEYID_INVALID,
           unsigned char aType=kMsgNormal, void* aUserp=nullptr)
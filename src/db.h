@@ -2,6 +2,28 @@
 #define _KARERE_DB_H
 
 #include <sqlite3.h>
+#include <string>
+#include <list>
+#include <deque>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+#if defined(__linux__)
+    #include <sys/resource.h>
+#elif defined(__APPLE__)
+    #include <pthread.h>
+#elif defined(_WIN32)
+    #include <windows.h>
+#endif
+#include "karereCommon.h"
 
 struct SqliteString
 {
@@ -16,8 +38,85 @@ struct SqliteString
 };
 class SqliteStmt;
 
+/** @brief An error returned by sqlite, with its result code */
+class SqliteError: public std::runtime_error
+{
+protected:
+    int mCode;
+public:
+    /** Codes of errors detected by SqliteDb itself, not by sqlite */
+    enum: int
+    {
+        kUnexpectedChanges = -1, ///< A write changed an unexpected number of rows
+        kVerifyFailed = -2 ///< The verification of a queued write failed, see SqliteDb::QueryHooks
+    };
+    SqliteError(const std::string& msg, int code): std::runtime_error(msg), mCode(code) {}
+    /** The sqlite result code, i.e. SQLITE_CONSTRAINT, or one of the codes above */
+    int code() const { return mCode; }
+};
+
+/** @brief Settings applied by SqliteDb::open() */
+struct SqliteDbOptions
+{
+    /** Use the write-ahead log instead of the rollback journal. Readers
+     * (i.e. other connections on other threads) don't block the writer,
+     * and commits don't need to rewrite the db file */
+    bool wal = true;
+    /** synchronous=NORMAL: commits are not fsync-ed, only checkpoints are.
+     * In WAL mode this can't corrupt the db, but the last transactions
+     * may be lost on power failure. Otherwise synchronous=FULL */
+    bool syncNormal = true;
+    /** Page cache size, in kB. Zero keeps the sqlite default (2 MB) */
+    int cacheSizeKb = 8*1024;
+    /** Max bytes of the db file accessed via memory mapping. Zero disables it */
+    int64_t mmapSize = 0;
+    bool readOnly = false;
+};
+
 class SqliteDb
 {
+public:
+    /** @brief A bound value of a queued write. Owns its data, as the write is
+     * executed after the caller's arguments are gone */
+    struct QueuedValue
+    {
+        enum Type: uint8_t { kNull, kInt, kInt64, kText, kBlob };
+        Type type = kNull;
+        int64_t intVal = 0;
+        std::string data;
+    };
+    typedef SqliteDbOptions Options;
+    /** @brief What is done around the execution of a write, on the thread that
+     * executes it, see queryAsyncEx() */
+    struct QueryHooks
+    {
+        /** Transforms the bound values before binding them */
+        void(*prepare)(std::vector<QueuedValue>& values) = nullptr;
+        /** Verifies the state of the db before the write. A verification that throws
+         * is reported to the write error handler, with code
+         * SqliteError::kVerifyFailed, and the write is executed anyway */
+        void(*verify)(SqliteDb& db, const std::vector<QueuedValue>& values) = nullptr;
+        /** The number of rows that the write must change, or -1 for any. A
+         * mismatch is an error with code SqliteError::kUnexpectedChanges */
+        int expectedChanges = -1;
+        /** Executes the write only if the write executed before it changed any
+         * rows, i.e. for a write that derives from a row the previous one
+         * may have not inserted */
+        bool ifPrevChanged = false;
+    };
+    struct QueuedWrite
+    {
+        enum Kind: uint8_t { kQuery, kCommit, kSetCommitMode };
+        Kind kind;
+        bool commitEach = false; //for kSetCommitMode
+        QueryHooks hooks;
+        std::string sql;
+        std::vector<QueuedValue> values;
+        QueuedWrite(Kind aKind): kind(aKind) {}
+    };
+    /** Called with the sql (or "COMMIT"), the sqlite error code and the error
+     * message of a queued write that failed, on the thread that executed it */
+    typedef std::function<void(const std::string& sql, int errCode, const std::string& errMsg)> WriteErrorHandler;
 protected:
     friend class SqliteStmt;
     sqlite3* mDb = nullptr;
@@ -25,30 +124,266 @@ protected:
     bool mHasOpenTransaction = false;
     uint16_t mCommitInterval = 20;
     time_t mLastCommitTs = 0;
+    int mLastChanges = 0;
+    int64_t mLastInsertRowid = 0;
+    /** Rows changed by the last write executed by execQuery(), or 0 if it failed.
+     * Used only by the thread that executes the writes */
+    int mPrevWriteChanges = 0;
+    /** Write-behind mode, see setAsyncWrites(). The connection is shared by the
+     * caller (the karere thread) and the writer thread, and every use of it is
+     * serialized by mDbMutex, which is recursive as statements may be nested.
+     * Before any synchronous access by the caller, the queued writes are
+     * executed, so that the caller always reads its own writes
+     */
+    std::atomic<bool> mAsyncWrites;
+    std::recursive_mutex mDbMutex;
+    std::mutex mQueueMutex;
+    std::condition_variable mQueueCv;
+    std::deque<QueuedWrite> mWriteQueue;
+    std::thread mWriterThread;
+    std::atomic<std::thread::id> mWriterThreadId;
+    bool mWriterExit = false;
+    bool mExecutingQueue = false; //guarded by mDbMutex
+    std::atomic<uint64_t> mQueuedWriteCount;
+    std::atomic<uint64_t> mInlineWriteCount;
+    std::atomic<uint64_t> mWriteErrorCount;
+    WriteErrorHandler mWriteErrorHandler; //only changed while write-behind mode is off
+    bool mWal = false;
+    std::atomic<int> mWalPages; //pages in the WAL file after the last commit
+    std::atomic<uint64_t> mCheckpointCount;
+    static int walHookCb(void* userp, sqlite3* db, const char* dbName, int pages)
+    {
+        static_cast<SqliteDb*>(userp)->mWalPages = pages;
+        return SQLITE_OK;
+    }
+    /** Prepared statement cache, keyed by the sql text. Statements that are
+     * currently in use by a SqliteStmt are checked out of the cache, so two live
+     * SqliteStmt objects never share the same sqlite3_stmt. Eviction is LRU,
+     * the most recently returned statement is at the front of the list.
+     */
+    typedef std::list<std::pair<std::string, sqlite3_stmt*>> StmtLru;
+    StmtLru mStmtLru;
+    std::unordered_map<std::string, StmtLru::iterator> mStmtCache;
+    size_t mStmtCacheMaxSize = kStmtCacheDefaultSize;
+    // counted by both the caller and the writer thread
+    std::atomic<uint64_t> mStmtCacheHits;
+    std::atomic<uint64_t> mStmtCacheMisses;
     inline int step(SqliteStmt& stmt);
+    sqlite3_stmt* stmtCacheCheckout(const std::string& sql)
+    {
+        auto it = mStmtCache.find(sql);
+        if (it == mStmtCache.end())
+        {
+            mStmtCacheMisses++;
+            return nullptr;
+        }
+        mStmtCacheHits++;
+        auto stmt = it->second->second;
+        mStmtLru.erase(it->second);
+        mStmtCache.erase(it);
+        return stmt;
+    }
+    void stmtCacheReturn(std::string&& sql, sqlite3_stmt* stmt)
+    {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        if (!mDb || !mStmtCacheMaxSize || mStmtCache.count(sql))
+        {
+            sqlite3_finalize(stmt);
+            return;
+        }
+        mStmtLru.emplace_front(std::move(sql), stmt);
+        mStmtCache.emplace(mStmtLru.front().first, mStmtLru.begin());
+        stmtCacheTrim(mStmtCacheMaxSize);
+    }
+    void stmtCacheTrim(size_t maxSize)
+    {
+        while (mStmtLru.size() > maxSize)
+        {
+            auto& entry = mStmtLru.back();
+            sqlite3_finalize(entry.second);
+            mStmtCache.erase(entry.first);
+            mStmtLru.pop_back();
+        }
+    }
     void beginTransaction()
     {
         assert(!mHasOpenTransaction);
-        simpleQuery("BEGIN TRANSACTION");
+        exec("BEGIN TRANSACTION");
         mHasOpenTransaction = true;
     }
     bool commitTransaction()
     {
         if (!mHasOpenTransaction)
             return false;
-        simpleQuery("COMMIT TRANSACTION");
+        exec("COMMIT TRANSACTION");
         mHasOpenTransaction = false;
         mLastCommitTs = time(NULL);
         return true;
     }
+    void exec(const char* sql)
+    {
+        SqliteString err;
+        auto ret = sqlite3_exec(mDb, sql, nullptr, nullptr, &err.mStr);
+        if (ret == SQLITE_OK)
+            return;
+        std::string msg("Error executing '");
+        msg.append(sql);
+        if (err.mStr)
+            msg.append("': ").append(err.mStr);
+        else
+            msg+='\'';
+
+        throw SqliteError(msg, ret);
+    }
+    void doCommit()
+    {
+        if (mCommitEach)
+            return;
+        commitTransaction();
+        beginTransaction();
+    }
+    void doSetCommitMode(bool commitEach)
+    {
+        if (commitEach == mCommitEach)
+            return;
+        mCommitEach = commitEach;
+        if (commitEach)
+        {
+            commitTransaction();
+        }
+    }
+    /** True if writes have to be queued, i.e. we are not the writer thread */
+    bool isAsyncCaller() const
+    {
+        return mAsyncWrites.load() && std::this_thread::get_id() != mWriterThreadId.load();
+    }
+    /** Locks the connection for synchronous use by the caller thread, and
+     * executes the queued writes first. A no-op if not in write-behind mode */
+    std::unique_lock<std::recursive_mutex> syncAccess()
+    {
+        if (!isAsyncCaller())
+            return std::unique_lock<std::recursive_mutex>();
+        std::unique_lock<std::recursive_mutex> lock(mDbMutex);
+        if (!mExecutingQueue)
+            mInlineWriteCount += execQueuedWrites(SIZE_MAX);
+        return lock;
+    }
+    void enqueueWrite(QueuedWrite&& write)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mQueueMutex);
+            mWriteQueue.push_back(std::move(write));
+        }
+        mQueuedWriteCount++;
+        mQueueCv.notify_one();
+    }
+    /** Executes up to \c maxCount queued writes, in a single transaction.
+     * Must be called with mDbMutex locked. Errors can't be reported to the
+     * code that queued the writes, so they go to the write error handler */
+    inline size_t execQueuedWrites(size_t maxCount);
+    inline void execQueuedWrite(QueuedWrite& write);
+    inline bool execQuery(QueuedWrite& write);
+    void onWriteError(const std::string& sql, const std::exception& e)
+    {
+        mWriteErrorCount++;
+        // the connection's error code may be overwritten by then, i.e. by the
+        // reset of a cached statement, so take it from the exception
+        auto sqlErr = dynamic_cast<const SqliteError*>(&e);
+        int errCode = sqlErr ? sqlErr->code() : SQLITE_ERROR;
+        KR_LOG_ERROR("Db writer: error executing queued %s: %s", sql.c_str(), e.what());
+        if (mWriteErrorHandler)
+            mWriteErrorHandler(sql, errCode, e.what());
+    }
+    /** The writer runs at a lower priority than the caller (the event loop),
+     * so that it doesn't delay it when they compete for the CPU, i.e. on a
+     * single core */
+    static void lowerWriterPriority()
+    {
+#if defined(__linux__)
+        setpriority(PRIO_PROCESS, 0, kWriterNice); //the nice value is per thread on Linux
+#elif defined(__APPLE__)
+        pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0);
+#elif defined(_WIN32)
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+#endif
+    }
+    void writerLoop()
+    {
+        mWriterThreadId = std::this_thread::get_id();
+        lowerWriterPriority();
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mQueueMutex);
+                // wake up periodically even if idle, for the timed commit
+                mQueueCv.wait_for(lock, std::chrono::seconds(1),
+                    [this]() { return mWriterExit || !mWriteQueue.empty(); });
+                if (mWriterExit && mWriteQueue.empty())
+                    break;
+            }
+            std::lock_guard<std::recursive_mutex> lock(mDbMutex);
+            try
+            {
+                // idle means that nothing was queued during the last wait
+                bool idle = !execQueuedWrites(kWriteBatchSize);
+                timedCommit();
+                if (mWal && mWalPages > (idle ? 0 : (int)kMaxWalPages))
+                {
+                    // The checkpoint copies the committed pages from the WAL to the db,
+                    // so they can't include the ones of the open timed-commit transaction
+                    doCommit();
+                    checkpoint();
+                }
+            }
+            catch(std::exception& e)
+            {
+                onWriteError("COMMIT", e);
+            }
+        }
+    }
+    static void captureV(std::vector<QueuedValue>& values) {}
+    template <class T, class... Args>
+    static void captureV(std::vector<QueuedValue>& values, T&& val, Args&&... args)
+    {
+        values.emplace_back();
+        capture(values.back(), val);
+        captureV(values, args...);
+    }
+    // The same overloads as SqliteStmt::bind(), so that the values are bound
+    // with the same types as by query()
+    static void capture(QueuedValue& v, int val) { v.type = QueuedValue::kInt; v.intVal = val; }
+    static void capture(QueuedValue& v, int64_t val) { v.type = QueuedValue::kInt64; v.intVal = val; }
+    static void capture(QueuedValue& v, const std::string& val) { v.type = QueuedValue::kText; v.data = val; }
+    static void capture(QueuedValue& v, const StaticBuffer& buf)
+    {
+        if (!buf.buf())
+            return; //bound as NULL, like sqlite3_bind_blob() does
+        v.type = QueuedValue::kBlob;
+        v.data.assign(buf.buf(), buf.dataSize());
+    }
+    static void capture(QueuedValue& v, uint64_t val) { v.type = QueuedValue::kInt64; v.intVal = (int64_t)val; }
+    static void capture(QueuedValue& v, unsigned int val) { v.type = QueuedValue::kInt; v.intVal = (int)val; }
+    static void capture(QueuedValue& v, const char* val) { v.type = QueuedValue::kText; v.data = val; }
 public:
+    enum { kStmtCacheDefaultSize = 64 };
+    enum { kWriteBatchSize = 256 }; //max queued writes executed in one go by the writer thread
+    /** In write-behind mode, the writer thread checkpoints the WAL when idle
+     * for a second, or when the WAL grows above this, even if busy. Otherwise
+     * sqlite's automatic checkpoint is used */
+    enum { kMaxWalPages = 4000 };
+    enum { kWriterNice = 10 }; //the nice value of the writer thread, on Linux
     SqliteDb(sqlite3* db=nullptr, uint16_t commitInterval=20)
-    : mDb(db), mCommitInterval(commitInterval)
+    : mDb(db), mCommitInterval(commitInterval), mAsyncWrites(false),
+      mWriterThreadId(std::thread::id()), mQueuedWriteCount(0), mInlineWriteCount(0),
+      mWriteErrorCount(0), mWalPages(0), mCheckpointCount(0), mStmtCacheHits(0), mStmtCacheMisses(0)
     {}
-    bool open(const char* fname, bool commitEach=true)
+    ~SqliteDb() { setAsyncWrites(false); }
+    bool open(const char* fname, bool commitEach=true, const Options& options=Options())
     {
         assert(!mDb);
-        int ret = sqlite3_open(fname, &mDb);
+        int flags = options.readOnly ? SQLITE_OPEN_READONLY : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+        int ret = sqlite3_open_v2(fname, &mDb, flags, nullptr);
         if (!mDb)
             return false;
         if (ret != SQLITE_OK)
@@ -57,7 +392,18 @@ public:
             mDb = nullptr;
             return false;
         }
-        mCommitEach = commitEach;
+        try
+        {
+            applyOptions(options);
+        }
+        catch(std::exception& e)
+        {
+            KR_LOG_ERROR("Error configuring database %s: %s", fname, e.what());
+            sqlite3_close(mDb);
+            mDb = nullptr;
+            return false;
+        }
+        mCommitEach = commitEach || options.readOnly;
         if (!mCommitEach)
         {
             beginTransaction();
@@ -65,12 +411,16 @@ public:
         }
         return true;
     }
+    /** Must be done outside of a transaction, as the journal mode can't be changed inside one */
+    inline void applyOptions(const Options& options);
     void close()
     {
         if (!mDb)
             return;
+        setAsyncWrites(false);
         if (!mCommitEach)
             commitTransaction();
+        stmtCacheTrim(0);
         sqlite3_close(mDb);
         mDb = nullptr;
         mLastCommitTs = 0;
@@ -78,44 +428,171 @@ public:
     bool isOpen() const { return mDb != nullptr; }
     void setCommitMode(bool commitEach)
     {
-        if (commitEach == mCommitEach)
+        if (isAsyncCaller())
+        {
+            QueuedWrite write(QueuedWrite::kSetCommitMode);
+            write.commitEach = commitEach;
+            enqueueWrite(std::move(write));
             return;
-        mCommitEach = commitEach;
-        if (commitEach)
+        }
+        doSetCommitMode(commitEach);
+    }
+    /** @brief Enables or disables the write-behind mode. In this mode, the writes
+     * done via queryAsync(), as well as commits, are queued and executed by a
+     * dedicated thread, in group transactions, so that slow storage doesn't
+     * block the caller. Any other access to the db by the caller first executes
+     * the queued writes, so reads always see them.
+     * Disabling it (as close() does) executes all queued writes and stops the
+     * thread, so it must not be done while a SqliteStmt is alive.
+     */
+    void setAsyncWrites(bool enable)
+    {
+        if (enable == mAsyncWrites.load())
+            return;
+        if (enable)
         {
-            commitTransaction();
+            assert(mDb);
+            // the writer thread does the checkpoints, when idle
+            sqlite3_wal_autocheckpoint(mDb, 0);
+            mWriterExit = false;
+            mAsyncWrites = true;
+            mWriterThread = std::thread([this]() { writerLoop(); });
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mQueueMutex);
+            mWriterExit = true;
+        }
+        mQueueCv.notify_one();
+        mWriterThread.join(); //executes everything queued before exiting
+        mAsyncWrites = false;
+        mWriterThreadId = std::thread::id();
+        sqlite3_wal_autocheckpoint(mDb, 1000); //the sqlite default
+    }
+    bool isWal() const { return mWal; }
+    /** @brief Copies the committed content of the WAL to the db file, without
+     * waiting for readers or writers of other connections (a passive checkpoint).
+     * Returns false if not in WAL mode or the checkpoint failed */
+    bool checkpoint()
+    {
+        if (!mWal)
+            return false;
+        auto lock = syncAccess();
+        int logPages = 0, donePages = 0;
+        int ret = sqlite3_wal_checkpoint_v2(mDb, nullptr, SQLITE_CHECKPOINT_PASSIVE, &logPages, &donePages);
+        if (ret != SQLITE_OK)
+        {
+            KR_LOG_WARNING("Db WAL checkpoint failed: %s", sqlite3_errmsg(mDb));
+            return false;
         }
+        mCheckpointCount++;
+        // when all pages are copied, the WAL is restarted by the next write
+        mWalPages = (logPages == donePages) ? 0 : logPages;
+        return true;
+    }
+    uint64_t checkpointCount() const { return mCheckpointCount.load(); }
+    bool asyncWrites() const { return mAsyncWrites.load(); }
+    /** Number of writes queued in write-behind mode */
+    uint64_t queuedWriteCount() const { return mQueuedWriteCount.load(); }
+    /** Number of queued writes that were executed by the caller, because it
+     * accessed the db before the writer thread got to them */
+    uint64_t inlineWriteCount() const { return mInlineWriteCount.load(); }
+    /** @brief Sets the handler of the errors of the writes queued in write-behind
+     * mode, which can't be reported to the code that queued them. It is called
+     * on the writer thread, or on the caller thread if the caller executes the
+     * queue. Must be set while write-behind mode is disabled */
+    void setWriteErrorHandler(WriteErrorHandler&& handler)
+    {
+        assert(!mAsyncWrites.load());
+        mWriteErrorHandler = std::move(handler);
+    }
+    /** Number of queued writes and commits that failed */
+    uint64_t writeErrorCount() const { return mWriteErrorCount.load(); }
+    /** @brief Barrier: on return, all writes done so far are executed and
+     * committed to disk. To be used i.e. before the app is suspended or terminated */
+    void flush()
+    {
+        auto lock = syncAccess();
+        if (!mHasOpenTransaction)
+            return;
+        commitTransaction();
+        if (!mCommitEach)
+            beginTransaction();
     }
     void setCommitInterval(uint16_t sec) { mCommitInterval = sec; }
+    /** Sets the max number of prepared statements kept for reuse. Zero disables the cache */
+    void setStmtCacheSize(size_t maxSize)
+    {
+        mStmtCacheMaxSize = maxSize;
+        stmtCacheTrim(maxSize);
+    }
+    size_t stmtCacheSize() const { return mStmtLru.size(); }
+    uint64_t stmtCacheHits() const { return mStmtCacheHits.load(); }
+    uint64_t stmtCacheMisses() const { return mStmtCacheMisses.load(); }
     bool hasOpenTransaction() const { return !mHasOpenTransaction; }
     operator sqlite3*() { return mDb; }
     operator const sqlite3*() const { return mDb; }
     template <class... Args>
     inline bool query(const char* sql, Args&&... args);
-    void simpleQuery(const char* sql)
+    /** @brief Like query(), but in write-behind mode the write is queued and
+     * executed by the writer thread. For writes whose result (i.e. the number
+     * of changed rows) is not needed. Errors are reported to the write error
+     * handler, see setWriteErrorHandler() */
+    template <class... Args>
+    void queryAsync(const char* sql, Args&&... args)
     {
-        SqliteString err;
-        auto ret = sqlite3_exec(mDb, sql, nullptr, nullptr, &err.mStr);
-        if (ret == SQLITE_OK)
+        if (!isAsyncCaller())
+        {
+            query(sql, args...);
             return;
-        std::string msg("Error executing '");
-        msg.append(sql);
-        if (err.mStr)
-            msg.append("': ").append(err.mStr);
-        else
-            msg+='\'';
-
-        throw std::runtime_error(msg);
+        }
+        QueuedWrite write(QueuedWrite::kQuery);
+        write.sql = sql;
+        captureV(write.values, args...);
+        enqueueWrite(std::move(write));
+    }
+    /** @brief Like queryAsync(), with \c hooks run around the write. In
+     * write-behind mode, they are run by the writer thread, so they can do
+     * expensive work, i.e. compression, or verify the result of the write,
+     * without delaying the caller. In synchronous mode, an unexpected number
+     * of changed rows is thrown, like any other error of the write */
+    template <class... Args>
+    void queryAsyncEx(const QueryHooks& hooks, const char* sql, Args&&... args)
+    {
+        QueuedWrite write(QueuedWrite::kQuery);
+        write.hooks = hooks;
+        write.sql = sql;
+        captureV(write.values, args...);
+        if (!isAsyncCaller())
+        {
+            execQuery(write);
+            mLastChanges = sqlite3_changes(mDb);
+            mLastInsertRowid = sqlite3_last_insert_rowid(mDb);
+            return;
+        }
+        enqueueWrite(std::move(write));
+    }
+    /** The number of rows changed by the last query() */
+    int changes() const { return mLastChanges; }
+    /** The rowid of the row inserted by the last query() */
+    int64_t lastInsertRowid() const { return mLastInsertRowid; }
+    void simpleQuery(const char* sql)
+    {
+        auto lock = syncAccess();
+        exec(sql);
     }
     void commit()
     {
-        if (mCommitEach)
+        if (isAsyncCaller())
+        {
+            enqueueWrite(QueuedWrite(QueuedWrite::kCommit));
             return;
-        commitTransaction();
-        beginTransaction();
+        }
+        doCommit();
     }
     bool rollback()
     {
+        auto lock = syncAccess();
         if (mCommitEach)
             return false;
         // the rollback may fail - in case of some critical errors, sqlite automatically
@@ -127,14 +604,15 @@ public:
     }
     bool timedCommit()
     {
-        if (mCommitEach)
+        // in write-behind mode, this is done by the writer thread
+        if (mCommitEach || isAsyncCaller())
             return false;
 
         auto now = time(NULL);
         if (now - mLastCommitTs < mCommitInterval)
             return false;
 
-        commit();
+        doCommit();
         return true;
     }
 };
@@ -142,13 +620,16 @@ public:
 class SqliteStmt
 {
 protected:
-    sqlite3_stmt* mStmt;
+    std::unique_lock<std::recursive_mutex> mDbLock; //must be destroyed last
+    sqlite3_stmt* mStmt = nullptr;
     SqliteDb& mDb;
     int mLastBindCol = 0;
+    bool mCached = false;
+    std::string mSql; //only set if the statement is to be returned to the cache
     void retCheck(int code, const char* opname)
     {
         if (code != SQLITE_OK)
-            throw std::runtime_error(getLastErrorMsg(opname));
+            throw SqliteError(getLastErrorMsg(opname), code);
     }
     std::string getLastErrorMsg(const char* opname)
     {
@@ -169,23 +650,42 @@ protected:
         return msg;
     }
 public:
-    SqliteStmt(SqliteDb& db, const char* sql):mDb(db)
+    /** @param cached - If true (the default), the prepared statement is taken from
+     * (and on destruction returned to) the statement cache of \c db, so that the sql
+     * is not re-parsed on every use. Pass false for one-off statements with
+     * dynamically generated sql, so they don't evict the hot ones.
+     */
+    SqliteStmt(SqliteDb& db, const char* sql, bool cached=true)
+        :mDbLock(db.syncAccess()), mDb(db)
     {
-        if (sqlite3_prepare_v2(db, sql, -1, &mStmt, nullptr) != SQLITE_OK)
+        if (cached && db.mStmtCacheMaxSize)
+        {
+            mCached = true;
+            mSql = sql;
+            mStmt = db.stmtCacheCheckout(mSql);
+            if (mStmt)
+                return;
+        }
+        int ret = sqlite3_prepare_v2(db, sql, -1, &mStmt, nullptr);
+        if (ret != SQLITE_OK)
         {
             const char* errMsg = sqlite3_errmsg(mDb);
             if (!errMsg)
                 errMsg = "(Unknown error)";
-            throw std::runtime_error(std::string(
-                "Error creating sqlite statement with sql:\n'")+sql+"'\n"+errMsg);
+            throw SqliteError(std::string(
+                "Error creating sqlite statement with sql:\n'")+sql+"'\n"+errMsg, ret);
         }
         assert(mStmt);
     }
-    SqliteStmt(SqliteDb& db, const std::string& sql)
-        :SqliteStmt(db, sql.c_str()){}
+    SqliteStmt(SqliteDb& db, const std::string& sql, bool cached=true)
+        :SqliteStmt(db, sql.c_str(), cached){}
     ~SqliteStmt()
     {
-        if (mStmt)
+        if (!mStmt)
+            return;
+        if (mCached)
+            mDb.stmtCacheReturn(std::move(mSql), mStmt);
+        else
             sqlite3_finalize(mStmt);
     }
     operator sqlite3_stmt*() { return mStmt; }
@@ -216,7 +716,7 @@ public:
         else if (ret == SQLITE_ROW)
             return true;
         else
-            throw std::runtime_error(getLastErrorMsg(nullptr));
+            throw SqliteError(getLastErrorMsg(nullptr), ret);
     }
     void stepMustHaveData(const char* opname=nullptr)
     {
@@ -288,7 +788,160 @@ inline bool SqliteDb::query(const char* sql, Args&&... args)
 {
     SqliteStmt stmt(*this, sql);
     stmt.bindV(args...);
-    return stmt.step();
+    bool ret = stmt.step();
+    mLastChanges = sqlite3_changes(mDb);
+    mLastInsertRowid = sqlite3_last_insert_rowid(mDb);
+    return ret;
+}
+
+inline void SqliteDb::applyOptions(const Options& options)
+{
+    mWal = false;
+    mWalPages = 0;
+    if (!options.readOnly)
+    {
+        if (options.wal)
+        {
+            SqliteStmt stmt(*this, "PRAGMA journal_mode=WAL", false);
+            mWal = stmt.step() && stmt.stringCol(0) == "wal";
+            if (!mWal)
+                KR_LOG_WARNING("Could not switch database to WAL mode, using the rollback journal");
+        }
+        else
+        {
+            exec("PRAGMA journal_mode=DELETE");
+        }
+        exec(options.syncNormal ? "PRAGMA synchronous=NORMAL" : "PRAGMA synchronous=FULL");
+        if (mWal)
+            sqlite3_wal_hook(mDb, walHookCb, this);
+    }
+    if (options.cacheSizeKb > 0)
+        exec(("PRAGMA cache_size=-"+std::to_string(options.cacheSizeKb)).c_str());
+    if (options.mmapSize >= 0)
+        exec(("PRAGMA mmap_size="+std::to_string(options.mmapSize)).c_str());
+}
+
+inline size_t SqliteDb::execQueuedWrites(size_t maxCount)
+{
+    std::deque<QueuedWrite> batch;
+    {
+        std::lock_guard<std::mutex> lock(mQueueMutex);
+        if (mWriteQueue.empty())
+            return 0;
+        if (maxCount >= mWriteQueue.size())
+        {
+            batch.swap(mWriteQueue);
+        }
+        else
+        {
+            auto end = mWriteQueue.begin() + maxCount;
+            std::move(mWriteQueue.begin(), end, std::back_inserter(batch));
+            mWriteQueue.erase(mWriteQueue.begin(), end);
+        }
+    }
+    mExecutingQueue = true;
+    bool grouped = false;
+    try
+    {
+        for (auto& write: batch)
+        {
+            if (!mHasOpenTransaction)
+            {
+                beginTransaction();
+                grouped = true;
+            }
+            execQueuedWrite(write);
+        }
+        // in commit-each mode, the group transaction is committed now. Otherwise,
+        // it is the one that will be committed by the next (timed) commit
+        if (grouped && mCommitEach)
+            commitTransaction();
+    }
+    catch(std::exception& e)
+    {
+        onWriteError("transaction", e);
+    }
+    mExecutingQueue = false;
+    return batch.size();
+}
+
+// Binds and executes a captured query. Throws on error
+inline bool SqliteDb::execQuery(QueuedWrite& write)
+{
+    auto& hooks = write.hooks;
+    if (hooks.ifPrevChanged && !mPrevWriteChanges)
+        return false;
+    mPrevWriteChanges = 0;
+    if (hooks.verify)
+    {
+        try
+        {
+            hooks.verify(*this, write.values);
+        }
+        catch(std::exception& e)
+        {
+            onWriteError(write.sql, SqliteError(e.what(), SqliteError::kVerifyFailed));
+        }
+    }
+    if (hooks.prepare)
+        hooks.prepare(write.values);
+    SqliteStmt stmt(*this, write.sql.c_str());
+    int col = 0;
+    for (auto& val: write.values)
+    {
+        col++;
+        switch (val.type)
+        {
+            case QueuedValue::kInt:
+                stmt.bind(col, (int)val.intVal);
+                break;
+            case QueuedValue::kInt64:
+                stmt.bind(col, val.intVal);
+                break;
+            case QueuedValue::kText:
+                stmt.bind(col, val.data);
+                break;
+            case QueuedValue::kBlob:
+                stmt.bind(col, (const void*)val.data.data(), val.data.size());
+                break;
+            default: //already bound to NULL by the statement reset
+                break;
+        }
+    }
+    bool ret = stmt.step();
+    int changes = sqlite3_changes(mDb);
+    mPrevWriteChanges = changes;
+    if (hooks.expectedChanges >= 0)
+    {
+        if (changes != hooks.expectedChanges)
+        {
+            throw SqliteError("Query changed "+std::to_string(changes)+" rows instead of "
+                +std::to_string(hooks.expectedChanges), SqliteError::kUnexpectedChanges);
+        }
+    }
+    return ret;
+}
+
+inline void SqliteDb::execQueuedWrite(QueuedWrite& write)
+{
+    try
+    {
+        if (write.kind == QueuedWrite::kCommit)
+        {
+            doCommit();
+            return;
+        }
+        if (write.kind == QueuedWrite::kSetCommitMode)
+        {
+            doSetCommitMode(write.commitEach);
+            return;
+        }
+        execQuery(write);
+    }
+    catch(std::exception& e)
+    {
+        onWriteError(write.kind == QueuedWrite::kQuery ? write.sql : "COMMIT", e);
+    }
 }
 
 inline int SqliteDb::step(SqliteStmt& stmt)
@@ -2,6 +2,7 @@ CREATE TABLE sending(rowid integer primary key autoincrement, msgid int64, keyid
     chatid int64 not null, type tinyint, ts int, updated smallint, msg blob,
     opcode smallint not null, msg_cmd blob, key_cmd blob, recipients blob not null,
     backrefid int64 not null, backrefs blob);
+CREATE INDEX sending_chatid ON sending(chatid);
 
 CREATE TABLE manual_sending(rowid integer primary key autoincrement, msgid int64,
     chatid int64 not null, type tinyint, ts int, updated smallint, msg blob,
@@ -28,7 +29,10 @@ CREATE TABLE chat_vars(chatid int64 not null, name text not null, value text,
 
 CREATE TABLE history(idx int not null, chatid int64 not null, msgid int64 not null,
     userid int64, keyid int not null, type tinyint, updated smallint, ts int,
-    is_encrypted tinyint, data blob, backrefid int64 not null, UNIQUE(chatid,msgid), UNIQUE(chatid,idx));
+    is_encrypted tinyint, data blob, backrefid int64 not null,
+    is_deleted tinyint not null default 0, data_fmt tinyint not null default 0,
+    UNIQUE(chatid,msgid), UNIQUE(chatid,idx));
+CREATE INDEX history_unread ON history(chatid, idx, userid, type, is_deleted);
 
 CREATE TABLE sendkeys(chatid int64 not null, userid int64 not null, keyid int64 not null, key blob not null,
     ts int not null, UNIQUE(chatid, userid, keyid));
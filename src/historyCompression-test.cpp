@@ -0,0 +1,106 @@
+#include <functional>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string.h>
+#include <asyncTest-framework.h>
+#include "historyCompression.h"
+
+TESTS_INIT();
+using namespace chatd;
+
+static bool roundTrips(const std::string& text)
+{
+    Buffer packed;
+    if (!compressMsgData(StaticBuffer(text.c_str(), text.size()), packed))
+        return false;
+    if (packed.dataSize() >= text.size())
+        return false;
+    Buffer restored;
+    decompressMsgData(kMsgDataDeflateDict1, packed.buf(), packed.dataSize(), restored);
+    return std::string(restored.buf(), restored.dataSize()) == text;
+}
+
+static bool decompressThrows(uint8_t fmt, const void* data, size_t len)
+{
+    Buffer out;
+    try
+    {
+        decompressMsgData(fmt, data, len, out);
+    }
+    catch(std::runtime_error&)
+    {
+        return out.empty();
+    }
+    return false;
+}
+
+int main()
+{
+
+TestGroup("historyCompression")
+{
+    syncTest("Round trip of text and json payloads")
+    {
+        check(roundTrips("Hello, how are you? Did you get my message?"));
+        check(roundTrips("Thank you so much! See you tomorrow at the office"));
+        check(roundTrips("{\"textMessage\":\"look at this\",\"extra\":[{\"url\":\"https://mega.nz/\","
+            "\"t\":\"MEGA\",\"d\":\"Secure cloud storage\"}]}"));
+        // longer than the initial output chunk of decompressMsgData()
+        std::string repeated;
+        for (int i = 0; i < 2000; i++)
+        {
+            repeated += "abcdefgh";
+        }
+        check(roundTrips(repeated));
+    });
+    syncTest("Payloads that are not worth compressing are rejected")
+    {
+        Buffer packed;
+        check(!compressMsgData(StaticBuffer("ok", 2), packed));
+        check(!compressMsgData(StaticBuffer("Hello, how are", 14), packed));
+        // like an encrypted payload
+        std::mt19937 rng(1);
+        std::string random(200, 0);
+        for (auto& ch: random)
+        {
+            ch = (char)rng();
+        }
+        check(!compressMsgData(StaticBuffer(random.c_str(), random.size()), packed));
+        check(packed.empty());
+        // a rejected payload is stored raw, and read back as is
+        Buffer restored;
+        decompressMsgData(kMsgDataRaw, random.c_str(), random.size(), restored);
+        check(restored.dataSize() == random.size());
+        check(memcmp(restored.buf(), random.c_str(), random.size()) == 0);
+    });
+    syncTest("The kMsgDataDeflateDict1 format is frozen")
+    {
+        // Written by the first version that had the format. If this fails,
+        // rows in existing dbs have become unreadable
+        static const uint8_t packed[] = {
+            0xc3, 0x96, 0x99, 0x71, 0x17, 0x18, 0x58, 0x63, 0x3a, 0x31, 0x29, 0x19,
+            0x00
+        };
+        const char* text = "Hello, how are you? Can you send me the file? https://mega.nz/file/abc";
+        Buffer restored;
+        decompressMsgData(kMsgDataDeflateDict1, packed, sizeof(packed), restored);
+        check(std::string(restored.buf(), restored.dataSize()) == text);
+    });
+    syncTest("Corrupt data and unknown formats throw")
+    {
+        std::string text = "Can you send me the file? I have uploaded the photos to the folder.";
+        Buffer packed;
+        check(compressMsgData(StaticBuffer(text.c_str(), text.size()), packed));
+        check(decompressThrows(kMsgDataDeflateDict1, packed.buf(), packed.dataSize() / 2));
+        check(decompressThrows(kMsgDataDeflateDict1, packed.buf(), 0));
+        static const uint8_t garbage[] = { 0xff, 0xff, 0xff, 0xff, 0x12, 0x34, 0x56, 0x78 };
+        check(decompressThrows(kMsgDataDeflateDict1, garbage, sizeof(garbage)));
+        check(decompressThrows(kMsgDataDeflateDict1 + 1, packed.buf(), packed.dataSize()));
+        // the streams are still usable after an error
+        check(roundTrips(text));
+    });
+});
+
+return test::gNumFailed;
+}
@@ -0,0 +1,135 @@
+#include "historyCompression.h"
+#include <zlib.h>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+namespace chatd
+{
+/** Preset dictionary of kMsgDataDeflateDict1. Chat messages are mostly too
+ * short for deflate to find repetitions within themselves, so they are
+ * compressed against this sample of common phrases, urls and the json of
+ * the management messages. Deflate favours the dictionary strings that are
+ * nearest to the data, i.e. the last ones, so the most frequent go last.
+ * It is part of the storage format: never change it, add a new format
+ * with a new dictionary instead.
+ */
+static const char kDict1[] =
+    "Thank you so much! Have a nice day. Good morning, good night. See you tomorrow. No problem"
+    ". I don't know, I think so. Let me know when you are ready. Sorry, I was busy. What time? "
+    "Where are you? I'll call you later. Can you send me the file? Did you get my message? Yes,"
+    " of course. Okay, thanks. Hello, how are you? I'm fine, and you? Happy birthday! Congratul"
+    "ations! Please check the document and let me know what you think about it. We have a meeti"
+    "ng at the office this afternoon. The link is not working, could you share it again? I have"
+    " uploaded the photos to the folder. Just a moment. What do you mean? That's great, really "
+    "good news. Not yet, maybe next week. Because it's important for the project. I will be the"
+    "re in five minutes. Are you coming today? hahaha lol :) :D ;) :( <3 ok OK yes no thanks Th"
+    "anks Hi hi Hey\n"
+    "https://mega.nz/file/https://mega.nz/folder/https://mega.nz/#!https://mega.nz/#F!https://w"
+    "ww.youtube.com/watch?v=https://www.google.com/http://www..com/.org/.html\n"
+    "{\"textMessage\":\"\",\"extra\":[{\"url\":\"\",\"t\":\"\",\"d\":\"\",\"ic\":\"\",\"i\":\"\"}]}\n"
+    "[{\"u\":\"\",\"email\":\"@gmail.com\",\"name\":\"\"}]\n"
+    "[{\"h\":\"\",\"k\":[,,,,,,,],\"t\":0,\"name\":\".jpg\",\"s\":,\"hash\":\"\",\"fa\":\"924:0*/925:1*\",\"ts\":15}][{"
+    "\"h\":\"\",\"k\":[,,,,,,,],\"t\":0,\"name\":\"IMG_20.jpg\",\"s\":,\"hash\":\"\",\"fa\":\"\",\"ts\":16}]\n";
+
+enum
+{
+    kMinCompressSize = 16, ///< Shorter payloads are never worth compressing
+    kDeflateLevel = 6,
+    kWindowBits = -15 ///< Raw deflate, without zlib header and checksum
+};
+
+// The streams are kept and reset for each message, as initializing them
+// allocates several hundred kB
+static std::mutex gDeflateMutex;
+static z_stream* gDeflate = nullptr;
+static std::mutex gInflateMutex;
+static z_stream* gInflate = nullptr;
+
+bool compressMsgData(const StaticBuffer& data, Buffer& out)
+{
+    if (data.dataSize() < kMinCompressSize)
+        return false;
+
+    std::lock_guard<std::mutex> lock(gDeflateMutex);
+    if (!gDeflate)
+    {
+        auto strm = new z_stream();
+        if (deflateInit2(strm, kDeflateLevel, Z_DEFLATED, kWindowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            delete strm;
+            throw std::runtime_error("compressMsgData: deflateInit2 failed");
+        }
+        gDeflate = strm;
+    }
+    else if (deflateReset(gDeflate) != Z_OK)
+    {
+        throw std::runtime_error("compressMsgData: deflateReset failed");
+    }
+    deflateSetDictionary(gDeflate, (const Bytef*)kDict1, sizeof(kDict1)-1);
+
+    // Only accept a result that is smaller than the input
+    size_t maxSize = data.dataSize() - 1;
+    out.clear();
+    gDeflate->next_in = (Bytef*)data.buf();
+    gDeflate->avail_in = data.dataSize();
+    gDeflate->next_out = (Bytef*)out.appendPtr(maxSize);
+    gDeflate->avail_out = maxSize;
+    int ret = deflate(gDeflate, Z_FINISH);
+    if (ret != Z_STREAM_END)
+    {
+        out.clear();
+        return false;
+    }
+    out.setDataSize(maxSize - gDeflate->avail_out);
+    return true;
+}
+
+void decompressMsgData(uint8_t fmt, const void* data, size_t len, Buffer& out)
+{
+    if (fmt == kMsgDataRaw)
+    {
+        out.assign(data, len);
+        return;
+    }
+    if (fmt != kMsgDataDeflateDict1)
+        throw std::runtime_error("decompressMsgData: unknown data format "+std::to_string(fmt));
+
+    std::lock_guard<std::mutex> lock(gInflateMutex);
+    if (!gInflate)
+    {
+        auto strm = new z_stream();
+        if (inflateInit2(strm, kWindowBits) != Z_OK)
+        {
+            delete strm;
+            throw std::runtime_error("decompressMsgData: inflateInit2 failed");
+        }
+        gInflate = strm;
+    }
+    else if (inflateReset(gInflate) != Z_OK)
+    {
+        throw std::runtime_error("decompressMsgData: inflateReset failed");
+    }
+    inflateSetDictionary(gInflate, (const Bytef*)kDict1, sizeof(kDict1)-1);
+
+    out.clear();
+    gInflate->next_in = (Bytef*)data;
+    gInflate->avail_in = len;
+    // Chat messages typically compress to about half their size
+    size_t chunk = len * 3 + 64;
+    for (;;)
+    {
+        gInflate->next_out = (Bytef*)out.appendPtr(chunk);
+        gInflate->avail_out = chunk;
+        int ret = inflate(gInflate, Z_NO_FLUSH);
+        out.setDataSize(out.dataSize() - gInflate->avail_out);
+        if (ret == Z_STREAM_END)
+            return;
+        if ((ret != Z_OK && ret != Z_BUF_ERROR) || (gInflate->avail_out && !gInflate->avail_in))
+        {
+            out.clear();
+            throw std::runtime_error("decompressMsgData: corrupt data ("+std::to_string(ret)+")");
+        }
+    }
+}
+}
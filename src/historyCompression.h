@@ -0,0 +1,34 @@
+#ifndef HISTORY_COMPRESSION_H
+#define HISTORY_COMPRESSION_H
+
+#include <stdint.h>
+#include "buffer.h"
+
+namespace chatd
+{
+/** Format of the message payload stored in the \c data column of the history
+ * table, as recorded in its \c data_fmt column. Existing values must never
+ * change meaning, as rows written by older versions must remain readable.
+ */
+enum: uint8_t
+{
+    kMsgDataRaw = 0, ///< The payload as is
+    kMsgDataDeflateDict1 = 1 ///< Raw deflate with the preset dictionary v1
+};
+
+/** @brief Compresses a message payload for storing in the db.
+ * @param out Receives the compressed payload, in \c kMsgDataDeflateDict1 format
+ * @returns \c false if compression does not make the payload smaller, i.e.
+ * for short or already encrypted payloads, in which case they should be
+ * stored raw. Thread-safe.
+ */
+bool compressMsgData(const StaticBuffer& data, Buffer& out);
+
+/** @brief Restores a message payload read from the db.
+ * @param fmt The value of the \c data_fmt column of the row
+ * @throws std::runtime_error if \c fmt is not known or the data is corrupt.
+ * Thread-safe.
+ */
+void decompressMsgData(uint8_t fmt, const void* data, size_t len, Buffer& out);
+}
+#endif // HISTORY_COMPRESSION_H
@@ -16,7 +16,7 @@ namespace rtcModule {void globalCleanup(); }
 
 namespace karere
 {
-const char* gDbSchemaVersionSuffix = "2";
+const char* gDbSchemaVersionSuffix = "4";
 bool gCatchException = true;
 
 void globalInit(void(*postFunc)(void*, void*), uint32_t options, const char* logPath, size_t logSize)
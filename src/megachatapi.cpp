@@ -173,6 +173,21 @@ void MegaChatApi::setLogToConsole(bool enable)
     MegaChatApiImpl::setLogToConsole(enable);
 }
 
+void MegaChatApi::setDatabaseOptions(bool walMode, bool syncNormal, int cacheSizeKb, int64_t mmapSize, bool asyncWrites, bool compressHistory)
+{
+    pImpl->setDatabaseOptions(walMode, syncNormal, cacheSizeKb, mmapSize, asyncWrites, compressHistory);
+}
+
+void MegaChatApi::setHistoryMemoryLimits(long long chatBytes, long long totalBytes)
+{
+    pImpl->setHistoryMemoryLimits(chatBytes, totalBytes);
+}
+
+void MegaChatApi::trimHistoryMemory(MegaChatRequestListener *listener)
+{
+    pImpl->trimHistoryMemory(listener);
+}
+
 int MegaChatApi::init(const char *sid)
 {
     return pImpl->init(sid);
@@ -443,6 +458,11 @@ MegaChatMessage *MegaChatApi::getManualSendingMessage(MegaChatHandle chatid, Meg
     return pImpl->getManualSendingMessage(chatid, rowid);
 }
 
+void MegaChatApi::searchMessages(MegaChatHandle chatid, const char *query, int limit, long long cursor, MegaChatRequestListener *listener)
+{
+    pImpl->searchMessages(chatid, query, limit, cursor, listener);
+}
+
 MegaChatMessage *MegaChatApi::sendMessage(MegaChatHandle chatid, const char *msg)
 {
     return pImpl->sendMessage(chatid, msg);
@@ -783,6 +803,11 @@ MegaNodeList *MegaChatRequest::getMegaNodeList()
     return NULL;
 }
 
+MegaChatMessageList *MegaChatRequest::getMegaChatMessageList()
+{
+    return NULL;
+}
+
 int MegaChatRequest::getParamType()
 {
     return -1;
@@ -1272,6 +1297,26 @@ unsigned int MegaChatListItemList::size() const
     return 0;
 }
 
+MegaChatMessageList *MegaChatMessageList::copy() const
+{
+    return NULL;
+}
+
+const MegaChatMessage *MegaChatMessageList::get(unsigned int i) const
+{
+    return NULL;
+}
+
+MegaChatHandle MegaChatMessageList::getChatHandle(unsigned int i) const
+{
+    return MEGACHAT_INVALID_HANDLE;
+}
+
+unsigned int MegaChatMessageList::size() const
+{
+    return 0;
+}
+
 MegaChatPresenceConfig *MegaChatPresenceConfig::copy() const
 {
     return NULL;
@@ -57,6 +57,7 @@ class MegaChatVideoListener;
 class MegaChatListener;
 class MegaChatNotificationListener;
 class MegaChatListItem;
+class MegaChatMessageList;
 
 /**
  * @brief Provide information about a call
@@ -546,6 +547,52 @@ public:
 
 };
 
+/**
+ * @brief List of MegaChatMessage objects, of one or several chatrooms
+ *
+ * A MegaChatMessageList has the ownership of the MegaChatMessage objects that it contains, so they will be
+ * only valid until the MegaChatMessageList is deleted. If you want to retain a MegaChatMessage returned by
+ * a MegaChatMessageList, use MegaChatMessage::copy.
+ *
+ * Objects of this class are immutable.
+ */
+class MegaChatMessageList
+{
+public:
+    virtual ~MegaChatMessageList() {}
+
+    virtual MegaChatMessageList *copy() const;
+
+    /**
+     * @brief Returns the MegaChatMessage at the position i in the MegaChatMessageList
+     *
+     * The MegaChatMessageList retains the ownership of the returned MegaChatMessage. It will be only valid until
+     * the MegaChatMessageList is deleted.
+     *
+     * If the index is >= the size of the list, this function returns NULL.
+     *
+     * @param i Position of the MegaChatMessage that we want to get for the list
+     * @return MegaChatMessage at the position i in the list
+     */
+    virtual const MegaChatMessage *get(unsigned int i) const;
+
+    /**
+     * @brief Returns the handle of the chatroom of the MegaChatMessage at the position i
+     *
+     * If the index is >= the size of the list, this function returns MEGACHAT_INVALID_HANDLE.
+     *
+     * @param i Position of the MegaChatMessage in the list
+     * @return MegaChatHandle of the chatroom that the message belongs to
+     */
+    virtual MegaChatHandle getChatHandle(unsigned int i) const;
+
+    /**
+     * @brief Returns the number of MegaChatMessages in the list
+     * @return Number of MegaChatMessages in the list
+     */
+    virtual unsigned int size() const;
+};
+
 class MegaChatMessage
 {
 public:
@@ -940,7 +987,8 @@ public:
         TYPE_SET_BACKGROUND_STATUS, TYPE_RETRY_PENDING_CONNECTIONS,
         TYPE_SEND_TYPING_NOTIF, TYPE_SIGNAL_ACTIVITY,
         TYPE_SET_PRESENCE_PERSIST, TYPE_SET_PRESENCE_AUTOAWAY,
-        TYPE_LOAD_AUDIO_VIDEO_DEVICES,
+        TYPE_LOAD_AUDIO_VIDEO_DEVICES, TYPE_SEARCH_MESSAGES,
+        TYPE_TRIM_HISTORY_MEMORY,
         TOTAL_OF_REQUEST_TYPES
     };
 
@@ -1085,6 +1133,19 @@ public:
      */
     virtual mega::MegaNodeList *getMegaNodeList();
 
+    /**
+     * @brief Returns the list of messages on this request.
+     *
+     * The SDK retains the ownership of the returned value. It will be valid until
+     * the MegaChatRequest object is deleted.
+     *
+     * This value is valid for these requests:
+     * - MegaChatApi::searchMessages - Returns the messages that match the query
+     *
+     * @return List of messages in this request
+     */
+    virtual MegaChatMessageList *getMegaChatMessageList();
+
     /**
      * @brief Returns the type of parameter related to the request
      *
@@ -1095,6 +1156,7 @@ public:
      * - MegaChatApi::disableVideo - Returns MegaChatRequest::VIDEO
      * - MegaChatApi::answerChatCall - Returns one
      * - MegaChatApi::rejectChatCall - Returns zero
+     * - MegaChatApi::searchMessages - Returns the maximum number of results
      *
      * @return Type of parameter related to the request
      */
@@ -1531,6 +1593,73 @@ public:
      */
     static void setLogToConsole(bool enable);
 
+    /**
+     * @brief Configures the local cache (database) of MEGAchat
+     *
+     * The settings take effect when the cache is opened or created, so this function
+     * must be called before MegaChatApi::init.
+     *
+     * By default, the write-ahead log is enabled with synchronous writes in NORMAL mode,
+     * the page cache is 8 MB, memory mapping is disabled, writes are done asynchronously
+     * and the message history is stored uncompressed.
+     *
+     * @param walMode True to use the write-ahead log (WAL) instead of the rollback journal.
+     * With WAL, readers don't block the writer and commits are faster.
+     * @param syncNormal True to flush the data to disk only at WAL checkpoints, instead of
+     * at every commit. The last changes may be lost on power failure, but the cache can't
+     * get corrupted, as long as WAL is enabled.
+     * @param cacheSizeKb Size of the page cache, in kilobytes. Zero to use the SQLite default.
+     * @param mmapSize Max number of bytes of the cache accessed via memory mapping.
+     * Zero to disable memory mapping.
+     * @param asyncWrites True to do most writes and commits from a dedicated thread, so they
+     * don't block the processing of network events.
+     * @param compressHistory True to store the content of the messages compressed, which
+     * reduces the size of the cache at a small cost in CPU time. Messages stored with either
+     * setting remain readable after changing it.
+     */
+    void setDatabaseOptions(bool walMode, bool syncNormal, int cacheSizeKb, int64_t mmapSize,
+                            bool asyncWrites, bool compressHistory = false);
+
+    /**
+     * @brief Limits the memory used by the messages of the chatrooms that are kept in RAM
+     *
+     * The history of each chatroom that has been loaded is kept in RAM, so that it can be
+     * returned quickly when the chatroom is opened again. When a limit is exceeded, the
+     * oldest messages are removed from RAM, starting from the chatrooms that are closed and
+     * have not been used for longest. They are still in the local cache, and are loaded
+     * again from there when needed.
+     *
+     * The messages that the app has loaded in an open chatroom, and the most recent ones of
+     * each chatroom, are always kept in RAM.
+     *
+     * This function can be called at any time. By default, there are no limits.
+     *
+     * @param chatBytes Maximum number of bytes used by the history of a single chatroom, or
+     * zero for no limit.
+     * @param totalBytes Maximum number of bytes used by the history of all chatrooms, or zero
+     * for no limit.
+     */
+    void setHistoryMemoryLimits(long long chatBytes, long long totalBytes);
+
+    /**
+     * @brief Removes from RAM all the messages that can be loaded again from the local cache
+     *
+     * Call this function when the operating system signals that memory is low. The messages
+     * that are kept are the same as for the limits set by MegaChatApi::setHistoryMemoryLimits.
+     *
+     * The associated request type with this request is MegaChatRequest::TYPE_TRIM_HISTORY_MEMORY
+     *
+     * Valid data in the MegaChatRequest object received in onRequestFinish when the error code
+     * is MegaError::ERROR_OK:
+     * - MegaChatRequest::getNumber - Returns the number of bytes freed
+     *
+     * On the onRequestFinish error, the error code associated to the MegaChatError can be:
+     * - MegaChatError::ERROR_ACCESS - If the chat engine is not initialized yet.
+     *
+     * @param listener MegaChatRequestListener to track this request
+     */
+    void trimHistoryMemory(MegaChatRequestListener *listener = NULL);
+
     /**
      * @brief Initializes karere
      *
@@ -2420,6 +2549,46 @@ public:
      */
     MegaChatMessage *getManualSendingMessage(MegaChatHandle chatid, MegaChatHandle rowid);
 
+    /**
+     * @brief Searches the text of the messages in the local history of one or all chatrooms
+     *
+     * The search is done in a background thread, on an index of the history that is kept in
+     * the local cache, so it covers the messages that have been loaded at some point, in this
+     * or a previous session. Messages are matched if they contain all the words of the query,
+     * or words starting with them, ignoring case and diacritics. The text of attachments and
+     * contacts (their names) is also indexed.
+     *
+     * Results are returned from the newest to the oldest message, a page at a time. To get
+     * the next page, call this function again with the cursor returned by the previous one.
+     *
+     * The associated request type with this request is MegaChatRequest::TYPE_SEARCH_MESSAGES
+     * Valid data in the MegaChatRequest object received on callbacks:
+     * - MegaChatRequest::getChatHandle - Returns the chat identifier
+     * - MegaChatRequest::getText - Returns the query
+     * - MegaChatRequest::getParamType - Returns the maximum number of results
+     *
+     * Valid data in the MegaChatRequest object received in onRequestFinish when the error code
+     * is MegaError::ERROR_OK:
+     * - MegaChatRequest::getMegaChatMessageList - Returns the messages that match the query
+     * - MegaChatRequest::getNumber - Returns the cursor of the next page, or 0 if there are no more results
+     *
+     * On the onRequestFinish error, the error code associated to the MegaChatError can be:
+     * - MegaChatError::ERROR_ARGS - If the query has no words or the limit is not positive.
+     * - MegaChatError::ERROR_NOENT - If the chatroom does not exist.
+     * - MegaChatError::ERROR_ACCESS - If the search index is not available, i.e. because the
+     * SQLite library does not support FTS5.
+     *
+     * @note Messages older than the index are added to it in the background after the app is
+     * upgraded, so they may be missing from the results for a while.
+     *
+     * @param chatid MegaChatHandle that identifies the chat room, or MEGACHAT_INVALID_HANDLE to search all chats
+     * @param query Words to search for
+     * @param limit Maximum number of messages to return
+     * @param cursor 0 for the first page, or the value of MegaChatRequest::getNumber of the previous page
+     * @param listener MegaChatRequestListener to track this request
+     */
+    void searchMessages(MegaChatHandle chatid, const char *query, int limit, long long cursor = 0, MegaChatRequestListener *listener = NULL);
+
     /**
      * @brief Sends a new message to the specified chatroom
      *
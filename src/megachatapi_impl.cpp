@@ -42,6 +42,7 @@
 #include <IGui.h>
 #include <chatClient.h>
 #include <mega/base64.h>
+#include <algorithm>
 
 #ifndef _WIN32
 #include <signal.h>
@@ -69,7 +70,7 @@ MegaChatApiImpl::~MegaChatApiImpl()
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_DELETE);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
     thread.join();
 
     // TODO: destruction of waiter hangs forever or may cause crashes
@@ -97,6 +98,10 @@ void MegaChatApiImpl::init(MegaChatApi *chatApi, MegaApi *megaApi)
 
     //Start blocking thread
     threadExit = 0;
+    mWakeupPending = false;
+    mChatListSnapshot = std::make_shared<ChatListSnapshot>();
+    mChatListSnapshotDirty = false;
+    mChatListSnapshotAllDirty = false;
     thread.start(threadEntryPoint, this);
 }
 
@@ -117,6 +122,7 @@ void *MegaChatApiImpl::threadEntryPoint(void *param)
 
 void MegaChatApiImpl::loop()
 {
+    mApiThreadId = std::this_thread::get_id();
     while (true)
     {
         sdkMutex.unlock();
@@ -127,9 +133,17 @@ void MegaChatApiImpl::loop()
 
         sdkMutex.lock();
 
+        // Anything queued after this point will notify the waiter again
+        mWakeupPending.store(false);
+
         sendPendingEvents();
         sendPendingRequests();
 
+        if (mChatListSnapshotDirty)
+        {
+            publishChatListSnapshot();
+        }
+
         if (threadExit)
         {
             // There must be only one pending events, at maximum: the logout marshall call to delete the client
@@ -142,6 +156,89 @@ void MegaChatApiImpl::loop()
     }
 }
 
+void MegaChatApiImpl::notifyWaiter()
+{
+    // The item has already been pushed to the queue. If a wakeup is already
+    // pending, the API thread will see the item when it processes the queues
+    if (!mWakeupPending.exchange(true))
+    {
+        waiter->notify();
+    }
+}
+
+bool MegaChatApiImpl::isApiThread() const
+{
+    return std::this_thread::get_id() == mApiThreadId.load();
+}
+
+void MegaChatApiImpl::invalidateChatListSnapshot(MegaChatHandle chatid)
+{
+    sdkMutex.lock();
+    if (chatid == MEGACHAT_INVALID_HANDLE)
+    {
+        mChatListSnapshotAllDirty = true;
+    }
+    else
+    {
+        mDirtyChats.insert(chatid);
+    }
+    if (!mChatListSnapshotDirty)
+    {
+        mChatListSnapshotDirty = true;
+        // publish it once the current batch of events has been processed
+        notifyWaiter();
+    }
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::publishChatListSnapshot()
+{
+    std::shared_ptr<const ChatListSnapshot> old = std::atomic_load(&mChatListSnapshot);
+    std::shared_ptr<ChatListSnapshot> snapshot = std::make_shared<ChatListSnapshot>();
+    if (mClient && !terminating)
+    {
+        ChatRoomList::iterator it;
+        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        {
+            ChatRoom *room = it->second;
+            MegaChatHandle chatid = room->chatid();
+            size_t pos = snapshot->items.size();
+            auto oldIt = old->chatIndex.find(chatid);
+            if (!mChatListSnapshotAllDirty && (oldIt != old->chatIndex.end())
+                && (mDirtyChats.find(chatid) == mDirtyChats.end()))
+            {
+                // Building the entries may load history or materialize the chat,
+                // so the unchanged ones are shared with the previous snapshot
+                snapshot->items.push_back(old->items[oldIt->second]);
+                snapshot->rooms.push_back(old->rooms[oldIt->second]);
+            }
+            else
+            {
+                snapshot->items.emplace_back(new MegaChatListItemPrivate(*room));
+                snapshot->rooms.emplace_back(new MegaChatRoomPrivate(*room));
+            }
+            snapshot->chatIndex[chatid] = pos;
+            if (!room->isGroup())
+            {
+                snapshot->peerIndex[snapshot->items.back()->getPeerHandle()] = pos;
+            }
+        }
+    }
+    std::atomic_store(&mChatListSnapshot, std::shared_ptr<const ChatListSnapshot>(std::move(snapshot)));
+    mChatListSnapshotDirty = false;
+    mChatListSnapshotAllDirty = false;
+    mDirtyChats.clear();
+}
+
+std::shared_ptr<const ChatListSnapshot> MegaChatApiImpl::chatListSnapshot()
+{
+    if (isApiThread() && mChatListSnapshotDirty)
+    {
+        return nullptr;
+    }
+    return std::atomic_load(&mChatListSnapshot);
+}
+
 void MegaChatApiImpl::megaApiPostMessage(void* msg, void* ctx)
 {    
     MegaChatApiImpl *megaChatApi = (MegaChatApiImpl *)ctx;
@@ -162,7 +259,7 @@ void MegaChatApiImpl::megaApiPostMessage(void* msg, void* ctx)
 void MegaChatApiImpl::postMessage(void *msg)
 {
     eventQueue.push(msg);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::sendPendingRequests()
@@ -310,6 +407,7 @@ void MegaChatApiImpl::sendPendingRequests()
                 delete mClient;
                 mClient = NULL;
                 terminating = false;
+                invalidateChatListSnapshot();
 
 #ifndef KARERE_DISABLE_WEBRTC
                 cleanCallHandlerMap();
@@ -918,6 +1016,73 @@ void MegaChatApiImpl::sendPendingRequests()
             fireOnChatRequestFinish(request, megaChatError);
             break;
         }
+        case MegaChatRequest::TYPE_SEARCH_MESSAGES:
+        {
+            MegaChatHandle chatid = request->getChatHandle();
+            const char *query = request->getText();
+            int limit = request->getParamType();
+            if (!query || limit <= 0 || MessageSearch::toMatchExpr(query).empty())
+            {
+                errorCode = MegaChatError::ERROR_ARGS;
+                break;
+            }
+            if (chatid != MEGACHAT_INVALID_HANDLE && !findChatRoom(chatid))
+            {
+                errorCode = MegaChatError::ERROR_NOENT;
+                break;
+            }
+            MessageSearch *search = mClient->messageSearch();
+            if (!search)
+            {
+                API_LOG_ERROR("Search messages - The search index is not available");
+                errorCode = MegaChatError::ERROR_ACCESS;
+                break;
+            }
+
+            search->search(chatid, query, limit, request->getNumber())
+            .then([request, this](std::shared_ptr<MessageSearch::Results> results)
+            {
+                MegaChatMessageListPrivate *list = new MegaChatMessageListPrivate;
+                for (auto& item: results->items)
+                {
+                    // the status of the loaded chats is more up to date than the one in db
+                    chatd::Message::Status status = item.status;
+                    std::shared_ptr<chatd::Chat> chat = mClient->chatd ? mClient->chatd->chatFromId(item.chatid) : nullptr;
+                    if (chat)
+                    {
+                        status = chat->getMsgStatus(*item.msg, item.idx);
+                    }
+                    list->addMessage(item.chatid, new MegaChatMessagePrivate(*item.msg, status, item.idx));
+                }
+                request->setMegaChatMessageList(list);
+                delete list;
+                request->setNumber(results->nextCursor);
+                MegaChatErrorPrivate *megaChatError = new MegaChatErrorPrivate(MegaChatError::ERROR_OK);
+                fireOnChatRequestFinish(request, megaChatError);
+            })
+            .fail([request, this](const promise::Error& err)
+            {
+                API_LOG_ERROR("Error searching messages: %s", err.what());
+                MegaChatErrorPrivate *megaChatError = new MegaChatErrorPrivate(err.msg(), err.code(), err.type());
+                fireOnChatRequestFinish(request, megaChatError);
+            });
+            break;
+        }
+        case MegaChatRequest::TYPE_TRIM_HISTORY_MEMORY:
+        {
+            if (!mClient->chatd)
+            {
+                API_LOG_ERROR("Trim history memory - The chat engine is not initialized yet");
+                errorCode = MegaChatError::ERROR_ACCESS;
+                break;
+            }
+            size_t freed = mClient->chatd->trimHistoryMemory();
+            API_LOG_INFO("Trim history memory - %zu bytes freed, %zu still in use", freed, mClient->chatd->historyBytes());
+            request->setNumber(freed);
+            MegaChatErrorPrivate *megaChatError = new MegaChatErrorPrivate(MegaChatError::ERROR_OK);
+            fireOnChatRequestFinish(request, megaChatError);
+            break;
+        }
 #ifndef KARERE_DISABLE_WEBRTC
         case MegaChatRequest::TYPE_START_CHAT_CALL:
         {
@@ -1113,10 +1278,14 @@ void MegaChatApiImpl::sendPendingRequests()
 
 void MegaChatApiImpl::sendPendingEvents()
 {
-    void *msg;
-    while ((msg = eventQueue.pop()))
+    void *msgs[64];
+    size_t count;
+    while ((count = eventQueue.popBatch(msgs, sizeof(msgs)/sizeof(msgs[0]))))
     {
-        megaProcessMessage(msg);
+        for (size_t i = 0; i < count; i++)
+        {
+            megaProcessMessage(msgs[i]);
+        }
     }
 }
 
@@ -1162,6 +1331,44 @@ void MegaChatApiImpl::setLoggerClass(MegaChatLogger *megaLogger)
     }
 }
 
+void MegaChatApiImpl::setDatabaseOptions(bool walMode, bool syncNormal, int cacheSizeKb, int64_t mmapSize, bool asyncWrites, bool compressHistory)
+{
+    sdkMutex.lock();
+    mDbOptions.wal = walMode;
+    mDbOptions.syncNormal = syncNormal;
+    mDbOptions.cacheSizeKb = cacheSizeKb;
+    mDbOptions.mmapSize = mmapSize;
+    mAsyncDbWrites = asyncWrites;
+    mCompressHistory = compressHistory;
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setHistoryMemoryLimits(long long chatBytes, long long totalBytes)
+{
+    size_t chatLimit = (chatBytes > 0) ? (size_t)chatBytes : 0;
+    size_t totalLimit = (totalBytes > 0) ? (size_t)totalBytes : 0;
+    sdkMutex.lock();
+    mChatHistoryMemLimit = chatLimit;
+    mTotalHistoryMemLimit = totalLimit;
+    sdkMutex.unlock();
+
+    // if the client already exists, apply them from the karere thread
+    marshallCall([this, chatLimit, totalLimit]()
+    {
+        if (mClient)
+        {
+            mClient->setHistoryMemoryLimits(chatLimit, totalLimit);
+        }
+    }, this);
+}
+
+void MegaChatApiImpl::trimHistoryMemory(MegaChatRequestListener *listener)
+{
+    MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_TRIM_HISTORY_MEMORY, listener);
+    requestQueue.push(request);
+    notifyWaiter();
+}
+
 int MegaChatApiImpl::init(const char *sid)
 {
     sdkMutex.lock();
@@ -1176,6 +1383,9 @@ int MegaChatApiImpl::init(const char *sid)
         terminating = false;
     }
 
+    mClient->setDbOptions(mDbOptions, mAsyncDbWrites, mCompressHistory);
+    mClient->setSearchTextFunc(&JSonUtils::getSearchableText);
+    mClient->setHistoryMemoryLimits(mChatHistoryMemLimit, mTotalHistoryMemLimit);
     int state = mClient->init(sid);
     if (state != karere::Client::kInitErrNoCache &&
             state != karere::Client::kInitWaitingNewSession &&
@@ -1185,6 +1395,8 @@ int MegaChatApiImpl::init(const char *sid)
         localLogout();
     }
 
+    // chats may have been loaded from the cache
+    invalidateChatListSnapshot();
     sdkMutex.unlock();
 
     return MegaChatApiImpl::convertInitState(state);
@@ -1426,6 +1638,8 @@ void MegaChatApiImpl::fireOnChatLocalVideoData(MegaChatHandle chatid, int width,
 
 void MegaChatApiImpl::fireOnChatListItemUpdate(MegaChatListItem *item)
 {
+    invalidateChatListSnapshot(item->getChatId());
+
     for(set<MegaChatListener *>::iterator it = listeners.begin(); it != listeners.end() ; it++)
     {
         (*it)->onChatListItemUpdate(chatApi, item);
@@ -1436,6 +1650,8 @@ void MegaChatApiImpl::fireOnChatListItemUpdate(MegaChatListItem *item)
 
 void MegaChatApiImpl::fireOnChatInitStateUpdate(int newState)
 {
+    invalidateChatListSnapshot();
+
     for(set<MegaChatListener *>::iterator it = listeners.begin(); it != listeners.end() ; it++)
     {
         (*it)->onChatInitStateUpdate(chatApi, newState);
@@ -1470,7 +1686,7 @@ void MegaChatApiImpl::fireOnChatConnectionStateUpdate(MegaChatHandle chatid, int
         ChatRoomList::iterator it;
         for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
         {
-            if (it->second->isActive() && it->second->chat().onlineState() != chatd::kChatStateOnline)
+            if (it->second->isActive() && it->second->chatdOnlineState() != chatd::kChatStateOnline)
             {
                 allConnected = false;
                 break;
@@ -1503,7 +1719,7 @@ void MegaChatApiImpl::connect(MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_CONNECT, listener);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::connectInBackground(MegaChatRequestListener *listener)
@@ -1511,14 +1727,14 @@ void MegaChatApiImpl::connectInBackground(MegaChatRequestListener *listener)
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_CONNECT, listener);
     request->setFlag(true);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::disconnect(MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_DISCONNECT, listener);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 int MegaChatApiImpl::getConnectionState()
@@ -1551,7 +1767,7 @@ void MegaChatApiImpl::retryPendingConnections(MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_RETRY_PENDING_CONNECTIONS, listener);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::logout(MegaChatRequestListener *listener)
@@ -1559,7 +1775,7 @@ void MegaChatApiImpl::logout(MegaChatRequestListener *listener)
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_LOGOUT, listener);
     request->setFlag(true);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::localLogout(MegaChatRequestListener *listener)
@@ -1567,7 +1783,7 @@ void MegaChatApiImpl::localLogout(MegaChatRequestListener *listener)
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_LOGOUT, listener);
     request->setFlag(false);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::setOnlineStatus(int status, MegaChatRequestListener *listener)
@@ -1575,7 +1791,7 @@ void MegaChatApiImpl::setOnlineStatus(int status, MegaChatRequestListener *liste
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SET_ONLINE_STATUS, listener);
     request->setNumber(status);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::setPresenceAutoaway(bool enable, int64_t timeout, MegaChatRequestListener *listener)
@@ -1584,7 +1800,7 @@ void MegaChatApiImpl::setPresenceAutoaway(bool enable, int64_t timeout, MegaChat
     request->setFlag(enable);
     request->setNumber(timeout);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::setPresencePersist(bool enable, MegaChatRequestListener *listener)
@@ -1592,14 +1808,14 @@ void MegaChatApiImpl::setPresencePersist(bool enable, MegaChatRequestListener *l
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SET_PRESENCE_PERSIST, listener);
     request->setFlag(enable);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::signalPresenceActivity(MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SIGNAL_ACTIVITY, listener);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 MegaChatPresenceConfig *MegaChatApiImpl::getPresenceConfig()
@@ -1702,7 +1918,7 @@ void MegaChatApiImpl::setBackgroundStatus(bool background, MegaChatRequestListen
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SET_BACKGROUND_STATUS, listener);
     request->setFlag(background);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::getUserFirstname(MegaChatHandle userhandle, MegaChatRequestListener *listener)
@@ -1710,7 +1926,7 @@ void MegaChatApiImpl::getUserFirstname(MegaChatHandle userhandle, MegaChatReques
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_GET_FIRSTNAME, listener);
     request->setUserHandle(userhandle);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::getUserLastname(MegaChatHandle userhandle, MegaChatRequestListener *listener)
@@ -1718,7 +1934,7 @@ void MegaChatApiImpl::getUserLastname(MegaChatHandle userhandle, MegaChatRequest
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_GET_LASTNAME, listener);
     request->setUserHandle(userhandle);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::getUserEmail(MegaChatHandle userhandle, MegaChatRequestListener *listener)
@@ -1726,7 +1942,7 @@ void MegaChatApiImpl::getUserEmail(MegaChatHandle userhandle, MegaChatRequestLis
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_GET_EMAIL, listener);
     request->setUserHandle(userhandle);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 char *MegaChatApiImpl::getContactEmail(MegaChatHandle userhandle)
@@ -1815,6 +2031,16 @@ MegaChatRoomList *MegaChatApiImpl::getChatRooms()
 {
     MegaChatRoomListPrivate *chats = new MegaChatRoomListPrivate();
 
+    std::shared_ptr<const ChatListSnapshot> snapshot = chatListSnapshot();
+    if (snapshot)
+    {
+        for (auto& room: snapshot->rooms)
+        {
+            chats->addChatRoom(new MegaChatRoomPrivate(room.get()));
+        }
+        return chats;
+    }
+
     sdkMutex.lock();
 
     if (mClient && !terminating)
@@ -1835,6 +2061,17 @@ MegaChatRoom *MegaChatApiImpl::getChatRoom(MegaChatHandle chatid)
 {
     MegaChatRoomPrivate *chat = NULL;
 
+    std::shared_ptr<const ChatListSnapshot> snapshot = chatListSnapshot();
+    if (snapshot)
+    {
+        auto it = snapshot->chatIndex.find(chatid);
+        if (it != snapshot->chatIndex.end())
+        {
+            chat = new MegaChatRoomPrivate(snapshot->rooms[it->second].get());
+        }
+        return chat;
+    }
+
     sdkMutex.lock();
 
     ChatRoom *chatRoom = findChatRoom(chatid);
@@ -1852,6 +2089,17 @@ MegaChatRoom *MegaChatApiImpl::getChatRoomByUser(MegaChatHandle userhandle)
 {
     MegaChatRoomPrivate *chat = NULL;
 
+    std::shared_ptr<const ChatListSnapshot> snapshot = chatListSnapshot();
+    if (snapshot)
+    {
+        auto it = snapshot->peerIndex.find(userhandle);
+        if (it != snapshot->peerIndex.end())
+        {
+            chat = new MegaChatRoomPrivate(snapshot->rooms[it->second].get());
+        }
+        return chat;
+    }
+
     sdkMutex.lock();
 
     ChatRoom *chatRoom = findChatRoomByUser(userhandle);
@@ -1869,6 +2117,16 @@ MegaChatListItemList *MegaChatApiImpl::getChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
+    std::shared_ptr<const ChatListSnapshot> snapshot = chatListSnapshot();
+    if (snapshot)
+    {
+        for (auto& item: snapshot->items)
+        {
+            items->addChatListItem(new MegaChatListItemPrivate(item.get()));
+        }
+        return items;
+    }
+
     sdkMutex.lock();
 
     if (mClient && !terminating)
@@ -1889,6 +2147,17 @@ MegaChatListItem *MegaChatApiImpl::getChatListItem(MegaChatHandle chatid)
 {
     MegaChatListItemPrivate *item = NULL;
 
+    std::shared_ptr<const ChatListSnapshot> snapshot = chatListSnapshot();
+    if (snapshot)
+    {
+        auto it = snapshot->chatIndex.find(chatid);
+        if (it != snapshot->chatIndex.end())
+        {
+            item = new MegaChatListItemPrivate(snapshot->items[it->second].get());
+        }
+        return item;
+    }
+
     sdkMutex.lock();
 
     ChatRoom *chatRoom = findChatRoom(chatid);
@@ -1906,6 +2175,19 @@ int MegaChatApiImpl::getUnreadChats()
 {
     int count = 0;
 
+    std::shared_ptr<const ChatListSnapshot> snapshot = chatListSnapshot();
+    if (snapshot)
+    {
+        for (auto& item: snapshot->items)
+        {
+            if (item->isActive() && item->getUnreadCount())
+            {
+                count++;
+            }
+        }
+        return count;
+    }
+
     sdkMutex.lock();
 
     if (mClient && !terminating)
@@ -1914,7 +2196,7 @@ int MegaChatApiImpl::getUnreadChats()
         for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
         {
             ChatRoom *room = it->second;
-            if (room->isActive() && room->chat().unreadMsgCount())
+            if (room->isActive() && room->unreadMsgCount())
             {
                 count++;
             }
@@ -1930,6 +2212,19 @@ MegaChatListItemList *MegaChatApiImpl::getActiveChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
+    std::shared_ptr<const ChatListSnapshot> snapshot = chatListSnapshot();
+    if (snapshot)
+    {
+        for (auto& item: snapshot->items)
+        {
+            if (item->isActive())
+            {
+                items->addChatListItem(new MegaChatListItemPrivate(item.get()));
+            }
+        }
+        return items;
+    }
+
     sdkMutex.lock();
 
     if (mClient && !terminating)
@@ -1953,6 +2248,19 @@ MegaChatListItemList *MegaChatApiImpl::getInactiveChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
+    std::shared_ptr<const ChatListSnapshot> snapshot = chatListSnapshot();
+    if (snapshot)
+    {
+        for (auto& item: snapshot->items)
+        {
+            if (!item->isActive())
+            {
+                items->addChatListItem(new MegaChatListItemPrivate(item.get()));
+            }
+        }
+        return items;
+    }
+
     sdkMutex.lock();
 
     if (mClient && !terminating)
@@ -1976,6 +2284,19 @@ MegaChatListItemList *MegaChatApiImpl::getUnreadChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
+    std::shared_ptr<const ChatListSnapshot> snapshot = chatListSnapshot();
+    if (snapshot)
+    {
+        for (auto& item: snapshot->items)
+        {
+            if (item->isActive() && item->getUnreadCount())
+            {
+                items->addChatListItem(new MegaChatListItemPrivate(item.get()));
+            }
+        }
+        return items;
+    }
+
     sdkMutex.lock();
 
     if (mClient && !terminating)
@@ -1984,7 +2305,7 @@ MegaChatListItemList *MegaChatApiImpl::getUnreadChatListItems()
         for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
         {
             ChatRoom *room = it->second;
-            if (room->isActive() && room->chat().unreadMsgCount())
+            if (room->isActive() && room->unreadMsgCount())
             {
                 items->addChatListItem(new MegaChatListItemPrivate(*it->second));
             }
@@ -2000,6 +2321,17 @@ MegaChatHandle MegaChatApiImpl::getChatHandleByUser(MegaChatHandle userhandle)
 {
     MegaChatHandle chatid = MEGACHAT_INVALID_HANDLE;
 
+    std::shared_ptr<const ChatListSnapshot> snapshot = chatListSnapshot();
+    if (snapshot)
+    {
+        auto it = snapshot->peerIndex.find(userhandle);
+        if (it != snapshot->peerIndex.end())
+        {
+            chatid = snapshot->items[it->second]->getChatId();
+        }
+        return chatid;
+    }
+
     sdkMutex.lock();
 
     ChatRoom *chatRoom = findChatRoomByUser(userhandle);
@@ -2019,7 +2351,7 @@ void MegaChatApiImpl::createChat(bool group, MegaChatPeerList *peerList, MegaCha
     request->setFlag(group);
     request->setMegaChatPeerList(peerList);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::inviteToChat(MegaChatHandle chatid, MegaChatHandle uh, int privilege, MegaChatRequestListener *listener)
@@ -2029,7 +2361,7 @@ void MegaChatApiImpl::inviteToChat(MegaChatHandle chatid, MegaChatHandle uh, int
     request->setUserHandle(uh);
     request->setPrivilege(privilege);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::removeFromChat(MegaChatHandle chatid, MegaChatHandle uh, MegaChatRequestListener *listener)
@@ -2038,7 +2370,7 @@ void MegaChatApiImpl::removeFromChat(MegaChatHandle chatid, MegaChatHandle uh, M
     request->setChatHandle(chatid);
     request->setUserHandle(uh);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::updateChatPermissions(MegaChatHandle chatid, MegaChatHandle uh, int privilege, MegaChatRequestListener *listener)
@@ -2048,7 +2380,7 @@ void MegaChatApiImpl::updateChatPermissions(MegaChatHandle chatid, MegaChatHandl
     request->setUserHandle(uh);
     request->setPrivilege(privilege);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::truncateChat(MegaChatHandle chatid, MegaChatHandle messageid, MegaChatRequestListener *listener)
@@ -2057,7 +2389,7 @@ void MegaChatApiImpl::truncateChat(MegaChatHandle chatid, MegaChatHandle message
     request->setChatHandle(chatid);
     request->setUserHandle(messageid);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::setChatTitle(MegaChatHandle chatid, const char *title, MegaChatRequestListener *listener)
@@ -2066,7 +2398,7 @@ void MegaChatApiImpl::setChatTitle(MegaChatHandle chatid, const char *title, Meg
     request->setChatHandle(chatid);
     request->setText(title);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 bool MegaChatApiImpl::openChatRoom(MegaChatHandle chatid, MegaChatRoomListener *listener)
@@ -2192,6 +2524,17 @@ MegaChatMessage *MegaChatApiImpl::getMessage(MegaChatHandle chatid, MegaChatHand
     return megaMsg;
 }
 
+void MegaChatApiImpl::searchMessages(MegaChatHandle chatid, const char *query, int limit, long long cursor, MegaChatRequestListener *listener)
+{
+    MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SEARCH_MESSAGES, listener);
+    request->setChatHandle(chatid);
+    request->setText(query);
+    request->setParamType(limit);
+    request->setNumber(cursor);
+    requestQueue.push(request);
+    notifyWaiter();
+}
+
 MegaChatMessage *MegaChatApiImpl::getManualSendingMessage(MegaChatHandle chatid, MegaChatHandle rowid)
 {
 
@@ -2351,7 +2694,7 @@ void MegaChatApiImpl::attachNodes(MegaChatHandle chatid, MegaNodeList *nodes, Me
     request->setChatHandle(chatid);
     request->setMegaNodeList(nodes);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::attachNode(MegaChatHandle chatid, MegaChatHandle nodehandle, MegaChatRequestListener *listener)
@@ -2360,7 +2703,7 @@ void MegaChatApiImpl::attachNode(MegaChatHandle chatid, MegaChatHandle nodehandl
     request->setChatHandle(chatid);
     request->setUserHandle(nodehandle);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::revokeAttachment(MegaChatHandle chatid, MegaChatHandle handle, MegaChatRequestListener *listener)
@@ -2369,7 +2712,7 @@ void MegaChatApiImpl::revokeAttachment(MegaChatHandle chatid, MegaChatHandle han
     request->setChatHandle(chatid);
     request->setUserHandle(handle);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 bool MegaChatApiImpl::isRevoked(MegaChatHandle chatid, MegaChatHandle nodeHandle)
@@ -2527,7 +2870,7 @@ void MegaChatApiImpl::sendTypingNotification(MegaChatHandle chatid, MegaChatRequ
     request->setChatHandle(chatid);
     request->setFlag(true);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::sendStopTypingNotification(MegaChatHandle chatid, MegaChatRequestListener *listener)
@@ -2536,7 +2879,7 @@ void MegaChatApiImpl::sendStopTypingNotification(MegaChatHandle chatid, MegaChat
     request->setChatHandle(chatid);
     request->setFlag(false);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 bool MegaChatApiImpl::isMessageReceptionConfirmationActive() const
@@ -2637,7 +2980,7 @@ void MegaChatApiImpl::startChatCall(MegaChatHandle chatid, bool enableVideo, Meg
     request->setChatHandle(chatid);
     request->setFlag(enableVideo);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::answerChatCall(MegaChatHandle chatid, bool enableVideo, MegaChatRequestListener *listener)
@@ -2646,7 +2989,7 @@ void MegaChatApiImpl::answerChatCall(MegaChatHandle chatid, bool enableVideo, Me
     request->setChatHandle(chatid);
     request->setFlag(enableVideo);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::hangChatCall(MegaChatHandle chatid, MegaChatRequestListener *listener)
@@ -2654,7 +2997,7 @@ void MegaChatApiImpl::hangChatCall(MegaChatHandle chatid, MegaChatRequestListene
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_HANG_CHAT_CALL, listener);
     request->setChatHandle(chatid);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::hangAllChatCalls(MegaChatRequestListener *listener = NULL)
@@ -2662,7 +3005,7 @@ void MegaChatApiImpl::hangAllChatCalls(MegaChatRequestListener *listener = NULL)
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_HANG_CHAT_CALL, listener);
     request->setChatHandle(MEGACHAT_INVALID_HANDLE);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::setAudioEnable(MegaChatHandle chatid, bool enable, MegaChatRequestListener *listener)
@@ -2672,7 +3015,7 @@ void MegaChatApiImpl::setAudioEnable(MegaChatHandle chatid, bool enable, MegaCha
     request->setFlag(enable);
     request->setParamType(MegaChatRequest::AUDIO);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::setVideoEnable(MegaChatHandle chatid, bool enable, MegaChatRequestListener *listener)
@@ -2682,14 +3025,14 @@ void MegaChatApiImpl::setVideoEnable(MegaChatHandle chatid, bool enable, MegaCha
     request->setFlag(enable);
     request->setParamType(MegaChatRequest::VIDEO);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::loadAudioVideoDeviceList(MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_LOAD_AUDIO_VIDEO_DEVICES, listener);
     requestQueue.push(request);
-    waiter->notify();
+    notifyWaiter();
 }
 
 void MegaChatApiImpl::setIgnoredCall(MegaChatHandle chatId)
@@ -3138,6 +3481,13 @@ void MegaChatApiImpl::onChatNotification(karere::Id chatid, const Message &msg,
     fireOnChatNotification(chatid, message);
 }
 
+void MegaChatApiImpl::onChatMemberInfoChanged(karere::Id chatid)
+{
+    // Must happen before the room handler builds the room for its update, or
+    // it would be built from the snapshot, with the old member names
+    invalidateChatListSnapshot(chatid);
+}
+
 int MegaChatApiImpl::convertInitState(int state)
 {
     switch (state)
@@ -3237,6 +3587,7 @@ void MegaChatApiImpl::removeGroupChatItem(IGroupChatListItem &item)
 //            listItem->setClosed();
 //            fireOnChatListItemUpdate(listItem);
 
+            invalidateChatListSnapshot((*it)->getChatRoom().chatid());
             delete (itemHandler);
             chatGroupListItemHandler.erase(it);
             return;
@@ -3259,6 +3610,7 @@ void MegaChatApiImpl::removePeerChatItem(IPeerChatListItem &item)
 //            listItem->setClosed();
 //            fireOnChatListItemUpdate(listItem);
 
+            invalidateChatListSnapshot((*it)->getChatRoom().chatid());
             delete (itemHandler);
             chatPeerListItemHandler.erase(it);
             return;
@@ -3289,106 +3641,64 @@ void MegaChatApiImpl::onPresenceConfigChanged(const presenced::Config &state, bo
 
 ChatRequestQueue::ChatRequestQueue()
 {
-    mutex.init(false);
 }
 
 void ChatRequestQueue::push(MegaChatRequestPrivate *request)
 {
-    mutex.lock();
-    requests.push_back(request);
-    mutex.unlock();
-}
-
-void ChatRequestQueue::push_front(MegaChatRequestPrivate *request)
-{
-    mutex.lock();
-    requests.push_front(request);
-    mutex.unlock();
+    requests.push(request);
 }
 
 MegaChatRequestPrivate *ChatRequestQueue::pop()
 {
-    mutex.lock();
-    if(requests.empty())
+    MegaChatRequestPrivate *request;
+    if (!requests.pop(request))
     {
-        mutex.unlock();
         return NULL;
     }
-    MegaChatRequestPrivate *request = requests.front();
-    requests.pop_front();
-    mutex.unlock();
     return request;
 }
 
 void ChatRequestQueue::removeListener(MegaChatRequestListener *listener)
 {
-    mutex.lock();
-
-    deque<MegaChatRequestPrivate *>::iterator it = requests.begin();
-    while(it != requests.end())
+    requests.forEach([listener](MegaChatRequestPrivate *request)
     {
-        MegaChatRequestPrivate *request = (*it);
-        if(request->getListener()==listener)
+        if (request->getListener() == listener)
             request->setListener(NULL);
-        it++;
-    }
-
-    mutex.unlock();
+    });
 }
 
 EventQueue::EventQueue()
 {
-    mutex.init(false);
-}
-
-void EventQueue::push(void *transfer)
-{
-    mutex.lock();
-    events.push_back(transfer);
-    mutex.unlock();
 }
 
-void EventQueue::push_front(void *event)
+void EventQueue::push(void *event)
 {
-    mutex.lock();
-    events.push_front(event);
-    mutex.unlock();
+    events.push(event);
 }
 
 void* EventQueue::pop()
 {
-    mutex.lock();
-    if(events.empty())
+    void *event;
+    if (!events.pop(event))
     {
-        mutex.unlock();
         return NULL;
     }
-    void* event = events.front();
-    events.pop_front();
-    mutex.unlock();
     return event;
 }
 
-bool EventQueue::isEmpty()
+size_t EventQueue::popBatch(void **out, size_t maxCount)
 {
-    bool ret;
-
-    mutex.lock();
-    ret = events.empty();
-    mutex.unlock();
+    return events.popBatch(out, maxCount);
+}
 
-    return ret;
+bool EventQueue::isEmpty()
+{
+    return events.empty();
 }
 
 size_t EventQueue::size()
 {
-    size_t ret;
-
-    mutex.lock();
-    ret = events.size();
-    mutex.unlock();
-
-    return ret;
+    return events.size();
 }
 
 MegaChatRequestPrivate::MegaChatRequestPrivate(int type, MegaChatRequestListener *listener)
@@ -3407,6 +3717,8 @@ MegaChatRequestPrivate::MegaChatRequestPrivate(int type, MegaChatRequestListener
     this->text = NULL;
     this->mMessage = NULL;
     this->mMegaNodeList = NULL;
+    this->mMessageList = NULL;
+    this->mParamType = 0;
 }
 
 MegaChatRequestPrivate::MegaChatRequestPrivate(MegaChatRequestPrivate &request)
@@ -3415,6 +3727,7 @@ MegaChatRequestPrivate::MegaChatRequestPrivate(MegaChatRequestPrivate &request)
     this->peerList = NULL;
     this->mMessage = NULL;
     this->mMegaNodeList = NULL;
+    this->mMessageList = NULL;
 
     this->type = request.getType();
     this->listener = request.getListener();
@@ -3429,6 +3742,8 @@ MegaChatRequestPrivate::MegaChatRequestPrivate(MegaChatRequestPrivate &request)
     this->setText(request.getText());
     this->setMegaChatMessage(request.getMegaChatMessage());
     this->setMegaNodeList(request.getMegaNodeList());
+    this->setMegaChatMessageList(request.getMegaChatMessageList());
+    this->setParamType(request.getParamType());
 }
 
 MegaChatRequestPrivate::~MegaChatRequestPrivate()
@@ -3437,6 +3752,7 @@ MegaChatRequestPrivate::~MegaChatRequestPrivate()
     delete [] text;
     delete mMessage;
     delete mMegaNodeList;
+    delete mMessageList;
 }
 
 MegaChatRequest *MegaChatRequestPrivate::copy()
@@ -3471,6 +3787,8 @@ const char *MegaChatRequestPrivate::getRequestString() const
         case TYPE_DISABLE_AUDIO_VIDEO_CALL: return "DISABLE_AUDIO_VIDEO_CALL";
         case TYPE_HANG_CHAT_CALL: return "HANG_CHAT_CALL";
         case TYPE_LOAD_AUDIO_VIDEO_DEVICES: return "LOAD_AUDIO_VIDEO_DEVICES";
+        case TYPE_SEARCH_MESSAGES: return "SEARCH_MESSAGES";
+        case TYPE_TRIM_HISTORY_MEMORY: return "TRIM_HISTORY_MEMORY";
         case TYPE_ATTACH_NODE_MESSAGE: return "ATTACH_NODE_MESSAGE";
         case TYPE_REVOKE_NODE_MESSAGE: return "REVOKE_NODE_MESSAGE";
         case TYPE_SHARE_CONTACT: return "SHARE_CONTACT";
@@ -3639,6 +3957,21 @@ void MegaChatRequestPrivate::setParamType(int paramType)
     this->mParamType = paramType;
 }
 
+MegaChatMessageList *MegaChatRequestPrivate::getMegaChatMessageList()
+{
+    return mMessageList;
+}
+
+void MegaChatRequestPrivate::setMegaChatMessageList(MegaChatMessageList *messageList)
+{
+    if (mMessageList != NULL)
+    {
+        delete mMessageList;
+    }
+
+    mMessageList = messageList ? messageList->copy() : NULL;
+}
+
 #ifndef KARERE_DISABLE_WEBRTC
 
 MegaChatCallPrivate::MegaChatCallPrivate(const rtcModule::ICall& call)
@@ -3979,6 +4312,8 @@ void MegaChatRoomHandler::removeChatRoomListener(MegaChatRoomListener *listener)
 
 void MegaChatRoomHandler::fireOnChatRoomUpdate(MegaChatRoom *chat)
 {
+    chatApiImpl->invalidateChatListSnapshot(chat->getChatId());
+
     for(set<MegaChatRoomListener *>::iterator it = roomListeners.begin(); it != roomListeners.end() ; it++)
     {
         (*it)->onChatRoomUpdate(chatApi, chat);
@@ -4151,6 +4486,8 @@ std::set<MegaChatHandle> *MegaChatRoomHandler::handleNewMessage(MegaChatMessage
 
 void MegaChatRoomHandler::onMemberNameChanged(uint64_t userid, const std::string &newName)
 {
+    // the snapshot has already been invalidated by onChatMemberInfoChanged(),
+    // so the room is built from the live chat, with the new name
     MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
     chat->setMembersUpdated();
 
@@ -4560,7 +4897,7 @@ MegaChatRoomPrivate::MegaChatRoomPrivate(const ChatRoom &chat)
     this->priv = (privilege_t) chat.ownPriv();
     this->group = chat.isGroup();
     this->title = chat.titleString();
-    this->unreadCount = chat.chat().unreadMsgCount();
+    this->unreadCount = chat.unreadMsgCount();
     this->active = chat.isActive();
     this->uh = MEGACHAT_INVALID_HANDLE;
 
@@ -4986,7 +5323,7 @@ MegaChatListItemPrivate::MegaChatListItemPrivate(ChatRoom &chatroom)
 {
     this->chatid = chatroom.chatid();
     this->title = chatroom.titleString();
-    this->unreadCount = chatroom.chat().unreadMsgCount();
+    this->unreadCount = chatroom.unreadMsgCount();
     this->group = chatroom.isGroup();
     this->active = chatroom.isActive();
     this->ownPriv = chatroom.ownPriv();
@@ -4996,7 +5333,7 @@ MegaChatListItemPrivate::MegaChatListItemPrivate(ChatRoom &chatroom)
     LastTextMsg tmp;
     LastTextMsg *message = &tmp;
     LastTextMsg *&msg = message;
-    uint8_t lastMsgStatus = chatroom.chat().lastTextMessage(msg);
+    uint8_t lastMsgStatus = chatroom.lastTextMessage(msg);
     if (lastMsgStatus == LastTextMsgState::kHave)
     {
         this->lastMsg = JSonUtils::getLastMessageContent(msg->contents(), msg->type());
@@ -5019,7 +5356,7 @@ MegaChatListItemPrivate::MegaChatListItemPrivate(ChatRoom &chatroom)
         this->mLastMsgId = MEGACHAT_INVALID_HANDLE;
     }
 
-    this->lastTs = chatroom.chat().lastMessageTs();
+    this->lastTs = chatroom.lastMessageTs();
 }
 
 MegaChatListItemPrivate::MegaChatListItemPrivate(const MegaChatListItem *item)
@@ -5943,6 +6280,68 @@ void MegaChatListItemListPrivate::addChatListItem(MegaChatListItem *item)
     list.push_back(item);
 }
 
+MegaChatMessageListPrivate::MegaChatMessageListPrivate()
+{
+}
+
+MegaChatMessageListPrivate::~MegaChatMessageListPrivate()
+{
+    for (unsigned int i = 0; i < list.size(); i++)
+    {
+        delete list[i].second;
+        list[i].second = NULL;
+    }
+
+    list.clear();
+}
+
+MegaChatMessageListPrivate::MegaChatMessageListPrivate(const MegaChatMessageListPrivate *list)
+{
+    for (unsigned int i = 0; i < list->size(); i++)
+    {
+        this->list.push_back(std::make_pair(list->getChatHandle(i), list->get(i)->copy()));
+    }
+}
+
+MegaChatMessageListPrivate *MegaChatMessageListPrivate::copy() const
+{
+    return new MegaChatMessageListPrivate(this);
+}
+
+const MegaChatMessage *MegaChatMessageListPrivate::get(unsigned int i) const
+{
+    if (i >= size())
+    {
+        return NULL;
+    }
+    else
+    {
+        return list.at(i).second;
+    }
+}
+
+MegaChatHandle MegaChatMessageListPrivate::getChatHandle(unsigned int i) const
+{
+    if (i >= size())
+    {
+        return MEGACHAT_INVALID_HANDLE;
+    }
+    else
+    {
+        return list.at(i).first;
+    }
+}
+
+unsigned int MegaChatMessageListPrivate::size() const
+{
+    return list.size();
+}
+
+void MegaChatMessageListPrivate::addMessage(MegaChatHandle chatid, MegaChatMessage *msg)
+{
+    list.push_back(std::make_pair(chatid, msg));
+}
+
 MegaChatPresenceConfigPrivate::MegaChatPresenceConfigPrivate(const MegaChatPresenceConfigPrivate &config)
 {
     this->status = config.getOnlineStatus();
@@ -6410,6 +6809,36 @@ string JSonUtils::getLastMessageContent(const string& content, uint8_t type)
     return messageContents;
 }
 
+string JSonUtils::getSearchableText(const chatd::Message &msg)
+{
+    switch (msg.type)
+    {
+        case chatd::Message::kMsgNormal:
+            // skip deleted messages and special messages, which start with a zero byte
+            if (msg.empty() || msg.buf()[0] == 0)
+            {
+                return std::string();
+            }
+            return std::string(msg.buf(), msg.dataSize());
+
+        case chatd::Message::kMsgAttachment:
+        case chatd::Message::kMsgContact:
+        case chatd::Message::kMsgContainsMeta:
+        {
+            if (msg.dataSize() < 3)
+            {
+                return std::string();
+            }
+            std::string text = getLastMessageContent(std::string(msg.buf(), msg.dataSize()), msg.type);
+            // names of nodes and contacts are separated by 0x01
+            std::replace(text.begin(), text.end(), (char)0x01, ' ');
+            return text;
+        }
+        default:
+            return std::string();
+    }
+}
+
 string JSonUtils::parseContainsMeta(const char *json)
 {
     switch (json[0])
@@ -41,10 +41,14 @@
 #include <sdkApi.h>
 #include <karereCommon.h>
 #include <logger.h>
+#include <base/mpscQueue.h>
 
 #include "net/websocketsIO.h"
 
 #include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <thread>
 
 #ifdef USE_LIBWEBSOCKETS
 
@@ -91,6 +95,7 @@ public:
     virtual MegaChatMessage *getMegaChatMessage();
     virtual mega::MegaNodeList *getMegaNodeList();
     virtual int getParamType();
+    virtual MegaChatMessageList *getMegaChatMessageList();
 
     void setTag(int tag);
     void setListener(MegaChatRequestListener *listener);
@@ -105,6 +110,7 @@ public:
     void setMegaChatMessage(MegaChatMessage *message);
     void setMegaNodeList(mega::MegaNodeList *nodelist);
     void setParamType(int paramType);
+    void setMegaChatMessageList(MegaChatMessageList *messageList);
 
 protected:
     int type;
@@ -122,6 +128,7 @@ protected:
     MegaChatMessage* mMessage;
     mega::MegaNodeList* mMegaNodeList;
     int mParamType;
+    MegaChatMessageList *mMessageList;
 };
 
 class MegaChatPresenceConfigPrivate : public MegaChatPresenceConfig
@@ -555,6 +562,24 @@ private:
     std::vector<MegaChatListItem*> list;
 };
 
+class MegaChatMessageListPrivate :  public MegaChatMessageList
+{
+public:
+    MegaChatMessageListPrivate();
+    virtual ~MegaChatMessageListPrivate();
+    virtual MegaChatMessageListPrivate *copy() const;
+
+    virtual const MegaChatMessage *get(unsigned int i) const;
+    virtual MegaChatHandle getChatHandle(unsigned int i) const;
+    virtual unsigned int size() const;
+
+    void addMessage(MegaChatHandle chatid, MegaChatMessage *msg);
+
+private:
+    MegaChatMessageListPrivate(const MegaChatMessageListPrivate *list);
+    std::vector<std::pair<MegaChatHandle, MegaChatMessage*>> list;
+};
+
 class MegaChatRoomPrivate : public MegaChatRoom
 {
 public:
@@ -703,37 +728,46 @@ private:
     mega::MegaNodeList* megaNodeList;
 };
 
-//Thread safe request queue
+//Thread safe request queue. Requests can be pushed from any thread without
+//locking, but must be popped only by the API thread, with sdkMutex locked
 class ChatRequestQueue
 {
     protected:
-        std::deque<MegaChatRequestPrivate *> requests;
-        mega::MegaMutex mutex;
+        karere::MpscQueue<MegaChatRequestPrivate *> requests;
 
     public:
         ChatRequestQueue();
         void push(MegaChatRequestPrivate *request);
-        void push_front(MegaChatRequestPrivate *request);
         MegaChatRequestPrivate * pop();
         void removeListener(MegaChatRequestListener *listener);
 };
 
-//Thread safe transfer queue
+//Thread safe event queue. Same threading rules as ChatRequestQueue
 class EventQueue
 {
 protected:
-    std::deque<void *> events;
-    mega::MegaMutex mutex;
+    karere::MpscQueue<void *> events;
 
 public:
     EventQueue();
     void push(void* event);
-    void push_front(void *event);
     void* pop();
+    size_t popBatch(void** out, size_t maxCount);
     bool isEmpty();
     size_t size();
 };
 
+// Immutable copy of the chat list and room metadata, published by the API
+// thread so that getters called from other threads don't need sdkMutex.
+// The entries of unchanged chats are shared between successive snapshots
+struct ChatListSnapshot
+{
+    std::vector<std::shared_ptr<const MegaChatRoomPrivate>> rooms;
+    std::vector<std::shared_ptr<const MegaChatListItemPrivate>> items;  // same order as rooms
+    std::map<MegaChatHandle, size_t> chatIndex;     // chatid -> position
+    std::map<MegaChatHandle, size_t> peerIndex;     // peer of 1on1 chat -> position
+};
+
 class MegaChatApiImpl :
         public karere::IApp,
         public karere::IApp::IChatListHandler
@@ -755,8 +789,31 @@ private:
 
     mega::MegaThread thread;
     int threadExit;
+    // Set when the waiter has been notified and the API thread has not yet
+    // started processing the queues, to avoid redundant notifications
+    std::atomic<bool> mWakeupPending;
     static void *threadEntryPoint(void *param);
     void loop();
+    // Wakes up the API thread, unless it's already been woken up
+    void notifyWaiter();
+
+    // The chat list snapshot is replaced (never modified) by the API thread,
+    // and readers keep the old one alive while they copy from it
+    std::shared_ptr<const ChatListSnapshot> mChatListSnapshot;
+    bool mChatListSnapshotDirty;    // protected by sdkMutex
+    bool mChatListSnapshotAllDirty; // protected by sdkMutex
+    std::set<MegaChatHandle> mDirtyChats;   // protected by sdkMutex
+    SqliteDb::Options mDbOptions;   // protected by sdkMutex
+    bool mAsyncDbWrites = true;     // protected by sdkMutex
+    bool mCompressHistory = false;  // protected by sdkMutex
+    size_t mChatHistoryMemLimit = 0;    // protected by sdkMutex
+    size_t mTotalHistoryMemLimit = 0;   // protected by sdkMutex
+    std::atomic<std::thread::id> mApiThreadId;
+    bool isApiThread() const;
+    void publishChatListSnapshot();
+    // Returns NULL if the caller must read the live state instead: that's the
+    // case of the API thread when the snapshot is outdated
+    std::shared_ptr<const ChatListSnapshot> chatListSnapshot();
 
     void init(MegaChatApi *chatApi, mega::MegaApi *megaApi);
 
@@ -794,6 +851,10 @@ private:
 public:
     static void megaApiPostMessage(void* msg, void* ctx);
     void postMessage(void *msg);
+    // Must be called whenever the chat list or the metadata of a room changes.
+    // Only the entries of the specified chat are rebuilt, or all of them if
+    // no chatid is specified
+    void invalidateChatListSnapshot(MegaChatHandle chatid = MEGACHAT_INVALID_HANDLE);
 
     void sendPendingRequests();
     void sendPendingEvents();
@@ -803,6 +864,9 @@ public:
     static void setLogWithColors(bool useColors);
     static void setLogToConsole(bool enable);
 
+    void setDatabaseOptions(bool walMode, bool syncNormal, int cacheSizeKb, int64_t mmapSize, bool asyncWrites, bool compressHistory);
+    void setHistoryMemoryLimits(long long chatBytes, long long totalBytes);
+    void trimHistoryMemory(MegaChatRequestListener *listener = NULL);
     int init(const char *sid);
     int getInitState();
 
@@ -928,6 +992,7 @@ public:
     bool isFullHistoryLoaded(MegaChatHandle chatid);
     MegaChatMessage *getMessage(MegaChatHandle chatid, MegaChatHandle msgid);
     MegaChatMessage *getManualSendingMessage(MegaChatHandle chatid, MegaChatHandle rowid);
+    void searchMessages(MegaChatHandle chatid, const char *query, int limit, long long cursor, MegaChatRequestListener *listener = NULL);
     MegaChatMessage *sendMessage(MegaChatHandle chatid, const char* msg);
     MegaChatMessage *attachContacts(MegaChatHandle chatid, mega::MegaHandleList* handles);
     void attachNodes(MegaChatHandle chatid, mega::MegaNodeList *nodes, MegaChatRequestListener *listener = NULL);
@@ -986,6 +1051,7 @@ public:
 #endif
     virtual void onInitStateChange(int newState);
     virtual void onChatNotification(karere::Id chatid, const chatd::Message &msg, chatd::Message::Status status, chatd::Idx idx);
+    virtual void onChatMemberInfoChanged(karere::Id chatid);
 
     // rtcModule::IChatListHandler implementation
     virtual IApp::IGroupChatListItem *addGroupChatItem(karere::GroupChatRoom &chat);
@@ -1053,6 +1119,8 @@ public:
     // you take the ownership of returned value. NULL if error
     static std::vector<MegaChatAttachedUser> *parseAttachContactJSon(const char* json);
     static std::string getLastMessageContent(const std::string &content, uint8_t type);
+    // Text of a message as indexed by karere::MessageSearch
+    static std::string getSearchableText(const chatd::Message &msg);
     static std::string parseContainsMeta(const char* json);
     static std::string parseRichPreview(const char* json);
 };
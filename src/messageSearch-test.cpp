@@ -0,0 +1,168 @@
+#include <functional>
+#include <memory>
+#include <string.h>
+#include <unistd.h>
+#include <asyncTest-framework.h>
+#include "messageSearch.h"
+
+TESTS_INIT();
+using namespace karere;
+
+static const char* kDbPath = "messageSearch-test.db";
+
+static void openDb(SqliteDb& db)
+{
+    unlink(kDbPath);
+    db.open(kDbPath, false);
+    db.simpleQuery("CREATE TABLE vars(name text not null primary key, value blob)");
+    db.simpleQuery("CREATE TABLE history(idx int not null, chatid int64 not null, msgid int64 not null, "
+        "userid int64, keyid int not null, type tinyint, updated smallint, ts int, "
+        "is_encrypted tinyint, data blob, backrefid int64 not null, "
+        "is_deleted tinyint not null default 0, data_fmt tinyint not null default 0, "
+        "UNIQUE(chatid,msgid), UNIQUE(chatid,idx))");
+}
+
+static chatd::Message* addMsg(SqliteDb& db, int64_t rowid, Id chatid, Id msgid, chatd::Idx idx,
+    uint32_t ts, const char* text)
+{
+    db.query("insert into history(rowid, idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid) "
+        "values(?,?,?,?,0,?,0,?,0,?,0)", rowid, idx, chatid, msgid, (int)chatd::Message::kMsgNormal, ts,
+        StaticBuffer(text, strlen(text)));
+    return new chatd::Message(msgid, 0, ts, 0, text, strlen(text), false,
+        CHATD_KEYID_INVALID, chatd::Message::kMsgNormal);
+}
+
+static int indexCount(SqliteDb& db, const char* where="1")
+{
+    SqliteStmt stmt(db, std::string("select count(*) from history_fts where ") + where);
+    stmt.stepMustHaveData("indexCount");
+    return stmt.intCol(0);
+}
+
+/** Returns the rowids of the index rows that match \c query, newest first */
+static std::vector<int64_t> match(SqliteDb& db, const std::string& query)
+{
+    std::vector<int64_t> rowids;
+    SqliteStmt stmt(db, "select rowid from history_fts where history_fts match ? order by ts desc, rowid desc");
+    stmt << MessageSearch::toMatchExpr(query);
+    while (stmt.step())
+    {
+        rowids.push_back(stmt.int64Col(0));
+    }
+    return rowids;
+}
+
+int main()
+{
+
+TestGroup("MessageSearch")
+{
+    syncTest("toMatchExpr quotes each word as a prefix query")
+    {
+        check(MessageSearch::toMatchExpr("").empty());
+        check(MessageSearch::toMatchExpr(" \t\n ").empty());
+        check(MessageSearch::toMatchExpr("hello") == "\"hello\"*");
+        check(MessageSearch::toMatchExpr("  hello   world ") == "\"hello\"* \"world\"*");
+        check(MessageSearch::toMatchExpr("say \"hi\"") == "\"say\"* \"\"\"hi\"\"\"*");
+        check(MessageSearch::toMatchExpr("NOT a OR (b*") == "\"NOT\"* \"a\"* \"OR\"* \"(b*\"*");
+    });
+    syncTest("Indexing and unindexing, with rowids that share their low bits")
+    {
+        SqliteDb db;
+        openDb(db);
+        check(MessageSearch::createIndex(db));
+        {
+            MessageSearch search(db, kDbPath, nullptr);
+            // Sent in the same second, with rowids that differ by 2^21, which
+            // used to map to the same index key
+            std::unique_ptr<chatd::Message> msg1(addMsg(db, 5, 1, 101, 0, 1000, "hello world"));
+            std::unique_ptr<chatd::Message> msg2(addMsg(db, 5 + (1 << 21), 1, 102, 1, 1000, "hello there"));
+            std::unique_ptr<chatd::Message> msg3(addMsg(db, 7, 2, 201, 0, 1001, "hello from chat two"));
+            search.indexMsg(1, *msg1);
+            search.indexMsg(1, *msg2);
+            search.indexMsg(2, *msg3);
+            check(indexCount(db) == 3);
+            check(indexCount(db, "rowid = 5 and ts = 1000") == 1);
+            check((match(db, "hello") == std::vector<int64_t>{7, 5 + (1 << 21), 5}));
+            check((match(db, "hel wor") == std::vector<int64_t>{5}));
+
+            // an edit replaces the text of its own row only
+            search.unindexMsg(1, 101);
+            std::unique_ptr<chatd::Message> edited(new chatd::Message(101, 0, 1000, 1, "bye", 3, false,
+                CHATD_KEYID_INVALID, chatd::Message::kMsgNormal));
+            search.indexMsg(1, *edited);
+            check(indexCount(db) == 3);
+            check((match(db, "hello") == std::vector<int64_t>{7, 5 + (1 << 21)}));
+            check((match(db, "bye") == std::vector<int64_t>{5}));
+
+            // a deleted message is removed, not replaced
+            search.unindexMsg(1, 101);
+            std::unique_ptr<chatd::Message> deleted(new chatd::Message(101, 0, 1000, 2, "", 0, false,
+                CHATD_KEYID_INVALID, chatd::Message::kMsgNormal));
+            search.indexMsg(1, *deleted);
+            check(indexCount(db) == 2);
+            check(indexCount(db, "rowid = 5") == 0);
+
+            search.unindexChat(1, 1);
+            check(indexCount(db) == 2); //chat 1 has nothing indexed below idx 1
+            search.unindexChat(1);
+            check((match(db, "hello") == std::vector<int64_t>{7}));
+            search.unindexChat(2);
+            check(indexCount(db) == 0);
+        }
+        db.close();
+        unlink(kDbPath);
+    });
+    syncTest("A queued history row is indexed only if it was inserted")
+    {
+        SqliteDb db;
+        openDb(db);
+        check(MessageSearch::createIndex(db));
+        {
+            MessageSearch search(db, kDbPath, nullptr);
+            db.setAsyncWrites(true);
+            SqliteDb::QueryHooks hooks;
+            hooks.expectedChanges = 1;
+            const char* texts[] = { "hello world", "hello again", "other text" };
+            Id msgids[] = { 101, 101, 102 };
+            chatd::Idx idxs[] = { 0, 0, 1 };
+            for (int i = 0; i < 3; i++)
+            {
+                // the second one is a duplicate, and is not inserted
+                db.queryAsyncEx(hooks, "insert or ignore into history(idx, chatid, msgid, keyid, type, userid, "
+                    "ts, updated, data, backrefid) values(?,1,?,0,?,0,1000,0,?,0)", idxs[i], msgids[i], (int)chatd::Message::kMsgNormal,
+                    StaticBuffer(texts[i], strlen(texts[i])));
+                chatd::Message msg(msgids[i], 0, 1000, 0, texts[i], strlen(texts[i]), false,
+                    CHATD_KEYID_INVALID, chatd::Message::kMsgNormal);
+                search.indexMsg(1, msg, true);
+            }
+            db.setAsyncWrites(false);
+            check(indexCount(db) == 2);
+            check(match(db, "again").empty());
+            check(match(db, "hello").size() == 1);
+        }
+        db.close();
+        unlink(kDbPath);
+    });
+    syncTest("An index with the old layout is rebuilt")
+    {
+        SqliteDb db;
+        openDb(db);
+        db.simpleQuery("CREATE VIRTUAL TABLE history_fts USING fts5(text, hrow UNINDEXED)");
+        db.simpleQuery("insert into history_fts(rowid, hrow, text) values(123456, 1, 'hello')");
+        db.simpleQuery("insert into vars(name, value) values('fts_backfill', 0)");
+        check(MessageSearch::createIndex(db));
+        check(indexCount(db) == 0);
+        check(indexCount(db, "ts is null") == 0); //has a ts column
+        {
+            SqliteStmt stmt(db, "select count(*) from vars where name = 'fts_backfill'");
+            stmt.stepMustHaveData("fts_backfill");
+            check(stmt.intCol(0) == 0); //backfill starts over
+        }
+        db.close();
+        unlink(kDbPath);
+    });
+});
+
+return test::gNumFailed;
+}
@@ -0,0 +1,368 @@
+#include "messageSearch.h"
+#include "chatdDb.h"
+#include <base/timers.hpp>
+
+namespace karere
+{
+bool MessageSearch::createIndex(SqliteDb& db)
+{
+    try
+    {
+        bool exists;
+        {
+            SqliteStmt stmt(db, "select count(*) from sqlite_master where name = 'history_fts'");
+            exists = stmt.step() && stmt.intCol(0);
+        }
+        if (exists)
+        {
+            {
+                // fails if the table was created by a build with FTS5, but this one has not
+                SqliteStmt stmt(db, "select rowid from history_fts where rowid = 0");
+                stmt.step();
+            }
+            try
+            {
+                SqliteStmt stmt(db, "select ts from history_fts where rowid = 0");
+                stmt.step();
+                return true;
+            }
+            catch(std::exception& e)
+            {
+                // Created by an older version, whose rowids were not unique.
+                // Rebuild it from scratch
+                KR_LOG_WARNING("Message search index has an old layout, rebuilding it");
+                db.simpleQuery("DROP TABLE history_fts");
+                db.simpleQuery("delete from vars where name = 'fts_backfill'");
+            }
+        }
+        // The rowid of an index row is that of its history row
+        db.simpleQuery("CREATE VIRTUAL TABLE history_fts USING fts5(text, ts UNINDEXED, "
+            "tokenize = 'unicode61 remove_diacritics 2', prefix = '2 3')");
+        // The search connection can see the table only once it is committed
+        db.flush();
+        return true;
+    }
+    catch(std::exception& e)
+    {
+        KR_LOG_WARNING("Message search index is not available: %s", e.what());
+        return false;
+    }
+}
+
+std::string MessageSearch::toMatchExpr(const std::string& query)
+{
+    // Each word becomes a quoted prefix query, so that FTS5 operators and
+    // punctuation typed by the user are taken literally
+    std::string expr;
+    size_t i = 0;
+    size_t len = query.size();
+    while (i < len)
+    {
+        while (i < len && isspace((unsigned char)query[i]))
+            i++;
+        if (i >= len)
+            break;
+        if (!expr.empty())
+            expr += ' ';
+        expr += '"';
+        for (; i < len && !isspace((unsigned char)query[i]); i++)
+        {
+            if (query[i] == '"')
+                expr += '"';
+            expr += query[i];
+        }
+        expr.append("\"*");
+    }
+    return expr;
+}
+
+std::string MessageSearch::defaultText(const chatd::Message& msg)
+{
+    if (msg.type != chatd::Message::kMsgNormal || msg.empty() || msg.buf()[0] == 0)
+        return std::string();
+    return std::string(msg.buf(), msg.dataSize());
+}
+
+MessageSearch::MessageSearch(SqliteDb& db, const std::string& dbPath, void* appCtx, TextFunc textFunc)
+    : mDb(db), mDbPath(dbPath), mAppCtx(appCtx),
+      mTextFunc(textFunc ? textFunc : TextFunc(defaultText))
+{
+    mThread = std::thread([this]() { workerLoop(); });
+}
+
+MessageSearch::~MessageSearch()
+{
+    if (mBackfillTimer)
+    {
+        cancelTimeout(mBackfillTimer, mAppCtx);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mExit = true;
+    }
+    mCv.notify_one();
+    mThread.join();
+    auto pending = std::move(mPendingSearches);
+    for (auto& item: pending)
+    {
+        item.second.reject("Message search was closed");
+    }
+}
+
+void MessageSearch::indexMsg(Id chatid, const chatd::Message& msg, bool ifInserted)
+{
+    std::string text = mTextFunc(msg);
+    if (text.empty())
+        return;
+    SqliteDb::QueryHooks hooks;
+    hooks.ifPrevChanged = ifInserted;
+    mDb.queryAsyncEx(hooks, "insert or replace into history_fts(rowid, ts, text) "
+        "select rowid, ts, ? from history where chatid = ? and msgid = ?",
+        text, chatid, msg.id());
+}
+
+void MessageSearch::unindexMsg(Id chatid, Id msgid)
+{
+    mDb.queryAsync("delete from history_fts where rowid = "
+        "(select rowid from history where chatid = ? and msgid = ?)", chatid, msgid);
+}
+
+void MessageSearch::unindexChat(Id chatid, chatd::Idx idx)
+{
+    if (idx == CHATD_IDX_INVALID)
+    {
+        mDb.queryAsync("delete from history_fts where rowid in "
+            "(select rowid from history where chatid = ?)", chatid);
+    }
+    else
+    {
+        mDb.queryAsync("delete from history_fts where rowid in "
+            "(select rowid from history where chatid = ? and idx < ?)", chatid, idx);
+    }
+}
+
+void MessageSearch::startBackfill()
+{
+    // vars.fts_backfill is the rowid below which history has not been indexed
+    // yet, or 0 when done. It is absent for a new index, or after a session
+    // without FTS5, in which the index was not kept up to date
+    int64_t cursor;
+    {
+        SqliteStmt stmt(mDb, "select value from vars where name = 'fts_backfill'");
+        cursor = stmt.step() ? stmt.int64Col(0) : -1;
+    }
+    if (cursor < 0)
+    {
+        mDb.simpleQuery("delete from history_fts");
+        SqliteStmt stmt(mDb, "select ifnull(max(rowid), 0) + 1 from history");
+        stmt.stepMustHaveData("fts backfill start");
+        cursor = stmt.int64Col(0);
+        mDb.query("insert or replace into vars(name, value) values('fts_backfill', ?)", cursor);
+    }
+    if (cursor <= 1)
+    {
+        mBackfillDone = true;
+        return;
+    }
+    KR_LOG_INFO("Indexing messages for search, starting from history row %lld", (long long)cursor);
+    backfillChunk();
+}
+
+void MessageSearch::backfillChunk()
+{
+    mBackfillTimer = 0;
+    int64_t cursor;
+    {
+        SqliteStmt stmt(mDb, "select value from vars where name = 'fts_backfill'");
+        stmt.stepMustHaveData("fts backfill cursor");
+        cursor = stmt.int64Col(0);
+    }
+    int count = 0;
+    {
+        SqliteStmt stmt(mDb, "select rowid, msgid, userid, ts, updated, type, data, data_fmt "
+            "from history where rowid < ? order by rowid desc limit ?");
+        stmt << cursor << (int)kBackfillChunk;
+        while (stmt.step())
+        {
+            count++;
+            cursor = stmt.int64Col(0);
+            Buffer buf;
+            ChatdSqliteDb::msgDataCol(stmt, 6, 7, buf);
+            chatd::Message msg(stmt.uint64Col(1), stmt.uint64Col(2), stmt.uintCol(3), stmt.intCol(4),
+                std::move(buf), false, CHATD_KEYID_INVALID, (unsigned char)stmt.intCol(5));
+            std::string text = mTextFunc(msg);
+            if (text.empty())
+                continue;
+            mDb.queryAsync("insert or replace into history_fts(rowid, ts, text) values(?,?,?)",
+                cursor, stmt.int64Col(3), text);
+        }
+    }
+    if (count < kBackfillChunk)
+    {
+        cursor = 0;
+    }
+    mDb.queryAsync("update vars set value = ? where name = 'fts_backfill'", cursor);
+    if (!cursor)
+    {
+        KR_LOG_INFO("Indexing messages for search done");
+        mBackfillDone = true;
+        return;
+    }
+    auto wptr = weakHandle();
+    mBackfillTimer = setTimeout([this, wptr]()
+    {
+        if (wptr.deleted())
+            return;
+        backfillChunk();
+    }, kBackfillIntervalMs, mAppCtx);
+}
+
+promise::Promise<std::shared_ptr<MessageSearch::Results>>
+MessageSearch::search(Id chatid, const std::string& query, unsigned limit, int64_t cursor)
+{
+    std::string expr = toMatchExpr(query);
+    if (expr.empty() || !limit)
+        return promise::Error("Invalid search query or limit");
+
+    uint32_t searchId = ++mNextSearchId;
+    auto& pms = mPendingSearches[searchId];
+    auto wptr = weakHandle();
+    postJob([this, wptr, searchId, chatid, expr, limit, cursor](SqliteDb& db)
+    {
+        // The result messages are built here, as the shared SlabArena, from
+        // which they are allocated, is thread-safe. Only the promise is
+        // resolved on the karere thread, as the app expects
+        auto results = std::make_shared<Results>();
+        std::string error;
+        try
+        {
+            execSearch(db, chatid, expr, limit, cursor, *results);
+        }
+        catch(std::exception& e)
+        {
+            error = e.what();
+        }
+        marshallCall([this, wptr, searchId, results, error]()
+        {
+            if (wptr.deleted())
+                return;
+            auto it = mPendingSearches.find(searchId);
+            if (it == mPendingSearches.end())
+                return;
+            auto pms = it->second;
+            mPendingSearches.erase(it);
+            if (!error.empty())
+            {
+                pms.reject(error);
+                return;
+            }
+            pms.resolve(results);
+        }, mAppCtx);
+    });
+    return pms;
+}
+
+void MessageSearch::execSearch(SqliteDb& db, Id chatid, const std::string& expr,
+    unsigned limit, int64_t cursor, Results& results)
+{
+    // Results are ordered by (ts, rowid), newest first. The cursor is the
+    // rowid of the last result of the previous page
+    int64_t cursorTs = INT64_MAX;
+    if (cursor)
+    {
+        SqliteStmt stmt(db, "select ts from history_fts where rowid = ?");
+        stmt << cursor;
+        if (!stmt.step())
+            return; //unindexed since, we can't tell where the page ended
+        cursorTs = stmt.int64Col(0);
+    }
+
+    // The status of a message depends on the seen and received pointers of
+    // its chat, as in Chat::getMsgStatus()
+    std::string sql = "select f.rowid, h.chatid, h.idx, h.msgid, h.userid, h.ts, h.updated, h.keyid, "
+        "h.type, h.backrefid, h.data, h.data_fmt, "
+        "(select idx from history where chatid = h.chatid and msgid = c.last_seen), "
+        "(select idx from history where chatid = h.chatid and msgid = c.last_recv) "
+        "from history_fts f join history h on h.rowid = f.rowid "
+        "left join chats c on c.chatid = h.chatid "
+        "where history_fts match ?1 and (f.ts < ?5 or (f.ts = ?5 and f.rowid < ?2)) ";
+    if (chatid != Id::inval())
+        sql += "and h.chatid = ?4 ";
+    sql += "order by f.ts desc, f.rowid desc limit ?3";
+
+    SqliteStmt stmt(db, sql);
+    sqlite3_bind_text(stmt, 1, expr.c_str(), expr.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, cursor ? cursor : INT64_MAX);
+    sqlite3_bind_int(stmt, 3, limit);
+    if (chatid != Id::inval())
+        sqlite3_bind_int64(stmt, 4, chatid.val);
+    sqlite3_bind_int64(stmt, 5, cursorTs);
+
+    Id myHandle = Id::inval();
+    {
+        SqliteStmt own(db, "select value from vars where name = 'my_handle'");
+        if (own.step())
+            myHandle = own.uint64Col(0);
+    }
+    int64_t lastKey = 0;
+    while (stmt.step())
+    {
+        lastKey = stmt.int64Col(0);
+        Id msgChatid = stmt.uint64Col(1);
+        chatd::Idx idx = stmt.intCol(2);
+        Id userid = stmt.uint64Col(4);
+        Buffer data;
+        ChatdSqliteDb::msgDataCol(stmt, 10, 11, data);
+        auto msg = new chatd::Message(stmt.uint64Col(3), userid, stmt.uintCol(5), stmt.intCol(6),
+            std::move(data), false, stmt.uintCol(7), stmt.intCol(8));
+        msg->backRefId = stmt.uint64Col(9);
+        int seenIdx = (sqlite3_column_type(stmt, 12) == SQLITE_NULL) ? -1 : stmt.intCol(12);
+        int recvIdx = (sqlite3_column_type(stmt, 13) == SQLITE_NULL) ? -1 : stmt.intCol(13);
+        chatd::Message::Status status;
+        if (userid == myHandle)
+            status = (idx <= recvIdx) ? chatd::Message::kDelivered : chatd::Message::kServerReceived;
+        else
+            status = (idx <= seenIdx) ? chatd::Message::kSeen : chatd::Message::kNotSeen;
+        results.items.push_back(Result{msgChatid, idx, std::unique_ptr<chatd::Message>(msg), status});
+    }
+    results.nextCursor = (results.items.size() == limit) ? lastKey : 0;
+}
+
+void MessageSearch::postJob(std::function<void(SqliteDb&)>&& job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mJobs.push_back(std::move(job));
+    }
+    mCv.notify_one();
+}
+
+void MessageSearch::workerLoop()
+{
+    SqliteDb db;
+    SqliteDb::Options options;
+    options.readOnly = true;
+    for (;;)
+    {
+        std::function<void(SqliteDb&)> job;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCv.wait(lock, [this]() { return mExit || !mJobs.empty(); });
+            if (mExit)
+                break;
+            job = std::move(mJobs.front());
+            mJobs.pop_front();
+        }
+        // opened on first use, as the db may be replaced before that
+        if (!db.isOpen())
+        {
+            if (!db.open(mDbPath.c_str(), true, options))
+                KR_LOG_ERROR("Message search: Can't open db %s", mDbPath.c_str());
+            else
+                sqlite3_busy_timeout(db, 2000);
+        }
+        job(db);
+    }
+    db.close();
+}
+}
@@ -0,0 +1,118 @@
+#ifndef MESSAGE_SEARCH_H
+#define MESSAGE_SEARCH_H
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <promise.h>
+#include <base/trackDelete.h>
+#include "db.h"
+#include "chatd.h"
+
+namespace karere
+{
+/** @brief Full-text search of the decrypted message history.
+ *
+ * The index is the FTS5 table \c history_fts of the local db, which holds the
+ * searchable text of each history row. It is created outside of the db schema,
+ * as FTS5 is an optional SQLite module. The index is updated by ChatdSqliteDb
+ * together with the history table, on the same db connection, so it follows
+ * the write-behind queue of the db. History that predates the index is added
+ * in the background by \c startBackfill().
+ *
+ * The rowid of an index row is the rowid of its history row, and its \c ts
+ * column, which is not indexed, is the timestamp of the message. Results are
+ * returned newest first, by \c ts.
+ *
+ * Searches run on a worker thread, with a separate read-only db connection,
+ * and their results are delivered on the karere thread.
+ */
+class MessageSearch: public DeleteTrackable
+{
+public:
+    /** Returns the searchable text of a message, or an empty string if the
+     * message should not be indexed */
+    typedef std::function<std::string(const chatd::Message&)> TextFunc;
+
+    struct Result
+    {
+        Id chatid;
+        chatd::Idx idx;
+        std::unique_ptr<chatd::Message> msg;
+        chatd::Message::Status status;
+    };
+    struct Results
+    {
+        std::vector<Result> items;
+        /** The cursor of the next page, or 0 if there are no more results */
+        int64_t nextCursor = 0;
+    };
+
+    /** @brief Creates the index table, if it does not exist yet.
+     * @returns \c false if the SQLite library does not support FTS5, in which
+     * case the index is not available */
+    static bool createIndex(SqliteDb& db);
+
+    /** @brief Converts free text typed by the user into an FTS5 query that
+     * matches the messages containing all its words, or words starting with
+     * them. Returns an empty string if the text has no words */
+    static std::string toMatchExpr(const std::string& query);
+
+    /** @brief The default text extractor - indexes only normal messages */
+    static std::string defaultText(const chatd::Message& msg);
+
+    MessageSearch(SqliteDb& db, const std::string& dbPath, void* appCtx, TextFunc textFunc=nullptr);
+    ~MessageSearch();
+
+    /** @name Index updates, done on the main db connection */
+    ///@{
+    /** Indexes the history row of \c msg, which must have been inserted or updated already.
+     * If \c ifInserted is true, the row is indexed only if the db write queued
+     * just before, which inserts it, changed a row */
+    void indexMsg(Id chatid, const chatd::Message& msg, bool ifInserted=false);
+    /** Removes the history row of \c msgid from the index. Must be done before the row is deleted or updated */
+    void unindexMsg(Id chatid, Id msgid);
+    /** Removes all history rows of the chat older than \c idx, or all if \c idx is CHATD_IDX_INVALID */
+    void unindexChat(Id chatid, chatd::Idx idx=CHATD_IDX_INVALID);
+    ///@}
+
+    /** @brief Adds the history rows that predate the index, in chunks, from the
+     * newest to the oldest. Progress is kept in the db, so it resumes after a restart */
+    void startBackfill();
+    bool backfillDone() const { return mBackfillDone; }
+
+    /** @brief Searches the index on the worker thread.
+     * @param chatid The chat to search, or Id::inval() to search all chats
+     * @param cursor 0 for the first page, or Results::nextCursor of the previous page
+     */
+    promise::Promise<std::shared_ptr<Results>>
+    search(Id chatid, const std::string& query, unsigned limit, int64_t cursor);
+protected:
+    enum { kBackfillChunk = 256, kBackfillIntervalMs = 20 };
+    SqliteDb& mDb;
+    std::string mDbPath;
+    void* mAppCtx;
+    TextFunc mTextFunc;
+    bool mBackfillDone = false;
+    megaHandle mBackfillTimer = 0;
+    // worker thread
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    std::deque<std::function<void(SqliteDb&)>> mJobs;
+    bool mExit = false;
+    std::thread mThread;
+    // pending searches, accessed only by the karere thread
+    std::map<uint32_t, promise::Promise<std::shared_ptr<Results>>> mPendingSearches;
+    uint32_t mNextSearchId = 0;
+    void backfillChunk();
+    void postJob(std::function<void(SqliteDb&)>&& job);
+    void workerLoop();
+    static void execSearch(SqliteDb& db, Id chatid, const std::string& expr,
+        unsigned limit, int64_t cursor, Results& results);
+};
+}
+#endif // MESSAGE_SEARCH_H
@@ -0,0 +1,140 @@
+#ifndef FRAME_RECORDER_H
+#define FRAME_RECORDER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "karereId.h"
+
+namespace karere
+{
+/** @brief Opt-in recorder of the chatd and presenced websocket frames, for
+ * offline replay and profiling (see tests/chatd_bench/chatd_replay.cpp).
+ * Recording is started either programmatically via start(), or by setting the
+ * KRFRAMEREC environment variable to the path of the output file. In the
+ * latter case, it starts before any chat is created, so that the recording
+ * contains the info about all chats, which the replay needs.
+ *
+ * File format (all integers little-endian):
+ *   header: "KRFRAMES" | version.u32
+ *   records: ts.u64 | type.u8 | channel.i32 | len.u32 | data[len]
+ * \c ts is in microseconds since the start of the recording. \c channel is
+ * the shard number for chatd records, and 0 for presenced. The payload of
+ * kChatdChat records is:
+ *   chatid.8 | myUserid.8 | creationTs.u32 | isGroup.u8 | userid.8 * n
+ */
+class FrameRecorder
+{
+public:
+    enum { kVersion = 1 };
+    enum: uint8_t
+    {
+        kChatdIn = 1,
+        kChatdOut = 2,
+        kPresencedIn = 3,
+        kPresencedOut = 4,
+        kChatdChat = 5 //a chat was created
+    };
+    static const char* magic() { return "KRFRAMES"; }
+    enum { kMagicLen = 8, kRecordHeaderSize = 17 };
+
+protected:
+    std::mutex mMutex;
+    FILE* mFile = nullptr;
+    std::atomic<bool> mRecording;
+    std::chrono::steady_clock::time_point mStartTime;
+    FrameRecorder(): mRecording(false)
+    {
+        const char* path = getenv("KRFRAMEREC");
+        if (path && path[0])
+            start(path);
+    }
+    void writeRecord(uint8_t type, int32_t channel, const void* data, size_t len)
+    {
+        uint64_t ts = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - mStartTime).count();
+        uint32_t len32 = (uint32_t)len;
+        char hdr[kRecordHeaderSize];
+        memcpy(hdr, &ts, 8);
+        hdr[8] = type;
+        memcpy(hdr+9, &channel, 4);
+        memcpy(hdr+13, &len32, 4);
+        fwrite(hdr, 1, sizeof(hdr), mFile);
+        fwrite(data, 1, len, mFile);
+    }
+
+public:
+    /** @brief The process-wide recorder. It is never destroyed, as frames may
+     * be recorded during static destruction */
+    static FrameRecorder& instance()
+    {
+        static FrameRecorder* recorder = new FrameRecorder;
+        return *recorder;
+    }
+    /** @brief Cheap check done before building any record */
+    bool isRecording() const { return mRecording.load(std::memory_order_relaxed); }
+    bool start(const char* path)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mFile)
+            fclose(mFile);
+        mFile = fopen(path, "wb");
+        if (!mFile)
+        {
+            mRecording = false;
+            return false;
+        }
+        setvbuf(mFile, nullptr, _IOFBF, 256*1024);
+        uint32_t version = kVersion;
+        fwrite(magic(), 1, kMagicLen, mFile);
+        fwrite(&version, 1, sizeof(version), mFile);
+        mStartTime = std::chrono::steady_clock::now();
+        mRecording = true;
+        return true;
+    }
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mRecording = false;
+        if (mFile)
+        {
+            fclose(mFile);
+            mFile = nullptr;
+        }
+    }
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mFile)
+            fflush(mFile);
+    }
+    void record(uint8_t type, int32_t channel, const void* data, size_t len)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mFile)
+            writeRecord(type, channel, data, len);
+    }
+    void recordChat(Id chatid, int shardNo, Id myUserid, uint32_t creationTs, bool isGroup, const SetOfIds& users)
+    {
+        std::string payload;
+        payload.reserve(21 + users.size()*8);
+        payload.append((const char*)&chatid.val, 8);
+        payload.append((const char*)&myUserid.val, 8);
+        payload.append((const char*)&creationTs, 4);
+        payload.push_back(isGroup ? 1 : 0);
+        for (auto& userid: users)
+        {
+            payload.append((const char*)&userid.val, 8);
+        }
+        record(kChatdChat, shardNo, payload.data(), payload.size());
+    }
+};
+}
+
+#endif
@@ -1,5 +1,6 @@
 #include "presenced.h"
 #include "chatClient.h"
+#include "net/frameRecorder.h"
 
 using namespace std;
 using namespace promise;
@@ -388,7 +389,10 @@ bool Client::sendBuf(Buffer&& buf)
 {
     if (!isOnline())
         return false;
-    
+
+    auto& recorder = FrameRecorder::instance();
+    if (recorder.isRecording())
+        recorder.record(FrameRecorder::kPresencedOut, 0, buf.buf(), buf.dataSize());
     bool rc = wsSendMessage(buf.buf(), buf.dataSize());
     buf.free();  //just in case, as it's content is xor-ed with the websock datamask so it's unusable
     mTsLastSend = time(NULL);
@@ -569,6 +573,9 @@ Client::~Client()
 void Client::wsHandleMsgCb(char *data, size_t len)
 {
     mTsLastRecv = time(NULL);
+    auto& recorder = FrameRecorder::instance();
+    if (recorder.isRecording())
+        recorder.record(FrameRecorder::kPresencedIn, 0, data, len);
     mTsLastPingSent = 0;
     handleMessage(StaticBuffer(data, len));
 }
@@ -5,6 +5,7 @@
 #include <chatClient.h>
 #include <userAttrCache.h>
 #include <strongvelope/strongvelope.h>
+#include <strongvelope/keyCache.h>
 #include <rtcModule/webrtc.h>
 #include <sodium.h>
 #include <cryptopp/aes.h>
@@ -29,9 +30,18 @@ void RtcCrypto::mac(const std::string& data, const SdpKey& key, SdpKey& output)
     assert(bmlen = 32);
 }
 
+static const std::string kRtcPairwiseKey = "webrtc pairwise key\x01";
+
 void RtcCrypto::computeSymmetricKey(karere::Id peer, strongvelope::SendKey& output)
 {
-    //No symmetric key cache here, unlike strongvelope
+    // Shares the cache of strongvelope, under a different pad string
+    auto& cache = strongvelope::KeyCache::instance();
+    auto cached = cache.getSymmKey(mClient.myHandle(), peer, kRtcPairwiseKey);
+    if (cached)
+    {
+        output.assign(cached->buf(), cached->dataSize());
+        return;
+    }
     auto pms = mClient.userAttrCache().getAttr(peer, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY);
     if (!pms.done())
         throw std::runtime_error("RtcCrypto::computeSymmetricKey: Key not readily available in cache");
@@ -44,7 +54,9 @@ void RtcCrypto::computeSymmetricKey(karere::Id peer, strongvelope::SendKey& outp
     strongvelope::Key<crypto_scalarmult_BYTES> sharedSecret;
     auto ignore = crypto_scalarmult(sharedSecret.ubuf(), (const unsigned char*)mClient.mMyPrivCu25519, pubKey->ubuf());
     (void)ignore;
-    strongvelope::deriveSharedKey(sharedSecret, output, "webrtc pairwise key\x01");
+    strongvelope::deriveSharedKey(sharedSecret, output, kRtcPairwiseKey);
+    cache.putSymmKey(mClient.myHandle(), peer, kRtcPairwiseKey,
+        std::make_shared<strongvelope::SendKey>(output.buf(), output.dataSize()));
 }
 
 void RtcCrypto::encryptKeyTo(karere::Id peer, const SdpKey& data, SdpKey& output)
@@ -8,6 +8,7 @@
 #include <cryptopp/sha.h>
 #include <cryptopp/hmac.h>
 #include <cryptopp/aes.h>
+#include <cryptopp/cpu.h>
 #include <cryptopp/modes.h>
 #include <cryptopp/osrng.h>
 #include <iostream>
@@ -82,45 +83,46 @@ static inline void aesCBCDecrypt(const StaticBuffer& cipherText,
     aesdec.ProcessData(output.ubuf(), cipherText.ubuf(), cipherText.dataSize());
 }
 
-//CTR mode is used for message content
+//CTR mode is used for message content. It is a stream mode, so encryption and
+//decryption are the same operation, which uses only the forward direction of
+//the cipher, and can be done in place, without any intermediate buffers
 
-//can't use binary buffers here, libsodium doesn't support them for CTR mode
-static inline std::string aesCTREncrypt(const std::string& text,
-                        const StaticBuffer& derivedkey, const StaticBuffer& iv)
+/** @brief An AES-128 key for CTR mode, expanded once and reused for all the
+ * messages that are encrypted or decrypted with it. Crypto++ uses the AES
+ * instructions of the CPU when available. Not thread-safe, as Crypto++ may
+ * use internal workspace of the cipher object */
+class AesCtrKey
 {
-    assert(iv.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    assert(derivedkey.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption encryptor;
-    std::string cipher;
-    encryptor.SetKeyWithIV(derivedkey.ubuf(), derivedkey.dataSize(), iv.ubuf());
-    // The StreamTransformationFilter adds padding
-    //  as required. ECB and CBC Mode must be padded
-    //  to the block size of the cipher. CTR does not.
-    CryptoPP::StringSource s(text, true,
-        new CryptoPP::StreamTransformationFilter(encryptor,
-            new CryptoPP::StringSink(cipher)
-        ) // StreamTransformationFilter
-    ); // StringSource
-    return cipher;
-}
-
-static inline std::string aesCTRDecrypt(const std::string& ciphertext,
-                            const StaticBuffer& derivedkey, const StaticBuffer& iv)
-{
-    CryptoPP::CTR_Mode<CryptoPP::AES>::Decryption decryptor;
-    std::string text;
-    assert(iv.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    assert(derivedkey.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    decryptor.SetKeyWithIV(derivedkey.ubuf(), derivedkey.dataSize(), iv.ubuf());
-    // The StreamTransformationFilter adds padding
-    //  as required. ECB and CBC Mode must be padded
-    //  to the block size of the cipher. CTR does not.
-    CryptoPP::StringSource s(ciphertext, true,
-        new CryptoPP::StreamTransformationFilter(decryptor,
-            new CryptoPP::StringSink(text)
-        ) // StreamTransformationFilter
-    ); // StringSource
-    return text;
-}
+protected:
+    CryptoPP::AES::Encryption mCipher;
+public:
+    AesCtrKey(const StaticBuffer& key)
+    : mCipher(key.ubuf(), key.dataSize())
+    {
+        assert(key.dataSize() == CryptoPP::AES::BLOCKSIZE);
+    }
+    /** @brief Encrypts or decrypts \c len bytes from \c in to \c out, which
+     * may be the same buffer. The counter starts at \c iv */
+    void process(const StaticBuffer& iv, const unsigned char* in, unsigned char* out, size_t len)
+    {
+        assert(iv.dataSize() == CryptoPP::AES::BLOCKSIZE);
+        CryptoPP::CTR_Mode_ExternalCipher::Encryption ctr(mCipher, iv.ubuf());
+        ctr.ProcessData(out, in, len);
+    }
+    /** @brief Encrypts or decrypts \c data in place. Applying it twice restores the original data */
+    void processInPlace(const StaticBuffer& iv, const StaticBuffer& data)
+    {
+        process(iv, data.ubuf(), data.ubuf(), data.dataSize());
+    }
+    /** @brief The AES implementation that Crypto++ uses on this CPU, for logging */
+    static const char* implementation()
+    {
+#if CRYPTOPP_BOOL_X86 || CRYPTOPP_BOOL_X32 || CRYPTOPP_BOOL_X64
+        return CryptoPP::HasAESNI() ? "AES-NI" : "table-based";
+#else
+        return "Crypto++ default";
+#endif
+    }
+};
 
 }
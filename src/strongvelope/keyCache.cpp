@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <inttypes.h>
+#include "keyCache.h"
+
+namespace strongvelope
+{
+KeyCache& KeyCache::instance()
+{
+    static KeyCache cache;
+    return cache;
+}
+
+KeyCache::KeyCache()
+: mSendKeys(kDefaultMaxSendKeys), mSymmKeys(kDefaultMaxSymmKeys)
+{}
+
+std::shared_ptr<SendKey> KeyCache::getSendKey(karere::Id chatid, karere::Id userid, uint64_t keyid)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto key = mSendKeys.get(SendKeyId{chatid.val, userid.val, keyid});
+    if (key)
+        mHits++;
+    else
+        mMisses++;
+    return key;
+}
+
+void KeyCache::putSendKey(karere::Id chatid, karere::Id userid, uint64_t keyid,
+    const std::shared_ptr<SendKey>& key)
+{
+    assert(key);
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEvictions += mSendKeys.put(SendKeyId{chatid.val, userid.val, keyid}, key);
+}
+
+std::shared_ptr<SendKey> KeyCache::getSymmKey(karere::Id ownHandle, karere::Id peer,
+    const std::string& padString)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto key = mSymmKeys.get(SymmKeyId{ownHandle.val, peer.val, padString});
+    if (key)
+        mHits++;
+    else
+        mMisses++;
+    return key;
+}
+
+void KeyCache::putSymmKey(karere::Id ownHandle, karere::Id peer, const std::string& padString,
+    const std::shared_ptr<SendKey>& key)
+{
+    assert(key);
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEvictions += mSymmKeys.put(SymmKeyId{ownHandle.val, peer.val, padString}, key);
+}
+
+void KeyCache::setMaxEntries(size_t maxSendKeys, size_t maxSymmKeys)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSendKeys.maxSize = maxSendKeys;
+    mSymmKeys.maxSize = maxSymmKeys;
+    mEvictions += mSendKeys.trim() + mSymmKeys.trim();
+}
+
+void KeyCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSendKeys.clear();
+    mSymmKeys.clear();
+}
+
+KeyCache::Stats KeyCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    Stats stats;
+    stats.hits = mHits;
+    stats.misses = mMisses;
+    stats.evictions = mEvictions;
+    stats.sendKeys = mSendKeys.size();
+    stats.symmKeys = mSymmKeys.size();
+    stats.bytes = sizeof(KeyCache)
+        + stats.sendKeys * Lru<SendKeyId>::entryBytes()
+        + stats.symmKeys * Lru<SymmKeyId>::entryBytes();
+    return stats;
+}
+
+std::string KeyCache::Stats::toString() const
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%zu send keys, %zu symmetric keys, ~%zu bytes, "
+        "%" PRIu64 " hits, %" PRIu64 " misses (hit rate %.1f%%), %" PRIu64 " evictions",
+        sendKeys, symmKeys, bytes, hits, misses, hitRate() * 100, evictions);
+    return buf;
+}
+}
@@ -0,0 +1,160 @@
+#ifndef STRONGVELOPE_KEYCACHE_H
+#define STRONGVELOPE_KEYCACHE_H
+
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "strongvelope.h"
+
+namespace strongvelope
+{
+/** @brief Process-wide cache of decrypted send keys and derived symmetric
+ * keys, shared by the ProtocolHandler instances of all chats, and by all
+ * clients in the process.
+ *
+ * Send keys are identified by chat, sender and keyid, as keyids are assigned
+ * per chat. A send key is the same for all participants of a chat, so it is
+ * shared also by the clients of different accounts. The db of each client
+ * remains the persistent store - the cache only saves loading the key again.
+ *
+ * Symmetric keys (a Curve25519 shared secret with a peer, expanded with HKDF)
+ * depend only on our own account, the peer and the purpose of the key, so they
+ * are computed once per peer, rather than once per chat with that peer.
+ *
+ * Both maps are bounded, and the least recently used keys are evicted. Keys
+ * are immutable once in the cache, so the returned shared pointers can be
+ * used without the lock. All methods are thread-safe.
+ */
+class KeyCache
+{
+public:
+    enum
+    {
+        kDefaultMaxSendKeys = 16384,
+        kDefaultMaxSymmKeys = 4096
+    };
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        size_t sendKeys = 0;
+        size_t symmKeys = 0;
+        /** An estimate of the memory used by the cache, including the map nodes */
+        size_t bytes = 0;
+        double hitRate() const { return (hits + misses) ? (double)hits / (hits + misses) : 0; }
+        std::string toString() const;
+    };
+    static KeyCache& instance();
+    /** @brief Returns the send key, or an empty pointer if it's not in the cache */
+    std::shared_ptr<SendKey> getSendKey(karere::Id chatid, karere::Id userid, uint64_t keyid);
+    void putSendKey(karere::Id chatid, karere::Id userid, uint64_t keyid, const std::shared_ptr<SendKey>& key);
+    /** @brief Returns the symmetric key of \c ownHandle with \c peer, derived
+     * with \c padString, or an empty pointer if it's not in the cache */
+    std::shared_ptr<SendKey> getSymmKey(karere::Id ownHandle, karere::Id peer, const std::string& padString);
+    void putSymmKey(karere::Id ownHandle, karere::Id peer, const std::string& padString,
+        const std::shared_ptr<SendKey>& key);
+    void setMaxEntries(size_t maxSendKeys, size_t maxSymmKeys);
+    /** @brief Drops all keys, i.e. on logout. The stats are kept */
+    void clear();
+    Stats stats() const;
+protected:
+    struct SendKeyId
+    {
+        uint64_t chatid;
+        uint64_t userid;
+        uint64_t keyid;
+        bool operator<(const SendKeyId& other) const
+        {
+            if (chatid != other.chatid)
+                return chatid < other.chatid;
+            if (userid != other.userid)
+                return userid < other.userid;
+            return keyid < other.keyid;
+        }
+    };
+    struct SymmKeyId
+    {
+        uint64_t ownHandle;
+        uint64_t peer;
+        std::string padString;
+        bool operator<(const SymmKeyId& other) const
+        {
+            if (ownHandle != other.ownHandle)
+                return ownHandle < other.ownHandle;
+            if (peer != other.peer)
+                return peer < other.peer;
+            return padString < other.padString;
+        }
+    };
+    /** A map with least-recently-used eviction. Not thread-safe by itself */
+    template <class K>
+    class Lru
+    {
+    protected:
+        typedef std::list<std::pair<K, std::shared_ptr<SendKey>>> List;
+        List mList; //most recently used first
+        std::map<K, typename List::iterator> mIndex;
+    public:
+        size_t maxSize;
+        Lru(size_t aMaxSize): maxSize(aMaxSize) {}
+        size_t size() const { return mIndex.size(); }
+        /** An estimate of the memory used per entry */
+        static size_t entryBytes()
+        {
+            return sizeof(SendKey) + sizeof(typename List::value_type)
+                + sizeof(typename std::map<K, typename List::iterator>::value_type)
+                + 8 * sizeof(void*); //list and tree node links, shared_ptr control block
+        }
+        std::shared_ptr<SendKey> get(const K& id)
+        {
+            auto it = mIndex.find(id);
+            if (it == mIndex.end())
+                return nullptr;
+            mList.splice(mList.begin(), mList, it->second);
+            return it->second->second;
+        }
+        /** Returns the number of evicted entries */
+        size_t put(const K& id, const std::shared_ptr<SendKey>& key)
+        {
+            auto it = mIndex.find(id);
+            if (it != mIndex.end())
+            {
+                it->second->second = key;
+                mList.splice(mList.begin(), mList, it->second);
+                return 0;
+            }
+            mList.emplace_front(id, key);
+            mIndex.emplace(id, mList.begin());
+            return trim();
+        }
+        size_t trim()
+        {
+            size_t count = 0;
+            while (mIndex.size() > maxSize)
+            {
+                mIndex.erase(mList.back().first);
+                mList.pop_back();
+                count++;
+            }
+            return count;
+        }
+        void clear()
+        {
+            mIndex.clear();
+            mList.clear();
+        }
+    };
+    mutable std::mutex mMutex;
+    Lru<SendKeyId> mSendKeys;
+    Lru<SymmKeyId> mSymmKeys;
+    uint64_t mHits = 0;
+    uint64_t mMisses = 0;
+    uint64_t mEvictions = 0;
+    KeyCache();
+};
+}
+#endif // STRONGVELOPE_KEYCACHE_H
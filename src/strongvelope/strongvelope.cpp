@@ -22,6 +22,7 @@
 
 #include "strongvelope.h"
 #include "cryptofunctions.h"
+#include "keyCache.h"
 #include <ctime>
 #include "sodium.h"
 #include "tlvstore.h"
@@ -31,6 +32,8 @@
 #include <codecvt>
 #include <locale>
 #include <karereCommon.h>
+#include <base/workerPool.h>
+#include <atomic>
 
 namespace strongvelope
 {
@@ -71,8 +74,8 @@ uint32_t getKeyIdLength(uint32_t protocolVersion)
     return (protocolVersion == 1) ? 8 : 4;
 }
 
-EncryptedMessage::EncryptedMessage(const Message& msg, const StaticBuffer& aKey)
-: key(aKey), backRefId(msg.backRefId)
+EncryptedMessage::EncryptedMessage(const Message& msg, const StaticBuffer& aKey, AesCtrKey& ctrKey)
+: ciphertext(10+msg.backRefs.size()*8+msg.dataSize()), key(aKey), backRefId(msg.backRefId)
 {
     assert(!key.empty());
     randombytes_buf(nonce.buf(), nonce.bufSize());
@@ -84,25 +87,26 @@ EncryptedMessage::EncryptedMessage(const Message& msg, const StaticBuffer& aKey)
     assert(derivedNonce.dataSize() == AES::BLOCKSIZE);
 
     size_t brsize = msg.backRefs.size()*8;
-    size_t binsize = 10+brsize;
-    Buffer buf(binsize+msg.dataSize());
-    buf.append<uint64_t>(msg.backRefId)
+    ciphertext.append<uint64_t>(msg.backRefId)
        .append<uint16_t>(brsize);
     if (brsize)
     {
-        buf.append((const char*)(&msg.backRefs[0]), brsize);
+        ciphertext.append((const char*)(&msg.backRefs[0]), brsize);
     }
     if (!msg.empty())
     {
-        buf.append(msg);
+        ciphertext.append(msg);
     }
-    ciphertext = aesCTREncrypt(std::string(buf.buf(), buf.dataSize()),
-        key, derivedNonce);
+    ctrKey.processInPlace(derivedNonce, ciphertext);
 }
 
 /**
  * Decrypts a message symmetrically using AES-128-CTR.
  *
+ * The payload is decrypted in place, and since it normally points into the
+ * buffer of \c outMsg itself, the plaintext is just moved to the start of that
+ * buffer, without any intermediate copies.
+ *
  * @param key Symmetric encryption key.
  * @param outMsg The message object to write the decrypted data to.
  */
@@ -115,6 +119,16 @@ void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
     }
     Id chatid = mProtoHandler.chatid;
     STRONGVELOPE_LOG_DEBUG("Decrypting msg %s", outMsg.id().toString().c_str());
+    symmetricDecrypt(*mProtoHandler.ctrKey(key), outMsg);
+}
+
+void ParsedMessage::symmetricDecrypt(AesCtrKey& ctrKey, Message& outMsg)
+{
+    if (payload.empty())
+    {
+        outMsg.clear();
+        return;
+    }
     Key<32> derivedNonce;
     // deriveNonceSecret() needs at least 32 bytes output buffer
     deriveNonceSecret(nonce, derivedNonce);
@@ -122,9 +136,17 @@ void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
     // For AES CRT mode, we take the first 12 bytes as the nonce,
     // and the remaining 4 bytes as the counter, which is initialized to zero
     *reinterpret_cast<uint32_t*>(derivedNonce.buf()+SVCRYPTO_NONCE_SIZE) = 0;
-    std::string cleartext = aesCTRDecrypt(std::string(payload.buf(), payload.dataSize()),
-        key, derivedNonce);
-    parsePayload(StaticBuffer(cleartext, false), outMsg);
+    ctrKey.processInPlace(derivedNonce, payload);
+    try
+    {
+        parsePayload(payload, outMsg);
+    }
+    catch(...)
+    {
+        // restore the ciphertext, the message may be saved as undecryptable
+        ctrKey.processInPlace(derivedNonce, payload);
+        throw;
+    }
     outMsg.setEncrypted(0);
 }
 
@@ -376,6 +398,17 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
     }
 }
 
+void ParsedMessage::detachFromSource(const Message& src)
+{
+    if (!ownContent.empty())
+        return;
+    ownContent.assign(src.buf(), src.dataSize());
+    if (payload.buf())
+        payload.assign(ownContent.buf()+(payload.buf()-src.buf()), payload.dataSize());
+    if (signedContent.buf())
+        signedContent.assign(ownContent.buf()+(signedContent.buf()-src.buf()), signedContent.dataSize());
+}
+
 void ParsedMessage::parsePayloadWithUtfBackrefs(const StaticBuffer &data, Message &msg)
 {
     Id chatid = mProtoHandler.chatid;
@@ -454,7 +487,6 @@ ProtocolHandler::ProtocolHandler(karere::Id ownHandle,
  mUserAttrCache(userAttrCache), mDb(db), chatid(aChatId)
 {
     getPubKeyFromPrivKey(myPrivEd25519, kKeyTypeEd25519, myPubEd25519);
-    loadKeysFromDb();
     auto var = getenv("KRCHAT_FORCE_RSA");
     if (var)
     {
@@ -468,35 +500,92 @@ unsigned int ProtocolHandler::getCacheVersion() const
     return mCacheVersion;
 }
 
-void ProtocolHandler::loadKeysFromDb()
+std::shared_ptr<AesCtrKey> ProtocolHandler::ctrKey(const StaticBuffer& key)
 {
-//    int oldest = time(NULL)-CHATD_MAX_EDIT_AGE-600;
-    SqliteStmt stmt(mDb, "select userid, keyid, key from sendkeys where chatid=?");
-    stmt << chatid;
-    while(stmt.step())
-    {
-        auto key = std::make_shared<SendKey>();
-        stmt.blobCol(2, *key);
-#ifndef NDEBUG
-        auto ret =
-#endif
-        mKeys.emplace(std::piecewise_construct,
-            std::forward_as_tuple(stmt.uint64Col(0), stmt.uint64Col(1)),
-            std::forward_as_tuple(key));
-        assert(ret.second);
+    std::string keyStr(key.buf(), key.dataSize());
+    auto it = mCtrKeys.find(keyStr);
+    if (it != mCtrKeys.end())
+        return it->second;
+
+    if (mCtrKeys.size() >= kCtrKeyCacheSize)
+    {
+        // keys are rarely reused after a rotation, any of them can go
+        mCtrKeys.erase(mCtrKeys.begin());
     }
-    STRONGVELOPE_LOG_DEBUG("(%" PRId64 "): Loaded %zu send keys from database", chatid, mKeys.size());
+    std::shared_ptr<AesCtrKey> result(new AesCtrKey(key));
+    mCtrKeys.emplace(keyStr, result);
+    return result;
+}
+
+std::shared_ptr<SendKey> ProtocolHandler::lookupKey(UserKeyId ukid)
+{
+    auto& cache = KeyCache::instance();
+    auto key = cache.getSendKey(chatid, ukid.user, ukid.key);
+    if (key)
+        return key;
+
+    SqliteStmt stmt(mDb, "select key from sendkeys where chatid=? and userid=? and keyid=?");
+    stmt << chatid << ukid.user << ukid.key;
+    if (!stmt.step())
+        return nullptr;
+    key = std::make_shared<SendKey>();
+    stmt.blobCol(0, *key);
+    cache.putSendKey(chatid, ukid.user, ukid.key, key);
+    mKeysInDb.insert(ukid);
+    return key;
+}
+
+std::map<UserKeyId, std::shared_ptr<SendKey>> ProtocolHandler::lookupKeys(const std::set<UserKeyId>& ukids)
+{
+    std::map<UserKeyId, std::shared_ptr<SendKey>> result;
+    std::vector<UserKeyId> misses;
+    auto& cache = KeyCache::instance();
+    for (auto& ukid: ukids)
+    {
+        auto key = cache.getSendKey(chatid, ukid.user, ukid.key);
+        if (key)
+            result.emplace(ukid, key);
+        else
+            misses.push_back(ukid);
+    }
+    // The keys are selected by keyid only, which keeps the number of bound
+    // parameters low, and the rows of other users are skipped
+    enum { kKeysPerQuery = 256 };
+    for (size_t start = 0; start < misses.size(); start += kKeysPerQuery)
+    {
+        size_t end = std::min<size_t>(start + kKeysPerQuery, misses.size());
+        std::string sql = "select userid, keyid, key from sendkeys where chatid=? and keyid in (?";
+        for (size_t i = start + 1; i < end; i++)
+            sql.append(",?");
+        sql += ')';
+        SqliteStmt stmt(mDb, sql);
+        stmt << chatid;
+        for (size_t i = start; i < end; i++)
+            stmt << misses[i].key;
+        while (stmt.step())
+        {
+            UserKeyId ukid(stmt.uint64Col(0), stmt.uint64Col(1));
+            if (!ukids.count(ukid) || result.count(ukid))
+                continue;
+            auto key = std::make_shared<SendKey>();
+            stmt.blobCol(2, *key);
+            cache.putSendKey(chatid, ukid.user, ukid.key, key);
+            mKeysInDb.insert(ukid);
+            result.emplace(ukid, key);
+        }
+    }
+    return result;
 }
 
 void ProtocolHandler::msgEncryptWithKey(Message& src, chatd::MsgCommand& dest,
     const StaticBuffer& key)
 {
-    EncryptedMessage encryptedMessage(src, key);
+    EncryptedMessage encryptedMessage(src, key, *ctrKey(key));
     assert(!encryptedMessage.ciphertext.empty());
-    TlvWriter tlv(encryptedMessage.ciphertext.size()+128); //only signed content goes here
+    TlvWriter tlv(encryptedMessage.ciphertext.dataSize()+128); //only signed content goes here
     // Assemble message content.
     tlv.addRecord(TLV_TYPE_NONCE, encryptedMessage.nonce);
-    tlv.addRecord(TLV_TYPE_PAYLOAD, StaticBuffer(encryptedMessage.ciphertext, false));
+    tlv.addRecord(TLV_TYPE_PAYLOAD, encryptedMessage.ciphertext);
     Key<64> signature;
     signMessage(tlv, SVCRYPTO_PROTOCOL_VERSION, SVCRYPTO_MSGTYPE_FOLLOWUP,
                 encryptedMessage.key, signature);
@@ -514,10 +603,11 @@ void ProtocolHandler::msgEncryptWithKey(Message& src, chatd::MsgCommand& dest,
 promise::Promise<std::shared_ptr<SendKey>>
 ProtocolHandler::computeSymmetricKey(karere::Id userid, const std::string& padString)
 {
-    auto it = mSymmKeyCache.find(userid);
-    if (it != mSymmKeyCache.end())
+    auto& cache = KeyCache::instance();
+    auto key = cache.getSymmKey(mOwnHandle, userid, padString);
+    if (key)
     {
-        return it->second;
+        return key;
     }
     auto wptr = weakHandle();
     return mUserAttrCache.getAttr(userid, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY)
@@ -526,9 +616,10 @@ ProtocolHandler::computeSymmetricKey(karere::Id userid, const std::string& padSt
         wptr.throwIfDeleted();
         // We may have had 2 almost parallel requests, and the second may
         // have put the key into the cache already
-        auto it = mSymmKeyCache.find(userid);
-        if (it != mSymmKeyCache.end())
-            return it->second;
+        auto& cache = KeyCache::instance();
+        auto key = cache.getSymmKey(mOwnHandle, userid, padString);
+        if (key)
+            return key;
 
         if (pubKey->empty())
             return promise::Error("Empty Cu25519 chat key for user "+userid.toString());
@@ -538,7 +629,7 @@ ProtocolHandler::computeSymmetricKey(karere::Id userid, const std::string& padSt
         (void)ignore;
         auto result = std::make_shared<SendKey>();
         deriveSharedKey(sharedSecret, *result, padString);
-        mSymmKeyCache.emplace(userid, result);
+        cache.putSymmKey(mOwnHandle, userid, padString, result);
         return result;
     });
 }
@@ -826,7 +917,12 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
         message->type = parsedMsg->type;
 
         if (message->userid == API_USER)
-            return handleManagementMessage(parsedMsg, message);
+        {
+            auto pms = handleManagementMessage(parsedMsg, message);
+            if (!pms.done())
+                parsedMsg->detachFromSource(*message);
+            return pms;
+        }
 
         // Get keyid
         uint64_t keyid;
@@ -864,7 +960,7 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
 
         // Verify signature and decrypt
         auto wptr = weakHandle();
-        return promise::when(symPms, edPms)
+        auto pms = promise::when(symPms, edPms)
         .then([this, wptr, message, parsedMsg, ctx, isLegacy, keyid, cacheVersion]() ->promise::Promise<Message*>
         {
             wptr.throwIfDeleted();
@@ -889,6 +985,11 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
             parsedMsg->symmetricDecrypt(*ctx->sendKey, *message);
             return message;
         });
+        // Waiting for the key or the signing key. The message may be updated
+        // meanwhile, so the parsed message can't point into it anymore
+        if (!pms.done())
+            parsedMsg->detachFromSource(*message);
+        return pms;
     }
     catch(std::runtime_error& e)
     {
@@ -896,23 +997,241 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
     }
 }
 
+/** A message of a batch, verified and decrypted on a worker thread. The
+ * worker has exclusive access to the copy of the message and to the parsed
+ * message, which points into the copy, and only reads the keys. All the rest
+ * is created and destroyed on the event loop thread */
+struct BatchDecryptJob
+{
+    Message* message;
+    std::unique_ptr<Message> copy;
+    std::unique_ptr<ParsedMessage> parsedMsg;
+    std::shared_ptr<SendKey> sendKey;
+    EcKey edKey;
+    Promise<Message*> pms;
+    // results
+    bool sigInvalid = false;
+    std::string error;
+};
+
+struct ProtocolHandler::DecryptBatch
+{
+    std::vector<BatchDecryptJob> jobs;
+    std::atomic<unsigned> pendingChunks;
+    DecryptBatch(): pendingChunks(0) {}
+};
+
+static void runDecryptJobs(BatchDecryptJob* begin, BatchDecryptJob* end)
+{
+    // The key cache of ProtocolHandler is not thread-safe, so each worker
+    // expands the keys itself. A batch of history is normally encrypted with
+    // just a few keys, in sequence, so keeping the last one is enough
+    std::unique_ptr<AesCtrKey> ctrKey;
+    const SendKey* ctrKeyOf = nullptr;
+    for (auto job = begin; job < end; job++)
+    {
+        try
+        {
+            if (!job->parsedMsg->verifySignature(job->edKey, *job->sendKey))
+            {
+                job->sigInvalid = true;
+                continue;
+            }
+            if (job->sendKey.get() != ctrKeyOf)
+            {
+                ctrKey.reset(new AesCtrKey(*job->sendKey));
+                ctrKeyOf = job->sendKey.get();
+            }
+            job->parsedMsg->symmetricDecrypt(*ctrKey, *job->copy);
+        }
+        catch(std::exception& e)
+        {
+            job->error = e.what();
+        }
+    }
+}
+
+std::vector<Promise<Message*>>
+ProtocolHandler::msgDecryptBatch(const std::vector<Message*>& msgs)
+{
+    std::vector<Promise<Message*>> result;
+    result.reserve(msgs.size());
+    // Only messages of the current protocol, whose keys are already known,
+    // can be handled without the event loop. The rest go the usual way.
+    // Older versions are excluded also because their payload parsing
+    // accesses the ProtocolHandler, which may be deleted meanwhile.
+    // The message is parsed from a copy, as the payload is decrypted in
+    // place, and the original stays on the loop
+    std::vector<std::unique_ptr<Message>> copies(msgs.size());
+    std::vector<std::unique_ptr<ParsedMessage>> parsedMsgs(msgs.size());
+    std::set<UserKeyId> ukids;
+    for (size_t i = 0; i < msgs.size(); i++)
+    {
+        auto message = msgs[i];
+        if (message->empty() || (message->userid == API_USER))
+            continue;
+        copies[i].reset(new Message(message->id(), message->userid, message->ts,
+            message->updated, message->buf(), message->dataSize(), false,
+            message->keyid, message->type));
+        try
+        {
+            parsedMsgs[i].reset(new ParsedMessage(*copies[i], *this));
+        }
+        catch(std::runtime_error&)
+        {
+            //msgDecrypt() will report the error
+            continue;
+        }
+        if (parsedMsgs[i]->protocolVersion >= 3)
+            ukids.insert(UserKeyId(message->userid, message->keyid));
+    }
+    // The keys that are not cached are loaded with one query for the whole batch
+    auto keys = lookupKeys(ukids);
+
+    auto batch = new DecryptBatch;
+    batch->jobs.reserve(msgs.size());
+    for (size_t i = 0; i < msgs.size(); i++)
+    {
+        auto message = msgs[i];
+        std::unique_ptr<Message>& copy = copies[i];
+        std::unique_ptr<ParsedMessage>& parsedMsg = parsedMsgs[i];
+        std::shared_ptr<SendKey> sendKey;
+        Buffer* edKey = nullptr;
+        if (parsedMsg && (parsedMsg->protocolVersion >= 3))
+        {
+            UserKeyId ukid(message->userid, message->keyid);
+            auto kit = keys.find(ukid);
+            if ((mKeys.find(ukid) == mKeys.end()) && (kit != keys.end()))
+            {
+                sendKey = kit->second;
+                auto edPms = mUserAttrCache.getAttr(parsedMsg->sender,
+                    ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY);
+                if (edPms.succeeded())
+                {
+                    edKey = edPms.value();
+                }
+                else
+                {
+                    // msgDecrypt() requests it again, and handles the error
+                    edPms.fail([](const promise::Error&) -> Buffer* { return nullptr; });
+                }
+            }
+        }
+        if (!edKey)
+        {
+            result.push_back(msgDecrypt(message));
+            continue;
+        }
+
+        message->type = parsedMsg->type;
+        batch->jobs.emplace_back();
+        auto& job = batch->jobs.back();
+        job.message = message;
+        job.copy = std::move(copy);
+        job.parsedMsg = std::move(parsedMsg);
+        job.sendKey = sendKey;
+        job.edKey.assign(edKey->buf(), edKey->dataSize());
+        result.push_back(job.pms);
+    }
+
+    auto& jobs = batch->jobs;
+    if (jobs.empty())
+    {
+        delete batch;
+        return result;
+    }
+    unsigned cacheVersion = mCacheVersion;
+    auto& pool = WorkerPool::instance();
+    if (jobs.size() < kMinParallelDecryptBatch)
+    {
+        runDecryptJobs(jobs.data(), jobs.data()+jobs.size());
+        completeDecryptBatch(*batch, cacheVersion);
+        delete batch;
+        return result;
+    }
+
+    size_t chunkSize = std::max<size_t>(kMinDecryptChunk,
+        (jobs.size() + pool.threadCount() - 1) / pool.threadCount());
+    unsigned chunkCount = (jobs.size() + chunkSize - 1) / chunkSize;
+    batch->pendingChunks = chunkCount;
+    auto wptr = weakHandle();
+    auto appCtx = getAppCtx();
+    for (size_t start = 0; start < jobs.size(); start += chunkSize)
+    {
+        BatchDecryptJob* begin = jobs.data()+start;
+        BatchDecryptJob* end = jobs.data()+std::min(start+chunkSize, jobs.size());
+        pool.post([this, wptr, batch, begin, end, cacheVersion, appCtx]()
+        {
+            runDecryptJobs(begin, end);
+            if (--batch->pendingChunks)
+                return;
+
+            // The last chunk to finish hands the batch back to the loop,
+            // which owns it from there on
+            marshallCall([this, wptr, batch, cacheVersion]()
+            {
+                std::unique_ptr<DecryptBatch> autodel(batch);
+                if (wptr.deleted())
+                    return;
+                completeDecryptBatch(*batch, cacheVersion);
+            }, appCtx);
+        });
+    }
+    return result;
+}
+
+void ProtocolHandler::completeDecryptBatch(DecryptBatch& batch, unsigned int cacheVersion)
+{
+    // Resolved from the last to the first, so when the client, which waits for
+    // the first one, is notified, the rest are already done and it can pass
+    // them all on at once
+    for (auto it = batch.jobs.rbegin(); it != batch.jobs.rend(); it++)
+    {
+        auto& job = *it;
+        if (cacheVersion != mCacheVersion)
+        {
+            job.pms.reject("msgDecryptBatch: history was reloaded, ignore message", EINVAL, SVCRYPTO_ENOMSG);
+        }
+        else if (job.sigInvalid)
+        {
+            job.pms.reject("Signature invalid for message "+
+                job.message->id().toString(), EINVAL, SVCRYPTO_ERRTYPE);
+        }
+        else if (!job.error.empty())
+        {
+            job.pms.reject(job.error);
+        }
+        else
+        {
+            auto& message = *job.message;
+            message.assign(job.copy->buf(), job.copy->dataSize());
+            message.backRefId = job.copy->backRefId;
+            message.backRefs = std::move(job.copy->backRefs);
+            message.setEncrypted(0);
+            job.pms.resolve(&message);
+        }
+    }
+}
+
 Promise<void>
 ProtocolHandler::legacyExtractKeys(const std::shared_ptr<ParsedMessage>& parsedMsg)
 {
     if (parsedMsg->encryptedKey.empty())
         return promise::Error("legacyExtractKeys: No encrypted keys found in parsed message", EPROTO, SVCRYPTO_ERRTYPE);
 
-    auto& key1 = mKeys[UserKeyId(parsedMsg->sender, parsedMsg->keyId)];
-    if (!key1.key)
+    UserKeyId ukid1(parsedMsg->sender, parsedMsg->keyId);
+    if (!lookupKey(ukid1))
     {
+        auto& key1 = mKeys[ukid1];
         if (!key1.pms)
             key1.pms.reset(new Promise<std::shared_ptr<SendKey>>);
     }
     if (parsedMsg->prevKeyId)
     {
-        auto& key2 = mKeys[UserKeyId(parsedMsg->sender, parsedMsg->prevKeyId)];
-        if (!key2.key)
+        UserKeyId ukid2(parsedMsg->sender, parsedMsg->prevKeyId);
+        if (!lookupKey(ukid2))
         {
+            auto& key2 = mKeys[ukid2];
             if (!key2.pms)
                 key2.pms.reset(new Promise<std::shared_ptr<SendKey>>);
         }
@@ -977,67 +1296,67 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
 {
     assert(key->dataSize() == SVCRYPTO_KEY_SIZE);
     STRONGVELOPE_LOG_DEBUG("Adding key %lld of user %s", ukid.key, ukid.user.toString().c_str());
-    auto& entry = mKeys[ukid];
-    if (entry.key)
+    auto known = lookupKey(ukid);
+    if (known)
     {
-        if (memcmp(entry.key->buf(), key->buf(), SVCRYPTO_KEY_SIZE))
+        if (memcmp(known->buf(), key->buf(), SVCRYPTO_KEY_SIZE))
             throw std::runtime_error("addDecryptedKey: Key with id "+std::to_string(ukid.key)+" from user '"+ukid.user.toString()+"' already known but different");
 
         STRONGVELOPE_LOG_DEBUG("addDecryptedKey: Key %lld from user %s already known and is same", ukid.key, ukid.user.toString().c_str());
     }
     else
     {
-        entry.key = key;
+        known = key;
+        KeyCache::instance().putSendKey(chatid, ukid.user, ukid.key, key);
+    }
+    // The key may be known only from the cache, i.e. decrypted by the client
+    // of another account in this process, so it's stored unless it's known
+    // to be in our db already
+    if (mKeysInDb.insert(ukid).second)
+    {
         try
         {
-            mDb.query("insert or ignore into sendkeys(chatid, userid, keyid, key, ts) values(?,?,?,?,?)",
-                chatid, ukid.user, ukid.key, *key, (int)time(NULL));
+            mDb.queryAsync("insert or ignore into sendkeys(chatid, userid, keyid, key, ts) values(?,?,?,?,?)",
+                chatid, ukid.user, ukid.key, *known, (int)time(NULL));
         }
         catch(std::exception& e)
         {
+            mKeysInDb.erase(ukid);
             STRONGVELOPE_LOG_ERROR("Exception while saving sendkey to db: %s", e.what());
             throw;
         }
     }
-    if (entry.pms)
+    auto it = mKeys.find(ukid);
+    if (it != mKeys.end())
     {
-        entry.pms->resolve(entry.key);
-        entry.pms.reset();
+        auto pms = it->second.pms;
+        mKeys.erase(it);
+        if (pms)
+            pms->resolve(known);
     }
 }
 promise::Promise<std::shared_ptr<SendKey>>
 ProtocolHandler::getKey(UserKeyId ukid, bool legacy)
 {
     auto kit = mKeys.find(ukid);
-    if (kit == mKeys.end())
+    if (kit != mKeys.end())
     {
-        if (legacy)
-        {
-            auto& key = mKeys[ukid];
-            key.pms.reset(new Promise<std::shared_ptr<SendKey>>);
-            return *key.pms;
-        }
-        else
-        {
-            return promise::Error("Key with id "+std::to_string(ukid.key)+
-            " from user "+ukid.user.toString()+" not found", SVCRYPTO_ENOKEY, SVCRYPTO_ERRTYPE);
-        }
+        assert(kit->second.pms);
+        return *kit->second.pms;
     }
-    auto& entry = kit->second;
-    auto key = entry.key;
+    auto key = lookupKey(ukid);
     if (key)
     {
         return key;
     }
-    else if (entry.pms)
-    {
-        return (*entry.pms);
-    }
-    else
+    if (legacy)
     {
-        assert(false && "Key found but no promise not key member are set");
-        return std::shared_ptr<SendKey>(); //return something, just to mute the gcc warning
+        auto& entry = mKeys[ukid];
+        entry.pms.reset(new Promise<std::shared_ptr<SendKey>>);
+        return *entry.pms;
     }
+    return promise::Error("Key with id "+std::to_string(ukid.key)+
+        " from user "+ukid.user.toString()+" not found", SVCRYPTO_ENOKEY, SVCRYPTO_ERRTYPE);
 }
 
 void ProtocolHandler::onKeyConfirmed(uint32_t keyxid, uint32_t keyid)
@@ -1091,32 +1410,213 @@ ProtocolHandler::encryptKeyToAllParticipants(const std::shared_ptr<SendKey>& key
 {
     // Users and send key may change while we are getting pubkeys of current
     // users, so make a snapshot
-    auto keyCmd = new KeyCommand(Id::null());
     SetOfIds users = *mParticipants;
     if (extraUser)
     {
         users.insert(extraUser);
     }
-    std::vector<Promise<void>> promises;
-    promises.reserve(users.size());
+    // Fetch the Cu25519 keys that we may need in one batch. The ones in the
+    // attribute cache are not requested again
+    std::vector<UserAttrPair> pubKeys;
+    if (!mForceRsa)
+    {
+        for (auto& user: users)
+        {
+            if (mWrapKeys.find(user) == mWrapKeys.end())
+                pubKeys.emplace_back(user, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY);
+        }
+    }
+    auto wptr = weakHandle();
+    return mUserAttrCache.getAttrs(pubKeys)
+    .then([this, wptr, users, key]()
+    {
+        wptr.throwIfDeleted();
+        return wrapKeyTo(users, key);
+    });
+}
 
+/** A recipient of a send key, to whom the key is encrypted with AES-ECB on a
+ * worker thread. If the symmetric key shared with the recipient is not known,
+ * the worker derives it from the Cu25519 public key of the recipient */
+struct KeyWrapJob
+{
+    Id userid;
+    std::shared_ptr<SendKey> symmKey;
+    EcKey pubKey;
+    std::shared_ptr<Buffer> result;
+};
+
+struct ProtocolHandler::KeyWrapBatch
+{
+    std::shared_ptr<SendKey> sendKey;
+    Id ownHandle;
+    EcKey privCu25519;
+    std::vector<KeyWrapJob> jobs;
+    std::shared_ptr<std::map<Id, std::shared_ptr<Buffer>>> results;
+    Promise<void> done;
+    std::atomic<unsigned> pendingChunks;
+    KeyWrapBatch(): pendingChunks(0) {}
+};
+
+static void runKeyWrapJobs(const SendKey& sendKey, Id ownHandle, const EcKey& privCu25519,
+    KeyWrapJob* begin, KeyWrapJob* end)
+{
+    for (auto job = begin; job < end; job++)
+    {
+        if (!job->symmKey)
+        {
+            Key<crypto_scalarmult_BYTES> sharedSecret;
+            sharedSecret.setDataSize(crypto_scalarmult_BYTES);
+            auto ignore = crypto_scalarmult(sharedSecret.ubuf(), privCu25519.ubuf(), job->pubKey.ubuf());
+            (void)ignore;
+            auto symmKey = std::make_shared<SendKey>();
+            deriveSharedKey(sharedSecret, *symmKey, SVCRYPTO_PAIRWISE_KEY);
+            KeyCache::instance().putSymmKey(ownHandle, job->userid, SVCRYPTO_PAIRWISE_KEY, symmKey);
+            job->symmKey = symmKey;
+        }
+        aesECBEncrypt(sendKey, *job->symmKey, *job->result);
+    }
+}
+
+promise::Promise<std::pair<KeyCommand*, std::shared_ptr<SendKey>>>
+ProtocolHandler::wrapKeyTo(const SetOfIds& users, const std::shared_ptr<SendKey>& key)
+{
+    auto results = std::make_shared<std::map<Id, std::shared_ptr<Buffer>>>();
+    auto batch = new KeyWrapBatch;
+    batch->sendKey = key;
+    batch->ownHandle = mOwnHandle;
+    batch->privCu25519.assign(myPrivCu25519.buf(), myPrivCu25519.dataSize());
+    batch->results = results;
+    batch->jobs.reserve(users.size());
+    std::vector<Promise<void>> promises;
+    size_t deriveCount = 0;
+    auto& cache = KeyCache::instance();
+    auto wptr = weakHandle();
     for (auto& user: users)
     {
-        auto pms = encryptKeyTo(key, user)
-        .then([keyCmd, user](const std::shared_ptr<Buffer>& encryptedKey)
+        std::shared_ptr<SendKey> symmKey;
+        const Buffer* pubKey = nullptr;
+        if (!mForceRsa)
         {
-            assert(encryptedKey && !encryptedKey->empty());
-            keyCmd->addKey(user, encryptedKey->buf(), encryptedKey->dataSize());
-        });
-        promises.push_back(pms);
+            auto it = mWrapKeys.find(user);
+            if (it != mWrapKeys.end())
+            {
+                symmKey = it->second;
+            }
+            else if (!(symmKey = cache.getSymmKey(mOwnHandle, user, SVCRYPTO_PAIRWISE_KEY)))
+            {
+                auto attr = mUserAttrCache.find(UserAttrPair(user, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY));
+                if ((attr != mUserAttrCache.end()) && attr->second->data
+                    && (attr->second->data->dataSize() == crypto_scalarmult_BYTES))
+                {
+                    pubKey = attr->second->data.get();
+                }
+            }
+        }
+        if (!symmKey && !pubKey)
+        {
+            // RSA encryption is done on the event loop thread, as the SDK
+            // takes the padding from a random generator that is not thread-safe.
+            // It's needed only for users that have no Cu25519 key
+            STRONGVELOPE_LOG_DEBUG("Can't use EC encryption for user %s, falling back to RSA", user.toString().c_str());
+            promises.push_back(rsaEncryptTo(std::static_pointer_cast<StaticBuffer>(key), user)
+            .then([results, user](const std::shared_ptr<Buffer>& encryptedKey)
+            {
+                (*results)[user] = encryptedKey;
+            })
+            .fail([this, wptr, user](const promise::Error& err)
+            {
+                wptr.throwIfDeleted();
+                STRONGVELOPE_LOG_ERROR("No public encryption key (RSA or x25519) available for %s", user.toString().c_str());
+                return err;
+            }));
+            continue;
+        }
+        batch->jobs.emplace_back();
+        auto& job = batch->jobs.back();
+        job.userid = user;
+        job.symmKey = symmKey;
+        if (pubKey)
+        {
+            job.pubKey.assign(pubKey->buf(), pubKey->dataSize());
+            deriveCount++;
+        }
+        job.result = std::make_shared<Buffer>((size_t)AES::BLOCKSIZE);
+        job.result->setDataSize(AES::BLOCKSIZE); //dataSize() is used to check available buffer space of StaticBuffers
+    }
+    promises.push_back(batch->done);
+
+    auto& jobs = batch->jobs;
+    auto& pool = WorkerPool::instance();
+    if (deriveCount < kMinParallelKeyWrap)
+    {
+        // Encrypting with known symmetric keys takes about a microsecond per user
+        runKeyWrapJobs(*key, mOwnHandle, myPrivCu25519, jobs.data(), jobs.data()+jobs.size());
+        completeKeyWrapBatch(*batch);
+        delete batch;
     }
+    else
+    {
+        STRONGVELOPE_LOG_DEBUG("Encrypting send key to %zu users on the worker pool, deriving %zu symmetric keys",
+            jobs.size(), deriveCount);
+        size_t chunkSize = std::max<size_t>(kMinKeyWrapChunk,
+            (jobs.size() + pool.threadCount() - 1) / pool.threadCount());
+        batch->pendingChunks = (jobs.size() + chunkSize - 1) / chunkSize;
+        auto appCtx = getAppCtx();
+        for (size_t start = 0; start < jobs.size(); start += chunkSize)
+        {
+            KeyWrapJob* begin = jobs.data()+start;
+            KeyWrapJob* end = jobs.data()+std::min(start+chunkSize, jobs.size());
+            pool.post([this, wptr, batch, begin, end, appCtx]()
+            {
+                runKeyWrapJobs(*batch->sendKey, batch->ownHandle, batch->privCu25519, begin, end);
+                if (--batch->pendingChunks)
+                    return;
+
+                marshallCall([this, wptr, batch]()
+                {
+                    std::unique_ptr<KeyWrapBatch> autodel(batch);
+                    if (wptr.deleted())
+                    {
+                        // the send that waits for the key must not hang
+                        batch->done.reject("wrapKeyTo: protocol handler deleted", EINVAL, SVCRYPTO_ERRTYPE);
+                        return;
+                    }
+                    completeKeyWrapBatch(*batch);
+                }, appCtx);
+            });
+        }
+    }
+
     return promise::when(promises)
-    .then([keyCmd, key]()
+    .then([results, key]()
     {
+        // The keys are added in the order of the user handles, regardless of
+        // which were encrypted first
+        auto keyCmd = new KeyCommand(Id::null());
+        for (auto& item: *results)
+        {
+            assert(item.second && !item.second->empty());
+            keyCmd->addKey(item.first, item.second->buf(), item.second->dataSize());
+        }
         return std::make_pair(keyCmd, key);
     });
 }
 
+void ProtocolHandler::completeKeyWrapBatch(KeyWrapBatch& batch)
+{
+    // The symmetric keys of this participant set replace the previous ones,
+    // so the ones of users that left are dropped
+    std::map<Id, std::shared_ptr<SendKey>> wrapKeys;
+    for (auto& job: batch.jobs)
+    {
+        wrapKeys[job.userid] = job.symmKey;
+        (*batch.results)[job.userid] = job.result;
+    }
+    mWrapKeys.swap(wrapKeys);
+    batch.done.resolve();
+}
+
 promise::Promise<std::shared_ptr<Buffer>>
 ProtocolHandler::encryptChatTitle(const std::string& data, uint64_t extraUser)
 {
@@ -1136,7 +1636,7 @@ ProtocolHandler::encryptChatTitle(const std::string& data, uint64_t extraUser)
         auto& key = result.second;
         chatd::Message msg(0, mOwnHandle, 0, 0, Buffer(data.c_str(), data.size()));
         msg.backRefId = chatd::Chat::generateRefId(this);
-        EncryptedMessage enc(msg, *key);
+        EncryptedMessage enc(msg, *key, *ctrKey(*key));
 
         chatd::KeyCommand& keyCmd = *result.first;
         assert(keyCmd.dataSize() >= 17);
@@ -1144,7 +1644,7 @@ ProtocolHandler::encryptChatTitle(const std::string& data, uint64_t extraUser)
         tlv.addRecord(TLV_TYPE_INVITOR, mOwnHandle.val);
         tlv.addRecord(TLV_TYPE_NONCE, enc.nonce);
         tlv.addRecord(TLV_TYPE_KEYBLOB, StaticBuffer(keyCmd.buf()+17, keyCmd.dataSize()-17));
-        tlv.addRecord(TLV_TYPE_PAYLOAD, StaticBuffer(enc.ciphertext, false));
+        tlv.addRecord(TLV_TYPE_PAYLOAD, enc.ciphertext);
         Key<64> signature;
         signMessage(tlv, SVCRYPTO_PROTOCOL_VERSION, Message::kMsgChatTitle,
             enc.key, signature);
@@ -1204,10 +1704,46 @@ void ProtocolHandler::onUserJoin(Id userid)
 {
     mParticipantsChanged = true;
     resetSendKey(); //just in case
-    //preload keys
-    mUserAttrCache.getAttr(userid, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY, nullptr, nullptr);
-    mUserAttrCache.getAttr(userid, ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY, nullptr, nullptr);
-    mUserAttrCache.getAttr(userid, USER_ATTR_RSA_PUBKEY, nullptr, nullptr);
+    prefetchKeysOf(std::vector<karere::Id>{userid});
+}
+
+void ProtocolHandler::prefetchUserKeys()
+{
+    if (!mParticipants)
+        return;
+    prefetchKeysOf(std::vector<karere::Id>(mParticipants->begin(), mParticipants->end()));
+}
+
+void ProtocolHandler::prefetchKeysOf(const std::vector<karere::Id>& users)
+{
+    std::vector<UserAttrPair> keys;
+    keys.reserve(users.size()*2);
+    for (auto userid: users)
+    {
+        keys.emplace_back(userid, ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY);
+        keys.emplace_back(userid, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY);
+    }
+    auto wptr = weakHandle();
+    mUserAttrCache.getAttrs(keys)
+    .then([this, wptr, users]()
+    {
+        if (wptr.deleted())
+            return;
+        // encryptKeyTo() falls back to RSA only for users without a Cu25519 key
+        std::vector<UserAttrPair> rsaKeys;
+        for (auto userid: users)
+        {
+            auto it = mUserAttrCache.find(UserAttrPair(userid, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY));
+            if ((it != mUserAttrCache.end()) && !it->second->pending && !it->second->data)
+            {
+                rsaKeys.emplace_back(userid, USER_ATTR_RSA_PUBKEY);
+            }
+        }
+        if (!rsaKeys.empty())
+        {
+            mUserAttrCache.getAttrs(rsaKeys);
+        }
+    });
 }
 
 void ProtocolHandler::onUserLeave(Id userid)
@@ -1228,14 +1764,7 @@ void ProtocolHandler::setUsers(karere::SetOfIds* users)
     mParticipants = users;
     mParticipantsChanged = true;
     resetSendKey(); //just in case
-
-    //pre-fetch user attributes
-    for (auto userid: *users)
-    {
-        mUserAttrCache.getAttr(userid, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY, nullptr, nullptr);
-        mUserAttrCache.getAttr(userid, ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY, nullptr, nullptr);
-        mUserAttrCache.getAttr(userid, USER_ATTR_RSA_PUBKEY, nullptr, nullptr);
-    }
+    //the keys of the participants are prefetched by prefetchUserKeys(), once joined
 }
 
 bool ProtocolHandler::handleLegacyKeys(chatd::Message& msg)
@@ -9,6 +9,7 @@
 #define STRONGVELOPE_H_
 #include <vector>
 #include <map>
+#include <set>
 #include <string>
 #include <assert.h>
 #include <iostream>
@@ -160,6 +161,7 @@ typedef Key<16> SendKey;
 typedef Key<32> EcKey;
 
 class ProtocolHandler;
+class AesCtrKey;
 /** Class to parse an encrypted message and store its attributes and content */
 struct ParsedMessage: public chatd::Message::ManagementInfo, public karere::DeleteTrackable
 {
@@ -167,8 +169,15 @@ struct ParsedMessage: public chatd::Message::ManagementInfo, public karere::Dele
     uint8_t protocolVersion;
     karere::Id sender;
     Key<32> nonce;
-    Buffer payload;
-    Buffer signedContent;
+    /** The payload and the signed content are not copied, but point into the buffer
+     * of the source message, so it must be kept alive (and its content intact)
+     * while they are used. The payload is decrypted in place, in the message buffer.
+     * If decryption can't complete immediately, detachFromSource() must be called */
+    StaticBuffer payload{nullptr, 0};
+    StaticBuffer signedContent{nullptr, 0};
+    /** The copy of the source message that \c payload and \c signedContent
+     * point into after detachFromSource() */
+    Buffer ownContent;
     Buffer signature;
     unsigned char type;
     chatd::BackRefId backRefId = 0;
@@ -178,10 +187,19 @@ struct ParsedMessage: public chatd::Message::ManagementInfo, public karere::Dele
     uint64_t prevKeyId;
     Buffer encryptedKey; //may contain also the prev key, concatenated
     ParsedMessage(const chatd::Message& src, ProtocolHandler& protoHandler);
+    /** Makes \c payload and \c signedContent point into a copy of \c src, which
+     * must be the message this was parsed from, still unchanged. Needed when
+     * the message is decrypted asynchronously, as its buffer may be changed
+     * meanwhile, i.e. by an edit of the same message */
+    void detachFromSource(const chatd::Message& src);
     bool verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey);
     void parsePayload(const StaticBuffer& data, chatd::Message& msg);
     void parsePayloadWithUtfBackrefs(const StaticBuffer& data, chatd::Message& msg);
     void symmetricDecrypt(const StaticBuffer& key, chatd::Message& outMsg);
+    /** Same as above, but with an expanded key that is owned by the caller.
+     * For protocol version 3 and later, does not access the ProtocolHandler,
+     * so it can be called from a worker thread */
+    void symmetricDecrypt(AesCtrKey& ctrKey, chatd::Message& outMsg);
     promise::Promise<chatd::Message*> decryptChatTitle(chatd::Message* msg, bool msgCanBeDeleted);
 };
 
@@ -206,14 +224,15 @@ enum
 };
 
 /** @brief Encrypts and holds an encrypted message and its attributes - key and
- *  nonce */
+ *  nonce. The payload is assembled directly in \c ciphertext and encrypted
+ *  there in place, with \c ctrKey, which is the expanded form of \c aKey */
 struct EncryptedMessage
 {
-    std::string ciphertext; //crypto++ does not support binary buffers in AES CTR mode, which is used for encrypting messages
+    Buffer ciphertext;
     SendKey key;
     chatd::BackRefId backRefId;
     Key<SVCRYPTO_NONCE_SIZE> nonce;
-    EncryptedMessage(const chatd::Message& msg, const StaticBuffer& aKey);
+    EncryptedMessage(const chatd::Message& msg, const StaticBuffer& aKey, AesCtrKey& ctrKey);
 };
 
 struct UserKeyId
@@ -251,19 +270,40 @@ protected:
     // gets broken. So we need to send it again upon re-login, until it gets confirmed.
     std::shared_ptr<chatd::KeyCommand> mUnconfirmedKeyCmd;
     bool mForceRsa = false;
+    /** Keys that are being decrypted. The decrypted ones are in the
+     * process-wide KeyCache and in the db, see lookupKey() */
     struct KeyEntry
     {
-        std::shared_ptr<SendKey> key;
         std::shared_ptr<promise::Promise<std::shared_ptr<SendKey>>> pms;
-        KeyEntry(){}
-        KeyEntry(const std::shared_ptr<SendKey>& aKey): key(aKey){}
     };
     std::map<UserKeyId, KeyEntry> mKeys;
-    std::map<karere::Id, std::shared_ptr<SendKey>> mSymmKeyCache;
+    /** Decrypted keys that are known to be in the db, so that addDecryptedKey()
+     * doesn't write them again */
+    std::set<UserKeyId> mKeysInDb;
+    /** Expanded forms of the send keys, by key value. Expanding an AES key
+     * costs about as much as encrypting a short message */
+    std::map<std::string, std::shared_ptr<AesCtrKey>> mCtrKeys;
+    enum { kCtrKeyCacheSize = 32 };
     karere::SetOfIds* mParticipants = nullptr;
     bool mParticipantsChanged = true;
     bool mIsDestroying = false;
     unsigned int mCacheVersion = 0;
+    /** Batches smaller than kMinParallelDecryptBatch are decrypted on the
+     * event loop thread, as handing them over to the worker pool would cost
+     * more than it saves. Larger ones are split in chunks of at least
+     * kMinDecryptChunk messages, one per worker thread */
+    enum { kMinParallelDecryptBatch = 4, kMinDecryptChunk = 8 };
+    struct DecryptBatch;
+    /** The symmetric keys with which our send keys are encrypted to the
+     * participants, for the participant set of the last key rotation. Unlike
+     * the KeyCache, they are not evicted by the keys of other chats, so a
+     * rotation after a user joins a large group derives only the new key */
+    std::map<karere::Id, std::shared_ptr<SendKey>> mWrapKeys;
+    /** Send keys are encrypted on the worker pool only if at least
+     * kMinParallelKeyWrap symmetric keys have to be derived, in chunks of at
+     * least kMinKeyWrapChunk recipients */
+    enum { kMinParallelKeyWrap = 8, kMinKeyWrapChunk = 16 };
+    struct KeyWrapBatch;
 public:
     karere::Id chatid;
     karere::Id ownHandle() const { return mOwnHandle; }
@@ -273,8 +313,24 @@ public:
         SqliteDb& db, karere::Id aChatId, void *ctx);
 
     unsigned int getCacheVersion() const;
+    /** @brief Returns the expanded form of the send key \c key, for message
+     * payload encryption and decryption */
+    std::shared_ptr<AesCtrKey> ctrKey(const StaticBuffer& key);
 protected:
-    void loadKeysFromDb();
+    /** Returns the decrypted key from the KeyCache, or loads it from the db
+     * into the cache. Returns an empty pointer if the key is not known */
+    std::shared_ptr<SendKey> lookupKey(UserKeyId ukid);
+    /** Like lookupKey(), for several keys, loading the ones that are not in
+     * the KeyCache with a single db query. Returns the keys that are known */
+    std::map<UserKeyId, std::shared_ptr<SendKey>> lookupKeys(const std::set<UserKeyId>& ukids);
+    /** Fetches the public keys of \c users in one batch. The RSA key is
+     * fetched only for those that turn out to have no Cu25519 key */
+    void prefetchKeysOf(const std::vector<karere::Id>& users);
+    void completeDecryptBatch(DecryptBatch& batch, unsigned int cacheVersion);
+    /** Encrypts \c key to \c users, whose Cu25519 keys must be already fetched */
+    promise::Promise<std::pair<chatd::KeyCommand*, std::shared_ptr<SendKey>>>
+        wrapKeyTo(const karere::SetOfIds& users, const std::shared_ptr<SendKey>& key);
+    void completeKeyWrapBatch(KeyWrapBatch& batch);
     promise::Promise<std::shared_ptr<SendKey>> getKey(UserKeyId ukid, bool legacy=false);
     void addDecryptedKey(UserKeyId ukid, const std::shared_ptr<SendKey>& key);
     /**
@@ -332,6 +388,10 @@ public:
     promise::Promise<std::pair<chatd::MsgCommand*, chatd::KeyCommand*>>
     msgEncrypt(chatd::Message *message, chatd::MsgCommand* msgCmd);
     virtual promise::Promise<chatd::Message*> msgDecrypt(chatd::Message* message);
+    /** Verifies and decrypts the messages whose keys are already known on the
+     * worker pool, and the rest via msgDecrypt() */
+    virtual std::vector<promise::Promise<chatd::Message*>>
+    msgDecryptBatch(const std::vector<chatd::Message*>& msgs);
     virtual void onKeyReceived(uint32_t keyid, karere::Id sender,
         karere::Id receiver, const char* data, uint16_t dataLen);
     virtual void onKeyConfirmed(uint32_t keyxid, uint32_t keyid);
@@ -339,6 +399,7 @@ public:
     virtual void setUsers(karere::SetOfIds* users);
     virtual void onUserJoin(karere::Id userid);
     virtual void onUserLeave(karere::Id userid);
+    virtual void prefetchUserKeys();
     virtual void resetSendKey();
     virtual bool handleLegacyKeys(chatd::Message& msg);
     virtual void randomBytes(void* buf, size_t bufsize) const;
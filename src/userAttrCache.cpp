@@ -111,7 +111,7 @@ UserAttrCache::~UserAttrCache()
 
 void UserAttrCache::dbWrite(UserAttrPair key, const Buffer& data)
 {
-    mClient.db.query(
+    mClient.db.queryAsync(
         "insert or replace into userattrs(userid, type, data) values(?,?,?)",
         key.user.val, key.attrType, data);
     UACACHE_LOG_DEBUG("dbWrite attr %s", key.toString().c_str());
@@ -119,7 +119,7 @@ void UserAttrCache::dbWrite(UserAttrPair key, const Buffer& data)
 
 void UserAttrCache::dbWriteNull(UserAttrPair key)
 {
-    mClient.db.query(
+    mClient.db.queryAsync(
         "insert or replace into userattrs(userid, type, data) values(?,?,NULL)",
         key.user, key.attrType);
     UACACHE_LOG_DEBUG("dbWriteNull attr %s as NULL", key.toString().c_str());
@@ -207,7 +207,7 @@ void UserAttrCache::onUserAttrChange(uint64_t userid, int changed)
 }
 void UserAttrCache::dbInvalidateItem(UserAttrPair key)
 {
-    mClient.db.query("delete from userattrs where userid=? and type=?",
+    mClient.db.queryAsync("delete from userattrs where userid=? and type=?",
                 key.user, key.attrType);
 }
 
@@ -513,4 +513,35 @@ UserAttrCache::getAttr(uint64_t user, unsigned attrType)
     return ret;
 }
 
+promise::Promise<void>
+UserAttrCache::getAttrs(const std::vector<UserAttrPair>& keys)
+{
+    std::vector<Promise<Buffer*>> pending;
+    size_t fetchCount = 0;
+    for (auto& key: keys)
+    {
+        auto it = find(key);
+        if (it != end())
+        {
+            if (it->second->pending != kCacheFetchNewPending)
+                continue; //we have it, even if it's being updated
+        }
+        else
+        {
+            fetchCount++;
+        }
+        pending.push_back(getAttr(key.user, key.attrType)
+        .fail([](const promise::Error&) -> Buffer*
+        {
+            return nullptr; //the error is cached, getAttr() will report it
+        }));
+    }
+    if (pending.empty())
+        return promise::_Void();
+
+    UACACHE_LOG_DEBUG("Batch request of %zu attributes: %zu fetched now, %zu already being fetched",
+        keys.size(), fetchCount, pending.size() - fetchCount);
+    return promise::when(pending);
+}
+
 }
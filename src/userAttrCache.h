@@ -4,6 +4,7 @@
 #include "karereId.h"
 #include <megaapi.h>
 #include <list>
+#include <vector>
 #include <promise.h>
 #include <base/trackDelete.h>
 
@@ -175,6 +176,15 @@ public:
      * is implicitly one-shot, as a promise can be resolved only once.
      */
     promise::Promise<Buffer*> getAttr(uint64_t user, unsigned attrType);
+    /** @brief Requests a batch of attributes, possibly of many users, i.e. the
+     * public keys of all participants of a chat. All the attributes that are
+     * neither cached nor being fetched are requested at once, so that the SDK
+     * sends them in one API request, instead of one after the other as they
+     * are needed. The returned promise is resolved when all attributes have
+     * been fetched or have failed - the results are then available from the
+     * cache via \c getAttr(). It's never rejected.
+     */
+    promise::Promise<void> getAttrs(const std::vector<UserAttrPair>& keys);
     /** @brief Unregisters an attribute request/subsequent callbacks.
      * It can be a not-yet-fetched single shot request as well. Use this method
      * to unsubscribe from further calling the corresponding callback.
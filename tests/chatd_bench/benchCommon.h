@@ -0,0 +1,111 @@
+#ifndef CHATD_BENCH_COMMON_H
+#define CHATD_BENCH_COMMON_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sqlite3.h>
+#include <base/gcmpp.h>
+#include <chatdICrypto.h>
+
+// Helpers shared by chatd_bench and chatd_replay
+
+static inline uint64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline uint64_t cpuTimeUs()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+        + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static inline uint64_t percentile(std::vector<uint64_t>& values, double p)
+{
+    if (values.empty())
+        return 0;
+    size_t n = (size_t)(p * (values.size()-1));
+    std::nth_element(values.begin(), values.begin()+n, values.end());
+    return values[n];
+}
+
+/** sqlite3_profile() callback that accumulates the statement execution time, in ns.
+ * It is called also by the db writer thread in write-behind mode */
+static inline void sqliteProfileCb(void* userp, const char* sql, sqlite3_uint64 ns)
+{
+    __atomic_fetch_add(static_cast<uint64_t*>(userp), (uint64_t)ns, __ATOMIC_RELAXED);
+}
+
+/** Runs \c func on the karere thread and waits for it to complete. Everything
+ * karere-related must run on that thread */
+static inline void runOnLoop(void* appCtx, std::function<void()> func)
+{
+    std::promise<void> done;
+    karere::marshallCall([&func, &done]()
+    {
+        func();
+        done.set_value();
+    }, appCtx);
+    done.get_future().wait();
+}
+
+/** Pass-through crypto, all messages are sent with the same fixed key.
+ * Received messages are not decrypted, but are treated as normal messages */
+class NullCrypto: public chatd::ICrypto
+{
+public:
+    enum { kKeyId = 1 };
+    NullCrypto(void* ctx): ICrypto(ctx) {}
+    virtual void setUsers(karere::SetOfIds* users) {}
+    virtual promise::Promise<std::pair<chatd::MsgCommand*, chatd::KeyCommand*> >
+    msgEncrypt(chatd::Message* msg, chatd::MsgCommand* cmd)
+    {
+        msg->keyid = kKeyId;
+        cmd->setKeyId(kKeyId);
+        cmd->setMsg(msg->buf(), msg->dataSize());
+        return std::make_pair(cmd, (chatd::KeyCommand*)nullptr);
+    }
+    virtual promise::Promise<chatd::Message*> msgDecrypt(chatd::Message* src)
+    {
+        src->setEncrypted(0);
+        if (src->type == chatd::Message::kMsgInvalid)
+            src->type = chatd::Message::kMsgNormal;
+        return src;
+    }
+    virtual void onKeyReceived(chatd::KeyId keyid, karere::Id sender, karere::Id receiver,
+        const char* keydata, uint16_t keylen) {}
+    virtual void onKeyConfirmed(chatd::KeyId keyxid, chatd::KeyId keyid) {}
+    virtual void onKeyRejected() {}
+    virtual chatd::KeyId currentKeyId() const { return kKeyId; }
+    virtual void resetSendKey() {}
+    virtual const chatd::KeyCommand* unconfirmedKeyCmd() const { return nullptr; }
+    virtual bool handleLegacyKeys(chatd::Message& msg) { return false; }
+    virtual void randomBytes(void* buf, size_t bufsize) const
+    {
+        for (size_t i = 0; i < bufsize; i++)
+            static_cast<uint8_t*>(buf)[i] = (uint8_t)rand();
+    }
+    virtual promise::Promise<std::shared_ptr<Buffer>>
+    encryptChatTitle(const std::string& data, uint64_t extraUser=0)
+    {
+        return std::make_shared<Buffer>(data.data(), data.size());
+    }
+    virtual promise::Promise<std::string> decryptChatTitle(const Buffer& data)
+    {
+        return std::string(data.buf(), data.dataSize());
+    }
+    virtual void onHistoryReload() {}
+};
+
+#endif
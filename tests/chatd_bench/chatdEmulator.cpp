@@ -0,0 +1,602 @@
+#include "chatdEmulator.h"
+#include <time.h>
+#include <algorithm>
+#include <base/gcmpp.h>
+#include <karereCommon.h>
+#include <chatdMsg.h>
+#include <presenced.h>
+
+#define EMU_LOG_DEBUG(fmtString,...) KR_LOG_DEBUG("emulator: " fmtString, ##__VA_ARGS__)
+#define EMU_LOG_WARNING(fmtString,...) KR_LOG_WARNING("emulator: " fmtString, ##__VA_ARGS__)
+
+using namespace karere;
+
+namespace chatdemu
+{
+EmuClient::EmuClient(::mega::Mutex* mutex, WebsocketsClient* client, EmuServer& server, void* ctx)
+: WebsocketsClientImpl(mutex, client), mServer(server), appCtx(ctx)
+{}
+
+EmuClient::~EmuClient()
+{
+    if (mConnected)
+    {
+        mConnected = false;
+        mServer.onDisconnect(*this);
+    }
+}
+
+void EmuClient::connect()
+{
+    auto wptr = getDelTracker();
+    marshallCall([this, wptr]()
+    {
+        if (wptr.deleted() || disconnecting)
+            return;
+
+        mConnected = true;
+        mServer.onConnect(*this);
+        wsConnectCb();
+    }, appCtx);
+}
+
+void EmuClient::deliver(const char* data, size_t len)
+{
+    std::string frame(data, len);
+    auto wptr = getDelTracker();
+    marshallCall([this, wptr, frame]()
+    {
+        if (wptr.deleted() || !mConnected)
+            return;
+
+        wsHandleMsgCb((char*)frame.data(), frame.size());
+    }, appCtx);
+}
+
+void EmuClient::close(const std::string& reason)
+{
+    if (!mConnected)
+        return;
+
+    mConnected = false;
+    mServer.onDisconnect(*this);
+    auto wptr = getDelTracker();
+    marshallCall([this, wptr, reason]()
+    {
+        if (wptr.deleted())
+            return;
+
+        wsCloseCb(0, 0, reason.data(), reason.size());
+    }, appCtx);
+}
+
+bool EmuClient::wsSendMessage(char* msg, size_t len)
+{
+    if (!mConnected)
+        return false;
+    if (mServer.failSends)
+    {
+        mServer.failSends--;
+        return false;
+    }
+
+    std::string frame(msg, len);
+    auto wptr = getDelTracker();
+    marshallCall([this, wptr, frame]()
+    {
+        if (wptr.deleted() || !mConnected)
+            return;
+
+        mServer.stats.framesIn++;
+        mServer.stats.bytesIn += frame.size();
+        mServer.onMessage(*this, StaticBuffer(frame.data(), frame.size()));
+    }, appCtx);
+    return true;
+}
+
+void EmuClient::wsDisconnect(bool immediate)
+{
+    disconnecting = true;
+    if (!mConnected)
+        return;
+
+    mConnected = false;
+    mServer.onDisconnect(*this);
+    if (immediate)
+        return; //the owning WebsocketsClient deletes us right away
+
+    auto wptr = getDelTracker();
+    marshallCall([this, wptr]()
+    {
+        if (wptr.deleted())
+            return;
+
+        wsCloseCb(0, 0, "", 0);
+    }, appCtx);
+}
+
+bool EmuClient::wsIsConnected()
+{
+    return mConnected;
+}
+
+void EmuServer::onConnect(EmuClient& conn)
+{
+    mConns.insert(&conn);
+}
+
+void EmuServer::onDisconnect(EmuClient& conn)
+{
+    mConns.erase(&conn);
+}
+
+void EmuServer::dropConnections()
+{
+    auto conns = mConns; //close() removes the connection from mConns
+    for (auto conn: conns)
+    {
+        conn->close("connection dropped by emulator");
+    }
+}
+
+void EmuServer::send(EmuClient& conn, const char* data, size_t len)
+{
+    stats.framesOut++;
+    stats.bytesOut += len;
+    conn.deliver(data, len);
+}
+
+EmuWebsocketsIO::EmuWebsocketsIO(::mega::Mutex* mutex, ::mega::MegaApi* api, void* ctx)
+: WebsocketsIO(mutex, api, ctx)
+{}
+
+bool EmuWebsocketsIO::wsResolveDNS(const char* hostname, std::function<void(int, std::string, std::string)> f)
+{
+    int status = mServers.count(hostname) ? 0 : -1;
+    marshallCall([f, status]()
+    {
+        f(status, "127.0.0.1", std::string());
+    }, appCtx);
+    return 0;
+}
+
+WebsocketsClientImpl* EmuWebsocketsIO::wsConnect(const char* ip, const char* host,
+    int port, const char* path, bool ssl, WebsocketsClient* client)
+{
+    auto it = mServers.find(host);
+    if (it == mServers.end())
+    {
+        EMU_LOG_WARNING("No emulated server for host %s", host);
+        return NULL;
+    }
+
+    auto conn = new EmuClient(mutex, client, *it->second, appCtx);
+    conn->connect();
+    return conn;
+}
+
+void ChatdEmulator::addChat(Id chatid, const std::vector<Id>& members)
+{
+    auto& chat = mChats[chatid];
+    chat.chatid = chatid;
+    for (auto userid: members)
+    {
+        chat.members[userid] = chatd::PRIV_OPER;
+    }
+}
+
+const ChatdEmulator::Chat* ChatdEmulator::chat(Id chatid) const
+{
+    auto it = mChats.find(chatid);
+    return (it == mChats.end()) ? nullptr : &it->second;
+}
+
+ChatdEmulator::Chat* ChatdEmulator::findChat(Id chatid)
+{
+    auto it = mChats.find(chatid);
+    return (it == mChats.end()) ? nullptr : &it->second;
+}
+
+ChatdEmulator::Chat* ChatdEmulator::joinedChat(EmuClient& conn, Id chatid)
+{
+    auto chat = findChat(chatid);
+    return (chat && chat->joined.count(&conn)) ? chat : nullptr;
+}
+
+Id ChatdEmulator::postMessage(Id chatid, Id userid, const std::string& data, uint32_t keyid)
+{
+    auto chat = findChat(chatid);
+    if (!chat)
+        throw std::runtime_error("postMessage: Unknown chatid "+chatid.toString());
+
+    Msg msg = { newMsgid(), userid, (uint32_t)time(NULL), 0, keyid, data };
+    chat->msgIndex[msg.msgid] = chat->history.size();
+    chat->history.push_back(msg);
+
+    Buffer out;
+    appendMsg(out, chatd::OP_NEWMSG, *chat, msg);
+    broadcast(*chat, out);
+    return msg.msgid;
+}
+
+bool ChatdEmulator::editMessage(Id chatid, Id msgid, const std::string& data)
+{
+    auto chat = findChat(chatid);
+    if (!chat)
+        return false;
+    auto it = chat->msgIndex.find(msgid);
+    if (it == chat->msgIndex.end())
+        return false;
+
+    auto& msg = chat->history[it->second];
+    msg.data = data;
+    msg.updated = (uint16_t)(time(NULL) - msg.ts + 1);
+    Buffer out;
+    appendMsg(out, chatd::OP_MSGUPD, *chat, msg);
+    broadcast(*chat, out);
+    return true;
+}
+
+void ChatdEmulator::onDisconnect(EmuClient& conn)
+{
+    for (auto& item: mChats)
+    {
+        item.second.joined.erase(&conn);
+    }
+    EmuServer::onDisconnect(conn);
+}
+
+void ChatdEmulator::appendMsg(Buffer& out, uint8_t opcode, const Chat& chat, const Msg& msg)
+{
+    chatd::MsgCommand cmd(opcode, chat.chatid, msg.userid, msg.msgid, msg.ts, msg.updated, msg.keyid);
+    cmd.setMsg(msg.data.data(), msg.data.size());
+    out.append(cmd);
+}
+
+void ChatdEmulator::broadcast(Chat& chat, const Buffer& buf, EmuClient* except)
+{
+    for (auto& item: chat.joined)
+    {
+        if (item.first != except)
+            send(*item.first, buf);
+    }
+}
+
+void ChatdEmulator::appendMembers(Buffer& out, const Chat& chat)
+{
+    for (auto& member: chat.members)
+    {
+        out.append(chatd::Command(chatd::OP_JOIN) + chat.chatid + member.first + member.second);
+    }
+}
+
+void ChatdEmulator::sendReject(EmuClient& conn, Id chatid, Id id, uint8_t op, uint8_t reason)
+{
+    EMU_LOG_DEBUG("REJECT %s for chat %s", chatd::Command::opcodeToStr(op), chatid.toString().c_str());
+    send(conn, chatd::Command(chatd::OP_REJECT) + chatid + id + op + reason);
+}
+
+void ChatdEmulator::appendHistory(Buffer& out, EmuClient& conn, Chat& chat, int32_t count)
+{
+    // chatd sends old history from the newest to the oldest message
+    if (count < 0)
+    {
+        auto& oldest = chat.joined[&conn].oldestSent;
+        size_t end = oldest - std::min((size_t)-(int64_t)count, oldest);
+        while (oldest > end)
+        {
+            appendMsg(out, chatd::OP_OLDMSG, chat, chat.history[--oldest]);
+        }
+    }
+    out.append(chatd::Command(chatd::OP_HISTDONE) + chat.chatid);
+}
+
+size_t ChatdEmulator::handleJoin(EmuClient& conn, const StaticBuffer& buf, size_t pos)
+{
+    Id chatid = buf.read<uint64_t>(pos+1);
+    Id userid = buf.read<uint64_t>(pos+9);
+    auto chat = findChat(chatid);
+    if (!chat || !chat->members.count(userid))
+    {
+        sendReject(conn, chatid, userid, chatd::OP_JOIN, 0);
+        return 18;
+    }
+    opStats.join++;
+    chat->joined[&conn] = { userid, chat->history.size() };
+    Buffer out;
+    appendMembers(out, *chat);
+    send(conn, out);
+    return 18;
+}
+
+size_t ChatdEmulator::handleJoinRangeHist(EmuClient& conn, const StaticBuffer& buf, size_t pos)
+{
+    Id chatid = buf.read<uint64_t>(pos+1);
+    Id oldest = buf.read<uint64_t>(pos+9);
+    Id newest = buf.read<uint64_t>(pos+17);
+    auto chat = findChat(chatid);
+    if (!chat)
+    {
+        sendReject(conn, chatid, Id::null(), chatd::OP_JOINRANGEHIST, 0);
+        return 25;
+    }
+    opStats.join++;
+    // send everything after the newest message that the client has
+    auto newestIt = chat->msgIndex.find(newest);
+    size_t start = (newestIt == chat->msgIndex.end()) ? 0 : newestIt->second+1;
+    auto oldestIt = chat->msgIndex.find(oldest);
+    auto& joined = chat->joined[&conn];
+    joined.oldestSent = (oldestIt == chat->msgIndex.end()) ? start : oldestIt->second;
+
+    Buffer out;
+    appendMembers(out, *chat);
+    for (size_t i = start; i < chat->history.size(); i++)
+    {
+        appendMsg(out, chatd::OP_NEWMSG, *chat, chat->history[i]);
+    }
+    out.append(chatd::Command(chatd::OP_HISTDONE) + chat->chatid);
+    send(conn, out);
+    return 25;
+}
+
+size_t ChatdEmulator::handleHist(EmuClient& conn, const StaticBuffer& buf, size_t pos)
+{
+    Id chatid = buf.read<uint64_t>(pos+1);
+    int32_t count = buf.read<int32_t>(pos+9);
+    auto chat = joinedChat(conn, chatid);
+    if (!chat)
+    {
+        sendReject(conn, chatid, Id::null(), chatd::OP_HIST, 0);
+        return 13;
+    }
+    opStats.hist++;
+    Buffer out;
+    appendHistory(out, conn, *chat, count);
+    send(conn, out);
+    return 13;
+}
+
+size_t ChatdEmulator::handleMsg(EmuClient& conn, const StaticBuffer& buf, size_t pos)
+{
+    // same layout as chatd::MsgCommand
+    uint8_t opcode = buf.read<uint8_t>(pos);
+    Id chatid = buf.read<uint64_t>(pos+1);
+    Id userid = buf.read<uint64_t>(pos+9);
+    Id msgid = buf.read<uint64_t>(pos+17);
+    uint16_t updated = buf.read<uint16_t>(pos+29);
+    uint32_t keyid = buf.read<uint32_t>(pos+31);
+    uint32_t msglen = buf.read<uint32_t>(pos+35);
+    const char* data = buf.readPtr(pos+39, msglen);
+    size_t len = 39 + msglen;
+
+    auto chat = joinedChat(conn, chatid);
+    if (!chat)
+    {
+        sendReject(conn, chatid, msgid, opcode, 0);
+        return len;
+    }
+    if (keyid == CHATD_KEYID_UNCONFIRMED)
+    {
+        keyid = chat->lastKeyid;
+    }
+
+    if (opcode == chatd::OP_NEWMSG)
+    {
+        opStats.newmsg++;
+        Msg msg = { newMsgid(), userid, (uint32_t)time(NULL), 0, keyid, std::string(data, msglen) };
+        chat->msgxidToMsgid[msgid] = msg.msgid;
+        chat->msgIndex[msg.msgid] = chat->history.size();
+        chat->history.push_back(msg);
+        send(conn, chatd::Command(chatd::OP_NEWMSGID) + msgid + msg.msgid);
+
+        Buffer out;
+        appendMsg(out, chatd::OP_NEWMSG, *chat, msg);
+        broadcast(*chat, out, &conn);
+        return len;
+    }
+
+    // MSGUPD or MSGUPDX
+    opStats.msgupd++;
+    if (opcode == chatd::OP_MSGUPDX)
+    {
+        auto it = chat->msgxidToMsgid.find(msgid);
+        if (it == chat->msgxidToMsgid.end())
+        {
+            sendReject(conn, chatid, msgid, opcode, 0);
+            return len;
+        }
+        msgid = it->second;
+    }
+    auto it = chat->msgIndex.find(msgid);
+    if (it == chat->msgIndex.end())
+    {
+        sendReject(conn, chatid, msgid, opcode, 0);
+        return len;
+    }
+    auto& msg = chat->history[it->second];
+    msg.data.assign(data, msglen);
+    msg.updated = updated;
+    msg.keyid = keyid;
+    // the author also receives the MSGUPD, as a confirmation
+    Buffer out;
+    appendMsg(out, chatd::OP_MSGUPD, *chat, msg);
+    broadcast(*chat, out);
+    return len;
+}
+
+size_t ChatdEmulator::handleNewKey(EmuClient& conn, const StaticBuffer& buf, size_t pos)
+{
+    Id chatid = buf.read<uint64_t>(pos+1);
+    uint32_t keyxid = buf.read<uint32_t>(pos+9);
+    uint32_t totalLen = buf.read<uint32_t>(pos+13);
+    const char* keys = buf.readPtr(pos+17, totalLen);
+    size_t len = 17 + totalLen;
+
+    auto chat = joinedChat(conn, chatid);
+    if (!chat)
+    {
+        sendReject(conn, chatid, Id::null(), chatd::OP_NEWKEY, 0);
+        return len;
+    }
+    uint32_t keyid = chat->lastKeyid = mNextKeyid++;
+    send(conn, chatd::Command(chatd::OP_NEWKEYID) + chatid + keyxid + keyid);
+
+    chatd::Command cmd(chatd::OP_NEWKEY, (size_t)(17 + totalLen));
+    cmd.append(chatid.val);
+    cmd.append(keyid);
+    cmd.append(totalLen);
+    cmd.append(keys, totalLen);
+    broadcast(*chat, cmd, &conn);
+    return len;
+}
+
+void ChatdEmulator::onMessage(EmuClient& conn, const StaticBuffer& buf)
+{
+    size_t pos = 0;
+    while (pos < buf.dataSize())
+    {
+        uint8_t opcode = buf.read<uint8_t>(pos);
+        size_t len = 0;
+        try
+        {
+            switch (opcode)
+            {
+                case chatd::OP_KEEPALIVE:
+                case chatd::OP_KEEPALIVEAWAY:
+                    len = 1;
+                    break;
+                case chatd::OP_ECHO:
+                    send(conn, chatd::Command(chatd::OP_ECHO));
+                    len = 1;
+                    break;
+                case chatd::OP_CLIENTID:
+                    buf.checkDataSize(pos+9);
+                    send(conn, chatd::Command(chatd::OP_CLIENTID) + mNextClientid++);
+                    len = 9;
+                    break;
+                case chatd::OP_JOIN:
+                    len = handleJoin(conn, buf, pos);
+                    break;
+                case chatd::OP_JOINRANGEHIST:
+                    len = handleJoinRangeHist(conn, buf, pos);
+                    break;
+                case chatd::OP_HIST:
+                    len = handleHist(conn, buf, pos);
+                    break;
+                case chatd::OP_NEWMSG:
+                case chatd::OP_MSGUPD:
+                case chatd::OP_MSGUPDX:
+                    len = handleMsg(conn, buf, pos);
+                    break;
+                case chatd::OP_NEWKEY:
+                    len = handleNewKey(conn, buf, pos);
+                    break;
+                case chatd::OP_SEEN:
+                    buf.checkDataSize(pos+17);
+                    opStats.seen++;
+                    len = 17;
+                    break;
+                case chatd::OP_RECEIVED:
+                    buf.checkDataSize(pos+17);
+                    opStats.received++;
+                    len = 17;
+                    break;
+                case chatd::OP_BROADCAST:
+                {
+                    Id chatid = buf.read<uint64_t>(pos+1);
+                    uint8_t type = buf.read<uint8_t>(pos+17);
+                    auto chat = joinedChat(conn, chatid);
+                    if (chat)
+                    {
+                        auto userid = chat->joined[&conn].userid;
+                        broadcast(*chat, chatd::Command(chatd::OP_BROADCAST) + chatid + userid + type, &conn);
+                    }
+                    len = 18;
+                    break;
+                }
+                default:
+                    EMU_LOG_WARNING("Unhandled chatd opcode %s, ignoring the rest of the frame",
+                        chatd::Command::opcodeToStr(opcode));
+                    return;
+            }
+        }
+        catch (BufferRangeError& e)
+        {
+            EMU_LOG_WARNING("Truncated chatd %s command: %s", chatd::Command::opcodeToStr(opcode), e.what());
+            return;
+        }
+        if (!len)
+            return;
+        pos += len;
+    }
+}
+
+PresencedEmulator::PresencedEmulator()
+: prefs(presenced::Config(Presence::kOnline).toCode())
+{}
+
+void PresencedEmulator::onMessage(EmuClient& conn, const StaticBuffer& buf)
+{
+    size_t pos = 0;
+    while (pos < buf.dataSize())
+    {
+        uint8_t opcode = buf.read<uint8_t>(pos);
+        try
+        {
+            switch (opcode)
+            {
+                case presenced::OP_KEEPALIVE:
+                    send(conn, presenced::Command(presenced::OP_KEEPALIVE));
+                    pos += 1;
+                    break;
+                case presenced::OP_HELLO:
+                    // the login completes when the client receives the prefs
+                    buf.checkDataSize(pos+3);
+                    send(conn, presenced::Command(presenced::OP_PREFS) + prefs);
+                    pos += 3;
+                    break;
+                case presenced::OP_USERACTIVE:
+                    buf.checkDataSize(pos+2);
+                    pos += 2;
+                    break;
+                case presenced::OP_PREFS:
+                    prefs = buf.read<uint16_t>(pos+1);
+                    send(conn, presenced::Command(presenced::OP_PREFS) + prefs);
+                    pos += 3;
+                    break;
+                case presenced::OP_ADDPEERS:
+                case presenced::OP_DELPEERS:
+                {
+                    uint32_t count = buf.read<uint32_t>(pos+1);
+                    buf.checkDataSize(pos+5+(size_t)count*8);
+                    if (opcode == presenced::OP_ADDPEERS)
+                    {
+                        Buffer out;
+                        for (uint32_t i = 0; i < count; i++)
+                        {
+                            Id peer = buf.read<uint64_t>(pos+5+i*8);
+                            out.append(presenced::Command(presenced::OP_PEERSTATUS) + (uint8_t)Presence::kOnline + peer);
+                        }
+                        peerCount += count;
+                        send(conn, out);
+                    }
+                    else
+                    {
+                        peerCount -= std::min((uint64_t)count, peerCount);
+                    }
+                    pos += 5+(size_t)count*8;
+                    break;
+                }
+                default:
+                    EMU_LOG_WARNING("Unhandled presenced opcode %d, ignoring the rest of the frame", opcode);
+                    return;
+            }
+        }
+        catch (BufferRangeError& e)
+        {
+            EMU_LOG_WARNING("Truncated presenced command %d: %s", opcode, e.what());
+            return;
+        }
+    }
+}
+}
@@ -0,0 +1,179 @@
+#ifndef CHATD_EMULATOR_H
+#define CHATD_EMULATOR_H
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <buffer.h>
+#include <karereId.h>
+#include <base/trackDelete.h>
+#include "net/websocketsIO.h"
+
+/** @brief In-process stand-ins for the chatd and presenced servers, that
+ * speak the real wire formats over the WebsocketsIO interface. Frames are
+ * passed between the client and the server by marshalling them to the app's
+ * event loop, so the client code sees the same asynchronous behaviour as with
+ * a real socket, but without any network, TLS or API dependency.
+ * Everything must be called from the app's (karere) thread.
+ */
+namespace chatdemu
+{
+class EmuServer;
+
+/** @brief The client side endpoint of an emulated websocket connection */
+class EmuClient: public WebsocketsClientImpl, public karere::DeleteTrackable
+{
+protected:
+    EmuServer& mServer;
+    void* appCtx;
+    bool mConnected = false;
+public:
+    EmuClient(::mega::Mutex* mutex, WebsocketsClient* client, EmuServer& server, void* ctx);
+    virtual ~EmuClient();
+    /** @brief Called after construction, establishes the connection asynchronously */
+    void connect();
+    /** @brief Called by the server to send a frame to the client */
+    void deliver(const char* data, size_t len);
+    /** @brief Called by the server to close the connection from its side */
+    void close(const std::string& reason);
+
+    virtual bool wsSendMessage(char* msg, size_t len);
+    virtual void wsDisconnect(bool immediate);
+    virtual bool wsIsConnected();
+};
+
+class EmuServer
+{
+public:
+    struct Stats
+    {
+        uint64_t framesIn = 0;
+        uint64_t bytesIn = 0;
+        uint64_t framesOut = 0;
+        uint64_t bytesOut = 0;
+    };
+    Stats stats;
+    /** The next \c failSends frames sent by the clients fail, as if the
+     * socket write failed. The connections are not closed */
+    unsigned failSends = 0;
+    virtual ~EmuServer() {}
+    virtual void onConnect(EmuClient& conn);
+    /** @brief Called when the connection is destroyed, after that the server
+     * must not reference \c conn anymore */
+    virtual void onDisconnect(EmuClient& conn);
+    virtual void onMessage(EmuClient& conn, const StaticBuffer& frame) = 0;
+    /** @brief Closes all client connections from the server side, so that
+     * the clients go through their reconnect logic */
+    void dropConnections();
+protected:
+    std::set<EmuClient*> mConns;
+    void send(EmuClient& conn, const char* data, size_t len);
+    void send(EmuClient& conn, const Buffer& buf) { send(conn, buf.buf(), buf.dataSize()); }
+};
+
+/** @brief A websockets layer that, instead of connecting to the network,
+ * connects to the emulated server registered for the host of the URL */
+class EmuWebsocketsIO: public WebsocketsIO
+{
+protected:
+    std::map<std::string, EmuServer*> mServers;
+    virtual bool wsResolveDNS(const char* hostname, std::function<void(int, std::string, std::string)> f);
+    virtual WebsocketsClientImpl* wsConnect(const char* ip, const char* host,
+                                           int port, const char* path, bool ssl,
+                                           WebsocketsClient* client);
+public:
+    EmuWebsocketsIO(::mega::Mutex* mutex, ::mega::MegaApi* api, void* ctx);
+    void addServer(const std::string& host, EmuServer* server) { mServers[host] = server; }
+    virtual void addevents(::mega::Waiter*, int) {}
+};
+
+/** @brief Minimal chatd server: keeps the history of each chat in memory,
+ * assigns message ids and keyids, and fans out messages to the joined
+ * clients. Crypto payloads are opaque to it, as to the real chatd */
+class ChatdEmulator: public EmuServer
+{
+public:
+    struct Msg
+    {
+        karere::Id msgid;
+        karere::Id userid;
+        uint32_t ts;
+        uint16_t updated;
+        uint32_t keyid;
+        std::string data;
+    };
+    struct Chat
+    {
+        karere::Id chatid;
+        std::map<karere::Id, int8_t> members;
+        std::vector<Msg> history; //oldest first
+        std::map<karere::Id, size_t> msgIndex;
+        std::map<karere::Id, karere::Id> msgxidToMsgid;
+        uint32_t lastKeyid = 0;
+        struct Joined
+        {
+            karere::Id userid;
+            /// index of the oldest message sent to that connection, where
+            /// its next HIST starts
+            size_t oldestSent;
+        };
+        std::map<EmuClient*, Joined> joined;
+    };
+    struct OpStats
+    {
+        uint64_t newmsg = 0;
+        uint64_t msgupd = 0;
+        uint64_t seen = 0;
+        uint64_t received = 0;
+        uint64_t hist = 0;
+        uint64_t join = 0;
+    };
+    OpStats opStats;
+    /** @brief Creates a chat with the specified members, all of them with
+     * moderator privilege */
+    void addChat(karere::Id chatid, const std::vector<karere::Id>& members);
+    /** @brief Posts a message as if it was sent by \c userid from another
+     * client, and broadcasts it to all joined connections. Returns the msgid */
+    karere::Id postMessage(karere::Id chatid, karere::Id userid, const std::string& data, uint32_t keyid);
+    /** @brief Edits a message as if it was done by its author from another client */
+    bool editMessage(karere::Id chatid, karere::Id msgid, const std::string& data);
+    const Chat* chat(karere::Id chatid) const;
+    virtual void onDisconnect(EmuClient& conn);
+    virtual void onMessage(EmuClient& conn, const StaticBuffer& frame);
+protected:
+    std::map<karere::Id, Chat> mChats;
+    uint64_t mNextMsgid = 0x1000;
+    uint32_t mNextKeyid = 1;
+    uint32_t mNextClientid = 1;
+    Chat* findChat(karere::Id chatid);
+    Chat* joinedChat(EmuClient& conn, karere::Id chatid);
+    karere::Id newMsgid() { return karere::Id(mNextMsgid++); }
+    void appendMsg(Buffer& out, uint8_t opcode, const Chat& chat, const Msg& msg);
+    void broadcast(Chat& chat, const Buffer& buf, EmuClient* except=nullptr);
+    void appendMembers(Buffer& out, const Chat& chat);
+    void sendReject(EmuClient& conn, karere::Id chatid, karere::Id id, uint8_t op, uint8_t reason);
+    void appendHistory(Buffer& out, EmuClient& conn, Chat& chat, int32_t count);
+    // the command handlers return the size of the command, or 0 if the rest
+    // of the frame can't be parsed
+    size_t handleJoin(EmuClient& conn, const StaticBuffer& buf, size_t pos);
+    size_t handleJoinRangeHist(EmuClient& conn, const StaticBuffer& buf, size_t pos);
+    size_t handleHist(EmuClient& conn, const StaticBuffer& buf, size_t pos);
+    size_t handleMsg(EmuClient& conn, const StaticBuffer& buf, size_t pos);
+    size_t handleNewKey(EmuClient& conn, const StaticBuffer& buf, size_t pos);
+};
+
+/** @brief Minimal presenced server: acknowledges the login and the prefs,
+ * and reports every added peer as online */
+class PresencedEmulator: public EmuServer
+{
+public:
+    uint16_t prefs;
+    uint64_t peerCount = 0;
+    PresencedEmulator();
+    virtual void onMessage(EmuClient& conn, const StaticBuffer& frame);
+};
+}
+
+#endif
@@ -0,0 +1,146 @@
+/**
+ * @file tests/chatd_bench/chatd_aesbench.cpp
+ * @brief Measures the per-message cost of the AES-CTR payload encryption.
+ *
+ * For message sizes from 32 bytes up to kMaxMsgSize, encrypts buffers with:
+ *  - the former Crypto++ StringSource/StreamTransformationFilter pipeline,
+ *    including the std::string copies of the payload in and out of it
+ *  - AesCtrKey in place, expanding the key for each message
+ *  - AesCtrKey in place, with the key expanded once, as ProtocolHandler does
+ * and reports the time per message and the throughput of each. Each variant
+ * is checked to produce the same ciphertext.
+ *
+ * Usage: chatd_aesbench [--mb N]
+ *  --mb  Megabytes to encrypt per size and variant, default 64
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <sodium.h>
+#include <strongvelope/strongvelope.h>
+#include <strongvelope/cryptofunctions.h>
+#include <cryptopp/filters.h>
+#include <chatd.h>
+#include "benchCommon.h"
+
+using namespace strongvelope;
+
+/** The payload encryption as it was done before AesCtrKey */
+static std::string legacyEncrypt(const StaticBuffer& data, const StaticBuffer& key, const StaticBuffer& iv)
+{
+    std::string text(data.buf(), data.dataSize());
+    CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption encryptor;
+    std::string cipher;
+    encryptor.SetKeyWithIV(key.ubuf(), key.dataSize(), iv.ubuf());
+    CryptoPP::StringSource s(text, true,
+        new CryptoPP::StreamTransformationFilter(encryptor,
+            new CryptoPP::StringSink(cipher)));
+    return cipher;
+}
+
+enum { kLegacy = 0, kExpandEach = 1, kReuseKey = 2, kVariantCount = 3 };
+static const char* kVariantNames[kVariantCount] = { "pipeline", "expand/msg", "reused key" };
+
+/** Encrypts \c data \c count times with the variant, returns the time per message in ns */
+static double runVariant(int variant, Buffer& data, const SendKey& key, const Key<16>& iv,
+    size_t count, std::string& firstCipher)
+{
+    AesCtrKey reusedKey(key);
+    uint64_t start = nowNs();
+    for (size_t i = 0; i < count; i++)
+    {
+        switch (variant)
+        {
+            case kLegacy:
+            {
+                std::string cipher = legacyEncrypt(data, key, iv);
+                // the caller copied the result into the message
+                Buffer out(cipher.data(), cipher.size());
+                if (!i)
+                    firstCipher.assign(out.buf(), out.dataSize());
+                break;
+            }
+            case kExpandEach:
+            {
+                AesCtrKey ctrKey(key);
+                ctrKey.processInPlace(iv, data);
+                if (!i)
+                    firstCipher.assign(data.buf(), data.dataSize());
+                ctrKey.processInPlace(iv, data); //restore the plaintext
+                i++;
+                break;
+            }
+            case kReuseKey:
+            {
+                reusedKey.processInPlace(iv, data);
+                if (!i)
+                    firstCipher.assign(data.buf(), data.dataSize());
+                reusedKey.processInPlace(iv, data);
+                i++;
+                break;
+            }
+        }
+    }
+    return (double)(nowNs() - start) / count;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [--mb N]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    size_t mb = 64;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--mb") && (i+1 < argc))
+            mb = atoi(argv[++i]);
+        else
+            usage(argv[0]);
+    }
+    if (!mb || sodium_init() == -1)
+        usage(argv[0]);
+
+    SendKey key;
+    key.setDataSize(CryptoPP::AES::BLOCKSIZE);
+    randombytes_buf(key.ubuf(), key.dataSize());
+    Key<16> iv;
+    iv.setDataSize(CryptoPP::AES::BLOCKSIZE);
+    randombytes_buf(iv.ubuf(), iv.dataSize());
+
+    printf("AES implementation: %s\n", AesCtrKey::implementation());
+    printf("%8s %14s %14s %14s %12s\n", "size", kVariantNames[0], kVariantNames[1],
+        kVariantNames[2], "MB/s reused");
+    std::vector<size_t> sizes;
+    for (size_t size = 32; size < chatd::kMaxMsgSize; size *= 4)
+        sizes.push_back(size);
+    sizes.push_back(chatd::kMaxMsgSize);
+
+    for (size_t size: sizes)
+    {
+        Buffer data(size);
+        randombytes_buf(data.appendPtr(size), size);
+        // an even count, as the in-place variants encrypt and decrypt in one iteration
+        size_t count = std::max<size_t>((mb << 20) / size, 16) & ~(size_t)1;
+        double ns[kVariantCount];
+        std::string ciphers[kVariantCount];
+        for (int variant = 0; variant < kVariantCount; variant++)
+        {
+            runVariant(variant, data, key, iv, 16, ciphers[variant]); //warm up
+            ns[variant] = runVariant(variant, data, key, iv, count, ciphers[variant]);
+        }
+        if (ciphers[kExpandEach] != ciphers[kLegacy] || ciphers[kReuseKey] != ciphers[kLegacy])
+        {
+            fprintf(stderr, "Error: ciphertext mismatch for size %zu\n", size);
+            return 1;
+        }
+        printf("%8zu %11.0f ns %11.0f ns %11.0f ns %12.1f\n", size,
+            ns[kLegacy], ns[kExpandEach], ns[kReuseKey], size * 1e3 / ns[kReuseKey]);
+    }
+    return 0;
+}
@@ -0,0 +1,434 @@
+/**
+ * @file tests/chatd_bench/chatd_bench.cpp
+ * @brief Offline load benchmark of the chatd client stack.
+ *
+ * Runs the chatd and presenced clients of karere against the in-process
+ * emulators in chatdEmulator.h, so the message path (websocket frame parsing,
+ * message buffers, SQLite history and listener callbacks) can be profiled
+ * without a MEGA account or network. The load is generated by the chatd
+ * emulator, that posts peer messages to N chats at M messages/sec each,
+ * while the client sends its own messages, edits them, fetches history and
+ * marks everything as seen.
+ * The crypto layer is replaced by a pass-through, as its cost is benchmarked
+ * separately, and the chat URLs come from chatd::Client::urlProvider instead
+ * of the API, as the chatd layer is driven directly without a logged in
+ * karere::Client.
+ * The event loop stall is measured by a probe that posts a call to the loop
+ * every 5 ms, and records how late it runs. With --async-db 1, the db is in
+ * write-behind mode (see SqliteDb::setAsyncWrites()), as in the app.
+ *
+ * Usage: chatd_bench [--chats N] [--rate M] [--duration SECS] [--dir PATH] [--async-db 0|1]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <thread>
+#include <string>
+#include <vector>
+#include <megaapi.h>
+#include <megachatapi_impl.h>
+#include <chatClient.h>
+#include <chatd.h>
+#include <chatdDb.h>
+#include <presenced.h>
+#include "chatdEmulator.h"
+#include "benchCommon.h"
+
+using namespace karere;
+
+static const char* kChatdUrl = "wss://chatd.emu/chatd";
+static const char* kPresencedUrl = "wss://presenced.emu/presenced";
+static const Id kMyHandle(0xA0A0A0A0A0A0A0A0ull);
+// message payloads start with the steady clock time at which they were
+// generated, in nanoseconds
+static const size_t kPayloadSize = 64;
+
+static std::string makePayload()
+{
+    std::string data(kPayloadSize, 'x');
+    uint64_t ts = nowNs();
+    memcpy(&data[0], &ts, sizeof(ts));
+    return data;
+}
+
+struct BenchStats
+{
+    std::vector<uint64_t> recvLatency; // peer message, from post to onRecvNewMessage
+    std::vector<uint64_t> sendLatency; // own message, from submit to confirmation
+    std::vector<uint64_t> loopLag; // delay of the event loop stall probe
+    uint64_t received = 0;
+    uint64_t sent = 0;
+    uint64_t confirmed = 0;
+    uint64_t edits = 0;
+    uint64_t editsConfirmed = 0;
+    uint64_t histFetches = 0;
+    uint64_t histDone = 0;
+    uint64_t seen = 0;
+};
+
+class Bench;
+
+class BenchListener: public chatd::Listener
+{
+protected:
+    Bench& mBench;
+public:
+    chatd::Chat* chat = nullptr;
+    chatd::Idx lastOwnIdx = CHATD_IDX_INVALID;
+    BenchListener(Bench& bench): mBench(bench) {}
+    virtual void init(chatd::Chat& aChat, chatd::DbInterface*& dbIntf);
+    virtual void onRecvNewMessage(chatd::Idx idx, chatd::Message& msg, chatd::Message::Status status);
+    virtual void onMessageConfirmed(karere::Id msgxid, const chatd::Message& msg, chatd::Idx idx);
+    virtual void onMessageEdited(const chatd::Message& msg, chatd::Idx idx);
+    virtual void onHistoryDone(chatd::HistSource source);
+    virtual void onOnlineStateChange(chatd::ChatState state);
+};
+
+class Bench
+{
+public:
+    struct Options
+    {
+        unsigned chats = 20;
+        unsigned rate = 5; //peer messages per second, per chat
+        unsigned duration = 10;
+        std::string dir = "/tmp";
+        bool asyncDb = false;
+    };
+    Options opts;
+    megachat::MegaChatApiImpl& loop;
+    chatdemu::EmuWebsocketsIO* websocketsIO = nullptr;
+    chatdemu::ChatdEmulator chatdServer;
+    chatdemu::PresencedEmulator presencedServer;
+    karere::Client* client = nullptr;
+    std::vector<std::unique_ptr<BenchListener>> listeners;
+    BenchStats stats;
+    std::promise<void> onlinePromise;
+    unsigned onlineCount = 0;
+    uint64_t dbTimeNs = 0;
+    std::vector<megaHandle> timers;
+
+    Bench(megachat::MegaChatApiImpl& aLoop, const Options& aOpts): opts(aOpts), loop(aLoop) {}
+    void setup(::mega::MegaApi& megaApi);
+    void start();
+    void stop();
+    void teardown();
+    void onChatOnline()
+    {
+        if (++onlineCount == opts.chats)
+            onlinePromise.set_value();
+    }
+    Id chatId(unsigned i) const { return Id(0xC000 + i); }
+    Id peerId(unsigned i) const { return Id(0x1000 + i); }
+protected:
+    double mPostCredit = 0;
+    unsigned mNextChat = 0;
+    void postPeerMessages(double count);
+    void sendOwnMessage(BenchListener& listener);
+    void editLastOwnMessage(BenchListener& listener);
+};
+
+void BenchListener::init(chatd::Chat& aChat, chatd::DbInterface*& dbIntf)
+{
+    chat = &aChat;
+    dbIntf = new ChatdSqliteDb(aChat, mBench.client->db);
+}
+
+void BenchListener::onRecvNewMessage(chatd::Idx idx, chatd::Message& msg, chatd::Message::Status status)
+{
+    mBench.stats.received++;
+    if (msg.dataSize() >= sizeof(uint64_t))
+        mBench.stats.recvLatency.push_back(nowNs() - msg.read<uint64_t>(0));
+}
+
+void BenchListener::onMessageConfirmed(karere::Id msgxid, const chatd::Message& msg, chatd::Idx idx)
+{
+    mBench.stats.confirmed++;
+    lastOwnIdx = idx;
+    if (msg.dataSize() >= sizeof(uint64_t))
+        mBench.stats.sendLatency.push_back(nowNs() - msg.read<uint64_t>(0));
+}
+
+void BenchListener::onMessageEdited(const chatd::Message& msg, chatd::Idx idx)
+{
+    if (msg.userid == kMyHandle)
+        mBench.stats.editsConfirmed++;
+}
+
+void BenchListener::onHistoryDone(chatd::HistSource source)
+{
+    mBench.stats.histDone++;
+}
+
+void BenchListener::onOnlineStateChange(chatd::ChatState state)
+{
+    if (state == chatd::kChatStateOnline)
+        mBench.onChatOnline();
+}
+
+void Bench::setup(::mega::MegaApi& megaApi)
+{
+    websocketsIO = new chatdemu::EmuWebsocketsIO(&loop.sdkMutex, &megaApi, &loop);
+    websocketsIO->addServer("chatd.emu", &chatdServer);
+    websocketsIO->addServer("presenced.emu", &presencedServer);
+    client = new karere::Client(megaApi, websocketsIO, loop, opts.dir, 0, &loop);
+
+    std::string dbPath = opts.dir + "/chatd_bench.db";
+    unlink(dbPath.c_str());
+    if (!client->db.open(dbPath.c_str(), true))
+        throw std::runtime_error("Can't open db "+dbPath);
+    client->db.simpleQuery(gDbSchema);
+    sqlite3_profile(client->db, sqliteProfileCb, &dbTimeNs);
+    client->db.setAsyncWrites(opts.asyncDb);
+
+    client->chatd.reset(new chatd::Client(client, kMyHandle));
+    client->chatd->urlProvider = [](Id chatid, int shardNo)
+    {
+        return std::string(kChatdUrl);
+    };
+
+    presenced::IdRefMap peers;
+    for (unsigned i = 0; i < opts.chats; i++)
+    {
+        Id chatid = chatId(i);
+        Id peer1 = peerId(2*i);
+        Id peer2 = peerId(2*i+1);
+        chatdServer.addChat(chatid, { kMyHandle, peer1, peer2 });
+        peers.insert(peer1);
+        peers.insert(peer2);
+
+        listeners.emplace_back(new BenchListener(*this));
+        karere::SetOfIds users;
+        users.insert(kMyHandle);
+        users.insert(peer1);
+        users.insert(peer2);
+        auto& chat = client->chatd->createChat(chatid, 0, std::string(), listeners.back().get(),
+            users, new NullCrypto(&loop), (uint32_t)time(NULL), true);
+        chat.connect();
+    }
+    client->presenced().connect(kPresencedUrl, kMyHandle, std::move(peers),
+        presenced::Config(Presence::kOnline));
+}
+
+void Bench::postPeerMessages(double count)
+{
+    mPostCredit += count;
+    while (mPostCredit >= 1)
+    {
+        mPostCredit -= 1;
+        unsigned i = mNextChat++ % opts.chats;
+        chatdServer.postMessage(chatId(i), peerId(2*i + (mNextChat & 1)), makePayload(), NullCrypto::kKeyId);
+    }
+}
+
+void Bench::sendOwnMessage(BenchListener& listener)
+{
+    auto data = makePayload();
+    listener.chat->msgSubmit(data.data(), data.size(), chatd::Message::kMsgNormal, nullptr);
+    stats.sent++;
+}
+
+void Bench::editLastOwnMessage(BenchListener& listener)
+{
+    auto& chat = *listener.chat;
+    if (listener.lastOwnIdx == CHATD_IDX_INVALID || !chat.findOrNull(listener.lastOwnIdx))
+        return;
+
+    auto data = makePayload();
+    if (chat.msgModify(chat.at(listener.lastOwnIdx), data.data(), data.size(), nullptr))
+        stats.edits++;
+}
+
+void Bench::start()
+{
+    // peer messages
+    const unsigned kTickMs = 10;
+    double perTick = (double)opts.rate * opts.chats * kTickMs / 1000;
+    timers.push_back(setInterval([this, perTick]()
+    {
+        postPeerMessages(perTick);
+    }, kTickMs, &loop));
+
+    // own messages and edits, one of each per chat every second
+    timers.push_back(setInterval([this]()
+    {
+        for (auto& listener: listeners)
+        {
+            editLastOwnMessage(*listener);
+            sendOwnMessage(*listener);
+        }
+    }, 1000, &loop));
+
+    // SEEN storm - mark the newest message of every chat as seen
+    timers.push_back(setInterval([this]()
+    {
+        for (auto& listener: listeners)
+        {
+            auto& chat = *listener->chat;
+            if (!chat.size())
+                continue;
+            if (chat.setMessageSeen(chat.highnum()))
+                stats.seen++;
+        }
+    }, 100, &loop));
+
+    // history fetches, rotating through the chats
+    timers.push_back(setInterval([this]()
+    {
+        auto& chat = *listeners[stats.histFetches++ % listeners.size()]->chat;
+        chat.resetGetHistory();
+        chat.getHistory(32);
+    }, 200, &loop));
+}
+
+void Bench::stop()
+{
+    for (auto timer: timers)
+    {
+        cancelInterval(timer, &loop);
+    }
+    timers.clear();
+}
+
+void Bench::teardown()
+{
+    client->chatd.reset();
+    client->db.close();
+    delete client;
+    client = nullptr;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [--chats N] [--rate MSGS_PER_SEC_PER_CHAT] [--duration SECS] [--dir PATH] [--async-db 0|1]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    Bench::Options opts;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i+1 >= argc)
+            usage(argv[0]);
+        std::string arg = argv[i];
+        const char* val = argv[++i];
+        if (arg == "--chats")
+            opts.chats = atoi(val);
+        else if (arg == "--rate")
+            opts.rate = atoi(val);
+        else if (arg == "--duration")
+            opts.duration = atoi(val);
+        else if (arg == "--dir")
+            opts.dir = val;
+        else if (arg == "--async-db")
+            opts.asyncDb = atoi(val) != 0;
+        else
+            usage(argv[0]);
+    }
+    if (!opts.chats || !opts.duration)
+        usage(argv[0]);
+
+    megachat::MegaChatApi::setLogLevel(megachat::MegaChatApi::LOG_LEVEL_ERROR);
+    ::mega::MegaApi megaApi("chatd_bench", opts.dir.c_str(), "chatd_bench");
+    megachat::MegaChatApiImpl loop(nullptr, &megaApi);
+    Bench bench(loop, opts);
+
+    runOnLoop(&loop, [&bench, &megaApi]() { bench.setup(megaApi); });
+    if (bench.onlinePromise.get_future().wait_for(std::chrono::seconds(30)) != std::future_status::ready)
+    {
+        fprintf(stderr, "Timed out waiting for %u chats to come online (%u are online)\n",
+            opts.chats, bench.onlineCount);
+        return 1;
+    }
+
+    uint64_t cpuStart = 0;
+    uint64_t dbStart = 0;
+    uint64_t start = 0;
+    runOnLoop(&loop, [&]()
+    {
+        cpuStart = cpuTimeUs();
+        dbStart = bench.dbTimeNs;
+        start = nowNs();
+        bench.start();
+    });
+
+    std::vector<uint64_t> loopLag; //accessed only by the loop thread
+    std::atomic<bool> probing(true);
+    std::thread prober([&]()
+    {
+        while (probing)
+        {
+            uint64_t posted = nowNs();
+            marshallCall([&loopLag, posted]() { loopLag.push_back(nowNs() - posted); }, &loop);
+            usleep(5000);
+        }
+    });
+    sleep(opts.duration);
+    probing = false;
+    prober.join();
+
+    BenchStats stats;
+    uint64_t cpuUs = 0;
+    uint64_t dbNs = 0;
+    uint64_t elapsedNs = 0;
+    chatdemu::EmuServer::Stats wire;
+    chatd::Connection::OutputStats output;
+    runOnLoop(&loop, [&]()
+    {
+        bench.stop();
+        elapsedNs = nowNs() - start;
+        cpuUs = cpuTimeUs() - cpuStart;
+        dbNs = bench.dbTimeNs - dbStart;
+        stats = bench.stats;
+        stats.loopLag.swap(loopLag);
+        wire = bench.chatdServer.stats;
+        output = bench.client->chatd->outputStats();
+        bench.teardown();
+    });
+
+    double secs = elapsedNs / 1e9;
+    uint64_t msgs = stats.received + stats.confirmed + stats.editsConfirmed;
+    printf("chats: %u, peer rate: %u msg/s/chat, duration: %.1f s\n", opts.chats, opts.rate, secs);
+    printf("received: %llu (%.0f msg/s), sent: %llu, confirmed: %llu, edits: %llu/%llu, seen: %llu, hist fetches: %llu (%llu done)\n",
+        (unsigned long long)stats.received, stats.received / secs,
+        (unsigned long long)stats.sent, (unsigned long long)stats.confirmed,
+        (unsigned long long)stats.editsConfirmed, (unsigned long long)stats.edits,
+        (unsigned long long)stats.seen, (unsigned long long)stats.histFetches,
+        (unsigned long long)stats.histDone);
+    printf("recv latency: p50 %llu us, p99 %llu us\n",
+        (unsigned long long)percentile(stats.recvLatency, 0.5) / 1000,
+        (unsigned long long)percentile(stats.recvLatency, 0.99) / 1000);
+    printf("send latency: p50 %llu us, p99 %llu us\n",
+        (unsigned long long)percentile(stats.sendLatency, 0.5) / 1000,
+        (unsigned long long)percentile(stats.sendLatency, 0.99) / 1000);
+    if (!stats.loopLag.empty())
+    {
+        uint64_t maxLag = *std::max_element(stats.loopLag.begin(), stats.loopLag.end());
+        printf("event loop stall: p50 %llu us, p99 %llu us, max %llu us\n",
+            (unsigned long long)percentile(stats.loopLag, 0.5) / 1000,
+            (unsigned long long)percentile(stats.loopLag, 0.99) / 1000,
+            (unsigned long long)maxLag / 1000);
+    }
+    if (msgs)
+    {
+        printf("per message: cpu %.1f us, db %.1f us\n", (double)cpuUs / msgs, dbNs / 1000.0 / msgs);
+    }
+    printf("chatd frames in/out: %llu/%llu, bytes in/out: %llu/%llu\n",
+        (unsigned long long)wire.framesIn, (unsigned long long)wire.framesOut,
+        (unsigned long long)wire.bytesIn, (unsigned long long)wire.bytesOut);
+    if (output.frames)
+    {
+        printf("client output: %llu commands in %llu frames (%.0f frames/s, %.1f commands/frame, %.0f bytes/frame), %llu early flushes\n",
+            (unsigned long long)output.commands, (unsigned long long)output.frames, output.frames / secs,
+            (double)output.commands / output.frames, (double)output.bytes / output.frames,
+            (unsigned long long)output.earlyFlushes);
+    }
+    return 0;
+}
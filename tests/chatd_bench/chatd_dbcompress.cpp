@@ -0,0 +1,207 @@
+/**
+ * @file tests/chatd_bench/chatd_dbcompress.cpp
+ * @brief Measures the effect of history compression on an existing karere db.
+ *
+ * Makes two copies of the db, one with all history payloads stored raw and
+ * one with them compressed as ChatdSqliteDb does with compression enabled,
+ * vacuums both and compares their sizes. Then reads the whole history of each
+ * copy in the same chunks and with the same query as fetchDbHistory(), and
+ * reports the time per message, including decompression. The source db is
+ * not modified. Run it on a real cache to get figures for a real corpus, with
+ * the app closed, so that all changes are checkpointed into the db file.
+ *
+ * Usage: chatd_dbcompress --db PATH [--out DIR] [--chunk N]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <db.h>
+#include <historyCompression.h>
+#include "benchCommon.h"
+
+struct Options
+{
+    std::string db;
+    std::string out = "/tmp";
+    unsigned chunk = 32;
+};
+
+struct FetchStats
+{
+    size_t msgs = 0;
+    size_t bytes = 0;
+    uint64_t ns = 0;
+};
+
+static long long fileSize(const std::string& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) ? -1 : (long long)st.st_size;
+}
+
+static void copyFile(const std::string& from, const std::string& to)
+{
+    std::ifstream in(from, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("Can't open "+from);
+    std::ofstream out(to, std::ios::binary | std::ios::trunc);
+    out << in.rdbuf();
+    if (!out)
+        throw std::runtime_error("Can't write "+to);
+}
+
+/** Rewrites all history payloads either raw or compressed, then vacuums the db */
+static void rewriteHistory(SqliteDb& db, bool compress, size_t& compressedCount)
+{
+    struct Row
+    {
+        int64_t rowid;
+        Buffer data;
+        int fmt;
+        Row(int64_t aRowid, Buffer&& aData, int aFmt): rowid(aRowid), data(std::move(aData)), fmt(aFmt) {}
+    };
+    {
+        // dbs of older schema versions
+        SqliteStmt stmt(db, "select count(*) from pragma_table_info('history') where name = 'data_fmt'");
+        if (stmt.step() && !stmt.intCol(0))
+            db.simpleQuery("ALTER TABLE history ADD COLUMN data_fmt tinyint not null default 0");
+    }
+    std::vector<Row> rows;
+    {
+        SqliteStmt stmt(db, "select rowid, data, data_fmt from history");
+        while (stmt.step())
+        {
+            Buffer buf;
+            chatd::decompressMsgData(stmt.intCol(2), sqlite3_column_blob(stmt, 1),
+                sqlite3_column_bytes(stmt, 1), buf);
+            rows.emplace_back(stmt.int64Col(0), std::move(buf), chatd::kMsgDataRaw);
+        }
+    }
+    compressedCount = 0;
+    db.simpleQuery("begin transaction");
+    for (auto& row: rows)
+    {
+        Buffer packed;
+        if (compress && chatd::compressMsgData(row.data, packed))
+        {
+            row.data.assign(packed);
+            row.fmt = chatd::kMsgDataDeflateDict1;
+            compressedCount++;
+        }
+        db.query("update history set data = ?, data_fmt = ? where rowid = ?", row.data, row.fmt, row.rowid);
+    }
+    db.simpleQuery("commit transaction");
+    db.simpleQuery("VACUUM");
+}
+
+/** Reads the whole history of all chats like fetchDbHistory() does */
+static FetchStats fetchAll(SqliteDb& db, unsigned chunk)
+{
+    std::vector<std::pair<int64_t, int>> chats;
+    {
+        SqliteStmt stmt(db, "select chatid, max(idx) from history group by chatid");
+        while (stmt.step())
+            chats.emplace_back(stmt.int64Col(0), stmt.intCol(1));
+    }
+    FetchStats stats;
+    uint64_t start = nowNs();
+    SqliteStmt stmt(db, "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, data_fmt from history "
+        "where chatid = ?1 and idx <= ?2 order by idx desc limit ?3");
+    for (auto& chat: chats)
+    {
+        int idx = chat.second;
+        for (;;)
+        {
+            stmt << chat.first << idx << chunk;
+            unsigned count = 0;
+            while (stmt.step())
+            {
+                Buffer buf;
+                int fmt = stmt.intCol(9);
+                if (fmt == chatd::kMsgDataRaw)
+                    stmt.blobCol(4, buf);
+                else
+                    chatd::decompressMsgData(fmt, sqlite3_column_blob(stmt, 4), sqlite3_column_bytes(stmt, 4), buf);
+                stats.bytes += buf.dataSize();
+                idx = stmt.intCol(5) - 1;
+                count++;
+            }
+            stmt.reset().clearBind();
+            stats.msgs += count;
+            if (count < chunk)
+                break;
+        }
+    }
+    stats.ns = nowNs() - start;
+    return stats;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s --db PATH [--out DIR] [--chunk N]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    Options opts;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i+1 >= argc)
+            usage(argv[0]);
+        if (!strcmp(argv[i], "--db"))
+            opts.db = argv[++i];
+        else if (!strcmp(argv[i], "--out"))
+            opts.out = argv[++i];
+        else if (!strcmp(argv[i], "--chunk"))
+            opts.chunk = atoi(argv[++i]);
+        else
+            usage(argv[0]);
+    }
+    if (opts.db.empty() || !opts.chunk)
+        usage(argv[0]);
+
+    FetchStats fetched[2];
+    long long sizes[2];
+    for (int compress = 0; compress < 2; compress++)
+    {
+        std::string path = opts.out + (compress ? "/chatd_dbcompress.z.db" : "/chatd_dbcompress.raw.db");
+        unlink((path+"-wal").c_str());
+        unlink((path+"-shm").c_str());
+        copyFile(opts.db, path);
+        SqliteDb db;
+        // The copy is rewritten entirely, so the journal mode is irrelevant.
+        // Without WAL the size of the db file is final after the vacuum
+        SqliteDb::Options dbOptions;
+        dbOptions.wal = false;
+        if (!db.open(path.c_str(), true, dbOptions))
+            throw std::runtime_error("Can't open db "+path);
+        size_t compressedCount;
+        rewriteHistory(db, compress != 0, compressedCount);
+        sizes[compress] = fileSize(path);
+        // The first pass warms up the page cache, so that the second one
+        // measures the query and decoding cost rather than disk reads
+        fetchAll(db, opts.chunk);
+        fetched[compress] = fetchAll(db, opts.chunk);
+        db.close();
+        printf("%s: db size %lld bytes, %zu messages (%zu compressed), %zu payload bytes\n",
+            compress ? "compressed" : "raw", sizes[compress], fetched[compress].msgs,
+            compressedCount, fetched[compress].bytes);
+    }
+    if (fetched[0].bytes != fetched[1].bytes)
+    {
+        fprintf(stderr, "Error: payload size mismatch between the raw and compressed db\n");
+        return 1;
+    }
+    size_t msgs = fetched[0].msgs ? fetched[0].msgs : 1;
+    printf("db size: %.1f%% of raw\n", 100.0 * sizes[1] / sizes[0]);
+    printf("fetch: raw %.2f us/msg, compressed %.2f us/msg (chunks of %u)\n",
+        fetched[0].ns / 1e3 / msgs, fetched[1].ns / 1e3 / msgs, opts.chunk);
+    return 0;
+}
@@ -0,0 +1,217 @@
+/**
+ * @file tests/chatd_bench/chatd_decryptbench.cpp
+ * @brief Measures the throughput of history decryption on the worker pool.
+ *
+ * Generates a history of signed and encrypted messages, in the format of
+ * strongvelope protocol version 3, and verifies and decrypts it in batches,
+ * split in chunks on the worker pool as ProtocolHandler::msgDecryptBatch()
+ * does. This is done for 1 to N worker threads, and on the calling thread
+ * only, as it was done before the pool. Reports the messages per second and
+ * the speedup over the calling thread for each.
+ * Only the CPU-bound part is measured - the signature verification and the
+ * AES-CTR decryption. Each run starts from the original ciphertext.
+ *
+ * Usage: chatd_decryptbench [--msgs N] [--size BYTES] [--batch N] [--threads N]
+ *  --msgs     Number of messages in the history, default 20000
+ *  --size     Payload size of each message, default 256
+ *  --batch    Messages per batch, default 128, as in chatd::Chat
+ *  --threads  Maximum number of worker threads, default the number of cores
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <sodium.h>
+#include <strongvelope/strongvelope.h>
+#include <strongvelope/cryptofunctions.h>
+#include <base/workerPool.h>
+#include "benchCommon.h"
+
+using namespace strongvelope;
+
+static const std::string kSigPrefix = "strongvelopesig";
+enum { kProtocolVersion = 3, kMinChunk = 8 };
+
+struct BenchMsg
+{
+    std::shared_ptr<SendKey> key;
+    Buffer signedContent;
+    Buffer signature;
+    Buffer payload;
+    bool ok = false;
+};
+
+struct Options
+{
+    size_t msgs = 20000;
+    size_t size = 256;
+    size_t batch = 128;
+    unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+};
+
+static void signedString(const BenchMsg& msg, Buffer& out)
+{
+    out.clear();
+    out.append(kSigPrefix.c_str(), kSigPrefix.size())
+       .append<uint8_t>(kProtocolVersion)
+       .append<uint8_t>(chatd::Message::kMsgNormal)
+       .append(*msg.key)
+       .append(msg.signedContent);
+}
+
+/** The same work as a worker does for a message in msgDecryptBatch() */
+static void decryptRange(BenchMsg* begin, BenchMsg* end, const unsigned char* pubKey, const Key<16>& iv)
+{
+    std::unique_ptr<AesCtrKey> ctrKey;
+    const SendKey* ctrKeyOf = nullptr;
+    Buffer toVerify;
+    for (auto msg = begin; msg < end; msg++)
+    {
+        signedString(*msg, toVerify);
+        if (crypto_sign_verify_detached(msg->signature.ubuf(), toVerify.ubuf(),
+                toVerify.dataSize(), pubKey) != 0)
+        {
+            continue;
+        }
+        if (msg->key.get() != ctrKeyOf)
+        {
+            ctrKey.reset(new AesCtrKey(*msg->key));
+            ctrKeyOf = msg->key.get();
+        }
+        ctrKey->processInPlace(iv, msg->payload);
+        msg->ok = true;
+    }
+}
+
+/** Decrypts all messages in batches with \c threads workers, or on the calling
+ * thread if \c threads is 0. Returns the time in ns */
+static uint64_t runBatches(std::vector<BenchMsg>& msgs, const Options& opts, unsigned threads,
+    const unsigned char* pubKey, const Key<16>& iv)
+{
+    auto& pool = karere::WorkerPool::instance();
+    if (threads)
+        pool.setThreadCount(threads);
+    std::mutex mutex;
+    std::condition_variable cv;
+    uint64_t start = nowNs();
+    for (size_t first = 0; first < msgs.size(); first += opts.batch)
+    {
+        BenchMsg* begin = msgs.data()+first;
+        BenchMsg* end = msgs.data()+std::min(first+opts.batch, msgs.size());
+        if (!threads)
+        {
+            decryptRange(begin, end, pubKey, iv);
+            continue;
+        }
+        // batches are decrypted one by one, as the client waits for the
+        // first message of a batch before it passes on the rest
+        size_t count = end-begin;
+        size_t chunkSize = std::max<size_t>(kMinChunk, (count + threads - 1) / threads);
+        std::atomic<unsigned> pending((count + chunkSize - 1) / chunkSize);
+        for (BenchMsg* chunk = begin; chunk < end; chunk += chunkSize)
+        {
+            BenchMsg* chunkEnd = std::min(chunk+chunkSize, end);
+            pool.post([&, chunk, chunkEnd]()
+            {
+                decryptRange(chunk, chunkEnd, pubKey, iv);
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--pending == 0)
+                    cv.notify_one();
+            });
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&pending]() { return pending == 0; });
+    }
+    return nowNs() - start;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [--msgs N] [--size BYTES] [--batch N] [--threads N]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    Options opts;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i+1 >= argc)
+            usage(argv[0]);
+        if (!strcmp(argv[i], "--msgs"))
+            opts.msgs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--size"))
+            opts.size = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--batch"))
+            opts.batch = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--threads"))
+            opts.threads = atoi(argv[++i]);
+        else
+            usage(argv[0]);
+    }
+    if (!opts.msgs || !opts.batch || !opts.threads || sodium_init() == -1)
+        usage(argv[0]);
+
+    unsigned char pubKey[crypto_sign_PUBLICKEYBYTES];
+    unsigned char privKey[crypto_sign_SECRETKEYBYTES];
+    crypto_sign_keypair(pubKey, privKey);
+    Key<16> iv;
+    iv.setDataSize(CryptoPP::AES::BLOCKSIZE);
+    randombytes_buf(iv.ubuf(), iv.dataSize());
+
+    // A few key rotations over the history, as in a group chat
+    std::vector<BenchMsg> msgs(opts.msgs);
+    std::vector<Buffer> ciphertexts;
+    std::shared_ptr<SendKey> key;
+    Buffer toSign;
+    for (size_t i = 0; i < msgs.size(); i++)
+    {
+        auto& msg = msgs[i];
+        if (i % 1000 == 0)
+        {
+            key = std::make_shared<SendKey>();
+            key->setDataSize(CryptoPP::AES::BLOCKSIZE);
+            randombytes_buf(key->ubuf(), key->dataSize());
+        }
+        msg.key = key;
+        randombytes_buf(msg.payload.appendPtr(opts.size), opts.size);
+        // the signed content is the TLV record, which contains the payload
+        msg.signedContent.append(msg.payload);
+        signedString(msg, toSign);
+        crypto_sign_detached(msg.signature.appendPtr(crypto_sign_BYTES), NULL,
+            toSign.ubuf(), toSign.dataSize(), privKey);
+        ciphertexts.emplace_back(msg.payload.buf(), msg.payload.dataSize());
+    }
+
+    printf("%zu messages of %zu bytes, batches of %zu, AES: %s\n", opts.msgs, opts.size,
+        opts.batch, AesCtrKey::implementation());
+    printf("%8s %12s %10s\n", "threads", "msgs/s", "speedup");
+    double baseRate = 0;
+    for (unsigned threads = 0; threads <= opts.threads; threads++)
+    {
+        for (size_t i = 0; i < msgs.size(); i++)
+        {
+            msgs[i].payload.assign(ciphertexts[i]);
+            msgs[i].ok = false;
+        }
+        uint64_t ns = runBatches(msgs, opts, threads, pubKey, iv);
+        for (auto& msg: msgs)
+        {
+            if (!msg.ok)
+            {
+                fprintf(stderr, "Error: signature verification failed\n");
+                return 1;
+            }
+        }
+        double rate = msgs.size() * 1e9 / ns;
+        if (!threads)
+            baseRate = rate;
+        printf("%8s %12.0f %9.2fx\n", threads ? std::to_string(threads).c_str() : "loop",
+            rate, rate / baseRate);
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+/**
+ * @file tests/chatd_bench/chatd_hashbench.cpp
+ * @brief Compares karere::FlatHashMap with std::map, as used for the message
+ * indexes of chatd::Chat (msgid -> idx, backrefid -> idx).
+ *
+ * For each map size, inserts random 64-bit keys, looks all of them up in a
+ * shuffled order, then erases them in another shuffled order, and reports
+ * the time per operation. Each figure is the best of a few runs.
+ *
+ * Usage: chatd_hashbench [--sizes N,N,...] [--runs N]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <flatHashMap.h>
+
+struct Options
+{
+    std::vector<size_t> sizes = { 10000, 1000000 };
+    int runs = 3;
+};
+
+struct Timings
+{
+    double insert = 1e30;
+    double lookup = 1e30;
+    double erase = 1e30;
+};
+
+static double nsSince(std::chrono::steady_clock::time_point start, size_t ops)
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / ops;
+}
+
+template <class Map>
+static void runOnce(const std::vector<uint64_t>& keys, const std::vector<uint64_t>& lookupOrder,
+    const std::vector<uint64_t>& eraseOrder, Timings& best)
+{
+    Map map;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        map[keys[i]] = (uint32_t)i;
+    }
+    best.insert = std::min(best.insert, nsSince(start, keys.size()));
+
+    uint64_t sum = 0;
+    start = std::chrono::steady_clock::now();
+    for (auto key: lookupOrder)
+    {
+        auto it = map.find(key);
+        if (it != map.end())
+            sum += it->second;
+    }
+    best.lookup = std::min(best.lookup, nsSince(start, lookupOrder.size()));
+
+    start = std::chrono::steady_clock::now();
+    for (auto key: eraseOrder)
+    {
+        map.erase(key);
+    }
+    best.erase = std::min(best.erase, nsSince(start, eraseOrder.size()));
+    if (!map.empty() || sum != (uint64_t)keys.size() * (keys.size()-1) / 2)
+    {
+        fprintf(stderr, "Map contents are wrong\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options opts;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if ((arg == "--sizes") && (i+1 < argc))
+        {
+            opts.sizes.clear();
+            for (char* s = strtok(argv[++i], ","); s; s = strtok(nullptr, ","))
+                opts.sizes.push_back(strtoul(s, nullptr, 10));
+        }
+        else if ((arg == "--runs") && (i+1 < argc))
+        {
+            opts.runs = atoi(argv[++i]);
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--sizes N,N,...] [--runs N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("%10s %-14s %12s %12s %12s\n", "entries", "map", "insert", "lookup", "erase");
+    std::mt19937_64 rng(1);
+    for (auto size: opts.sizes)
+    {
+        std::vector<uint64_t> keys(size);
+        for (auto& key: keys)
+        {
+            key = rng();
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        std::shuffle(keys.begin(), keys.end(), rng);
+        auto lookupOrder = keys;
+        std::shuffle(lookupOrder.begin(), lookupOrder.end(), rng);
+        auto eraseOrder = keys;
+        std::shuffle(eraseOrder.begin(), eraseOrder.end(), rng);
+
+        Timings stdMap, flatMap;
+        for (int run = 0; run < opts.runs; run++)
+        {
+            runOnce<std::map<uint64_t, uint32_t>>(keys, lookupOrder, eraseOrder, stdMap);
+            runOnce<karere::FlatHashMap<uint64_t, uint32_t>>(keys, lookupOrder, eraseOrder, flatMap);
+        }
+        printf("%10zu %-14s %9.1f ns %9.1f ns %9.1f ns\n", keys.size(), "std::map",
+            stdMap.insert, stdMap.lookup, stdMap.erase);
+        printf("%10zu %-14s %9.1f ns %9.1f ns %9.1f ns\n", keys.size(), "FlatHashMap",
+            flatMap.insert, flatMap.lookup, flatMap.erase);
+    }
+    return 0;
+}
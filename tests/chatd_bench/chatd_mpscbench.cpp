@@ -0,0 +1,177 @@
+/**
+ * @file tests/chatd_bench/chatd_mpscbench.cpp
+ * @brief Measures the throughput of marshalling items from producer threads to
+ * the MegaChatApi thread, with the queue and wakeup scheme of MegaChatApiImpl
+ * (karere::MpscQueue, batched draining, coalesced notify), compared to a
+ * mutex-protected deque with a notify per item, as before.
+ *
+ * The waiter is a condition variable, like the one of the API thread. Each
+ * producer posts an equal share of the items, and the consumer runs until it
+ * has received all of them.
+ *
+ * Usage: chatd_mpscbench [--items N] [--producers N,N,...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <mpscQueue.h>
+
+struct Options
+{
+    size_t items = 2000000;
+    std::vector<size_t> producers = { 1, 4, 16 };
+};
+
+/** The equivalent of the API thread's waiter */
+class Waiter
+{
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    bool mSignalled = false;
+public:
+    std::atomic<size_t> notifies;
+    Waiter(): notifies(0) {}
+    void notify()
+    {
+        notifies++;
+        std::lock_guard<std::mutex> lock(mMutex);
+        mSignalled = true;
+        mCond.notify_one();
+    }
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCond.wait(lock, [this]() { return mSignalled; });
+        mSignalled = false;
+    }
+};
+
+struct Result
+{
+    double itemsPerSec;
+    size_t notifies;
+};
+
+/** The queue before MpscQueue: a deque under a mutex, with a notify per item */
+static Result runMutexDeque(size_t producerCount, size_t items)
+{
+    std::mutex mutex;
+    std::deque<uintptr_t> queue;
+    Waiter waiter;
+    size_t perProducer = items / producerCount;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> producers;
+    for (size_t p = 0; p < producerCount; p++)
+    {
+        producers.emplace_back([&]()
+        {
+            for (size_t i = 0; i < perProducer; i++)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    queue.push_back(i + 1);
+                }
+                waiter.notify();
+            }
+        });
+    }
+    size_t received = 0;
+    while (received < perProducer * producerCount)
+    {
+        waiter.wait();
+        for (;;)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (queue.empty())
+                break;
+            queue.pop_front();
+            received++;
+        }
+    }
+    for (auto& thread: producers)
+        thread.join();
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return { received / sec, waiter.notifies };
+}
+
+/** The scheme of MegaChatApiImpl: MpscQueue, notifyWaiter() and sendPendingEvents() */
+static Result runMpsc(size_t producerCount, size_t items)
+{
+    karere::MpscQueue<uintptr_t> queue;
+    std::atomic<bool> wakeupPending(false);
+    Waiter waiter;
+    size_t perProducer = items / producerCount;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> producers;
+    for (size_t p = 0; p < producerCount; p++)
+    {
+        producers.emplace_back([&]()
+        {
+            for (size_t i = 0; i < perProducer; i++)
+            {
+                queue.push(i + 1);
+                if (!wakeupPending.exchange(true))
+                    waiter.notify();
+            }
+        });
+    }
+    size_t received = 0;
+    uintptr_t batch[64];
+    while (received < perProducer * producerCount)
+    {
+        waiter.wait();
+        wakeupPending.store(false);
+        while (size_t count = queue.popBatch(batch, 64))
+            received += count;
+    }
+    for (auto& thread: producers)
+        thread.join();
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return { received / sec, waiter.notifies };
+}
+
+int main(int argc, char** argv)
+{
+    Options opts;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if ((arg == "--items") && (i+1 < argc))
+        {
+            opts.items = strtoul(argv[++i], nullptr, 10);
+        }
+        else if ((arg == "--producers") && (i+1 < argc))
+        {
+            opts.producers.clear();
+            for (char* s = strtok(argv[++i], ","); s; s = strtok(nullptr, ","))
+                opts.producers.push_back(strtoul(s, nullptr, 10));
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--items N] [--producers N,N,...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("%zu items, %u CPUs\n", opts.items, std::thread::hardware_concurrency());
+    printf("%10s %29s %29s\n", "producers", "mutex+deque", "mpsc+coalesced notify");
+    for (auto producers: opts.producers)
+    {
+        if (!producers)
+            continue;
+        auto base = runMutexDeque(producers, opts.items);
+        auto mpsc = runMpsc(producers, opts.items);
+        printf("%10zu %13.2fM/s %8zu ntf %13.2fM/s %8zu ntf\n", producers,
+            base.itemsPerSec / 1e6, base.notifies, mpsc.itemsPerSec / 1e6, mpsc.notifies);
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+/**
+ * @file tests/chatd_bench/chatd_msgalloc.cpp
+ * @brief Measures the memory used by chatd::Message objects allocated from a
+ * client's SlabArena, compared to plain malloc().
+ *
+ * Creates messages the way ChatdSqliteDb::fetchDbHistory() does, with content
+ * and backrefs of realistic sizes, spread over a number of chats that are
+ * loaded in turns, and reports the number of malloc() calls and the growth
+ * of the resident set size. RSS is per process, so each allocator is measured
+ * by a separate run.
+ *
+ * Usage: chatd_msgalloc [--malloc] [--msgs N] [--chats N]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <chatdMsg.h>
+
+struct Options
+{
+    bool useMalloc = false;
+    size_t msgs = 100000;
+    size_t chats = 200;
+};
+
+static size_t rssBytes()
+{
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+    unsigned long size = 0, resident = 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+int main(int argc, char** argv)
+{
+    Options opts;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--malloc")
+            opts.useMalloc = true;
+        else if ((arg == "--msgs") && (i+1 < argc))
+            opts.msgs = strtoul(argv[++i], nullptr, 10);
+        else if ((arg == "--chats") && (i+1 < argc))
+            opts.chats = strtoul(argv[++i], nullptr, 10);
+        else
+        {
+            fprintf(stderr, "Usage: %s [--malloc] [--msgs N] [--chats N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!opts.chats || !opts.msgs)
+        return 1;
+
+    // decrypted text messages are mostly short, with a long tail
+    std::mt19937 rng(1);
+    std::lognormal_distribution<double> textLen(4.0, 0.8);
+    std::vector<char> text(4096, 'x');
+
+    auto arena = new karere::SlabArena;
+    std::vector<std::vector<chatd::Message*>> histories(opts.chats);
+    size_t contentAllocs = 0;
+    size_t rssBefore = rssBytes();
+    auto start = std::chrono::steady_clock::now();
+
+    // chats are loaded in chunks of 32 messages, in turns, as when the app
+    // opens them one after the other, so the allocations of chats interleave
+    size_t count = 0;
+    while (count < opts.msgs)
+    {
+        for (auto& history: histories)
+        {
+            for (int i = 0; (i < 32) && (count < opts.msgs); i++, count++)
+            {
+                size_t len = std::min<size_t>(text.size(), 1 + (size_t)textLen(rng));
+                chatd::Message* msg = opts.useMalloc
+                    ? ::new chatd::Message(count+1, 1, 1500000000+count, 0, text.data(), len)
+                    : new (*arena) chatd::Message(count+1, 1, 1500000000+count, 0, text.data(), len);
+                contentAllocs++;
+                msg->backRefId = count;
+                if (count % 3 == 0)
+                {
+                    msg->backRefs.assign(3, count);
+                    contentAllocs++;
+                }
+                history.push_back(msg);
+            }
+        }
+    }
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    size_t rssGrowth = rssBytes() - rssBefore;
+    size_t headerAllocs = opts.useMalloc ? count : (arena->reservedBytes() / karere::SlabArena::kSlabSize);
+    printf("%s: %zu messages in %zu chats, %.1f ms\n", opts.useMalloc ? "malloc" : "slab arena",
+        count, opts.chats, ms);
+    printf("  malloc() calls: %zu for Message objects, %zu for content and backrefs, %zu total\n",
+        headerAllocs, contentAllocs, headerAllocs + contentAllocs);
+    printf("  RSS growth: %.2f MB (%.1f bytes per message)\n", rssGrowth / 1048576.0, (double)rssGrowth / count);
+    if (!opts.useMalloc)
+    {
+        printf("  arena: %zu live blocks, %zu live bytes, %zu bytes reserved\n",
+            arena->liveCount(), arena->liveBytes(), arena->reservedBytes());
+    }
+
+    for (auto& history: histories)
+    {
+        for (auto msg: history)
+        {
+            if (opts.useMalloc)
+                ::delete msg;
+            else
+                delete msg;
+        }
+    }
+    arena->release();
+    return 0;
+}
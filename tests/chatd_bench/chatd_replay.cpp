@@ -0,0 +1,353 @@
+/**
+ * @file tests/chatd_bench/chatd_replay.cpp
+ * @brief Deterministic offline replay of a websocket frame recording.
+ *
+ * Feeds the inbound chatd and presenced frames of a recording made with
+ * karere::FrameRecorder (i.e. by running the app with KRFRAMEREC=<file>)
+ * back through Connection::wsHandleMsgCb()/execCommand() and the presenced
+ * message handler, against a fresh database, as fast as they can be
+ * processed. This allows to profile a real session offline, and to compare
+ * builds on identical input.
+ * The chats are recreated from the chat records in the recording, and the
+ * client connects to in-process stand-in servers (see chatdEmulator.h) that
+ * drop everything the client sends. As the recording contains the encrypted
+ * messages but not the keys, crypto is a pass-through, so the cost of
+ * decryption is not included.
+ *
+ * Usage: chatd_replay <recording> [--dir PATH]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <future>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include <megaapi.h>
+#include <megachatapi_impl.h>
+#include <chatClient.h>
+#include <chatd.h>
+#include <chatdDb.h>
+#include <presenced.h>
+#include <net/frameRecorder.h>
+#include "chatdEmulator.h"
+#include "benchCommon.h"
+
+using namespace karere;
+
+struct Record
+{
+    uint64_t ts;
+    uint8_t type;
+    int32_t channel;
+    std::string data;
+};
+
+struct ChatInfo
+{
+    Id chatid;
+    int shardNo;
+    uint32_t creationTs;
+    bool isGroup;
+    SetOfIds users;
+};
+
+static bool loadRecording(const char* path, std::vector<Record>& records)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Can't open %s\n", path);
+        return false;
+    }
+    char magic[FrameRecorder::kMagicLen];
+    uint32_t version = 0;
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic)
+     || memcmp(magic, FrameRecorder::magic(), sizeof(magic))
+     || fread(&version, 1, sizeof(version), file) != sizeof(version)
+     || version != FrameRecorder::kVersion)
+    {
+        fprintf(stderr, "%s is not a frame recording, or has an unsupported version\n", path);
+        fclose(file);
+        return false;
+    }
+    char hdr[FrameRecorder::kRecordHeaderSize];
+    while (fread(hdr, 1, sizeof(hdr), file) == sizeof(hdr))
+    {
+        Record rec;
+        uint32_t len;
+        memcpy(&rec.ts, hdr, 8);
+        rec.type = hdr[8];
+        memcpy(&rec.channel, hdr+9, 4);
+        memcpy(&len, hdr+13, 4);
+        rec.data.resize(len);
+        if (len && fread(&rec.data[0], 1, len, file) != len)
+        {
+            fprintf(stderr, "Warning: truncated last record, ignoring it\n");
+            break;
+        }
+        records.push_back(std::move(rec));
+    }
+    fclose(file);
+    return true;
+}
+
+static bool parseChat(const Record& rec, ChatInfo& info, Id& myUserid)
+{
+    const std::string& data = rec.data;
+    if (data.size() < 21 || (data.size() - 21) % 8)
+        return false;
+    uint64_t val;
+    memcpy(&val, data.data(), 8);
+    info.chatid = val;
+    memcpy(&val, data.data()+8, 8);
+    myUserid = val;
+    memcpy(&info.creationTs, data.data()+16, 4);
+    info.isGroup = data[20] != 0;
+    info.shardNo = rec.channel;
+    for (size_t pos = 21; pos < data.size(); pos += 8)
+    {
+        memcpy(&val, data.data()+pos, 8);
+        info.users.insert(val);
+    }
+    return true;
+}
+
+/** Accepts the connection of the client, drops whatever it sends and
+ * injects the recorded inbound frames */
+class ReplayServer: public chatdemu::EmuServer
+{
+public:
+    std::function<void()> onConnected;
+    virtual void onConnect(chatdemu::EmuClient& conn)
+    {
+        EmuServer::onConnect(conn);
+        if (onConnected)
+            onConnected();
+    }
+    virtual void onMessage(chatdemu::EmuClient& conn, const StaticBuffer& frame) {}
+    bool inject(const std::string& frame)
+    {
+        if (mConns.empty())
+            return false;
+        send(**mConns.begin(), frame.data(), frame.size());
+        return true;
+    }
+};
+
+class ReplayListener: public chatd::Listener
+{
+protected:
+    SqliteDb& mDb;
+public:
+    uint64_t& mMsgCount;
+    ReplayListener(SqliteDb& db, uint64_t& msgCount): mDb(db), mMsgCount(msgCount) {}
+    virtual void init(chatd::Chat& chat, chatd::DbInterface*& dbIntf)
+    {
+        dbIntf = new ChatdSqliteDb(chat, mDb);
+    }
+    virtual void onRecvNewMessage(chatd::Idx idx, chatd::Message& msg, chatd::Message::Status status)
+    {
+        mMsgCount++;
+    }
+    virtual void onRecvHistoryMessage(chatd::Idx idx, chatd::Message& msg, chatd::Message::Status status, bool isLocal)
+    {
+        mMsgCount++;
+    }
+    virtual void onOnlineStateChange(chatd::ChatState state) {}
+};
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s <recording> [--dir PATH]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+        usage(argv[0]);
+    const char* recPath = argv[1];
+    std::string dir = "/tmp";
+    for (int i = 2; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--dir") && i+1 < argc)
+            dir = argv[++i];
+        else
+            usage(argv[0]);
+    }
+
+    std::vector<Record> records;
+    if (!loadRecording(recPath, records))
+        return 1;
+
+    std::vector<ChatInfo> chats;
+    std::set<int> shards;
+    Id myUserid;
+    bool usesPresenced = false;
+    uint64_t inFrames = 0, inBytes = 0;
+    for (auto& rec: records)
+    {
+        switch (rec.type)
+        {
+            case FrameRecorder::kChatdChat:
+            {
+                ChatInfo info;
+                if (!parseChat(rec, info, myUserid))
+                {
+                    fprintf(stderr, "Malformed chat record, aborting\n");
+                    return 1;
+                }
+                chats.push_back(info);
+                shards.insert(info.shardNo);
+                break;
+            }
+            case FrameRecorder::kChatdIn:
+                shards.insert(rec.channel);
+                inFrames++;
+                inBytes += rec.data.size();
+                break;
+            case FrameRecorder::kPresencedIn:
+                usesPresenced = true;
+                inFrames++;
+                inBytes += rec.data.size();
+                break;
+            default:
+                break;
+        }
+    }
+    if (chats.empty())
+    {
+        fprintf(stderr, "The recording has no chat records. Recording must be started before login, i.e. via the KRFRAMEREC env variable\n");
+        return 1;
+    }
+
+    megachat::MegaChatApi::setLogLevel(megachat::MegaChatApi::LOG_LEVEL_ERROR);
+    ::mega::MegaApi megaApi("chatd_replay", dir.c_str(), "chatd_replay");
+    megachat::MegaChatApiImpl loop(nullptr, &megaApi);
+
+    std::map<int, std::unique_ptr<ReplayServer>> chatdServers;
+    ReplayServer presencedServer;
+    std::vector<std::unique_ptr<ReplayListener>> listeners;
+    karere::Client* client = nullptr;
+    uint64_t dbTimeNs = 0;
+    uint64_t msgCount = 0;
+    std::promise<void> connected;
+    size_t connectedCount = 0;
+    size_t expectedConnections = shards.size() + (usesPresenced ? 1 : 0);
+    auto onConnected = [&]()
+    {
+        if (++connectedCount == expectedConnections)
+            connected.set_value();
+    };
+
+    runOnLoop(&loop, [&]()
+    {
+        auto websocketsIO = new chatdemu::EmuWebsocketsIO(&loop.sdkMutex, &megaApi, &loop);
+        for (auto shard: shards)
+        {
+            auto server = new ReplayServer;
+            server->onConnected = onConnected;
+            chatdServers[shard].reset(server);
+            websocketsIO->addServer("shard"+std::to_string(shard)+".replay", server);
+        }
+        presencedServer.onConnected = onConnected;
+        websocketsIO->addServer("presenced.replay", &presencedServer);
+
+        client = new karere::Client(megaApi, websocketsIO, loop, dir, 0, &loop);
+        std::string dbPath = dir + "/chatd_replay.db";
+        unlink(dbPath.c_str());
+        if (!client->db.open(dbPath.c_str(), true))
+            throw std::runtime_error("Can't open db "+dbPath);
+        client->db.simpleQuery(gDbSchema);
+        sqlite3_profile(client->db, sqliteProfileCb, &dbTimeNs);
+
+        client->chatd.reset(new chatd::Client(client, myUserid));
+        client->chatd->urlProvider = [](Id chatid, int shardNo)
+        {
+            return "wss://shard"+std::to_string(shardNo)+".replay/chatd";
+        };
+        for (auto& info: chats)
+        {
+            listeners.emplace_back(new ReplayListener(client->db, msgCount));
+            auto& chat = client->chatd->createChat(info.chatid, info.shardNo, std::string(),
+                listeners.back().get(), info.users, new NullCrypto(&loop), info.creationTs, info.isGroup);
+            chat.connect();
+        }
+        if (usesPresenced)
+        {
+            client->presenced().connect("wss://presenced.replay/", myUserid,
+                presenced::IdRefMap(), presenced::Config(Presence::kOnline));
+        }
+    });
+
+    if (connected.get_future().wait_for(std::chrono::seconds(30)) != std::future_status::ready)
+    {
+        fprintf(stderr, "Timed out waiting for the client to connect\n");
+        return 1;
+    }
+
+    uint64_t cpuStart = 0;
+    uint64_t dbStart = 0;
+    uint64_t start = 0;
+    uint64_t dropped = 0;
+    std::promise<void> done;
+    runOnLoop(&loop, [&]()
+    {
+        cpuStart = cpuTimeUs();
+        dbStart = dbTimeNs;
+        start = nowNs();
+        for (auto& rec: records)
+        {
+            bool sent = true;
+            if (rec.type == FrameRecorder::kChatdIn)
+                sent = chatdServers[rec.channel]->inject(rec.data);
+            else if (rec.type == FrameRecorder::kPresencedIn)
+                sent = presencedServer.inject(rec.data);
+            if (!sent)
+                dropped++;
+        }
+        // The frames are delivered via the app's message queue, so this runs
+        // after all of them have been processed. Wait one more round, for the
+        // work that their processing has marshalled
+        marshallCall([&loop, &done]()
+        {
+            marshallCall([&done]() { done.set_value(); }, &loop);
+        }, &loop);
+    });
+    done.get_future().wait();
+
+    uint64_t elapsedNs = 0;
+    uint64_t cpuUs = 0;
+    uint64_t dbNs = 0;
+    runOnLoop(&loop, [&]()
+    {
+        elapsedNs = nowNs() - start;
+        cpuUs = cpuTimeUs() - cpuStart;
+        dbNs = dbTimeNs - dbStart;
+        client->chatd.reset();
+        client->db.close();
+        delete client;
+    });
+
+    double secs = elapsedNs / 1e9;
+    printf("replayed %llu frames (%llu bytes) of %zu chats on %zu shards in %.3f s: %.0f frames/s, %.1f MB/s\n",
+        (unsigned long long)inFrames, (unsigned long long)inBytes, chats.size(), shards.size(),
+        secs, inFrames / secs, inBytes / secs / 1048576);
+    printf("messages: %llu, cpu: %.3f s, db: %.3f s\n",
+        (unsigned long long)msgCount, cpuUs / 1e6, dbNs / 1e9);
+    if (inFrames)
+    {
+        printf("per frame: cpu %.1f us, db %.1f us\n", (double)cpuUs / inFrames, dbNs / 1000.0 / inFrames);
+    }
+    if (dropped)
+    {
+        printf("warning: %llu frames were dropped, as their connection was not established\n",
+            (unsigned long long)dropped);
+    }
+    return 0;
+}
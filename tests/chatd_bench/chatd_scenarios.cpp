@@ -0,0 +1,516 @@
+/**
+ * @file tests/chatd_bench/chatd_scenarios.cpp
+ * @brief Functional scenarios of the chatd client, run against the emulator.
+ *
+ * Each scenario drives the chatd client of karere through a sequence that
+ * the unit tests can't cover, as it needs a server: i.e. a restart with
+ * dormant chats, a connection that fails while sending, history that is
+ * evicted from RAM and loaded back, or history that is decrypted out of order. The chatd server is the in-process emulator in
+ * chatdEmulator.h, the crypto layer is a pass-through, and the chat URLs come
+ * from chatd::Client::urlProvider, as in chatd_bench.
+ * The scenarios run in sequence, each with its own chats and a new
+ * chatd::Client, and share the db. The exit code is the number of failed
+ * scenarios.
+ *
+ * Usage: chatd_scenarios [--dir PATH]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <megaapi.h>
+#include <megachatapi_impl.h>
+#include <chatClient.h>
+#include <chatd.h>
+#include <chatdDb.h>
+#include "chatdEmulator.h"
+#include "benchCommon.h"
+
+using namespace karere;
+
+static const char* kChatdUrl = "wss://chatd.emu/chatd";
+static const Id kMyHandle(0xA0A0A0A0A0A0A0A0ull);
+static const Id kPeerHandle(0xB0B0B0B0B0B0B0B0ull);
+
+/** Evaluates \c cond on the karere thread until it's true, or until the timeout */
+static bool waitFor(void* appCtx, std::function<bool()> cond, unsigned timeoutMs=10000)
+{
+    for (unsigned waited = 0; ; waited += 10)
+    {
+        bool done = false;
+        runOnLoop(appCtx, [&cond, &done]() { done = cond(); });
+        if (done)
+            return true;
+        if (waited >= timeoutMs)
+            return false;
+        usleep(10000);
+    }
+}
+
+/** Records what the client passes to the app, in the order it does */
+class ScenarioListener: public chatd::Listener
+{
+protected:
+    SqliteDb& mDb;
+public:
+    chatd::Chat* chat = nullptr;
+    chatd::ChatState state = chatd::kChatStateOffline;
+    std::vector<chatd::Idx> newIdxs;
+    std::vector<Id> newMsgs;
+    std::vector<Id> confirmed;
+    std::vector<chatd::Idx> histIdxs;
+    std::vector<Id> histMsgs;
+    ScenarioListener(SqliteDb& db): mDb(db) {}
+    virtual void init(chatd::Chat& aChat, chatd::DbInterface*& dbIntf)
+    {
+        chat = &aChat;
+        dbIntf = new ChatdSqliteDb(aChat, mDb);
+    }
+    virtual void onDestroy() { chat = nullptr; }
+    virtual void onRecvNewMessage(chatd::Idx idx, chatd::Message& msg, chatd::Message::Status status)
+    {
+        newIdxs.push_back(idx);
+        newMsgs.push_back(msg.id());
+    }
+    virtual void onRecvHistoryMessage(chatd::Idx idx, chatd::Message& msg, chatd::Message::Status status, bool isLocal)
+    {
+        histIdxs.push_back(idx);
+        histMsgs.push_back(msg.id());
+    }
+    virtual void onMessageConfirmed(Id msgxid, const chatd::Message& msg, chatd::Idx idx)
+    {
+        confirmed.push_back(msg.id());
+    }
+    virtual void onOnlineStateChange(chatd::ChatState aState) { state = aState; }
+};
+
+/** Decrypts batches asynchronously, and completes the messages of each batch
+ * in reverse order, as a parallel decrypt may */
+class ReorderingCrypto: public NullCrypto
+{
+public:
+    unsigned batches = 0;
+    ReorderingCrypto(void* ctx): NullCrypto(ctx) {}
+    virtual std::vector<promise::Promise<chatd::Message*>>
+    msgDecryptBatch(const std::vector<chatd::Message*>& msgs)
+    {
+        batches++;
+        std::vector<promise::Promise<chatd::Message*>> result(msgs.size());
+        for (size_t i = msgs.size(); i-- > 0;)
+        {
+            auto pms = result[i];
+            auto msg = msgs[i];
+            marshallCall([this, pms, msg]() mutable
+            {
+                msgDecrypt(msg);
+                pms.resolve(msg);
+            }, getAppCtx());
+        }
+        return result;
+    }
+};
+
+class Scenarios
+{
+public:
+    megachat::MegaChatApiImpl& loop;
+    chatdemu::ChatdEmulator chatdServer;
+    karere::Client* client = nullptr;
+    std::vector<std::unique_ptr<ScenarioListener>> listeners;
+    unsigned failed = 0;
+
+    Scenarios(megachat::MegaChatApiImpl& aLoop): loop(aLoop) {}
+    void setup(::mega::MegaApi& megaApi, const std::string& dir);
+    void teardown();
+    /** Runs \c scenario, that returns the reason of the failure, or an empty
+     * string if it passed */
+    void run(const char* name, std::string (Scenarios::*scenario)());
+    std::string materializeDormantChat();
+    std::string reconnectOnSendError();
+    std::string evictAndLoadBack();
+    std::string orderedBatchDecrypt();
+protected:
+    uint64_t mNextChatid = 0xC000;
+    /** Replaces the chatd client, as after an app restart. The db is kept */
+    void resetChatd();
+    ScenarioListener& newListener();
+    /** Creates a chat on the emulator, with \c msgCount peer messages */
+    Id newChat(unsigned msgCount, std::vector<Id>* msgids=nullptr);
+    chatd::Chat& createChat(Id chatid, ScenarioListener& listener, chatd::ICrypto* crypto=nullptr);
+    Id postPeerMessage(Id chatid, unsigned n);
+    bool onLoop(std::function<bool()> cond) { return waitFor(&loop, cond); }
+};
+
+void Scenarios::setup(::mega::MegaApi& megaApi, const std::string& dir)
+{
+    auto websocketsIO = new chatdemu::EmuWebsocketsIO(&loop.sdkMutex, &megaApi, &loop);
+    websocketsIO->addServer("chatd.emu", &chatdServer);
+    client = new karere::Client(megaApi, websocketsIO, loop, dir, 0, &loop);
+
+    std::string dbPath = dir + "/chatd_scenarios.db";
+    unlink(dbPath.c_str());
+    if (!client->db.open(dbPath.c_str(), true))
+        throw std::runtime_error("Can't open db "+dbPath);
+    client->db.simpleQuery(gDbSchema);
+}
+
+void Scenarios::teardown()
+{
+    client->chatd.reset();
+    client->db.close();
+    delete client;
+    client = nullptr;
+}
+
+void Scenarios::resetChatd()
+{
+    client->chatd.reset(new chatd::Client(client, kMyHandle));
+    client->chatd->urlProvider = [](Id chatid, int shardNo)
+    {
+        return std::string(kChatdUrl);
+    };
+}
+
+void Scenarios::run(const char* name, std::string (Scenarios::*scenario)())
+{
+    runOnLoop(&loop, [this]() { resetChatd(); });
+    std::string error = (this->*scenario)();
+    if (error.empty())
+    {
+        printf("PASS %s\n", name);
+        return;
+    }
+    printf("FAIL %s: %s\n", name, error.c_str());
+    failed++;
+}
+
+ScenarioListener& Scenarios::newListener()
+{
+    listeners.emplace_back(new ScenarioListener(client->db));
+    return *listeners.back();
+}
+
+Id Scenarios::newChat(unsigned msgCount, std::vector<Id>* msgids)
+{
+    Id chatid(mNextChatid++);
+    chatdServer.addChat(chatid, { kMyHandle, kPeerHandle });
+    for (unsigned i = 0; i < msgCount; i++)
+    {
+        Id msgid = postPeerMessage(chatid, i);
+        if (msgids)
+            msgids->push_back(msgid);
+    }
+    // as ChatRoom does, dormant chats are loaded from here
+    client->db.query("insert into chats(chatid, shard, own_priv, ts_created) values(?,0,3,?)",
+        chatid, (uint32_t)time(NULL));
+    return chatid;
+}
+
+chatd::Chat& Scenarios::createChat(Id chatid, ScenarioListener& listener, chatd::ICrypto* crypto)
+{
+    return client->chatd->createChat(chatid, 0, std::string(), &listener, SetOfIds({kMyHandle, kPeerHandle}),
+        crypto ? crypto : new NullCrypto(&loop), (uint32_t)time(NULL), true);
+}
+
+Id Scenarios::postPeerMessage(Id chatid, unsigned n)
+{
+    return chatdServer.postMessage(chatid, kPeerHandle, "message "+std::to_string(n), NullCrypto::kKeyId);
+}
+
+// A chat that is loaded as dormant is joined without its Chat object, which
+// is created when chatd sends a new message for it. The new messages must
+// follow the local history, and be passed to the app in order
+std::string Scenarios::materializeDormantChat()
+{
+    const unsigned kHistCount = 10;
+    const unsigned kNewCount = 3;
+    Id chatid;
+    ScenarioListener* listener = nullptr;
+    runOnLoop(&loop, [&]()
+    {
+        chatid = newChat(kHistCount);
+        listener = &newListener();
+        createChat(chatid, *listener).connect();
+    });
+    if (!onLoop([listener]() { return listener->state == chatd::kChatStateOnline && listener->chat->size() == (chatd::Idx)kHistCount; }))
+        return "the chat did not come online with its history";
+
+    chatd::ChatDbInfo dbInfo;
+    ScenarioListener* dormantListener = nullptr;
+    runOnLoop(&loop, [&]()
+    {
+        listener->chat->unreadMsgCount(); //persisted on destruction, a dormant chat needs it
+        resetChatd();
+        std::map<Id, chatd::ChatSummary> summaries;
+        ChatdSqliteDb::loadChatSummaries(client->db, summaries);
+        auto& summary = summaries[chatid];
+        if (!summary.canBeDormant())
+            return;
+        dbInfo = summary.dbInfo;
+
+        dormantListener = &newListener();
+        client->chatd->addDormantChat(chatid, 0, std::string(), dbInfo,
+            [this, chatid, dormantListener]() { createChat(chatid, *dormantListener); });
+        client->chatd->connectDormantChat(chatid);
+    });
+    if (!dormantListener)
+        return "the chat can't be dormant after a restart";
+    if (!onLoop([this, chatid]() { return client->chatd->dormantChatState(chatid) == chatd::kChatStateOnline; }))
+        return "the dormant chat did not come online";
+
+    bool dormant = false;
+    std::vector<Id> posted;
+    runOnLoop(&loop, [&]()
+    {
+        dormant = client->chatd->isDormant(chatid) && !dormantListener->chat;
+        for (unsigned i = 0; i < kNewCount; i++)
+            posted.push_back(postPeerMessage(chatid, kHistCount + i));
+    });
+    if (!dormant)
+        return "the chat was materialized by a join without new messages";
+    if (!onLoop([dormantListener]() { return dormantListener->newMsgs.size() >= kNewCount; }))
+        return "the new messages were not received after materializing the chat";
+
+    std::string error;
+    runOnLoop(&loop, [&]()
+    {
+        if (client->chatd->isDormant(chatid) || !dormantListener->chat)
+            error = "the chat is still dormant";
+        else if (dormantListener->state != chatd::kChatStateOnline)
+            error = "the materialized chat is not online";
+        else if (dormantListener->newMsgs != posted)
+            error = "the new messages were received out of order, or more than once";
+        else if (dormantListener->newIdxs.front() != dbInfo.newestDbIdx + 1)
+            error = "the new messages don't follow the local history";
+    });
+    return error;
+}
+
+// The commands of a frame that fails to be sent are lost. The connection must
+// be reset, so that the chat rejoins and resends its send queue, and the
+// message reaches chatd exactly once
+std::string Scenarios::reconnectOnSendError()
+{
+    static const std::string kText = "sent on a broken connection";
+    Id chatid;
+    ScenarioListener* listener = nullptr;
+    runOnLoop(&loop, [&]()
+    {
+        chatid = newChat(1);
+        listener = &newListener();
+        createChat(chatid, *listener).connect();
+    });
+    if (!onLoop([listener]() { return listener->state == chatd::kChatStateOnline; }))
+        return "the chat did not come online";
+
+    uint64_t joins = 0;
+    runOnLoop(&loop, [&]()
+    {
+        joins = chatdServer.opStats.join;
+        chatdServer.failSends = 1;
+        listener->chat->msgSubmit(kText.data(), kText.size(), chatd::Message::kMsgNormal, nullptr);
+    });
+    if (!onLoop([listener]() { return !listener->confirmed.empty(); }))
+        return "the message was not confirmed after the send error";
+
+    std::string error;
+    runOnLoop(&loop, [&]()
+    {
+        unsigned copies = 0;
+        for (auto& msg: chatdServer.chat(chatid)->history)
+        {
+            if (msg.userid == kMyHandle && msg.data == kText)
+                copies++;
+        }
+        if (chatdServer.failSends)
+            error = "the message was not sent";
+        else if (chatdServer.opStats.join == joins)
+            error = "the chat was not rejoined, the connection was not reset";
+        else if (copies != 1)
+            error = "chatd has "+std::to_string(copies)+" copies of the message";
+        else if (listener->confirmed.size() != 1)
+            error = "the message was confirmed more than once";
+        else if (listener->state != chatd::kChatStateOnline)
+            error = "the chat is not online after the reconnect";
+    });
+    return error;
+}
+
+// Messages evicted from RAM are still part of the history buffer. They must
+// be found by id without loading them, and be loaded back from the db, in
+// order, on access and by getHistory()
+std::string Scenarios::evictAndLoadBack()
+{
+    const unsigned kMsgCount = 100;
+    Id chatid;
+    std::vector<Id> msgids;
+    ScenarioListener* listener = nullptr;
+    runOnLoop(&loop, [&]()
+    {
+        chatid = newChat(kMsgCount, &msgids);
+        listener = &newListener();
+        auto& chat = createChat(chatid, *listener);
+        chat.initialHistoryFetchCount = kMsgCount;
+        chat.connect();
+    });
+    if (!onLoop([listener]() { return listener->state == chatd::kChatStateOnline && listener->chat->size() == (chatd::Idx)kMsgCount; }))
+        return "the chat did not come online with its history";
+
+    std::string error;
+    runOnLoop(&loop, [&]()
+    {
+        auto& chat = *listener->chat;
+        chatd::Idx oldest = chat.lownum();
+        size_t bytes = chat.historyBytes();
+        client->chatd->trimHistoryMemory();
+        if (!chat.evictedCount() || (chat.historyBytes() >= bytes))
+        {
+            error = "nothing was evicted";
+            return;
+        }
+        if (chat.lownum() - oldest != chat.evictedCount())
+        {
+            error = "the evicted range is not below the RAM history buffer";
+            return;
+        }
+        if ((chat.msgIndexFromId(msgids[0]) != oldest) || (chat.lownum() == oldest))
+        {
+            error = "an evicted message was not found by id, or was loaded to find it";
+            return;
+        }
+        for (unsigned i = 0; i < kMsgCount; i++)
+        {
+            auto msg = chat.findOrNull(oldest + i);
+            if (!msg || (msg->id() != msgids[i]))
+            {
+                error = "message "+std::to_string(i)+" was not loaded back";
+                return;
+            }
+        }
+        if (chat.evictedCount())
+        {
+            error = "messages are still evicted after accessing all of them";
+            return;
+        }
+
+        // again, through a history fetch of the app
+        client->chatd->trimHistoryMemory();
+        listener->histMsgs.clear();
+        chat.resetGetHistory();
+        chat.getHistory(kMsgCount);
+        if (listener->histMsgs != std::vector<Id>(msgids.rbegin(), msgids.rend()))
+            error = "getHistory() did not return the evicted messages, newest first";
+    });
+    return error;
+}
+
+// Old history is decrypted in batches, whose messages may complete in any
+// order. They must be passed to the app and written to the db in index order,
+// also when more history arrives while a batch is being decrypted
+std::string Scenarios::orderedBatchDecrypt()
+{
+    // more than one batch, see Chat::kDecryptBatchMaxSize
+    const unsigned kMsgCount = 300;
+    Id chatid;
+    std::vector<Id> msgids;
+    ScenarioListener* listener = nullptr;
+    ReorderingCrypto* crypto = nullptr;
+    runOnLoop(&loop, [&]()
+    {
+        chatid = newChat(kMsgCount, &msgids);
+        listener = &newListener();
+        crypto = new ReorderingCrypto(&loop);
+        auto& chat = createChat(chatid, *listener, crypto);
+        chat.initialHistoryFetchCount = 1;
+        chat.connect();
+    });
+    if (!onLoop([listener]() { return listener->state == chatd::kChatStateOnline; }))
+        return "the chat did not come online";
+
+    // the newest message is in RAM, the rest comes from the server
+    runOnLoop(&loop, [&]() { listener->chat->getHistory(kMsgCount); });
+    if (!onLoop([listener]() { return listener->histMsgs.size() >= kMsgCount && !listener->chat->isFetchingFromServer(); }))
+        return "the history fetch did not complete";
+
+    std::string error;
+    runOnLoop(&loop, [&]()
+    {
+        auto& chat = *listener->chat;
+        if (crypto->batches < 2)
+        {
+            error = "the history was not decrypted in batches";
+            return;
+        }
+        if (listener->histMsgs != std::vector<Id>(msgids.rbegin(), msgids.rend()))
+        {
+            error = "the history was not passed to the app newest first, or not once";
+            return;
+        }
+        for (size_t i = 1; i < listener->histIdxs.size(); i++)
+        {
+            if (listener->histIdxs[i] != listener->histIdxs[i-1] - 1)
+            {
+                error = "the history was passed to the app with gaps in its indexes";
+                return;
+            }
+        }
+        chatd::Idx oldest = listener->histIdxs.back();
+        SqliteStmt stmt(client->db, "select idx, msgid from history where chatid = ? order by idx");
+        stmt << chatid;
+        unsigned count = 0;
+        while (stmt.step())
+        {
+            if ((count >= kMsgCount) || (stmt.intCol(0) != oldest + (chatd::Idx)count)
+                || (Id(stmt.uint64Col(1)) != msgids[count]))
+            {
+                error = "the db history does not match the chatd history at index "+std::to_string(stmt.intCol(0));
+                return;
+            }
+            count++;
+        }
+        if (count != kMsgCount)
+            error = "the db has "+std::to_string(count)+" of "+std::to_string(kMsgCount)+" messages";
+        else if (chat.at(oldest).id() != msgids[0])
+            error = "the RAM history buffer does not match the chatd history";
+    });
+    return error;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [--dir PATH]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    std::string dir = "/tmp";
+    for (int i = 1; i < argc; i++)
+    {
+        if (i+1 >= argc)
+            usage(argv[0]);
+        if (!strcmp(argv[i], "--dir"))
+            dir = argv[++i];
+        else
+            usage(argv[0]);
+    }
+
+    megachat::MegaChatApi::setLogLevel(megachat::MegaChatApi::LOG_LEVEL_ERROR);
+    ::mega::MegaApi megaApi("chatd_scenarios", dir.c_str(), "chatd_scenarios");
+    megachat::MegaChatApiImpl loop(nullptr, &megaApi);
+    Scenarios scenarios(loop);
+
+    runOnLoop(&loop, [&]() { scenarios.setup(megaApi, dir); });
+    scenarios.run("materialize a dormant chat", &Scenarios::materializeDormantChat);
+    scenarios.run("reconnect on a failed send", &Scenarios::reconnectOnSendError);
+    scenarios.run("evict history, then load it back", &Scenarios::evictAndLoadBack);
+    scenarios.run("in-order delivery of decrypt batches", &Scenarios::orderedBatchDecrypt);
+    runOnLoop(&loop, [&]() { scenarios.teardown(); });
+    return scenarios.failed;
+}
@@ -0,0 +1,197 @@
+/**
+ * @file tests/chatd_bench/chatd_startup.cpp
+ * @brief Benchmark of the chatd client startup cost versus the number of chats.
+ *
+ * Creates a database with N chats of M messages each, and then loads all
+ * chats either eagerly, by creating the chatd::Chat object of each one, or as
+ * dormant chats via ChatdSqliteDb::loadChatSummaries() and
+ * chatd::Client::addDormantChat(), as ChatRoomList::loadFromDb() does.
+ * Reports the load time and the increase of the resident set size. Run each
+ * mode in a separate process, as the RSS does not shrink after freeing memory.
+ * The crypto layer is a pass-through, so the cost of loading the keys of each
+ * chat, which dormant chats also avoid, is not included.
+ *
+ * Usage: chatd_startup [--mode eager|dormant] [--chats N] [--msgs M] [--dir PATH]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <megaapi.h>
+#include <megachatapi_impl.h>
+#include <chatClient.h>
+#include <chatd.h>
+#include <chatdDb.h>
+#include "chatdEmulator.h"
+#include "benchCommon.h"
+
+using namespace karere;
+
+static const Id kMyHandle(0xA0A0A0A0A0A0A0A0ull);
+static const Id kPeerHandle(0xB0B0B0B0B0B0B0B0ull);
+
+struct Options
+{
+    bool dormant = true;
+    unsigned chats = 1000;
+    unsigned msgs = 100;
+    std::string dir = "/tmp";
+};
+
+class StartupListener: public chatd::Listener
+{
+protected:
+    SqliteDb& mDb;
+public:
+    StartupListener(SqliteDb& db): mDb(db) {}
+    virtual void init(chatd::Chat& chat, chatd::DbInterface*& dbIntf)
+    {
+        dbIntf = new ChatdSqliteDb(chat, mDb);
+    }
+    virtual void onOnlineStateChange(chatd::ChatState state) {}
+};
+
+/** Resident set size of the process, in kB */
+static long rssKb()
+{
+    long pages = 0, resident = 0;
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (!file)
+        return 0;
+    if (fscanf(file, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(file);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static Id chatId(unsigned i) { return Id(0xC000 + i); }
+
+static void populateDb(SqliteDb& db, const Options& opts)
+{
+    db.simpleQuery("begin transaction");
+    std::string data(64, 'x');
+    for (unsigned i = 0; i < opts.chats; i++)
+    {
+        Id chatid = chatId(i);
+        Id lastMsgid = (chatid.val << 20) + opts.msgs - 1;
+        db.query("insert into chats(chatid, shard, own_priv, ts_created, last_seen) values(?,0,3,?,?)",
+            chatid, 1000, lastMsgid);
+        db.query("insert into chat_peers(chatid, userid, priv) values(?,?,2)", chatid, kPeerHandle);
+        for (unsigned j = 0; j < opts.msgs; j++)
+        {
+            Id msgid = (chatid.val << 20) + j;
+            Buffer buf(data.data(), data.size());
+            db.query("insert into history(idx, chatid, msgid, userid, keyid, type, updated, ts, "
+                "is_encrypted, data, backrefid) values(?,?,?,?,1,1,0,?,0,?,0)",
+                (int)j, chatid, msgid, (j & 1) ? kPeerHandle : kMyHandle, (int)(2000 + j), buf);
+        }
+        db.query("insert into chat_vars(chatid, name, value) values(?, 'unread_count', ?)",
+            chatid, "0:"+std::to_string(lastMsgid.val));
+    }
+    db.simpleQuery("commit transaction");
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [--mode eager|dormant] [--chats N] [--msgs M] [--dir PATH]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    Options opts;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i+1 >= argc)
+            usage(argv[0]);
+        if (!strcmp(argv[i], "--mode"))
+            opts.dormant = !strcmp(argv[++i], "dormant");
+        else if (!strcmp(argv[i], "--chats"))
+            opts.chats = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--msgs"))
+            opts.msgs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--dir"))
+            opts.dir = argv[++i];
+        else
+            usage(argv[0]);
+    }
+
+    megachat::MegaChatApi::setLogLevel(megachat::MegaChatApi::LOG_LEVEL_ERROR);
+    ::mega::MegaApi megaApi("chatd_startup", opts.dir.c_str(), "chatd_startup");
+    megachat::MegaChatApiImpl loop(nullptr, &megaApi);
+    karere::Client* client = nullptr;
+    std::vector<std::unique_ptr<StartupListener>> listeners;
+    uint64_t elapsedNs = 0;
+    uint64_t dbTimeNs = 0;
+    long rssBefore = 0;
+    long rssAfter = 0;
+
+    runOnLoop(&loop, [&]()
+    {
+        auto websocketsIO = new chatdemu::EmuWebsocketsIO(&loop.sdkMutex, &megaApi, &loop);
+        client = new karere::Client(megaApi, websocketsIO, loop, opts.dir, 0, &loop);
+        std::string dbPath = opts.dir + "/chatd_startup.db";
+        unlink(dbPath.c_str());
+        if (!client->db.open(dbPath.c_str(), true))
+            throw std::runtime_error("Can't open db "+dbPath);
+        client->db.simpleQuery(gDbSchema);
+        populateDb(client->db, opts);
+        sqlite3_profile(client->db, sqliteProfileCb, &dbTimeNs);
+        client->chatd.reset(new chatd::Client(client, kMyHandle));
+        auto& chatd = *client->chatd;
+
+        auto createChat = [&](Id chatid)
+        {
+            listeners.emplace_back(new StartupListener(client->db));
+            chatd.createChat(chatid, 0, std::string(), listeners.back().get(),
+                SetOfIds({kMyHandle, kPeerHandle}), new NullCrypto(&loop), 1000, true);
+        };
+
+        rssBefore = rssKb();
+        uint64_t start = nowNs();
+        if (opts.dormant)
+        {
+            std::map<Id, chatd::ChatSummary> summaries;
+            ChatdSqliteDb::loadChatSummaries(client->db, summaries);
+            for (auto& item: summaries)
+            {
+                Id chatid = item.first;
+                if (!item.second.canBeDormant())
+                {
+                    createChat(chatid);
+                    continue;
+                }
+                chatd.addDormantChat(chatid, 0, std::string(), item.second.dbInfo,
+                    [&createChat, chatid]() { createChat(chatid); });
+            }
+        }
+        else
+        {
+            for (unsigned i = 0; i < opts.chats; i++)
+                createChat(chatId(i));
+        }
+        elapsedNs = nowNs() - start;
+        rssAfter = rssKb();
+        printf("%s: loaded %u chats of %u messages in %.1f ms (db %.1f ms), RSS +%ld kB, %zu dormant\n",
+            opts.dormant ? "dormant" : "eager", opts.chats, opts.msgs, elapsedNs / 1e6,
+            dbTimeNs / 1e6, rssAfter - rssBefore, chatd.dormantChatCount());
+
+        if (opts.dormant && opts.chats)
+        {
+            // the cost of opening a chat later, i.e. when the user selects it
+            uint64_t t = nowNs();
+            chatd.chats(chatId(0));
+            printf("first access to a dormant chat: %.3f ms\n", (nowNs() - t) / 1e6);
+        }
+
+        client->chatd.reset();
+        client->db.close();
+        delete client;
+    });
+    return 0;
+}